@@ -0,0 +1,58 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "testutils.h"
+
+#include "room.h"
+
+#include <QtTest/QtTest>
+
+#include <atomic>
+
+using namespace Quotient;
+
+class ConnectionThreadTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void syncInWorkerThread();
+};
+
+namespace {
+const auto RoomId = QStringLiteral("!room:example.org");
+} // namespace
+
+void ConnectionThreadTest::syncInWorkerThread()
+{
+    auto* c = Connection::makeMockConnection(QStringLiteral("@me:example.org"));
+    std::atomic<int> loadedRooms { 0 };
+    connect(c, &Connection::loadedRoomState, c, [&loadedRooms] {
+        ++loadedRooms;
+    });
+
+    const QPointer<QThread> workerThread = c->moveToWorkerThread();
+    QVERIFY(workerThread);
+    QVERIFY(workerThread != QThread::currentThread());
+    QCOMPARE(c->thread(), workerThread.data());
+
+    SyncData data;
+    const QJsonObject joinedRooms { { RoomId, QJsonObject {} } };
+    data.parseJson({ { "next_batch"_ls, "s1"_ls },
+                     { "rooms"_ls,
+                       QJsonObject { { "join"_ls, joinedRooms } } } });
+    invokeBlocking(c, [c, &data] { SyncFeeder::feed(c, std::move(data)); });
+    QTRY_COMPARE(loadedRooms.load(), 1);
+
+    // Rooms are made in the thread of their connection
+    auto* roomThread = invokeBlocking(c, [c] {
+        auto* r = c->room(RoomId);
+        return r ? r->thread() : nullptr;
+    });
+    QCOMPARE(roomThread, workerThread.data());
+
+    // The thread quits and gets deleted once the connection is gone
+    c->deleteLater();
+    QTRY_VERIFY(workerThread.isNull());
+}
+
+QTEST_GUILESS_MAIN(ConnectionThreadTest)
+#include "connectionthreadtest.moc"
@@ -0,0 +1,192 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "connection.h"
+#include "jobs/downloadfilejob.h"
+
+#include <QtCore/QTemporaryDir>
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
+#include <QtTest/QSignalSpy>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+//! A minimal HTTP server that serves the same payload for any GET request,
+//! honouring single-range Range headers
+class MediaStandIn : public QTcpServer {
+public:
+    explicit MediaStandIn(QByteArray payload) : payload(std::move(payload))
+    {
+        connect(this, &QTcpServer::newConnection, this, [this] {
+            while (auto* socket = nextPendingConnection()) {
+                connect(socket, &QTcpSocket::disconnected, socket,
+                        &QObject::deleteLater);
+                connect(socket, &QTcpSocket::readyRead, socket,
+                        [this, socket] { processRequest(socket); });
+            }
+        });
+    }
+
+    const QByteArray payload;
+    //! If non-negative, only send that many bytes of the body and disconnect
+    qint64 cutAfter = -1;
+    //! The Range header value of the last request
+    QByteArray lastRange;
+
+private:
+    void processRequest(QTcpSocket* socket)
+    {
+        auto request = socket->property("request").toByteArray()
+                       + socket->readAll();
+        socket->setProperty("request", request);
+        if (!request.contains("\r\n\r\n"))
+            return; // Wait for the rest of headers
+
+        lastRange.clear();
+        for (const auto& line : request.split('\n'))
+            if (line.toLower().startsWith("range:"))
+                lastRange = line.mid(line.indexOf(':') + 1).trimmed();
+
+        qint64 first = 0;
+        qint64 last = payload.size() - 1;
+        if (lastRange.startsWith("bytes=")) {
+            const auto bounds = lastRange.mid(6).split('-');
+            first = bounds.front().toLongLong();
+            if (bounds.size() > 1 && !bounds.back().isEmpty())
+                last = std::min(last, bounds.back().toLongLong());
+        }
+        QByteArray response;
+        if (first > last)
+            response = "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                       "Content-Type: application/json\r\n"
+                       "Content-Length: 2\r\n\r\n{}";
+        else {
+            const auto body = payload.mid(int(first), int(last - first + 1));
+            response = lastRange.isEmpty() ? "HTTP/1.1 200 OK\r\n"
+                                           : "HTTP/1.1 206 Partial Content\r\n";
+            response += "Content-Type: application/octet-stream\r\n"
+                        "Content-Length: "
+                        + QByteArray::number(body.size()) + "\r\n";
+            if (!lastRange.isEmpty())
+                response += "Content-Range: bytes " + QByteArray::number(first)
+                            + '-' + QByteArray::number(last) + '/'
+                            + QByteArray::number(payload.size()) + "\r\n";
+            response += "Connection: close\r\n\r\n"
+                        + (cutAfter >= 0 ? body.left(int(cutAfter)) : body);
+        }
+        socket->write(response);
+        socket->disconnectFromHost();
+    }
+};
+
+class DownloadFileJobTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void resumeDownload();
+    void resumeAfterCrash();
+    void contentRange();
+
+private:
+    QByteArray payload;
+    std::unique_ptr<MediaStandIn> server;
+    std::unique_ptr<Connection> connection;
+};
+
+void DownloadFileJobTest::initTestCase()
+{
+    for (int i = 0; i < 100000; ++i)
+        payload.append(char(i % 253));
+    server = std::make_unique<MediaStandIn>(payload);
+    QVERIFY(server->listen(QHostAddress::LocalHost));
+    connection = std::make_unique<Connection>(
+        QUrl(QStringLiteral("http://127.0.0.1:%1").arg(server->serverPort())));
+}
+
+void DownloadFileJobTest::resumeDownload()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const auto targetName = dir.filePath(QStringLiteral("media.bin"));
+
+    server->cutAfter = payload.size() / 3;
+    auto* job = connection->callApi<DownloadFileJob>(
+        QStringLiteral("example.org"), QStringLiteral("media"), targetName);
+    job->setMaxRetries(0);
+    QSignalSpy failureSpy(job, &BaseJob::failure);
+    QVERIFY(failureSpy.wait());
+    QCOMPARE(QFileInfo(targetName + ".qtntdownload").size(),
+             server->cutAfter);
+
+    server->cutAfter = -1;
+    job = connection->callApi<DownloadFileJob>(
+        QStringLiteral("example.org"), QStringLiteral("media"), targetName);
+    QSignalSpy successSpy(job, &BaseJob::success);
+    QVERIFY(successSpy.wait());
+    QCOMPARE(server->lastRange,
+             "bytes=" + QByteArray::number(payload.size() / 3) + '-');
+    QFile target(targetName);
+    QVERIFY(target.open(QIODevice::ReadOnly));
+    QCOMPARE(target.readAll(), payload);
+    QVERIFY(!QFile::exists(targetName + ".qtntdownload"));
+}
+
+void DownloadFileJobTest::resumeAfterCrash()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const auto targetName = dir.filePath(QStringLiteral("media.bin"));
+    const auto tempName = targetName + ".qtntdownload";
+    const auto progressName = tempName + ".progress";
+    const auto validSize = payload.size() / 4;
+
+    // What a download killed midway leaves behind: the temporary file with
+    // the preallocated size, only the beginning of it being valid
+    const auto writeFile = [](const QString& fileName, const QByteArray& data) {
+        QFile file(fileName);
+        return file.open(QIODevice::WriteOnly) && file.write(data) == data.size();
+    };
+    const auto leftover =
+        payload.left(validSize) + QByteArray(payload.size() - validSize, '\0');
+    QVERIFY(writeFile(tempName, leftover));
+    QVERIFY(writeFile(progressName, QByteArray::number(validSize)));
+
+    auto* job = connection->callApi<DownloadFileJob>(
+        QStringLiteral("example.org"), QStringLiteral("media"), targetName);
+    QSignalSpy successSpy(job, &BaseJob::success);
+    QVERIFY(successSpy.wait());
+    QCOMPARE(server->lastRange, "bytes=" + QByteArray::number(validSize) + '-');
+    QFile target(targetName);
+    QVERIFY(target.open(QIODevice::ReadOnly));
+    QCOMPARE(target.readAll(), payload);
+    target.close();
+    QVERIFY(!QFile::exists(tempName));
+    QVERIFY(!QFile::exists(progressName));
+
+    // Without the saved progress, nothing in the leftover can be trusted
+    QVERIFY(QFile::remove(targetName));
+    QVERIFY(writeFile(tempName, leftover));
+    job = connection->callApi<DownloadFileJob>(
+        QStringLiteral("example.org"), QStringLiteral("media"), targetName);
+    QSignalSpy restartSpy(job, &BaseJob::success);
+    QVERIFY(restartSpy.wait());
+    QVERIFY(server->lastRange.isEmpty());
+    QVERIFY(target.open(QIODevice::ReadOnly));
+    QCOMPARE(target.readAll(), payload);
+}
+
+void DownloadFileJobTest::contentRange()
+{
+    auto* job = connection->callApi<GetContentRangeJob>(
+        QUrl(QStringLiteral("mxc://example.org/media")), 1000, 500);
+    QSignalSpy successSpy(job, &BaseJob::success);
+    QVERIFY(successSpy.wait());
+    QCOMPARE(server->lastRange, QByteArray("bytes=1000-1499"));
+    QCOMPARE(job->offset(), qint64(1000));
+    QCOMPARE(job->totalSize(), qint64(payload.size()));
+    QCOMPARE(job->rangeContent(), payload.mid(1000, 500));
+}
+
+QTEST_GUILESS_MAIN(DownloadFileJobTest)
+#include "downloadfilejobtest.moc"
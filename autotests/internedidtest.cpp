@@ -0,0 +1,76 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "internedid.h"
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class InternedIdTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void identity();
+    void find();
+    void containers();
+    void purge();
+};
+
+void InternedIdTest::identity()
+{
+    const auto idString = QStringLiteral("@alice:example.org");
+    const InternedId id1(idString);
+    const InternedId id2(QString(idString.data(), idString.size())); // Copy
+    QCOMPARE(id1, id2);
+    QCOMPARE(id1.toString(), idString);
+    QCOMPARE(id1.toString().constData(), id2.toString().constData());
+    QVERIFY(id1 != InternedId(QStringLiteral("@bob:example.org")));
+
+    QVERIFY(InternedId().isNull());
+    QVERIFY(InternedId(QString()).isNull());
+    QCOMPARE(InternedId(QString()), InternedId());
+    QVERIFY(InternedId().toString().isEmpty());
+}
+
+void InternedIdTest::find()
+{
+    const InternedId id(QStringLiteral("$event:example.org"));
+    QCOMPARE(InternedId::find(QStringLiteral("$event:example.org")), id);
+
+    const auto sizeBefore = InternedId::tableSize();
+    const auto missing = InternedId::find(QStringLiteral("$missing"));
+    QCOMPARE(InternedId::tableSize(), sizeBefore);
+    QVERIFY(missing != InternedId());
+    QVERIFY(missing != id);
+    QVERIFY(missing.toString().isEmpty());
+    // Handles for different missing strings are not told apart
+    QCOMPARE(InternedId::find(QStringLiteral("$missing too")), missing);
+    QCOMPARE(InternedId::find({}), InternedId());
+}
+
+void InternedIdTest::containers()
+{
+    QHash<InternedId, int> index;
+    index.insert(InternedId(QStringLiteral("$a")), 1);
+    index.insert(InternedId(QStringLiteral("$b")), 2);
+    QCOMPARE(index.value(InternedId::find(QStringLiteral("$b"))), 2);
+    QVERIFY(!index.contains(InternedId::find(QStringLiteral("$c"))));
+
+    QSet<InternedId> users { InternedId(QStringLiteral("@a:example.org")) };
+    QVERIFY(users.contains(InternedId::find(QStringLiteral("@a:example.org"))));
+}
+
+void InternedIdTest::purge()
+{
+    // Intern (and drop) enough strings to trigger purging at least once;
+    // the table should stay bounded while live handles stay valid
+    const InternedId kept(QStringLiteral("@kept:example.org"));
+    for (int i = 0; i < 20000; ++i)
+        InternedId(QStringLiteral("$temporary%1").arg(i));
+    QVERIFY(InternedId::tableSize() < 20000);
+    QCOMPARE(InternedId::find(QStringLiteral("@kept:example.org")), kept);
+    QCOMPARE(kept.toString(), QStringLiteral("@kept:example.org"));
+}
+
+QTEST_APPLESS_MAIN(InternedIdTest)
+#include "internedidtest.moc"
@@ -0,0 +1,84 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+// Simulate a library build with these categories stripped
+#define Quotient_STRIPPED_LOGGING "STATE,MEMBERS"
+#include "logging.h"
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class LoggingTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void init();
+    void cleanup();
+    void strippedCategories();
+    void strippedLogging();
+    void enabledLogging();
+};
+
+namespace {
+int evaluations = 0;
+
+QString countedArg()
+{
+    ++evaluations;
+    return QStringLiteral("arg");
+}
+
+void discardMessage(QtMsgType, const QMessageLogContext&, const QString&) {}
+} // namespace
+
+static_assert(_impl::isLoggingStripped("STATE"));
+static_assert(_impl::isLoggingStripped("MEMBERS"));
+static_assert(!_impl::isLoggingStripped("MAIN"));
+static_assert(!_impl::isLoggingStripped("STAT"));
+
+void LoggingTest::init()
+{
+    evaluations = 0;
+    QLoggingCategory::setFilterRules(QStringLiteral("quotient.*.debug=true"));
+    qInstallMessageHandler(discardMessage);
+}
+
+void LoggingTest::cleanup()
+{
+    qInstallMessageHandler(nullptr);
+    QLoggingCategory::setFilterRules({});
+}
+
+void LoggingTest::strippedCategories()
+{
+    QVERIFY(STATE().isDebugEnabled());
+    QVERIFY(!QUO_DEBUG_ENABLED(STATE));
+    QVERIFY(QUO_DEBUG_ENABLED(MAIN));
+}
+
+void LoggingTest::strippedLogging()
+{
+    QUO_CDEBUG(STATE) << countedArg();
+    QUO_CINFO(MEMBERS) << countedArg();
+    // The macros are single statements, as qCDebug() is
+    if (evaluations == 0)
+        QUO_CDEBUG(STATE) << countedArg();
+    else
+        QFAIL("Unexpected evaluation of arguments");
+    QCOMPARE(evaluations, 0);
+}
+
+void LoggingTest::enabledLogging()
+{
+    QUO_CDEBUG(MAIN) << countedArg();
+    QUO_CINFO(EVENTS) << countedArg();
+    QCOMPARE(evaluations, 2);
+
+    // Categories disabled at runtime still don't evaluate arguments
+    QLoggingCategory::setFilterRules(QStringLiteral("quotient.*.debug=false"));
+    QUO_CDEBUG(MAIN) << countedArg();
+    QCOMPARE(evaluations, 2);
+}
+
+QTEST_APPLESS_MAIN(LoggingTest)
+#include "loggingtest.moc"
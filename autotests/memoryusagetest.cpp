@@ -0,0 +1,64 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "memoryusage.h"
+#include "util.h"
+
+#include <QtCore/QJsonArray>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class MemoryUsageTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void accumulation();
+    void stringsAndJson();
+};
+
+void MemoryUsageTest::accumulation()
+{
+    MemoryUsage usage;
+    usage.add(QStringLiteral("timeline"), 100);
+    usage.add(QStringLiteral("state"), 20);
+    usage.add(QStringLiteral("timeline"), 5);
+    QCOMPARE(usage.value(QStringLiteral("timeline")), qint64(105));
+    QCOMPARE(usage.value(QStringLiteral("members")), qint64(0));
+    QCOMPARE(usage.total(), qint64(125));
+
+    MemoryUsage other;
+    other.add(QStringLiteral("state"), 30);
+    other.add(QStringLiteral("members"), 7);
+    usage += other;
+    QCOMPARE(usage.value(QStringLiteral("state")), qint64(50));
+    QCOMPARE(usage.total(), qint64(162));
+
+    const auto json = usage.toJson();
+    QCOMPARE(json.value("members"_ls).toInt(), 7);
+    QCOMPARE(json.value("total"_ls).toInt(), 162);
+}
+
+void MemoryUsageTest::stringsAndJson()
+{
+    QCOMPARE(MemoryUsage::sizeOf(QString()), qint64(0));
+    const QString shortString(10, 'a');
+    const QString longString(1000, 'a');
+    QVERIFY(MemoryUsage::sizeOf(longString) > MemoryUsage::sizeOf(shortString));
+    QVERIFY(MemoryUsage::sizeOf(longString) >= 2000);
+
+    const QJsonObject small { { "body"_ls, shortString } };
+    const QJsonObject big { { "body"_ls, longString },
+                            { "nested"_ls, QJsonArray { small, small } } };
+    QVERIFY(MemoryUsage::sizeOf(small) > MemoryUsage::sizeOf(shortString));
+    QVERIFY(MemoryUsage::sizeOf(big)
+            > MemoryUsage::sizeOf(longString) + 2 * MemoryUsage::sizeOf(small));
+
+    const QHash<QString, int> hash { { QStringLiteral("a"), 1 },
+                                     { QStringLiteral("b"), 2 } };
+    QCOMPARE(MemoryUsage::nodesOf(hash),
+             2 * qint64(sizeof(QString) + sizeof(int)
+                        + MemoryUsage::NodeOverhead));
+}
+
+QTEST_APPLESS_MAIN(MemoryUsageTest)
+#include "memoryusagetest.moc"
@@ -0,0 +1,136 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "metrics.h"
+
+#include "jobs/syncjob.h"
+
+#include <QtCore/QJsonArray>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class MetricsTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void countersAndGauges();
+    void histograms();
+    void jsonDump();
+    void prometheusDump();
+    void typeMismatch();
+    void jobLabels();
+};
+
+void MetricsTest::countersAndGauges()
+{
+    Metrics m;
+    QCOMPARE(m.counter(MetricNames::Syncs), qint64(0));
+    m.increment(MetricNames::Syncs);
+    m.increment(MetricNames::Syncs, 2);
+    QCOMPARE(m.counter(MetricNames::Syncs), qint64(3));
+
+    const Metrics::Labels labels { { QStringLiteral("job"),
+                                     QStringLiteral("SyncJob") } };
+    m.increment(MetricNames::JobFailures, 1, labels);
+    QCOMPARE(m.counter(MetricNames::JobFailures, labels), qint64(1));
+    QCOMPARE(m.counter(MetricNames::JobFailures), qint64(0));
+
+    m.setGauge(MetricNames::RoomUpdateQueueDepth, 5);
+    m.setGauge(MetricNames::RoomUpdateQueueDepth, 2);
+    QCOMPARE(m.gauge(MetricNames::RoomUpdateQueueDepth), 2.0);
+
+    m.reset();
+    QCOMPARE(m.counter(MetricNames::Syncs), qint64(0));
+}
+
+void MetricsTest::histograms()
+{
+    Metrics m;
+    m.observe(MetricNames::SyncParseSeconds, 0.0001);
+    m.observe(MetricNames::SyncParseSeconds, 0.001); // Bounds are inclusive
+    m.observe(MetricNames::SyncParseSeconds, 1000);
+    const auto h = m.histogram(MetricNames::SyncParseSeconds);
+    QCOMPARE(h.count, qint64(3));
+    QCOMPARE(h.sum, 1000.0011);
+    QCOMPARE(h.bucketCounts.size(), h.bounds.size() + 1);
+    QCOMPARE(h.bucketCounts[0], qint64(1));
+    QCOMPARE(h.bucketCounts[1], qint64(1));
+    QCOMPARE(h.bucketCounts.back(), qint64(1));
+
+    QCOMPARE(m.histogram(MetricNames::DecryptSeconds).count, qint64(0));
+}
+
+void MetricsTest::jsonDump()
+{
+    Metrics m;
+    m.increment(MetricNames::Syncs, 4);
+    m.observe(MetricNames::JobSeconds, 0.02,
+              { { QStringLiteral("job"), QStringLiteral("SyncJob") } });
+
+    const auto json = m.toJson();
+    const auto syncs = json[MetricNames::Syncs].toObject();
+    QCOMPARE(syncs["type"_ls].toString(), QStringLiteral("counter"));
+    QCOMPARE(syncs["series"_ls][0]["value"_ls].toInt(), 4);
+
+    const auto jobs = json[MetricNames::JobSeconds].toObject();
+    QCOMPARE(jobs["type"_ls].toString(), QStringLiteral("histogram"));
+    const auto series = jobs["series"_ls][0].toObject();
+    QCOMPARE(series["labels"_ls]["job"_ls].toString(),
+             QStringLiteral("SyncJob"));
+    QCOMPARE(series["count"_ls].toInt(), 1);
+    QCOMPARE(series["buckets"_ls]["0.01"_ls].toInt(), 0);
+    QCOMPARE(series["buckets"_ls]["0.025"_ls].toInt(), 1);
+    QCOMPARE(series["buckets"_ls]["+Inf"_ls].toInt(), 1);
+}
+
+void MetricsTest::prometheusDump()
+{
+    Metrics m;
+    m.setGauge(MetricNames::RoomUpdateQueueDepth, 7);
+    m.observe(MetricNames::JobSeconds, 0.02,
+              { { QStringLiteral("job"), QStringLiteral("Say \"hi\"") } });
+
+    const auto lines = m.toPrometheus().split('\n');
+    QVERIFY(lines.contains(
+        QStringLiteral("# TYPE quotient_room_update_queue_depth gauge")));
+    QVERIFY(lines.contains(QStringLiteral("quotient_room_update_queue_depth 7")));
+    QVERIFY(lines.contains(
+        QStringLiteral("# TYPE quotient_job_duration_seconds histogram")));
+    QVERIFY(lines.contains(QStringLiteral(
+        R"(quotient_job_duration_seconds_bucket{job="Say \"hi\"",le="0.025"} 1)")));
+    QVERIFY(lines.contains(QStringLiteral(
+        R"(quotient_job_duration_seconds_bucket{job="Say \"hi\"",le="+Inf"} 1)")));
+    QVERIFY(lines.contains(QStringLiteral(
+        R"(quotient_job_duration_seconds_count{job="Say \"hi\""} 1)")));
+}
+
+void MetricsTest::typeMismatch()
+{
+    Metrics m;
+    m.increment(MetricNames::Syncs);
+    m.observe(MetricNames::Syncs, 1.0);
+    QCOMPARE(m.counter(MetricNames::Syncs), qint64(1));
+    QCOMPARE(m.histogram(MetricNames::Syncs).count, qint64(0));
+}
+
+void MetricsTest::jobLabels()
+{
+    // Each SyncJob has its own objectName (SyncJob-1, SyncJob-2, ...) but
+    // all of them should end up in the same series
+    const SyncJob job1 {}, job2 {};
+    QVERIFY(job1.objectName() != job2.objectName());
+    QCOMPARE(job1.metricsLabel(), QStringLiteral("SyncJob"));
+    QCOMPARE(job2.metricsLabel(), job1.metricsLabel());
+
+    Metrics m;
+    for (const auto* job : { &job1, &job2 })
+        m.observe(MetricNames::JobSeconds, 0.02,
+                  { { QStringLiteral("job"), job->metricsLabel() } });
+    const auto series =
+        m.toJson()[MetricNames::JobSeconds]["series"_ls].toArray();
+    QCOMPARE(series.size(), 1);
+    QCOMPARE(series[0]["count"_ls].toInt(), 2);
+}
+
+QTEST_APPLESS_MAIN(MetricsTest)
+#include "metricstest.moc"
@@ -0,0 +1,87 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "events/roommessageevent.h"
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class RoomMessageEventTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void plainText();
+    void replacement();
+    void file();
+    void noBody();
+};
+
+namespace {
+QJsonObject messageJson(const QJsonObject& content)
+{
+    return { { "type"_ls, RoomMessageEvent::TypeId },
+             { "event_id"_ls, "$event:example.org"_ls },
+             { "sender"_ls, "@alice:example.org"_ls },
+             { "origin_server_ts"_ls, 1650000000000 },
+             { "content"_ls, content } };
+}
+} // namespace
+
+void RoomMessageEventTest::plainText()
+{
+    const RoomMessageEvent e(messageJson(
+        { { "msgtype"_ls, "m.text"_ls }, { "body"_ls, "Hello"_ls } }));
+    QCOMPARE(e.msgtype(), RoomMessageEvent::MsgType::Text);
+    QCOMPARE(e.plainBody(), QStringLiteral("Hello"));
+    QVERIFY(e.hasTextContent());
+    QVERIFY(!e.hasFileContent());
+    QVERIFY(e.replacedEvent().isEmpty());
+    QVERIFY(e.content() == nullptr); // Plain text has no content object
+    QCOMPARE(e.mimeType().name(), QStringLiteral("text/plain"));
+}
+
+void RoomMessageEventTest::replacement()
+{
+    const RoomMessageEvent e(messageJson(
+        { { "msgtype"_ls, "m.text"_ls },
+          { "body"_ls, "* Hello"_ls },
+          { "m.new_content"_ls,
+            QJsonObject { { "msgtype"_ls, "m.text"_ls },
+                          { "body"_ls, "Hello"_ls } } },
+          { "m.relates_to"_ls,
+            QJsonObject { { "rel_type"_ls, "m.replace"_ls },
+                          { "event_id"_ls, "$original:example.org"_ls } } } }));
+    QCOMPARE(e.replacedEvent(), QStringLiteral("$original:example.org"));
+    QVERIFY(e.hasTextContent());
+    const auto* content =
+        static_cast<const EventContent::TextContent*>(e.content());
+    QVERIFY(content != nullptr);
+    QCOMPARE(content->body, QStringLiteral("Hello"));
+}
+
+void RoomMessageEventTest::file()
+{
+    const RoomMessageEvent e(messageJson(
+        { { "msgtype"_ls, "m.file"_ls },
+          { "body"_ls, "report.pdf"_ls },
+          { "url"_ls, "mxc://example.org/abcdef"_ls },
+          { "info"_ls, QJsonObject { { "mimetype"_ls, "application/pdf"_ls },
+                                     { "size"_ls, 1024 } } } }));
+    QVERIFY(!e.hasTextContent());
+    QVERIFY(e.hasFileContent());
+    QVERIFY(e.hasThumbnail());
+    QVERIFY(e.replacedEvent().isEmpty());
+    QCOMPARE(e.content()->fileInfo()->payloadSize, qint64(1024));
+    QCOMPARE(e.mimeType().name(), QStringLiteral("application/pdf"));
+}
+
+void RoomMessageEventTest::noBody()
+{
+    const RoomMessageEvent e(messageJson({ { "msgtype"_ls, "m.image"_ls } }));
+    QVERIFY(e.hasTextContent());
+    QVERIFY(!e.hasFileContent());
+    QVERIFY(e.content() == nullptr);
+}
+
+QTEST_APPLESS_MAIN(RoomMessageEventTest)
+#include "roommessageeventtest.moc"
@@ -0,0 +1,145 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "testutils.h"
+
+#include "eventstats.h"
+#include "room.h"
+
+#include <QtCore/QJsonArray>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class RoomSnapshotTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void nullSnapshot();
+    void captureAndIsolate();
+};
+
+namespace {
+const auto RoomId = QStringLiteral("!room:example.org");
+const auto UserId = QStringLiteral("@me:example.org");
+
+int eventCounter = 0;
+
+QJsonObject makeStateEvent(const QString& type, const QJsonObject& content,
+                           const QString& stateKey = {})
+{
+    return makeEvent(type, UserId, content, ++eventCounter, stateKey, true);
+}
+
+QJsonObject makeMessage(const QString& body)
+{
+    return makeEvent(QStringLiteral("m.room.message"), UserId,
+                     { { "msgtype"_ls, "m.text"_ls }, { "body"_ls, body } },
+                     ++eventCounter);
+}
+
+void feedTimeline(Connection* c, const QString& nextBatch,
+                  const QJsonArray& events)
+{
+    const QJsonObject roomJson {
+        { "timeline"_ls, QJsonObject { { "events"_ls, events } } }
+    };
+    SyncData data;
+    data.parseJson(
+        { { "next_batch"_ls, nextBatch },
+          { "rooms"_ls,
+            QJsonObject {
+                { "join"_ls, QJsonObject { { RoomId, roomJson } } } } } });
+    SyncFeeder::feed(c, std::move(data));
+}
+
+QString contentValue(const QJsonObject& json, QLatin1String key)
+{
+    return json[ContentKeyL][key].toString();
+}
+
+QString topicFromState(const RoomSnapshot& snapshot)
+{
+    return contentValue(snapshot.stateEventJson(QStringLiteral("m.room.topic")),
+                        "topic"_ls);
+}
+} // namespace
+
+void RoomSnapshotTest::nullSnapshot()
+{
+    const RoomSnapshot snapshot;
+    QVERIFY(snapshot.isNull());
+    QVERIFY(snapshot.id().isEmpty());
+    QVERIFY(snapshot.state().isEmpty());
+    QVERIFY(snapshot.timeline().isEmpty());
+    QVERIFY(snapshot.timelineEvent(0).isEmpty());
+}
+
+void RoomSnapshotTest::captureAndIsolate()
+{
+    auto* c = Connection::makeMockConnection(UserId);
+    feedTimeline(
+        c, QStringLiteral("s1"),
+        { makeStateEvent(QStringLiteral("m.room.create"), {}),
+          makeStateEvent(QStringLiteral("m.room.member"),
+                         { { "membership"_ls, "join"_ls },
+                           { "displayname"_ls, "Me"_ls } },
+                         UserId),
+          makeStateEvent(QStringLiteral("m.room.topic"),
+                         { { "topic"_ls, "Old topic"_ls } }),
+          makeMessage(QStringLiteral("one")),
+          makeMessage(QStringLiteral("two")),
+          makeMessage(QStringLiteral("three")) });
+    auto* room = c->room(RoomId);
+    QVERIFY(room);
+    // Room updates are applied from the event loop
+    QTRY_COMPARE(room->topic(), QStringLiteral("Old topic"));
+
+    const auto snapshot = room->snapshot(2);
+    QVERIFY(!snapshot.isNull());
+    QCOMPARE(snapshot.id(), RoomId);
+    QCOMPARE(snapshot.joinState(), JoinState::Join);
+    QCOMPARE(snapshot.topic(), QStringLiteral("Old topic"));
+    QCOMPARE(snapshot.unreadStats().notableCount,
+             room->unreadStats().notableCount);
+    QCOMPARE(snapshot.joinedMemberIds(), QStringList { UserId });
+    QCOMPARE(snapshot.memberDisplayName(UserId), QStringLiteral("Me"));
+    QCOMPARE(topicFromState(snapshot), QStringLiteral("Old topic"));
+
+    QCOMPARE(snapshot.timeline().size(), 2);
+    QCOMPARE(snapshot.minTimelineIndex(), room->minTimelineIndex());
+    const auto lastIndex = room->maxTimelineIndex();
+    QCOMPARE(snapshot.timeline().back().index, lastIndex);
+    QCOMPARE(contentValue(snapshot.timelineEvent(lastIndex), "body"_ls),
+             QStringLiteral("three"));
+    QVERIFY(snapshot.timelineEvent(lastIndex - 2).isEmpty());
+
+    // Changes in the room don't affect snapshots taken before
+    feedTimeline(c, QStringLiteral("s2"),
+                 { makeStateEvent(QStringLiteral("m.room.topic"),
+                                  { { "topic"_ls, "New topic"_ls } }),
+                   makeMessage(QStringLiteral("four")) });
+    QTRY_COMPARE(room->topic(), QStringLiteral("New topic"));
+    QCOMPARE(snapshot.topic(), QStringLiteral("Old topic"));
+    QCOMPARE(topicFromState(snapshot), QStringLiteral("Old topic"));
+    QCOMPARE(snapshot.timeline().back().index, lastIndex);
+
+    const auto newSnapshot = room->snapshot(-1);
+    QCOMPARE(topicFromState(newSnapshot), QStringLiteral("New topic"));
+    QCOMPARE(newSnapshot.timeline().size(), int(room->messageEvents().size()));
+
+    // Snapshots can be read from another thread
+    QString bodyFromThread;
+    std::unique_ptr<QThread> reader { QThread::create([&bodyFromThread,
+                                                       newSnapshot] {
+        bodyFromThread =
+            contentValue(newSnapshot.timeline().back().json, "body"_ls);
+    }) };
+    reader->start();
+    QVERIFY(reader->wait());
+    QCOMPARE(bodyFromThread, QStringLiteral("four"));
+
+    delete c;
+}
+
+QTEST_GUILESS_MAIN(RoomSnapshotTest)
+#include "roomsnapshottest.moc"
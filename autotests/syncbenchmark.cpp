@@ -0,0 +1,505 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "testutils.h"
+
+#include "eventstats.h"
+#include "room.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QThreadPool>
+#include <QtTest/QtTest>
+
+#include <atomic>
+
+#ifdef __GLIBC__
+#    include <malloc.h>
+#endif
+
+// Sync payloads for the benchmarks are generated in several sizes; on top of
+// that, JSON files from the directory set in QUOTIENT_BENCHMARK_FIXTURES
+// (e.g., anonymised /sync responses recorded from a real account) are
+// replayed as well. Time is reported by QtTest; the peak heap usage of each
+// benchmark is printed after it, on platforms where it can be measured.
+
+using namespace Quotient;
+
+namespace {
+std::atomic<qint64> allocatedBytes { 0 };
+std::atomic<qint64> peakAllocatedBytes { 0 };
+
+void countAllocation(qint64 bytes)
+{
+    const auto current = allocatedBytes += bytes;
+    for (auto peak = peakAllocatedBytes.load();
+         current > peak
+         && !peakAllocatedBytes.compare_exchange_weak(peak, current);) {}
+}
+} // namespace
+
+#ifdef __GLIBC__
+// Count heap usage by interposing the allocation functions of glibc; Qt
+// containers use malloc() directly, so counting in operator new would miss
+// most of the memory used by the library
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size)
+{
+    auto* ptr = __libc_malloc(size);
+    if (ptr)
+        countAllocation(qint64(malloc_usable_size(ptr)));
+    return ptr;
+}
+
+void* calloc(size_t count, size_t size)
+{
+    auto* ptr = __libc_calloc(count, size);
+    if (ptr)
+        countAllocation(qint64(malloc_usable_size(ptr)));
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    const auto oldSize = ptr ? qint64(malloc_usable_size(ptr)) : 0;
+    auto* newPtr = __libc_realloc(ptr, size);
+    if (newPtr)
+        countAllocation(qint64(malloc_usable_size(newPtr)) - oldSize);
+    else if (size == 0)
+        countAllocation(-oldSize);
+    return newPtr;
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+    auto* ptr = __libc_memalign(alignment, size);
+    if (ptr)
+        countAllocation(qint64(malloc_usable_size(ptr)));
+    return ptr;
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void*) != 0
+        || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    *ptr = memalign(alignment, size);
+    return *ptr || size == 0 ? 0 : ENOMEM;
+}
+
+void free(void* ptr)
+{
+    if (ptr)
+        countAllocation(-qint64(malloc_usable_size(ptr)));
+    __libc_free(ptr);
+}
+}
+#    define HEAP_USAGE_MEASURED
+#endif
+
+namespace {
+//! Print the peak heap usage above the level at construction, when destroyed
+class PeakHeapUsage {
+public:
+    PeakHeapUsage() : baseline(allocatedBytes.load())
+    {
+        peakAllocatedBytes = baseline;
+    }
+    ~PeakHeapUsage()
+    {
+#ifdef HEAP_USAGE_MEASURED
+        qInfo("Peak heap usage: %lld KiB",
+              (peakAllocatedBytes.load() - baseline) / 1024);
+#endif
+    }
+
+private:
+    qint64 baseline;
+};
+
+//! Make the protected room API available to the benchmarks
+class BenchmarkRoom : public Room {
+public:
+    using Room::Room;
+    using Room::toJson;
+    using Room::updateData;
+};
+
+const auto LocalUserId = QStringLiteral("@bench:example.org");
+//! Make a /sync response with joined rooms that only have plain messages
+QJsonObject makeSyncJson(int roomCount, int membersPerRoom,
+                         int messagesPerRoom)
+{
+    int n = 0;
+    QJsonObject joinedRooms;
+    for (int r = 0; r < roomCount; ++r) {
+        const auto creator = QStringLiteral("@user0:example.org");
+        QJsonArray state {
+            makeEvent("m.room.create"_ls, creator,
+                      { { "creator"_ls, creator } }, ++n, {}, true),
+            makeEvent("m.room.name"_ls, creator,
+                      { { "name"_ls, QStringLiteral("Room %1").arg(r) } }, ++n,
+                      {}, true),
+            makeEvent("m.room.topic"_ls, creator,
+                      { { "topic"_ls, QStringLiteral("Topic of room %1").arg(r) } },
+                      ++n, {}, true)
+        };
+        for (int m = 0; m < membersPerRoom; ++m) {
+            const auto userId = m == 0 ? LocalUserId
+                                       : QStringLiteral("@user%1:example.org")
+                                             .arg(m);
+            state.append(makeEvent(
+                "m.room.member"_ls, userId,
+                { { "membership"_ls, "join"_ls },
+                  { "displayname"_ls, QStringLiteral("User %1").arg(m) } },
+                ++n, userId, true));
+        }
+        QJsonArray timeline;
+        for (int e = 0; e < messagesPerRoom; ++e) {
+            const auto sender = QStringLiteral("@user%1:example.org")
+                                    .arg(e % membersPerRoom);
+            timeline.append(makeEvent(
+                "m.room.message"_ls, sender,
+                { { "msgtype"_ls, "m.text"_ls },
+                  { "body"_ls, QStringLiteral("Message %1 mentioning %2")
+                                   .arg(e)
+                                   .arg(e % 7 == 0 ? "bench" : "nobody") } },
+                ++n));
+        }
+        // The local user has read the room up to the middle of the timeline
+        const auto readEventId =
+            timeline.at(messagesPerRoom / 2)["event_id"_ls].toString();
+        const QJsonObject receipt {
+            { readEventId,
+              QJsonObject {
+                  { "m.read"_ls,
+                    QJsonObject { { LocalUserId,
+                                    QJsonObject { { "ts"_ls,
+                                                    FixtureBaseTimestamp } } } } } } }
+        };
+        const QJsonArray ephemeral { QJsonObject {
+            { "type"_ls, "m.receipt"_ls }, { "content"_ls, receipt } } };
+        joinedRooms.insert(
+            QStringLiteral("!room%1:example.org").arg(r),
+            QJsonObject {
+                { "state"_ls, QJsonObject { { "events"_ls, state } } },
+                { "timeline"_ls,
+                  QJsonObject { { "events"_ls, timeline },
+                                { "limited"_ls, true },
+                                { "prev_batch"_ls, "p0"_ls } } },
+                { "ephemeral"_ls, QJsonObject { { "events"_ls, ephemeral } } },
+                { "summary"_ls,
+                  QJsonObject {
+                      { "m.joined_member_count"_ls, membersPerRoom } } },
+                { "unread_notifications"_ls,
+                  QJsonObject { { "notification_count"_ls, 0 },
+                                { "highlight_count"_ls, 0 } } } });
+    }
+    return { { "next_batch"_ls, "s1"_ls },
+             { "rooms"_ls, QJsonObject { { "join"_ls, joinedRooms } } } };
+}
+
+SyncData parseSync(const QJsonObject& json)
+{
+    SyncData data;
+    data.parseJson(json);
+    return data;
+}
+
+//! Make rooms of a mock connection and feed them with the sync data
+std::vector<std::unique_ptr<BenchmarkRoom>> makeRooms(Connection* c,
+                                                      const QJsonObject& json)
+{
+    std::vector<std::unique_ptr<BenchmarkRoom>> rooms;
+    for (auto&& roomData : parseSync(json).takeRoomData()) {
+        auto& r = rooms.emplace_back(std::make_unique<BenchmarkRoom>(
+            c, roomData.roomId, roomData.joinState));
+        r->updateData(std::move(roomData), true);
+    }
+    return rooms;
+}
+
+//! \brief Enable debug logging of the library while the object exists
+//!
+//! The messages are thrown away, so that only making them is measured.
+class DebugLoggingEnabler {
+public:
+    DebugLoggingEnabler()
+    {
+        QLoggingCategory::setFilterRules(
+            QStringLiteral("quotient.*.debug=true"));
+        previousHandler = qInstallMessageHandler(discardLibraryMessages);
+    }
+    ~DebugLoggingEnabler()
+    {
+        qInstallMessageHandler(previousHandler);
+        QLoggingCategory::setFilterRules({});
+    }
+
+private:
+    static inline QtMessageHandler previousHandler = nullptr;
+
+    static void discardLibraryMessages(QtMsgType type,
+                                       const QMessageLogContext& context,
+                                       const QString& message)
+    {
+        if (qstrncmp(context.category, "quotient.", 9) != 0 && previousHandler)
+            previousHandler(type, context, message);
+    }
+};
+
+//! \brief Run a benchmark that needs preparation not to be measured
+//!
+//! QBENCHMARK cannot leave a part of its body out of the measurement;
+//! \p prepare is called before each of \p iterations to make the input for
+//! \p fn, and only calls to the latter are timed.
+template <typename PrepareFnT, typename FnT>
+void benchmarkPrepared(int iterations, PrepareFnT prepare, FnT fn)
+{
+    qint64 totalNs = 0;
+    PeakHeapUsage peakHeapUsage;
+    for (int i = 0; i < iterations; ++i) {
+        auto input = prepare();
+        QElapsedTimer et;
+        et.start();
+        fn(input);
+        totalNs += et.nsecsElapsed();
+    }
+    QTest::setBenchmarkResult(qreal(totalNs) / iterations / 1e6,
+                              QTest::WalltimeMilliseconds);
+}
+} // namespace
+
+class SyncBenchmark : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+
+    void parseSyncData_data() { addSyncPayloads(); }
+    void parseSyncData();
+    void applySyncData_data() { addSyncPayloads(); }
+    void applySyncData();
+    void updateRooms_data() { addSyncPayloads(); }
+    void updateRooms();
+    void updateRoomsWithDebugLogging_data() { addSyncPayloads(); }
+    void updateRoomsWithDebugLogging();
+    void saveRoomState_data() { addSyncPayloads(); }
+    void saveRoomState();
+    void loadRoomState_data() { addSyncPayloads(); }
+    void loadRoomState();
+    void countEventStats_data() { addSyncPayloads(); }
+    void countEventStats();
+    void destroyRooms_data() { addSyncPayloads(); }
+    void destroyRooms();
+    void loadMillionEvents();
+
+private:
+    static constexpr int Iterations = 5;
+    void addSyncPayloads();
+
+    std::unique_ptr<Connection> connection;
+};
+
+void SyncBenchmark::initTestCase()
+{
+    Connection::setRoomType<BenchmarkRoom>();
+    connection.reset(Connection::makeMockConnection(LocalUserId));
+}
+
+void SyncBenchmark::addSyncPayloads()
+{
+    QTest::addColumn<QJsonObject>("json");
+    QTest::newRow("synthetic-small") << makeSyncJson(10, 5, 20);
+    QTest::newRow("synthetic-medium") << makeSyncJson(100, 20, 50);
+    QTest::newRow("synthetic-large") << makeSyncJson(500, 50, 100);
+    QTest::newRow("synthetic-long-timelines") << makeSyncJson(5, 20, 5000);
+
+    const auto fixturesDir = qEnvironmentVariable("QUOTIENT_BENCHMARK_FIXTURES");
+    if (fixturesDir.isEmpty())
+        return;
+    const QDir dir(fixturesDir);
+    for (const auto& fileName : dir.entryList({ "*.json"_ls }, QDir::Files)) {
+        QFile file(dir.filePath(fileName));
+        if (!file.open(QFile::ReadOnly)) {
+            qWarning() << "Couldn't open" << file.fileName();
+            continue;
+        }
+        auto json = QJsonDocument::fromJson(file.readAll()).object();
+        // Mock connections don't do E2EE
+        json.remove("to_device"_ls);
+        json.remove("device_lists"_ls);
+        json.remove("device_one_time_keys_count"_ls);
+        QTest::newRow(qPrintable(fileName)) << json;
+    }
+}
+
+void SyncBenchmark::parseSyncData()
+{
+    QFETCH(QJsonObject, json);
+    PeakHeapUsage peakHeapUsage;
+    QBENCHMARK {
+        SyncData data;
+        data.parseJson(json);
+    }
+}
+
+void SyncBenchmark::applySyncData()
+{
+    QFETCH(QJsonObject, json);
+    const auto roomCount = json["rooms"_ls]["join"_ls].toObject().size();
+    benchmarkPrepared(
+        Iterations,
+        [&json] {
+            return std::pair { std::unique_ptr<Connection>(
+                                   Connection::makeMockConnection(LocalUserId)),
+                               parseSync(json) };
+        },
+        [roomCount](auto& input) {
+            auto& [c, data] = input;
+            int loadedRooms = 0;
+            connect(c.get(), &Connection::loadedRoomState, c.get(),
+                    [&loadedRooms] { ++loadedRooms; });
+            SyncFeeder::feed(c.get(), std::move(data));
+            // Room updates are applied in slices, from the event loop
+            while (loadedRooms < roomCount)
+                QCoreApplication::processEvents();
+        });
+}
+
+void SyncBenchmark::updateRooms()
+{
+    QFETCH(QJsonObject, json);
+    benchmarkPrepared(
+        Iterations, [&json] { return parseSync(json).takeRoomData(); },
+        [this](SyncDataList& roomDataList) {
+            for (auto&& roomData : roomDataList)
+                BenchmarkRoom(connection.get(), roomData.roomId,
+                              roomData.joinState)
+                    .updateData(std::move(roomData));
+        });
+}
+
+void SyncBenchmark::updateRoomsWithDebugLogging()
+{
+    // Compare with updateRooms to see the cost of debug logging in room
+    // updates; with the library built with Quotient_STRIPPED_LOGGING for
+    // the categories involved, the difference should be gone
+    DebugLoggingEnabler debugLogging;
+    updateRooms();
+}
+
+void SyncBenchmark::saveRoomState()
+{
+    QFETCH(QJsonObject, json);
+    const auto rooms = makeRooms(connection.get(), json);
+    PeakHeapUsage peakHeapUsage;
+    QBENCHMARK {
+        for (const auto& r : rooms)
+            QJsonDocument(r->toJson()).toJson(QJsonDocument::Compact);
+    }
+}
+
+void SyncBenchmark::loadRoomState()
+{
+    QFETCH(QJsonObject, json);
+    std::vector<std::pair<QString, QByteArray>> roomStates;
+    for (const auto& r : makeRooms(connection.get(), json))
+        roomStates.emplace_back(r->id(), QJsonDocument(r->toJson()).toJson(
+                                             QJsonDocument::Compact));
+    PeakHeapUsage peakHeapUsage;
+    QBENCHMARK {
+        for (const auto& [roomId, state] : roomStates)
+            BenchmarkRoom(connection.get(), roomId, JoinState::Join)
+                .updateData({ roomId, JoinState::Join,
+                              QJsonDocument::fromJson(state).object() },
+                            true);
+    }
+}
+
+void SyncBenchmark::countEventStats()
+{
+    QFETCH(QJsonObject, json);
+    const auto rooms = makeRooms(connection.get(), json);
+    PeakHeapUsage peakHeapUsage;
+    QBENCHMARK {
+        for (const auto& r : rooms)
+            EventStats::fromRange(r.get(),
+                                  EventStats::marker_t(r->syncEdge()),
+                                  r->historyEdge());
+    }
+}
+
+void SyncBenchmark::destroyRooms()
+{
+    QFETCH(QJsonObject, json);
+#ifdef HEAP_USAGE_MEASURED
+    {
+        // The heap retained by the rooms once the sync payload is gone
+        const auto baseline = allocatedBytes.load();
+        const auto rooms = makeRooms(connection.get(), json);
+        qInfo("Heap usage of rooms: %lld KiB",
+              (allocatedBytes.load() - baseline) / 1024);
+    }
+#endif
+    benchmarkPrepared(
+        Iterations,
+        [this, &json] {
+            // Don't let destruction of rooms from the previous iteration
+            // interfere with this one
+            QThreadPool::globalInstance()->waitForDone();
+            return makeRooms(connection.get(), json);
+        },
+        [](auto& rooms) { rooms.clear(); });
+    QThreadPool::globalInstance()->waitForDone();
+}
+
+void SyncBenchmark::loadMillionEvents()
+{
+    // Not among addSyncPayloads(): running all the benchmarks above with
+    // a payload this big would take too long
+    const auto json = makeSyncJson(10, 20, 100'000);
+    struct Input {
+        qint64 heapBaseline;
+        SyncDataList roomDataList;
+        std::vector<std::unique_ptr<BenchmarkRoom>> rooms {};
+    };
+    benchmarkPrepared(
+        1,
+        [&json] {
+            const auto heapBaseline = allocatedBytes.load();
+            return Input { heapBaseline, parseSync(json).takeRoomData() };
+        },
+        [this](Input& input) {
+            for (auto&& roomData : std::exchange(input.roomDataList, {})) {
+                auto& r = input.rooms.emplace_back(
+                    std::make_unique<BenchmarkRoom>(connection.get(),
+                                                    roomData.roomId,
+                                                    roomData.joinState));
+                r->updateData(std::move(roomData), true);
+            }
+#ifdef HEAP_USAGE_MEASURED
+            // The sync data is gone by now, only the rooms remain
+            qInfo("Heap usage of rooms: %lld KiB",
+                  (allocatedBytes.load() - input.heapBaseline) / 1024);
+#endif
+        });
+    // Rooms are destroyed once measurement is over; wait until their
+    // timelines are gone as well
+    QThreadPool::globalInstance()->waitForDone();
+}
+
+QTEST_GUILESS_MAIN(SyncBenchmark)
+#include "syncbenchmark.moc"
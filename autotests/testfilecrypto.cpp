@@ -6,6 +6,7 @@
 
 #include "events/filesourceinfo.h"
 
+#include <QtCore/QBuffer>
 #include <qtest.h>
 
 using namespace Quotient;
@@ -19,4 +20,31 @@ void TestFileCrypto::encryptDecryptData()
     QCOMPARE(decrypted.size(), data.size());
     QCOMPARE(decrypted, data);
 }
+
+void TestFileCrypto::encryptingDevice()
+{
+    QByteArray data;
+    for (int i = 0; i < 1000; ++i) // Deliberately not a multiple of 16 bytes
+        data.append(char(i % 251));
+    QBuffer source(&data);
+    EncryptingFileDevice encryptor(&source);
+    QVERIFY(encryptor.open(QIODevice::ReadOnly));
+    QVERIFY(!encryptor.isSequential());
+    QCOMPARE(encryptor.size(), qint64(data.size()));
+
+    // Read in uneven chunks, with a rewind in the middle, as
+    // QNetworkAccessManager may do on retries
+    auto cipherText = encryptor.read(100);
+    QVERIFY(encryptor.seek(37));
+    QCOMPARE(encryptor.read(63), cipherText.mid(37));
+    cipherText += encryptor.readAll();
+    QCOMPARE(cipherText.size(), data.size());
+
+    const auto metadata = encryptor.metadata();
+    QCOMPARE(decryptFile(cipherText, metadata), data);
+
+    // Random access should yield the same ciphertext
+    QVERIFY(encryptor.seek(517));
+    QCOMPARE(encryptor.read(200), cipherText.mid(517, 200));
+}
 QTEST_APPLESS_MAIN(TestFileCrypto)
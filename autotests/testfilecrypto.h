@@ -9,4 +9,5 @@ class TestFileCrypto : public QObject
     Q_OBJECT
 private Q_SLOTS:
     void encryptDecryptData();
+    void encryptingDevice();
 };
@@ -0,0 +1,258 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "testkeyexport.h"
+
+#include "database.h"
+
+#include "e2ee/keyexport.h"
+#include "events/encryptedevent.h"
+#include "e2ee/qolminboundsession.h"
+#include "e2ee/qolmoutboundsession.h"
+
+#include <QtCore/QBuffer>
+#include <QtCore/QStandardPaths>
+#include <qtest.h>
+
+using namespace Quotient;
+
+// Deriving keys with the default number of rounds takes too long for a test
+static constexpr int TestRounds = 1000;
+
+static ExportedMegolmSession makeSession(int i)
+{
+    return { QStringLiteral("m.megolm.v1.aes-sha2"),
+             QStringLiteral("!room%1:example.org").arg(i % 3),
+             QStringLiteral("senderKey%1").arg(i),
+             QStringLiteral("ed25519Key%1").arg(i),
+             QStringLiteral("session%1").arg(i),
+             QByteArray("sessionKey").repeated(i % 17 + 1),
+             { QStringLiteral("forwarder%1").arg(i) } };
+}
+
+static QByteArray writeExport(int count, const QString& passphrase)
+{
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    KeyExportWriter writer(&buffer, passphrase, TestRounds);
+    for (int i = 0; i < count; ++i)
+        if (!writer.write(makeSession(i)))
+            return {};
+    return writer.finish() ? data : QByteArray();
+}
+
+void TestKeyExport::roundTrip()
+{
+    static constexpr int Count = 300;
+    auto data = writeExport(Count, QStringLiteral("passphrase"));
+    QVERIFY(data.startsWith("-----BEGIN MEGOLM SESSION DATA-----\n"));
+    QVERIFY(data.endsWith("-----END MEGOLM SESSION DATA-----\n"));
+
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::ReadOnly);
+    KeyExportReader reader(&buffer, QStringLiteral("passphrase"));
+    QVERIFY(reader.verify());
+    int i = 0;
+    // Read in uneven batches to cross the boundaries of decrypted blocks
+    for (auto sessions = reader.read(7); !sessions.empty();
+         sessions = reader.read(7)) {
+        QVERIFY(sessions.size() <= 7);
+        for (const auto& session : sessions) {
+            const auto expected = makeSession(i++);
+            QCOMPARE(session.algorithm, expected.algorithm);
+            QCOMPARE(session.roomId, expected.roomId);
+            QCOMPARE(session.senderKey, expected.senderKey);
+            QCOMPARE(session.senderClaimedEd25519Key,
+                     expected.senderClaimedEd25519Key);
+            QCOMPARE(session.sessionId, expected.sessionId);
+            QCOMPARE(session.sessionKey, expected.sessionKey);
+            QCOMPARE(session.forwardingCurve25519KeyChain,
+                     expected.forwardingCurve25519KeyChain);
+        }
+    }
+    QVERIFY(!reader.hasError());
+    QCOMPARE(i, Count);
+}
+
+void TestKeyExport::wrongPassphrase()
+{
+    auto data = writeExport(5, QStringLiteral("passphrase"));
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::ReadOnly);
+    KeyExportReader reader(&buffer, QStringLiteral("wrong passphrase"));
+    QVERIFY(!reader.verify());
+    QVERIFY(reader.read(10).empty());
+    QVERIFY(reader.hasError());
+}
+
+void TestKeyExport::tamperedExport()
+{
+    auto data = writeExport(5, QStringLiteral("passphrase"));
+    // Flip a base64 character in the ciphertext, past the prologue line
+    const auto pos = data.indexOf('\n', data.indexOf('\n') + 1) + 10;
+    data[pos] = data[pos] == 'A' ? 'B' : 'A';
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::ReadOnly);
+    KeyExportReader reader(&buffer, QStringLiteral("passphrase"));
+    QVERIFY(!reader.verify());
+}
+
+void TestKeyExport::excessiveRounds()
+{
+    auto data = writeExport(5, QStringLiteral("passphrase"));
+    // The first line after the header encodes the first 72 bytes, including
+    // the number of rounds
+    const auto lineStart = data.indexOf('\n') + 1;
+    const auto lineEnd = data.indexOf('\n', lineStart);
+    auto bytes = QByteArray::fromBase64(data.mid(lineStart, lineEnd - lineStart));
+    const auto roundsPos = 1 + 16 + 16; // Version, salt, IV
+    bytes.replace(roundsPos, 4, QByteArray::fromHex("7fffffff"));
+    data.replace(lineStart, lineEnd - lineStart, bytes.toBase64());
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::ReadOnly);
+    KeyExportReader reader(&buffer, QStringLiteral("passphrase"));
+    // Has to fail before deriving keys, which would take ages otherwise
+    QVERIFY(!reader.verify());
+}
+
+void TestKeyExport::databaseRoundTrip()
+{
+    QStandardPaths::setTestModeEnabled(true);
+    const auto roomId = QStringLiteral("!room:example.org");
+    const auto senderId = QStringLiteral("@sender:example.org");
+    const auto senderKey = QStringLiteral("senderCurveKey");
+    const auto edKey = QStringLiteral("senderEdKey");
+    auto outbound = QOlmOutboundGroupSession::create();
+    const auto inbound =
+        QOlmInboundGroupSession::create(outbound->sessionKey().value());
+    const auto sessionId = QString::fromLatin1(inbound->sessionId());
+
+    QByteArray data;
+    {
+        Database source(QStringLiteral("@source:example.org"),
+                        QStringLiteral("SOURCEDEVICE"), nullptr);
+        source.clear();
+        // A session received over olm only has its sender key in olm_sessions
+        source.saveOlmSession(senderKey, QStringLiteral("olmSessionId"),
+                              "olmPickle", QDateTime::currentDateTime());
+        source.saveMegolmSession(roomId, sessionId,
+                                 inbound->pickle(Unencrypted {}), senderId,
+                                 QStringLiteral("olmSessionId"));
+        qint64 afterRowId = 0;
+        const auto records = source.loadMegolmSessionRecords(afterRowId, 10);
+        QCOMPARE(records.size(), size_t(1));
+        const auto& record = records.front();
+        QCOMPARE(record.sessionId, sessionId);
+        QCOMPARE(record.senderKey, senderKey);
+        QVERIFY(record.ed25519Key.isEmpty());
+        QVERIFY(source.loadMegolmSessionRecords(afterRowId, 10).empty());
+
+        auto session =
+            QOlmInboundGroupSession::unpickle(record.pickle, Unencrypted {})
+                .value();
+        QBuffer buffer(&data);
+        buffer.open(QIODevice::WriteOnly);
+        KeyExportWriter writer(&buffer, QStringLiteral("passphrase"),
+                               TestRounds);
+        QVERIFY(writer.write(
+            { MegolmV1AesSha2AlgoKey, record.roomId, record.senderKey, edKey,
+              record.sessionId,
+              session->exportSession(session->firstKnownIndex()).value(),
+              {} }));
+        QVERIFY(writer.finish());
+    }
+
+    Database target(QStringLiteral("@target:example.org"),
+                    QStringLiteral("TARGETDEVICE"), nullptr);
+    target.clear();
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::ReadOnly);
+    KeyExportReader reader(&buffer, QStringLiteral("passphrase"));
+    QVERIFY(reader.verify());
+    const auto exported = reader.read(10);
+    QCOMPARE(exported.size(), size_t(1));
+    const auto imported =
+        QOlmInboundGroupSession::import(exported.front().sessionKey);
+    QCOMPARE(imported->sessionId(), inbound->sessionId());
+    target.saveMegolmSessions({ { exported.front().roomId,
+                                  exported.front().sessionId,
+                                  imported->pickle(Unencrypted {}),
+                                  {},
+                                  {},
+                                  exported.front().senderKey,
+                                  exported.front().senderClaimedEd25519Key } });
+
+    QCOMPARE(target.megolmSessionIds(roomId), QSet<QString> { sessionId });
+    QCOMPARE(target.megolmSessionSenderKey(roomId, sessionId), senderKey);
+    qint64 afterRowId = 0;
+    const auto records = target.loadMegolmSessionRecords(afterRowId, 10);
+    QCOMPARE(records.size(), size_t(1));
+    QCOMPARE(records.front().senderKey, senderKey);
+    QCOMPARE(records.front().ed25519Key, edKey);
+    QVERIFY(records.front().senderId.isEmpty());
+
+    target.setMegolmSessionSenderId(roomId, sessionId, senderId);
+    auto loaded = target.loadMegolmSession(roomId, sessionId, Unencrypted {});
+    QVERIFY(loaded);
+    QCOMPARE(loaded->senderId(), senderId);
+    // The imported session decrypts what the original one encrypts
+    const auto ciphertext =
+        outbound->encrypt(QStringLiteral("Hello world!")).value();
+    QCOMPARE(loaded->decrypt(ciphertext).value().first,
+             QByteArray("Hello world!"));
+}
+static DeviceKeys makeDevice(const QString& userId, const QString& deviceId,
+                             const QString& curveKey)
+{
+    return { userId,
+             deviceId,
+             { MegolmV1AesSha2AlgoKey },
+             { { "curve25519:"_ls + deviceId, curveKey },
+               { "ed25519:"_ls + deviceId, "ed"_ls + curveKey } },
+             {} };
+}
+
+void TestKeyExport::importedSessionSender()
+{
+    QStandardPaths::setTestModeEnabled(true);
+    const auto alice = QStringLiteral("@alice:example.org");
+    const auto bob = QStringLiteral("@bob:example.org");
+    const auto mallory = QStringLiteral("@mallory:example.org");
+    Database db(QStringLiteral("@owner:example.org"),
+                QStringLiteral("OWNERDEVICE"), nullptr);
+    db.clear();
+    db.updateDevicesList(
+        { { alice, bob, mallory },
+          {},
+          {},
+          {},
+          { makeDevice(alice, QStringLiteral("ALICE1"), "curveA"_ls),
+            makeDevice(bob, QStringLiteral("BOB1"), "curveB"_ls),
+            // Anyone can publish a device with someone else's Curve25519
+            // key; such keys can't be attributed to either user
+            makeDevice(mallory, QStringLiteral("MALLORY1"), "curveB"_ls) },
+          {} });
+    QCOMPARE(db.curveKeyOwner("curveA"_ls), alice);
+    QVERIFY(db.curveKeyOwner("curveB"_ls).isEmpty());
+    QVERIFY(db.curveKeyOwner("curveUnknown"_ls).isEmpty());
+
+    // Only Room marks events decrypted with a session tied to their sender
+    const EncryptedEvent encrypted(QJsonObject {
+        { "type"_ls, EncryptedEvent::TypeId },
+        { "event_id"_ls, "$event:example.org"_ls },
+        { "sender"_ls, alice },
+        { "origin_server_ts"_ls, 0 },
+        { "content"_ls,
+          QJsonObject { { "algorithm"_ls, MegolmV1AesSha2AlgoKey },
+                        { "ciphertext"_ls, "ciphertext"_ls },
+                        { "session_id"_ls, "session"_ls } } } });
+    const auto decrypted = encrypted.createDecrypted(QStringLiteral(
+        R"({"type":"m.room.message","room_id":"!room:example.org",)"
+        R"("content":{"msgtype":"m.text","body":"Hello"}})"));
+    QVERIFY(decrypted);
+    QVERIFY(!decrypted->isSenderVerified());
+}
+
+QTEST_GUILESS_MAIN(TestKeyExport)
@@ -0,0 +1,17 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include <QtTest/QtTest>
+
+class TestKeyExport : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void roundTrip();
+    void wrongPassphrase();
+    void tamperedExport();
+    void excessiveRounds();
+    void databaseRoundTrip();
+    void importedSessionSender();
+};
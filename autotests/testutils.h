@@ -0,0 +1,46 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "connection.h"
+#include "syncdata.h"
+
+#include <QtCore/QJsonObject>
+
+namespace Quotient {
+//! The timestamp of the events made by makeEvent() with n == 0
+constexpr qint64 FixtureBaseTimestamp = 1650000000000;
+
+//! \brief Make the JSON of a room event for test fixtures
+//!
+//! \p n makes the event id and the timestamp of the event unique; events
+//! are a second apart. Pass \p isState to make a state event.
+inline QJsonObject makeEvent(const QString& type, const QString& sender,
+                             QJsonObject content, int n,
+                             const QString& stateKey = {}, bool isState = false)
+{
+    QJsonObject event { { "type"_ls, type },
+                        { "sender"_ls, sender },
+                        { "event_id"_ls,
+                          QStringLiteral("$event%1:example.org").arg(n) },
+                        { "origin_server_ts"_ls,
+                          FixtureBaseTimestamp + n * 1000 },
+                        { "content"_ls, std::move(content) } };
+    if (isState)
+        event.insert("state_key"_ls, stateKey);
+    return event;
+}
+
+//! \brief Feed sync data to a connection, as if it came from the server
+//!
+//! This is meant for connections made with Connection::makeMockConnection();
+//! it gets around the protected access to Connection::onSyncSuccess().
+class SyncFeeder : public Connection {
+public:
+    static void feed(Connection* c, SyncData&& data)
+    {
+        (c->*&SyncFeeder::onSyncSuccess)(std::move(data), false);
+    }
+};
+} // namespace Quotient
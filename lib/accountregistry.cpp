@@ -6,33 +6,76 @@
 
 #include "connection.h"
 #include <QtCore/QCoreApplication>
+#include <QtCore/QThread>
 
 using namespace Quotient;
 
+AccountRegistry::~AccountRegistry()
+{
+    // A connection deleted before gets its thread quit and deleted already
+    for (const auto& workerThread : std::as_const(m_workerThreads))
+        if (workerThread) {
+            workerThread->quit();
+            workerThread->wait();
+        }
+}
+
 void AccountRegistry::add(Connection* a)
 {
+    if (QThread::currentThread() != thread()) {
+        // Queued calls are delivered in order, so a connection added and
+        // then dropped from another thread ends up dropped
+        QMetaObject::invokeMethod(this, [this, a] { add(a); },
+                                  Qt::QueuedConnection);
+        return;
+    }
     if (contains(a))
         return;
+    if (auto* connectionThread = a->thread();
+        connectionThread != thread()
+        && !m_workerThreads.contains(connectionThread))
+        m_workerThreads.push_back(connectionThread);
     beginInsertRows(QModelIndex(), size(), size());
-    push_back(a);
+    {
+        const QWriteLocker locker(&m_lock);
+        push_back(a);
+    }
     endInsertRows();
     emit accountCountChanged();
 }
 
 void AccountRegistry::drop(Connection* a)
 {
+    if (QThread::currentThread() != thread()) {
+        // The connection is likely being destroyed; make sure get() no more
+        // returns it until the removal below gets through
+        {
+            const QWriteLocker locker(&m_lock);
+            m_accountsDropping.insert(a);
+        }
+        QMetaObject::invokeMethod(this, [this, a] { drop(a); },
+                                  Qt::QueuedConnection);
+        return;
+    }
     if (const auto idx = indexOf(a); idx != -1) {
         beginRemoveRows(QModelIndex(), idx, idx);
-        remove(idx);
+        {
+            const QWriteLocker locker(&m_lock);
+            remove(idx);
+        }
         endRemoveRows();
     }
+    const QWriteLocker locker(&m_lock);
+    m_accountsDropping.remove(a);
     Q_ASSERT(!contains(a));
 }
 
 bool AccountRegistry::isLoggedIn(const QString &userId) const
 {
-    return std::any_of(cbegin(), cend(), [&userId](const Connection* a) {
-        return a->userId() == userId;
+    const QReadLocker locker(&m_lock);
+    return std::any_of(cbegin(), cend(), [this, &userId](const Connection* a) {
+        return !m_accountsDropping.contains(const_cast<Connection*>(a))
+               && a->userId() == userId;
     });
 }
 
@@ -59,13 +102,25 @@ QHash<int, QByteArray> AccountRegistry::roleNames() const
 
 Connection* AccountRegistry::get(const QString& userId)
 {
+    const QReadLocker locker(&m_lock);
     for (const auto &connection : *this) {
-        if (connection->userId() == userId)
+        if (!m_accountsDropping.contains(connection)
+            && connection->userId() == userId)
             return connection;
     }
     return nullptr;
 }
 
+bool AccountRegistry::connectionsInWorkerThreads() const
+{
+    return m_connectionsInWorkerThreads;
+}
+
+void AccountRegistry::setConnectionsInWorkerThreads(bool enabled)
+{
+    m_connectionsInWorkerThreads = enabled;
+}
+
 QKeychain::ReadPasswordJob* AccountRegistry::loadAccessTokenFromKeychain(const QString& userId)
 {
     qCDebug(MAIN) << "Reading access token from keychain for" << userId;
@@ -99,12 +154,22 @@ void AccountRegistry::invokeLogin()
 
                     AccountSettings account { accountId };
                     auto connection = new Connection(account.homeserver());
+                    // Track the thread here: connections that fail to log in
+                    // are never added
+                    if (m_connectionsInWorkerThreads) {
+                        if (auto* workerThread =
+                                connection->moveToWorkerThread())
+                            m_workerThreads.push_back(workerThread);
+                    }
                     connect(connection, &Connection::connected, this,
                             [connection, this, accountId] {
-                                connection->loadState();
-                                connection->setLazyLoading(true);
+                                // Calls the connection in its own thread
+                                QMetaObject::invokeMethod(connection, [connection] {
+                                    connection->loadState();
+                                    connection->setLazyLoading(true);
 
-                                connection->syncLoop();
+                                    connection->syncLoop();
+                                });
 
                                 m_accountsLoading.removeAll(accountId);
                                 emit accountsLoadingChanged();
@@ -124,9 +189,14 @@ void AccountRegistry::invokeLogin()
                                 m_accountsLoading.removeAll(accountId);
                                 emit accountsLoadingChanged();
                             });
-                    connection->assumeIdentity(
-                        account.userId(), accessTokenLoadingJob->binaryData(),
-                        account.deviceId());
+                    QMetaObject::invokeMethod(
+                        connection,
+                        [connection, userId = account.userId(),
+                         accessToken = accessTokenLoadingJob->binaryData(),
+                         deviceId = account.deviceId()] {
+                            connection->assumeIdentity(userId, accessToken,
+                                                       deviceId);
+                        });
                 });
     }
 }
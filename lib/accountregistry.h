@@ -8,6 +8,10 @@
 #include "settings.h"
 
 #include <QtCore/QAbstractListModel>
+#include <QtCore/QPointer>
+#include <QtCore/QReadWriteLock>
+#include <QtCore/QSet>
+#include <QtCore/QThread>
 
 #if QT_VERSION_MAJOR >= 6
 #    include <qt6keychain/keychain.h>
@@ -42,10 +46,23 @@ public:
     [[deprecated("Use Accounts variable instead")]] //
     static AccountRegistry& instance();
 
+    //! \brief Stop the threads of connections moved to worker threads
+    //!
+    //! Connections still alive at this point stay in their (finished)
+    //! threads; the threads themselves are waited for, so that the process
+    //! doesn't go down with them still running.
+    ~AccountRegistry() override;
+
     // Expose most of QVector's const-API but only provide add() and drop()
     // for changing it. In theory other changing operations could be supported
     // too; but then boilerplate begin/end*() calls has to be tucked into each
     // and this class gives no guarantees on the order of entries, so why care.
+    //
+    // The registry is only changed in its own thread: add() and drop() called
+    // from other threads (by connections living there, see
+    // Connection::moveToWorkerThread()) are queued to it. isLoggedIn() and
+    // get() can be called from any thread; get() doesn't return connections
+    // that are being dropped.
 
     const QVector<Connection*>& accounts() const { return *this; }
     void add(Connection* a);
@@ -71,6 +88,13 @@ public:
 
     QStringList accountsLoading() const;
 
+    //! \brief Whether connections made by invokeLogin() get threads of their own
+    //!
+    //! Off by default; see Connection::moveToWorkerThread() for what it takes
+    //! to work with connections in worker threads.
+    bool connectionsInWorkerThreads() const;
+    void setConnectionsInWorkerThreads(bool enabled);
+
     void invokeLogin();
 Q_SIGNALS:
     void accountCountChanged();
@@ -83,6 +107,12 @@ Q_SIGNALS:
 private:
     QKeychain::ReadPasswordJob* loadAccessTokenFromKeychain(const QString &userId);
     QStringList m_accountsLoading;
+    bool m_connectionsInWorkerThreads = false;
+    mutable QReadWriteLock m_lock;
+    //! Connections dropped from other threads, with removal still queued
+    QSet<Connection*> m_accountsDropping;
+    //! Threads of the added connections that live outside the registry thread
+    QVector<QPointer<QThread>> m_workerThreads;
 };
 
 inline QUOTIENT_API AccountRegistry Accounts {};
@@ -4,6 +4,7 @@
 #include "avatar.h"
 
 #include "connection.h"
+#include "memoryusage.h"
 
 #include "events/eventcontent.h"
 #include "jobs/mediathumbnailjob.h"
@@ -179,3 +180,11 @@ bool Avatar::updateUrl(const QUrl& newUrl)
         d->_thumbnailRequest->abandon();
     return true;
 }
+
+qint64 Avatar::cachedImagesSize() const
+{
+    auto result = MemoryUsage::sizeOf(d->_originalImage);
+    for (const auto& p : d->_scaledImages)
+        result += MemoryUsage::sizeOf(p.second);
+    return result;
+}
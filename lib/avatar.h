@@ -35,6 +35,9 @@ public:
     QUrl url() const;
     bool updateUrl(const QUrl& newUrl);
 
+    //! The memory taken by the image and its scaled versions cached in memory
+    qint64 cachedImagesSize() const;
+
 private:
     class Private;
     ImplPtr<Private> d;
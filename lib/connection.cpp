@@ -7,6 +7,8 @@
 #include "connection.h"
 
 #include "connectiondata.h"
+#include "internedid.h"
+#include "metrics.h"
 #include "room.h"
 #include "settings.h"
 #include "user.h"
@@ -42,6 +44,10 @@
 #    include "e2ee/qolmutility.h"
 #    include "e2ee/qolmutils.h"
 
+#    include <QtCore/QRunnable>
+#    include <QtCore/QThreadPool>
+
+#    include <olm/olm.h>
 #endif // Quotient_E2EE_ENABLED
 #if QT_VERSION_MAJOR >= 6
 #    include <qt6keychain/keychain.h>
@@ -53,6 +59,7 @@
 #    include <QtCore/QCborValue>
 #endif
 
+#include <QtCore/QCache>
 #include <QtCore/QCoreApplication>
 #include <QtCore/QDir>
 #include <QtCore/QElapsedTimer>
@@ -61,10 +68,48 @@
 #include <QtCore/QRegularExpression>
 #include <QtCore/QStandardPaths>
 #include <QtCore/QStringBuilder>
+#include <QtCore/QThread>
 #include <QtNetwork/QDnsLookup>
 
+#include <deque>
+
 using namespace Quotient;
 
+#ifdef Quotient_E2EE_ENABLED
+//! \brief Get the base key of an olm pre-key message
+//!
+//! The base key is the ephemeral key of the sender the session has been
+//! created with; all pre-key messages of the same session have the same
+//! base key. Returns an empty byte array if the message cannot be parsed.
+inline QByteArray preKeyMessageBaseKey(const QOlmMessage& message)
+{
+    // A version byte is followed by protobuf-like fields, each made of
+    // a tag (field number << 3 | wire type) and a varint-prefixed value
+    static constexpr uint8_t BaseKeyTag = 0x12;
+    const auto data = QByteArray::fromBase64(message.toCiphertext());
+    for (int pos = 1; pos < data.size();) {
+        const auto tag = uint8_t(data[pos++]);
+        if ((tag & 0x7) != 2) // Only length-delimited values are expected
+            return {};
+        qint64 length = 0;
+        for (int shift = 0;; shift += 7) {
+            if (pos == data.size() || shift > 28)
+                return {};
+            const auto byte = uint8_t(data[pos++]);
+            length |= qint64(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        if (length > data.size() - pos)
+            return {};
+        if (tag == BaseKeyTag)
+            return data.mid(pos, int(length));
+        pos += int(length);
+    }
+    return {};
+}
+#endif
+
 // This is very much Qt-specific; STL iterators don't have key() and value()
 template <typename HashT, typename Pred>
 HashT remove_if(HashT& hashMap, Pred pred)
@@ -108,12 +153,39 @@ public:
     UnorderedMap<QString, EventPtr> accountData;
     QMetaObject::Connection syncLoopConnection {};
     int syncTimeout = -1;
+    bool pipelinedSync = false;
+    bool syncLoopAwaitsRoomUpdates = false;
+
+    struct PendingRoomUpdate {
+        QPointer<Room> room;
+        SyncRoomData data;
+        bool fromCache;
+    };
+    //! Room updates from sync responses that are yet to be applied
+    std::deque<PendingRoomUpdate> pendingRoomUpdates;
+    bool roomUpdatesScheduled = false;
+    //! Applying room updates yields to the event loop after this many ms
+    static constexpr qint64 RoomUpdatesSliceMs = 8;
 
 #ifdef Quotient_E2EE_ENABLED
     QSet<QString> trackedUsers;
     QSet<QString> outdatedUsers;
     QHash<QString, QHash<QString, DeviceKeys>> deviceKeys;
-    QueryKeysJob *currentQueryKeysJob = nullptr;
+    //! Tracked and outdated users as last passed to the database
+    QSet<QString> savedTrackedUsers;
+    QSet<QString> savedOutdatedUsers;
+    //! Users queued for or being in a key query
+    QSet<QString> usersBeingQueried;
+    //! Users whose devices changed again while their keys were being queried
+    QSet<QString> usersToRequery;
+    //! Key queries and claims waiting for a free slot
+    std::deque<std::function<BaseJob*()>> queuedKeyJobs;
+    int runningKeyJobs = 0;
+    static constexpr int MaxRunningKeyJobs = 4;
+    static constexpr int KeyQueryBatchSize = 250;
+    static constexpr int KeyClaimBatchSize = 100;
+    //! New olm sessions for a single thread pool task
+    static constexpr int OlmSessionsPerTask = 16;
     bool encryptionUpdateRequired = false;
     PicklingMode picklingMode = Unencrypted {};
     Database *database = nullptr;
@@ -121,8 +193,24 @@ public:
     std::vector<std::unique_ptr<EncryptedEvent>> pendingEncryptedEvents;
     void handleEncryptedToDeviceEvent(const EncryptedEvent& event);
 
-    // A map from SenderKey to vector of InboundSession
+    // A map from SenderKey to vector of InboundSession, most recently used
+    // sessions first
     UnorderedMap<QString, std::vector<QOlmSessionPtr>> olmSessions;
+    //! \brief Olm sessions by sender key and base key of their pre-key
+    //!        messages
+    //!
+    //! This only points into olmSessions; entries must be dropped whenever
+    //! the sessions they point to are removed from there.
+    QHash<QByteArray, QOlmSession*> olmSessionsByPreKey;
+
+    static constexpr int MegolmSessionCacheSize = 1000;
+    //! \brief Recently used inbound megolm sessions, keyed by room and
+    //!        session ids
+    //!
+    //! Sessions are shared so that callers can keep using a session that
+    //! has been evicted from the cache in the meantime.
+    QCache<QPair<QString, QString>, std::shared_ptr<QOlmInboundGroupSession>>
+        megolmSessionCache { MegolmSessionCacheSize };
 
 #endif
 
@@ -135,6 +223,16 @@ public:
     std::unique_ptr<QOlmAccount> olmAccount;
     bool isUploadingKeys = false;
     bool firstSync = true;
+    //! Changes each time olmAccount needs saving
+    int olmAccountRevision = 0;
+    //! \brief The pool for olm work that is done off the connection thread
+    //!
+    //! Tasks in this pool never touch olmAccount, which is only used in
+    //! the thread of the connection; they work on copies unpickled from
+    //! its pickle instead. They deliver results to the connection though,
+    //! so the pool must be destroyed, waiting for them to finish, before
+    //! the rest of the connection.
+    QThreadPool olmTaskPool;
 #endif // Quotient_E2EE_ENABLED
 
     QPointer<GetWellknownJob> resolverJob = nullptr;
@@ -143,6 +241,9 @@ public:
     SyncJob* syncJob = nullptr;
     QPointer<LogoutJob> logoutJob = nullptr;
 
+    //! Whether completeSetup() has been done; the connection can't be moved
+    //! to another thread after that
+    bool setupCompleted = false;
     bool cacheState = true;
     bool cacheToBinary =
         SettingsGroup("libQuotient").get("cache_type",
@@ -171,9 +272,12 @@ public:
     template <typename... LoginArgTs>
     void loginToServer(LoginArgTs&&... loginArgs);
     void completeSetup(const QString &mxId);
+    void connectSaveOnQuit();
     void removeRoom(const QString& roomId);
 
     void consumeRoomData(SyncDataList&& roomDataList, bool fromCache);
+    void scheduleRoomUpdates();
+    void applyRoomUpdates();
     void consumeAccountData(Events&& accountDataEvents);
     void consumePresenceData(Events&& presenceData);
     void consumeToDeviceEvents(Events&& toDeviceEvents);
@@ -210,6 +314,8 @@ public:
 
 #ifdef Quotient_E2EE_ENABLED
     void loadSessions() {
+        // The old sessions are destroyed by the assignment below
+        olmSessionsByPreKey.clear();
         olmSessions = q->database()->loadOlmSessions(picklingMode);
     }
     void saveSession(const QOlmSession& session, const QString& senderKey) const
@@ -254,20 +360,46 @@ public:
         QOlmMessage message {
             personalCipherObject.value(BodyKeyL).toString().toLatin1(), msgType
         };
-        for (const auto& session : olmSessions[senderKey])
-            if (msgType == QOlmMessage::General
-                || session->matchesInboundSessionFrom(senderKey, message)) {
-                return doDecryptMessage(*session, message, [this, &session] {
-                    q->database()->setOlmSessionLastReceived(
-                        session->sessionId(), QDateTime::currentDateTime());
+        auto& sessions = olmSessions[senderKey];
+        if (msgType == QOlmMessage::General) {
+            // Sessions are ordered by last use, so the right one is usually
+            // the first one
+            for (const auto& session : sessions) {
+                auto* const s = session.get();
+                auto result = doDecryptMessage(*s, message, [this, &sessions, s] {
+                    markOlmSessionUsed(sessions, s);
                 });
+                if (!result.first.isEmpty())
+                    return result;
             }
-
-        if (msgType == QOlmMessage::General) {
             qCWarning(E2EE) << "Failed to decrypt message";
             return {};
         }
 
+        const auto preKeyIndexKey = senderKey + preKeyMessageBaseKey(message);
+        auto* preKeySession = preKeyIndexKey.size() > senderKey.size()
+                                  ? olmSessionsByPreKey.value(preKeyIndexKey)
+                                  : nullptr;
+        if (!preKeySession) {
+            const auto it = std::find_if(
+                sessions.cbegin(), sessions.cend(),
+                [&senderKey, &message](const QOlmSessionPtr& session) {
+                    return session->matchesInboundSessionFrom(senderKey,
+                                                              message);
+                });
+            if (it != sessions.cend()) {
+                preKeySession = it->get();
+                if (preKeyIndexKey.size() > senderKey.size())
+                    olmSessionsByPreKey.insert(preKeyIndexKey, preKeySession);
+            }
+        }
+        if (preKeySession)
+            return doDecryptMessage(*preKeySession, message,
+                                    [this, &sessions, preKeySession] {
+                                        markOlmSessionUsed(sessions,
+                                                           preKeySession);
+                                    });
+
         qCDebug(E2EE) << "Creating new inbound session"; // Pre-key messages only
         auto newSessionResult =
             olmAccount->createInboundSessionFrom(senderKey, message);
@@ -285,11 +417,32 @@ public:
             // Keep going though
         }
         return doDecryptMessage(
-            *newSession, message, [this, &senderKey, &newSession] {
+            *newSession, message,
+            [this, &senderKey, &sessions, &newSession, &preKeyIndexKey] {
                 saveSession(*newSession, senderKey);
-                olmSessions[senderKey].push_back(std::move(newSession));
+                if (preKeyIndexKey.size() > senderKey.size())
+                    olmSessionsByPreKey.insert(preKeyIndexKey,
+                                               newSession.get());
+                sessions.insert(sessions.begin(), std::move(newSession));
             });
     }
+
+    //! \brief Record that the session has just been used to decrypt a message
+    //!
+    //! The session is moved to the front of \p sessions; the timestamp of
+    //! its use is written to the database in a batch with others.
+    void markOlmSessionUsed(std::vector<QOlmSessionPtr>& sessions,
+                            QOlmSession* session)
+    {
+        const auto it = std::find_if(sessions.begin(), sessions.end(),
+                                     [session](const QOlmSessionPtr& s) {
+                                         return s.get() == session;
+                                     });
+        if (it != sessions.end())
+            std::rotate(sessions.begin(), it, std::next(it));
+        q->database()->setOlmSessionLastReceived(session->sessionId(),
+                                                 QDateTime::currentDateTime());
+    }
 #endif
 
     std::pair<EventPtr, QString> sessionDecryptMessage(const EncryptedEvent& encryptedEvent)
@@ -367,24 +520,65 @@ public:
     bool isKnownCurveKey(const QString& userId, const QString& curveKey) const;
 
     void loadOutdatedUserDevices();
-    void saveDevicesList();
+    void handleQueryKeysResult(const QueryKeysJob* job);
+    //! \brief Run a key query or claim once there's a free slot for it
+    //!
+    //! \p startJob is called to start the job, which should be returned
+    //! so that the number of running jobs can be kept under
+    //! MaxRunningKeyJobs.
+    void enqueueKeyJob(std::function<BaseJob*()> startJob);
+    void startQueuedKeyJobs();
+    //! \brief Persist the changes to the device lists
+    //!
+    //! Changes to the sets of tracked and outdated users are figured out
+    //! by this function; changes to device keys are passed in \p changes.
+    void saveDevicesList(Database::DevicesListChanges&& changes = {});
     void loadDevicesList();
 
     // This function assumes that an olm session with (user, device) exists
     std::pair<QOlmMessage::Type, QByteArray> olmEncryptMessage(
         const QString& userId, const QString& device,
         const QByteArray& message) const;
-    bool createOlmSession(const QString& targetUserId,
-                          const QString& targetDeviceId,
-                          const OneTimeKeys &oneTimeKeyObject);
     QString curveKeyForUserDevice(const QString& userId,
                                   const QString& device) const;
     QString edKeyForUserDevice(const QString& userId,
                                const QString& device) const;
-    std::unique_ptr<EncryptedEvent> makeEventForSessionKey(
-        const QString& roomId, const QString& targetUserId,
-        const QString& targetDeviceId, const QByteArray& sessionId,
-        const QByteArray& sessionKey) const;
+    //! Map Curve25519 keys of known devices to their users and Ed25519 keys
+    QHash<QString, std::pair<QString, QString>> knownDevicesByCurveKey() const;
+    QByteArray makeRoomKeyPayload(const QString& roomId,
+                                  const QString& targetUserId,
+                                  const QString& targetDeviceId,
+                                  const QByteArray& sessionId,
+                                  const QByteArray& sessionKey) const;
+    std::unique_ptr<EncryptedEvent> makeOlmEncryptedEvent(
+        const QString& recipientCurveKey, QOlmMessage::Type type,
+        const QByteArray& ciphertext) const;
+    //! \brief Replenish one-time keys on the server
+    //!
+    //! The keys are generated on olmTaskPool, in a copy of the account;
+    //! the copy replaces the account and the keys are uploaded once that is
+    //! done, unless the account has changed in the meantime. In the latter
+    //! case, the keys are dropped and generation is restarted right away,
+    //! up to MaxOneTimeKeysAttempts times in total; after that, or if
+    //! generation fails, it is tried again after a next sync.
+    void generateAndUploadOneTimeKeys(size_t count, int attempt = 1);
+    static constexpr int MaxOneTimeKeysAttempts = 3;
+    void claimKeysAndSendRoomKey(
+        const QString& roomId, const QByteArray& sessionId,
+        const QByteArray& sessionKey,
+        const QHash<QString, QHash<QString, QString>>& keysToClaim, int index);
+    //! \brief Encrypt a megolm session key for devices and send it to them
+    //!
+    //! Devices that have no olm session yet should have a one-time key in
+    //! \p oneTimeKeys; olm sessions for them are created, and the room key
+    //! encrypted with those sessions, on olmTaskPool. The key is sent to
+    //! all devices in a single request once that is done.
+    void sendRoomKeyToDevices(
+        const QString& roomId, const QByteArray& sessionId,
+        const QByteArray& sessionKey,
+        const QMultiHash<QString, QString>& devices,
+        const QHash<QString, QHash<QString, OneTimeKeys>>& oneTimeKeys,
+        int index);
 #endif
 
     void saveAccessTokenToKeychain() const
@@ -611,7 +805,8 @@ void Connection::Private::completeSetup(const QString& mxId)
                   << "by user" << data->userId()
                   << "from device" << data->deviceId();
     Accounts.add(q);
-    connect(qApp, &QCoreApplication::aboutToQuit, q, &Connection::saveState);
+    setupCompleted = true;
+    connectSaveOnQuit();
 #ifndef Quotient_E2EE_ENABLED
     qCWarning(E2EE) << "End-to-end encryption (E2EE) support is turned off.";
 #else // Quotient_E2EE_ENABLED
@@ -648,9 +843,12 @@ void Connection::Private::completeSetup(const QString& mxId)
     }
 
     database = new Database(data->userId(), data->deviceId(), q);
+    database->setMetrics(data->sharedMetrics());
 
     // init olmAccount
     olmAccount = std::make_unique<QOlmAccount>(data->userId(), data->deviceId(), q);
+    connect(olmAccount.get(), &QOlmAccount::needsSave, q,
+            [this] { ++olmAccountRevision; });
     connect(olmAccount.get(), &QOlmAccount::needsSave, q, &Connection::saveOlmAccount);
 
     loadSessions();
@@ -757,8 +955,13 @@ void Connection::sync(int timeout)
         callApi<SyncJob>(BackgroundRequest, d->data->lastEvent(), filter,
                          timeout);
     connect(job, &SyncJob::success, this, [this, job] {
+        // Only get ahead by one batch; if room updates from previous batches
+        // are still being applied, let the loop wait for them
+        const auto canGetAhead = d->pendingRoomUpdates.empty();
         onSyncSuccess(job->takeData());
         d->syncJob = nullptr;
+        if (d->pipelinedSync && d->syncLoopConnection && canGetAhead)
+            sync(d->syncTimeout); // Don't wait until room updates are applied
         emit syncDone();
     });
     connect(job, &SyncJob::retryScheduled, this,
@@ -800,10 +1003,19 @@ void Connection::syncLoop(int timeout)
 
 void Connection::syncLoopIteration()
 {
-    if (isLoggedIn())
-        sync(d->syncTimeout);
-    else
+    if (!isLoggedIn()) {
         qCInfo(MAIN) << "Logged out, sync loop will stop now";
+        return;
+    }
+    // In the pipelined mode the next sync may have been started already
+    if (d->syncJob)
+        return;
+    if (!d->pendingRoomUpdates.empty()) {
+        // Resume once room updates from the last sync are applied
+        d->syncLoopAwaitsRoomUpdates = true;
+        return;
+    }
+    sync(d->syncTimeout);
 }
 
 QJsonObject toJson(const DirectChatsMap& directChats)
@@ -821,27 +1033,31 @@ QJsonObject toJson(const DirectChatsMap& directChats)
 
 void Connection::onSyncSuccess(SyncData&& data, bool fromCache)
 {
+    if (!fromCache) {
+        auto& m = metrics();
+        m.increment(MetricNames::Syncs);
+        m.increment(MetricNames::SyncEvents, data.eventCount());
+        m.observe(MetricNames::SyncParseSeconds,
+                  double(data.parsingNsecs()) / 1e9);
+    }
 #ifdef Quotient_E2EE_ENABLED
-    d->oneTimeKeysCount = data.deviceOneTimeKeysCount();
-    if (d->oneTimeKeysCount[SignedCurve25519Key] < 0.4 * d->olmAccount->maxNumberOfOneTimeKeys()
-        && !d->isUploadingKeys) {
-        d->isUploadingKeys = true;
-        d->olmAccount->generateOneTimeKeys(
-            d->olmAccount->maxNumberOfOneTimeKeys() / 2 - d->oneTimeKeysCount[SignedCurve25519Key]);
-        auto keys = d->olmAccount->oneTimeKeys();
-        auto job = d->olmAccount->createUploadKeyRequest(keys);
-        run(job, ForegroundRequest);
-        connect(job, &BaseJob::success, this,
-                [this] { d->olmAccount->markKeysAsPublished(); });
-        connect(job, &BaseJob::result, this,
-                [this] { d->isUploadingKeys = false; });
-    }
-    if(d->firstSync) {
-        d->loadDevicesList();
-        d->firstSync = false;
-    }
-
-    d->consumeDevicesList(data.takeDevicesList());
+    // Mock connections have no olm account
+    if (d->olmAccount) {
+        d->oneTimeKeysCount = data.deviceOneTimeKeysCount();
+        if (d->oneTimeKeysCount[SignedCurve25519Key]
+                < 0.4 * d->olmAccount->maxNumberOfOneTimeKeys()
+            && !d->isUploadingKeys) {
+            d->generateAndUploadOneTimeKeys(
+                d->olmAccount->maxNumberOfOneTimeKeys() / 2
+                - d->oneTimeKeysCount[SignedCurve25519Key]);
+        }
+        if (d->firstSync) {
+            d->loadDevicesList();
+            d->firstSync = false;
+        }
+
+        d->consumeDevicesList(data.takeDevicesList());
+    }
 #endif // Quotient_E2EE_ENABLED
     d->consumeToDeviceEvents(data.takeToDeviceEvents());
     d->data->setLastEvent(data.nextBatch());
@@ -849,7 +1065,7 @@ void Connection::onSyncSuccess(SyncData&& data, bool fromCache)
     d->consumeAccountData(data.takeAccountData());
     d->consumePresenceData(data.takePresenceData());
 #ifdef Quotient_E2EE_ENABLED
-    if(d->encryptionUpdateRequired) {
+    if (d->encryptionUpdateRequired && d->olmAccount) {
         d->loadOutdatedUserDevices();
         d->encryptionUpdateRequired = false;
     }
@@ -876,15 +1092,89 @@ void Connection::Private::consumeRoomData(SyncDataList&& roomDataList,
         }
         if (auto* r = q->provideRoom(roomData.roomId, roomData.joinState)) {
             pendingStateRoomIds.removeOne(roomData.roomId);
-            // Update rooms one by one, giving time to update the UI.
-            QMetaObject::invokeMethod(
-                r,
-                [r, rd = std::move(roomData), fromCache] () mutable {
-                    r->updateData(std::move(rd), fromCache);
-                },
-                Qt::QueuedConnection);
+            // If the room still has an update waiting, try to merge into it
+            const auto it = std::find_if(pendingRoomUpdates.rbegin(),
+                                         pendingRoomUpdates.rend(),
+                                         [r](const PendingRoomUpdate& u) {
+                                             return u.room == r;
+                                         });
+            if (it == pendingRoomUpdates.rend() || it->fromCache != fromCache
+                || !it->data.merge(std::move(roomData)))
+                pendingRoomUpdates.push_back({ r, std::move(roomData),
+                                               fromCache });
+        }
+    }
+    data->metrics().setGauge(MetricNames::RoomUpdateQueueDepth,
+                             double(pendingRoomUpdates.size()));
+    scheduleRoomUpdates();
+}
+
+void Connection::Private::scheduleRoomUpdates()
+{
+    if (roomUpdatesScheduled || pendingRoomUpdates.empty())
+        return;
+    roomUpdatesScheduled = true;
+    QMetaObject::invokeMethod(
+        q, [this] { applyRoomUpdates(); }, Qt::QueuedConnection);
+}
+
+inline int roomUpdatePriority(const Room& room, const SyncRoomData& data)
+{
+    // From the most to the least important
+    return (room.displayed() ? 0x8 : 0) | (room.isFavourite() ? 0x4 : 0)
+           | (room.isDirectChat() ? 0x2 : 0)
+           | (room.highlightCount() > 0 || data.highlightCount.value_or(0) > 0
+                  ? 0x1
+                  : 0);
+}
+
+void Connection::Private::applyRoomUpdates()
+{
+    roomUpdatesScheduled = false;
+    if (pendingRoomUpdates.empty())
+        return;
+
+    // Rank rooms anew on every slice as the user may have switched to
+    // another room in the meantime. The sort is stable and all updates
+    // for the same room have the same rank, so they stay in their order.
+    QHash<const Room*, int> priorities;
+    for (const auto& u : pendingRoomUpdates)
+        if (u.room) {
+            auto& p = priorities[u.room.data()];
+            p = std::max(p, roomUpdatePriority(*u.room, u.data));
         }
+    std::stable_sort(pendingRoomUpdates.begin(), pendingRoomUpdates.end(),
+                     [&priorities](const PendingRoomUpdate& lhs,
+                                   const PendingRoomUpdate& rhs) {
+                         return priorities.value(lhs.room.data())
+                                > priorities.value(rhs.room.data());
+                     });
+
+    // Update rooms one by one, yielding to the event loop once the time
+    // budget is exhausted, to give time to update the UI.
+    QElapsedTimer et;
+    et.start();
+    do {
+        auto u = std::move(pendingRoomUpdates.front());
+        pendingRoomUpdates.pop_front();
+        if (u.room)
+            u.room->updateData(std::move(u.data), u.fromCache);
+    } while (!pendingRoomUpdates.empty()
+             && !et.hasExpired(RoomUpdatesSliceMs));
+    data->metrics().setGauge(MetricNames::RoomUpdateQueueDepth,
+                             double(pendingRoomUpdates.size()));
+
+    if (!pendingRoomUpdates.empty()) {
+        scheduleRoomUpdates();
+        return;
     }
+#ifdef Quotient_E2EE_ENABLED
+    // Commit replay protection records for the whole batch at once
+    if (database)
+        database->flushGroupSessionIndexRecords();
+#endif
+    if (std::exchange(syncLoopAwaitsRoomUpdates, false) && syncLoopConnection)
+        q->syncLoopIteration();
 }
 
 void Connection::Private::consumeAccountData(Events&& accountDataEvents)
@@ -1035,6 +1325,8 @@ void Connection::Private::consumeDevicesList(DevicesList&& devicesList)
         if(trackedUsers.contains(changed)) {
             outdatedUsers += changed;
             hasNewOutdatedUser = true;
+            if (usersBeingQueried.contains(changed))
+                usersToRequery += changed;
         }
     }
     for(const auto &left : devicesList.left) {
@@ -1044,7 +1336,8 @@ void Connection::Private::consumeDevicesList(DevicesList&& devicesList)
     }
     if(hasNewOutdatedUser) {
         loadOutdatedUserDevices();
-    }
+    } else if (!devicesList.left.isEmpty())
+        saveDevicesList();
 #endif
 }
 
@@ -1052,6 +1345,7 @@ void Connection::stopSync()
 {
     // If there's a sync loop, break it
     disconnect(d->syncLoopConnection);
+    d->syncLoopAwaitsRoomUpdates = false;
     if (d->syncJob) // If there's an ongoing sync job, stop it too
     {
         if (d->syncJob->status().code == BaseJob::Pending)
@@ -1709,6 +2003,115 @@ const ConnectionData* Connection::connectionData() const
     return d->data.get();
 }
 
+Metrics& Connection::metrics() const { return d->data->metrics(); }
+
+MemoryUsage Connection::memoryUsage() const
+{
+    using M = MemoryUsage;
+    MemoryUsage result;
+
+    qint64 roomsBytes = 0;
+    for (const auto* r : qAsConst(d->roomMap))
+        roomsBytes += r->memoryUsage().total();
+    result.add(QStringLiteral("rooms"), roomsBytes);
+
+    qint64 roomMapsBytes = M::nodesOf(d->roomMap) + M::nodesOf(d->roomAliasMap);
+    for (auto it = d->roomMap.cbegin(); it != d->roomMap.cend(); ++it)
+        roomMapsBytes += M::sizeOf(it.key().first);
+    for (auto it = d->roomAliasMap.cbegin(); it != d->roomAliasMap.cend(); ++it)
+        roomMapsBytes += M::sizeOf(it.key()) + M::sizeOf(it.value());
+    result.add(QStringLiteral("roomMaps"), roomMapsBytes);
+
+    qint64 usersBytes = M::nodesOf(d->userMap);
+    for (auto it = d->userMap.cbegin(); it != d->userMap.cend(); ++it)
+        usersBytes += M::sizeOf(it.key()) + it.value()->memoryUsage().total();
+    result.add(QStringLiteral("users"), usersBytes);
+
+    qint64 directChatsBytes = M::nodesOf(d->directChats)
+                              + M::nodesOf(d->directChatUsers)
+                              + M::nodesOf(d->dcLocalAdditions)
+                              + M::nodesOf(d->dcLocalRemovals);
+    for (const auto* dcMap :
+         { &d->directChats, &d->dcLocalAdditions, &d->dcLocalRemovals })
+        for (const auto& roomId : *dcMap)
+            directChatsBytes += M::sizeOf(roomId);
+    for (auto it = d->directChatUsers.cbegin(); it != d->directChatUsers.cend();
+         ++it)
+        directChatsBytes += M::sizeOf(it.key());
+    result.add(QStringLiteral("directChats"), directChatsBytes);
+
+    qint64 accountDataBytes = M::nodesOf(d->accountData);
+    for (const auto& [type, evt] : d->accountData)
+        accountDataBytes += M::sizeOf(type) + (evt ? M::sizeOf(*evt) : 0);
+    result.add(QStringLiteral("accountData"), accountDataBytes);
+
+    qint64 pendingUpdatesBytes = 0;
+    for (const auto& u : d->pendingRoomUpdates) {
+        pendingUpdatesBytes += qint64(sizeof(u)) + M::sizeOf(u.data.roomId);
+        for (const auto& e : u.data.state)
+            pendingUpdatesBytes += M::sizeOf(*e);
+        for (const auto& e : u.data.timeline)
+            pendingUpdatesBytes += M::sizeOf(*e);
+        for (const auto& e : u.data.ephemeral)
+            pendingUpdatesBytes += M::sizeOf(*e);
+        for (const auto& e : u.data.accountData)
+            pendingUpdatesBytes += M::sizeOf(*e);
+    }
+    result.add(QStringLiteral("pendingRoomUpdates"), pendingUpdatesBytes);
+
+#ifdef Quotient_E2EE_ENABLED
+    qint64 deviceKeysBytes = M::nodesOf(d->deviceKeys);
+    for (auto it = d->deviceKeys.cbegin(); it != d->deviceKeys.cend(); ++it) {
+        deviceKeysBytes += M::sizeOf(it.key()) + M::nodesOf(*it);
+        for (const auto& device : *it) {
+            deviceKeysBytes += M::sizeOf(device.userId)
+                               + M::sizeOf(device.deviceId)
+                               + M::nodesOf(device.keys)
+                               + M::nodesOf(device.signatures);
+            for (const auto& algorithm : device.algorithms)
+                deviceKeysBytes += M::sizeOf(algorithm);
+            for (auto keyIt = device.keys.cbegin(); keyIt != device.keys.cend();
+                 ++keyIt)
+                deviceKeysBytes += M::sizeOf(keyIt.key())
+                                   + M::sizeOf(keyIt.value());
+            for (const auto& userSignatures : device.signatures) {
+                deviceKeysBytes += M::nodesOf(userSignatures);
+                for (auto sigIt = userSignatures.cbegin();
+                     sigIt != userSignatures.cend(); ++sigIt)
+                    deviceKeysBytes += M::sizeOf(sigIt.key())
+                                       + M::sizeOf(sigIt.value());
+            }
+        }
+    }
+    result.add(QStringLiteral("deviceKeys"), deviceKeysBytes);
+
+    qint64 olmSessionsBytes = M::nodesOf(d->olmSessions)
+                              + M::nodesOf(d->olmSessionsByPreKey);
+    for (const auto& [senderKey, sessions] : d->olmSessions)
+        olmSessionsBytes += M::sizeOf(senderKey)
+                            + qint64(sessions.size()
+                                     * (sizeof(QOlmSessionPtr)
+                                        + olm_session_size()));
+    result.add(QStringLiteral("olmSessions"), olmSessionsBytes);
+
+    result.add(QStringLiteral("megolmSessionCache"),
+               qint64(d->megolmSessionCache.size())
+                   * qint64(M::NodeOverhead
+                            + olm_inbound_group_session_size()));
+
+    qint64 pendingEncryptedBytes = 0;
+    for (const auto& e : d->pendingEncryptedEvents)
+        pendingEncryptedBytes += M::sizeOf(*e);
+    result.add(QStringLiteral("pendingEncryptedEvents"), pendingEncryptedBytes);
+#endif
+
+    // Historical avatars are per thread; count those of the connection's one
+    Q_ASSERT(QThread::currentThread() == thread());
+    result += User::historicalAvatarsMemoryUsage();
+    result += InternedId::memoryUsage();
+    return result;
+}
+
 Room* Connection::provideRoom(const QString& id, Omittable<JoinState> joinState)
 {
     // TODO: This whole function is a strong case for a RoomManager class.
@@ -1779,6 +2182,16 @@ Room* Connection::provideRoom(const QString& id, Omittable<JoinState> joinState)
     return room;
 }
 
+Connection* Connection::makeMockConnection(const QString& mxId)
+{
+    auto* c = new Connection;
+    c->setCacheState(false);
+    c->d->data->setUserId(mxId);
+    c->user(); // Creates a User object for the local user
+    c->setObjectName(mxId % "/mock"_ls);
+    return c;
+}
+
 void Connection::setRoomFactory(room_factory_t f)
 {
     _roomFactory = std::move(f);
@@ -1801,6 +2214,44 @@ QByteArray Connection::generateTxnId() const
     return d->data->generateTxnId();
 }
 
+void Connection::Private::connectSaveOnQuit()
+{
+    // The state of a connection in another thread has to be saved before
+    // the application quits, hence the blocking connection in that case
+    QObject::disconnect(qApp, &QCoreApplication::aboutToQuit, q,
+                        &Connection::saveState);
+    connect(qApp, &QCoreApplication::aboutToQuit, q, &Connection::saveState,
+            q->thread() == qApp->thread() ? Qt::AutoConnection
+                                          : Qt::BlockingQueuedConnection);
+}
+
+QThread* Connection::moveToWorkerThread()
+{
+    Q_ASSERT_X(parent() == nullptr, __FUNCTION__,
+               "Connections with a parent cannot be moved to another thread");
+    Q_ASSERT(thread() == QThread::currentThread());
+    // The database connection used from this thread and the keychain
+    // access made during the setup can't be moved to another thread
+    if (d->setupCompleted) {
+        qCCritical(MAIN) << "Connection" << objectName()
+                         << "is already set up and can't be moved to another "
+                            "thread";
+        Q_ASSERT(false);
+        return nullptr;
+    }
+    auto* workerThread = new QThread();
+    workerThread->setObjectName("Quotient connection "_ls % objectName());
+    connect(this, &QObject::destroyed, workerThread, &QThread::quit,
+            Qt::DirectConnection);
+    connect(workerThread, &QThread::finished, workerThread,
+            &QObject::deleteLater);
+    moveToThread(workerThread);
+    // The rate limiter timer is not a child of the connection
+    d->data->moveToThread(workerThread);
+    workerThread->start();
+    return workerThread;
+}
+
 void Connection::setHomeserver(const QUrl& url)
 {
     if (isJobPending(d->resolverJob))
@@ -1831,6 +2282,8 @@ void Connection::saveRoomState(Room* r) const
     if (!d->cacheState)
         return;
 
+    QElapsedTimer et;
+    et.start();
     QFile outRoomFile { stateCacheDir().filePath(
         SyncData::fileNameForRoom(r->id())) };
     if (outRoomFile.open(QFile::WriteOnly)) {
@@ -1845,6 +2298,8 @@ void Connection::saveRoomState(Room* r) const
                                            : json.toJson(QJsonDocument::Compact);
 #endif
         outRoomFile.write(data.data(), data.size());
+        metrics().observe(MetricNames::CacheSaveSeconds, et,
+                          { { QStringLiteral("scope"), QStringLiteral("room") } });
         qCDebug(MAIN) << "Room state cache saved to" << outRoomFile.fileName();
     } else {
         qCWarning(MAIN) << "Error opening" << outRoomFile.fileName() << ":"
@@ -1925,6 +2380,9 @@ void Connection::saveState() const
     qCDebug(PROFILER) << "Cache for" << userId() << "generated in" << et;
 
     outFile.write(data.data(), data.size());
+    metrics().observe(MetricNames::CacheSaveSeconds, et,
+                      { { QStringLiteral("scope"),
+                          QStringLiteral("connection") } });
     qCDebug(MAIN) << "State cache saved to" << outFile.fileName();
 }
 
@@ -1948,6 +2406,7 @@ void Connection::loadState()
     // 1. Do initial sync on failed rooms without saving the nextBatch token
     // 2. Do the sync across all rooms as normal
     onSyncSuccess(std::move(sync), true);
+    metrics().observe(MetricNames::CacheLoadSeconds, et);
     qCDebug(PROFILER) << "*** Cached state for" << userId() << "loaded in" << et;
 }
 
@@ -1983,6 +2442,16 @@ void Connection::setLazyLoading(bool newValue)
     }
 }
 
+bool Connection::pipelinedSync() const { return d->pipelinedSync; }
+
+void Connection::setPipelinedSync(bool newValue)
+{
+    if (d->pipelinedSync != newValue) {
+        d->pipelinedSync = newValue;
+        emit pipelinedSyncChanged();
+    }
+}
+
 BaseJob* Connection::run(BaseJob* job, RunningPolicy runningPolicy)
 {
     // Reparent to protect from #397, #398 and to prevent BaseJob* from being
@@ -2059,112 +2528,131 @@ QVector<Connection::SupportedRoomVersion> Connection::availableRoomVersions() co
 }
 
 #ifdef Quotient_E2EE_ENABLED
+void Connection::Private::enqueueKeyJob(std::function<BaseJob*()> startJob)
+{
+    queuedKeyJobs.push_back(std::move(startJob));
+    startQueuedKeyJobs();
+}
+
+void Connection::Private::startQueuedKeyJobs()
+{
+    while (runningKeyJobs < MaxRunningKeyJobs && !queuedKeyJobs.empty()) {
+        auto* job = queuedKeyJobs.front()();
+        queuedKeyJobs.pop_front();
+        ++runningKeyJobs;
+        connect(job, &BaseJob::finished, q, [this] {
+            --runningKeyJobs;
+            startQueuedKeyJobs();
+        });
+    }
+}
+
 void Connection::Private::loadOutdatedUserDevices()
 {
-    QHash<QString, QStringList> users;
-    for(const auto &user : outdatedUsers) {
-        users[user] += QStringList();
-    }
-    if(currentQueryKeysJob) {
-        currentQueryKeysJob->abandon();
-        currentQueryKeysJob = nullptr;
-    }
-    auto queryKeysJob = q->callApi<QueryKeysJob>(users);
-    currentQueryKeysJob = queryKeysJob;
-    connect(queryKeysJob, &BaseJob::success, q, [this, queryKeysJob](){
-        currentQueryKeysJob = nullptr;
-        const auto data = queryKeysJob->deviceKeys();
-        for(const auto &[user, keys] : asKeyValueRange(data)) {
-            QHash<QString, Quotient::DeviceKeys> oldDevices = deviceKeys[user];
-            deviceKeys[user].clear();
-            for(const auto &device : keys) {
-                if(device.userId != user) {
-                    qCWarning(E2EE)
-                        << "mxId mismatch during device key verification:"
-                        << device.userId << user;
-                    continue;
-                }
-                if (!std::all_of(device.algorithms.cbegin(),
-                                 device.algorithms.cend(),
-                                 isSupportedAlgorithm)) {
-                    qCWarning(E2EE) << "Unsupported encryption algorithms found"
-                                    << device.algorithms;
-                    continue;
-                }
-                if (!verifyIdentitySignature(device, device.deviceId,
-                                             device.userId)) {
-                    qCWarning(E2EE) << "Failed to verify devicekeys signature. "
-                                       "Skipping this device";
+    // Users already queued or being queried are left alone, rather than
+    // abandoning the query - their results are still good to use
+    QStringList users;
+    for (const auto& user : outdatedUsers)
+        if (!usersBeingQueried.contains(user)) {
+            usersBeingQueried += user;
+            users.push_back(user);
+        }
+    for (int i = 0; i < users.size(); i += KeyQueryBatchSize) {
+        QHash<QString, QStringList> batch;
+        for (const auto& user : users.mid(i, KeyQueryBatchSize))
+            batch.insert(user, {});
+        enqueueKeyJob([this, batch] {
+            auto queryKeysJob = q->callApi<QueryKeysJob>(batch);
+            connect(queryKeysJob, &BaseJob::finished, q, [this, batch] {
+                for (auto it = batch.cbegin(); it != batch.cend(); ++it)
+                    usersBeingQueried.remove(it.key());
+            });
+            connect(queryKeysJob, &BaseJob::success, q,
+                    [this, queryKeysJob] {
+                        handleQueryKeysResult(queryKeysJob);
+                    });
+            return queryKeysJob;
+        });
+    }
+}
+
+void Connection::Private::handleQueryKeysResult(
+    const QueryKeysJob* queryKeysJob)
+{
+    const auto data = queryKeysJob->deviceKeys();
+    Database::DevicesListChanges changes;
+    bool requeryNeeded = false;
+    for(const auto &[user, keys] : asKeyValueRange(data)) {
+        if (!trackedUsers.contains(user))
+            continue; // The user has left while the query was in flight
+        QHash<QString, Quotient::DeviceKeys> oldDevices = deviceKeys[user];
+        deviceKeys[user].clear();
+        for(const auto &device : keys) {
+            if(device.userId != user) {
+                qCWarning(E2EE)
+                    << "mxId mismatch during device key verification:"
+                    << device.userId << user;
+                continue;
+            }
+            if (!std::all_of(device.algorithms.cbegin(),
+                             device.algorithms.cend(),
+                             isSupportedAlgorithm)) {
+                qCWarning(E2EE) << "Unsupported encryption algorithms found"
+                                << device.algorithms;
+                continue;
+            }
+            if (!verifyIdentitySignature(device, device.deviceId,
+                                         device.userId)) {
+                qCWarning(E2EE) << "Failed to verify devicekeys signature. "
+                                   "Skipping this device";
+                continue;
+            }
+            if (oldDevices.contains(device.deviceId)) {
+                if (oldDevices[device.deviceId].keys["ed25519:" % device.deviceId] != device.keys["ed25519:" % device.deviceId]) {
+                    qCDebug(E2EE) << "Device reuse detected. Skipping this device";
                     continue;
                 }
-                if (oldDevices.contains(device.deviceId)) {
-                    if (oldDevices[device.deviceId].keys["ed25519:" % device.deviceId] != device.keys["ed25519:" % device.deviceId]) {
-                        qCDebug(E2EE) << "Device reuse detected. Skipping this device";
-                        continue;
-                    }
-                }
-                deviceKeys[user][device.deviceId] = SLICE(device, DeviceKeys);
             }
-            outdatedUsers -= user;
+            deviceKeys[user][device.deviceId] = SLICE(device, DeviceKeys);
+            if (!oldDevices.contains(device.deviceId)
+                || oldDevices[device.deviceId].keys != device.keys)
+                changes.changedDevices.push_back(
+                    deviceKeys[user][device.deviceId]);
         }
-        saveDevicesList();
+        for (const auto& oldDeviceId : oldDevices.keys())
+            if (!deviceKeys[user].contains(oldDeviceId))
+                changes.removedDevices.insert(user, oldDeviceId);
+        // Keep the user outdated if the keys changed since the query
+        if (usersToRequery.remove(user))
+            requeryNeeded = true;
+        else
+            outdatedUsers -= user;
+    }
+    saveDevicesList(std::move(changes));
+    if (requeryNeeded)
+        loadOutdatedUserDevices();
 
-        for(size_t i = 0; i < pendingEncryptedEvents.size();) {
-            if (isKnownCurveKey(
-                    pendingEncryptedEvents[i]->fullJson()[SenderKeyL].toString(),
-                    pendingEncryptedEvents[i]->contentPart<QString>("sender_key"_ls))) {
-                handleEncryptedToDeviceEvent(*pendingEncryptedEvents[i]);
-                pendingEncryptedEvents.erase(pendingEncryptedEvents.begin() + i);
-            } else
-                ++i;
-        }
-    });
+    for(size_t i = 0; i < pendingEncryptedEvents.size();) {
+        if (isKnownCurveKey(
+                pendingEncryptedEvents[i]->fullJson()[SenderKeyL].toString(),
+                pendingEncryptedEvents[i]->contentPart<QString>("sender_key"_ls))) {
+            handleEncryptedToDeviceEvent(*pendingEncryptedEvents[i]);
+            pendingEncryptedEvents.erase(pendingEncryptedEvents.begin() + i);
+        } else
+            ++i;
+    }
 }
 
-void Connection::Private::saveDevicesList()
+void Connection::Private::saveDevicesList(
+    Database::DevicesListChanges&& changes)
 {
-    q->database()->transaction();
-    auto query = q->database()->prepareQuery(
-        QStringLiteral("DELETE FROM tracked_users"));
-    q->database()->execute(query);
-    query.prepare(QStringLiteral(
-        "INSERT INTO tracked_users(matrixId) VALUES(:matrixId);"));
-    for (const auto& user : trackedUsers) {
-        query.bindValue(":matrixId", user);
-        q->database()->execute(query);
-    }
-
-    query.prepare(QStringLiteral("DELETE FROM outdated_users"));
-    q->database()->execute(query);
-    query.prepare(QStringLiteral(
-        "INSERT INTO outdated_users(matrixId) VALUES(:matrixId);"));
-    for (const auto& user : outdatedUsers) {
-        query.bindValue(":matrixId", user);
-        q->database()->execute(query);
-    }
-
-    query.prepare(QStringLiteral(
-        "INSERT INTO tracked_devices"
-        "(matrixId, deviceId, curveKeyId, curveKey, edKeyId, edKey) "
-        "VALUES(:matrixId, :deviceId, :curveKeyId, :curveKey, :edKeyId, :edKey);"
-        ));
-    for (const auto& user : deviceKeys.keys()) {
-        for (const auto& device : deviceKeys[user]) {
-            auto keys = device.keys.keys();
-            auto curveKeyId = keys[0].startsWith(QLatin1String("curve")) ? keys[0] : keys[1];
-            auto edKeyId = keys[0].startsWith(QLatin1String("ed")) ? keys[0] : keys[1];
-
-            query.bindValue(":matrixId", user);
-            query.bindValue(":deviceId", device.deviceId);
-            query.bindValue(":curveKeyId", curveKeyId);
-            query.bindValue(":curveKey", device.keys[curveKeyId]);
-            query.bindValue(":edKeyId", edKeyId);
-            query.bindValue(":edKey", device.keys[edKeyId]);
-
-            q->database()->execute(query);
-        }
-    }
-    q->database()->commit();
+    changes.addedTrackedUsers = trackedUsers - savedTrackedUsers;
+    changes.removedTrackedUsers = savedTrackedUsers - trackedUsers;
+    changes.addedOutdatedUsers = outdatedUsers - savedOutdatedUsers;
+    changes.removedOutdatedUsers = savedOutdatedUsers - outdatedUsers;
+    savedTrackedUsers = trackedUsers;
+    savedOutdatedUsers = outdatedUsers;
+    q->database()->updateDevicesList(changes);
 }
 
 void Connection::Private::loadDevicesList()
@@ -2193,6 +2681,8 @@ void Connection::Private::loadDevicesList()
              {} // Signatures are not saved/loaded as they are not needed after initial validation
         };
     }
+    savedTrackedUsers = trackedUsers;
+    savedOutdatedUsers = outdatedUsers;
 
 }
 
@@ -2253,6 +2743,189 @@ void Connection::saveMegolmSession(const Room* room,
                                   session.senderId(), session.olmSessionId());
 }
 
+std::shared_ptr<QOlmInboundGroupSession> Connection::inboundMegolmSession(
+    const Room* room, const QString& sessionId)
+{
+    const auto key = qMakePair(room->id(), sessionId);
+    if (const auto* session = d->megolmSessionCache.object(key))
+        return *session;
+
+    std::shared_ptr<QOlmInboundGroupSession> session =
+        database()->loadMegolmSession(room->id(), sessionId, picklingMode());
+    if (session)
+        d->megolmSessionCache.insert(key, new auto(session));
+    return session;
+}
+
+void Connection::addInboundMegolmSession(const Room* room,
+                                         QOlmInboundGroupSessionPtr session)
+{
+    saveMegolmSession(room, *session);
+    auto key = qMakePair(room->id(), QString(session->sessionId()));
+    d->megolmSessionCache.insert(
+        key, new std::shared_ptr<QOlmInboundGroupSession>(std::move(session)));
+}
+
+bool Connection::attributeMegolmSession(const Room* room,
+                                        QOlmInboundGroupSession& session,
+                                        const QString& userId)
+{
+    const auto senderKey =
+        database()->megolmSessionSenderKey(room->id(), session.sessionId());
+    if (senderKey.isEmpty())
+        return false;
+    const auto ownCurveKey = d->olmAccount->identityKeys().curve25519;
+    const auto ownerId = senderKey == QString::fromLatin1(ownCurveKey)
+                             ? this->userId()
+                             : database()->curveKeyOwner(senderKey);
+    if (ownerId.isEmpty())
+        return false;
+    session.setSenderId(ownerId);
+    database()->setMegolmSessionSenderId(room->id(), session.sessionId(),
+                                         ownerId);
+    return ownerId == userId;
+}
+
+QHash<QString, std::pair<QString, QString>>
+Connection::Private::knownDevicesByCurveKey() const
+{
+    QHash<QString, std::pair<QString, QString>> devices;
+    for (auto userIt = deviceKeys.cbegin(); userIt != deviceKeys.cend();
+         ++userIt)
+        for (const auto& device : *userIt)
+            devices.insert(device.keys.value("curve25519:"_ls % device.deviceId),
+                           { userIt.key(),
+                             device.keys.value("ed25519:"_ls
+                                               % device.deviceId) });
+    const auto identityKeys = olmAccount->identityKeys();
+    devices.insert(QString::fromLatin1(identityKeys.curve25519),
+                   { q->userId(), QString::fromLatin1(identityKeys.ed25519) });
+    return devices;
+}
+
+int Connection::exportRoomKeys(QIODevice* device, const QString& passphrase,
+                               int rounds)
+{
+    static constexpr int PageSize = 500;
+
+    const auto knownDevices = d->knownDevicesByCurveKey();
+    const auto ownCurveKey =
+        QString::fromLatin1(d->olmAccount->identityKeys().curve25519);
+    KeyExportWriter writer(device, passphrase, rounds);
+    int count = 0;
+    qint64 rowId = 0;
+    for (auto records = database()->loadMegolmSessionRecords(rowId, PageSize);
+         !records.empty();
+         records = database()->loadMegolmSessionRecords(rowId, PageSize)) {
+        for (const auto& record : records) {
+            auto expectedSession =
+                QOlmInboundGroupSession::unpickle(record.pickle,
+                                                  picklingMode());
+            if (!expectedSession) {
+                qCWarning(E2EE) << "Skipping megolm session"
+                                << record.sessionId << "in the export:"
+                                << expectedSession.error();
+                continue;
+            }
+            auto& session = *expectedSession;
+            const auto sessionKey =
+                session->exportSession(session->firstKnownIndex());
+            if (!sessionKey) {
+                qCWarning(E2EE) << "Failed to export megolm session"
+                                << record.sessionId << sessionKey.error();
+                continue;
+            }
+            // Our own sessions are stored without a sender key
+            const auto& senderKey = record.olmSessionId == "SELF"_ls
+                                        ? ownCurveKey
+                                        : record.senderKey;
+            auto ed25519Key = record.ed25519Key;
+            if (ed25519Key.isEmpty())
+                ed25519Key = knownDevices.value(senderKey).second;
+            if (!writer.write({ MegolmV1AesSha2AlgoKey, record.roomId,
+                                senderKey, ed25519Key, record.sessionId,
+                                *sessionKey, {} }))
+                return -1;
+            ++count;
+        }
+    }
+    return writer.finish() ? count : -1;
+}
+
+int Connection::importRoomKeys(QIODevice* device, const QString& passphrase)
+{
+    static constexpr int BatchSize = 1000;
+
+    KeyExportReader reader(device, passphrase);
+    if (!reader.verify()) {
+        qCWarning(E2EE) << "Failed to verify the key export";
+        return -1;
+    }
+    // The export doesn't tell who sent a session; for devices that we know
+    // it is looked up by their keys, otherwise left empty until the session
+    // is used (see attributeMegolmSession())
+    const auto knownDevices = d->knownDevicesByCurveKey();
+    QHash<QString, QSet<QString>> knownSessionIds;
+    QHash<QString, QSet<QString>> importedSessionIds;
+    int count = 0;
+    for (auto sessions = reader.read(BatchSize); !sessions.empty();
+         sessions = reader.read(BatchSize)) {
+        std::vector<Database::MegolmSessionRecord> records;
+        records.reserve(sessions.size());
+        for (const auto& exported : sessions) {
+            if (exported.algorithm != MegolmV1AesSha2AlgoKey)
+                continue;
+            auto knownIt = knownSessionIds.find(exported.roomId);
+            if (knownIt == knownSessionIds.end())
+                knownIt = knownSessionIds.insert(
+                    exported.roomId,
+                    database()->megolmSessionIds(exported.roomId));
+            if (knownIt->contains(exported.sessionId))
+                continue;
+
+            QOlmInboundGroupSessionPtr session;
+            try {
+                session = QOlmInboundGroupSession::import(exported.sessionKey);
+            } catch (QOlmError error) {
+                qCWarning(E2EE) << "Failed to import megolm session"
+                                << exported.sessionId << error;
+                continue;
+            }
+            if (session->sessionId() != exported.sessionId.toLatin1()) {
+                qCWarning(E2EE) << "Session ID mismatch in the key export";
+                continue;
+            }
+            knownIt->insert(exported.sessionId);
+            importedSessionIds[exported.roomId].insert(exported.sessionId);
+            // Don't trust the sender key if the Ed25519 key claimed along
+            // with it belongs to a different device
+            const auto& [senderId, edKey] =
+                knownDevices.value(exported.senderKey);
+            const auto senderMatches =
+                exported.senderClaimedEd25519Key.isEmpty()
+                || exported.senderClaimedEd25519Key == edKey;
+            records.push_back({ exported.roomId, exported.sessionId,
+                                session->pickle(picklingMode()),
+                                senderMatches ? senderId : QString(), {},
+                                exported.senderKey,
+                                exported.senderClaimedEd25519Key });
+        }
+        count += int(records.size());
+        database()->saveMegolmSessions(std::move(records));
+    }
+    if (reader.hasError()) {
+        qCWarning(E2EE) << "Failed to read the key export after" << count
+                        << "sessions";
+        count = -1;
+    }
+    // Sessions imported so far are saved even if reading failed midway
+    for (auto it = importedSessionIds.cbegin(); it != importedSessionIds.cend();
+         ++it)
+        if (auto* r = room(it.key(), JoinState::Join | JoinState::Leave))
+            r->handleImportedMegolmSessions(*it);
+    return count;
+}
+
 QStringList Connection::devicesForUser(const QString& userId) const
 {
     return d->deviceKeys[userId].keys();
@@ -2305,56 +2978,227 @@ std::pair<QOlmMessage::Type, QByteArray> Connection::Private::olmEncryptMessage(
     return { type, result.toCiphertext() };
 }
 
-bool Connection::Private::createOlmSession(const QString& targetUserId,
-                                           const QString& targetDeviceId,
-                                           const OneTimeKeys& oneTimeKeyObject)
-{
-    static QOlmUtility verifier;
-    qDebug(E2EE) << "Creating a new session for" << targetUserId
-                 << targetDeviceId;
-    if (oneTimeKeyObject.isEmpty()) {
-        qWarning(E2EE) << "No one time key for" << targetUserId
-                       << targetDeviceId;
-        return false;
-    }
-    auto* signedOneTimeKey =
-        std::get_if<SignedOneTimeKey>(&*oneTimeKeyObject.begin());
-    if (!signedOneTimeKey) {
-        qWarning(E2EE) << "No signed one time key for" << targetUserId
-                       << targetDeviceId;
-        return false;
-    }
-    // Verify contents of signedOneTimeKey - for that, drop `signatures` and
-    // `unsigned` and then verify the object against the respective signature
-    const auto signature =
-        signedOneTimeKey
-            ->signatures[targetUserId]["ed25519:"_ls % targetDeviceId]
-            .toLatin1();
-    if (!verifier.ed25519Verify(
-            edKeyForUserDevice(targetUserId, targetDeviceId).toLatin1(),
-            QJsonDocument(toJson(SignedOneTimeKey { signedOneTimeKey->key, {} }))
-                .toJson(QJsonDocument::Compact),
-            signature)) {
-        qWarning(E2EE) << "Failed to verify one-time-key signature for" << targetUserId
-                       << targetDeviceId << ". Skipping this device.";
-        return false;
+namespace {
+//! A device to send a room key to, using a new olm session
+struct RoomKeyRecipient {
+    QString userId;
+    QString deviceId;
+    QString curveKey;
+    QString edKey;
+    SignedOneTimeKey oneTimeKey;
+    QByteArray payload;
+    // The below is filled by OlmSessionCreationTask
+    QOlmSessionPtr session = nullptr;
+    QByteArray pickle {};
+    QOlmMessage::Type messageType = QOlmMessage::PreKey;
+    QByteArray ciphertext {};
+};
+using RoomKeyRecipients = std::vector<RoomKeyRecipient>;
+
+//! \brief A thread pool task creating olm sessions and encrypting room keys
+//!
+//! The task verifies the one-time key of each recipient, creates an
+//! outbound olm session with it, encrypts the payload and pickles the
+//! session; the session is only handed over to the connection, in its own
+//! thread, after that. Recipients that failed on the way are passed back
+//! without a session. Sessions are created with a copy of the account
+//! unpickled from the passed pickle, as the account itself keeps changing
+//! in the connection thread.
+class OlmSessionCreationTask : public QRunnable {
+public:
+    using Handler = std::function<void(RoomKeyRecipients&)>;
+
+    OlmSessionCreationTask(QByteArray accountPickle, PicklingMode picklingMode,
+                           QString userId, QString deviceId,
+                           RoomKeyRecipients recipients, Connection* connection,
+                           Handler handler)
+        : accountPickle(std::move(accountPickle))
+        , picklingMode(std::move(picklingMode))
+        , userId(std::move(userId))
+        , deviceId(std::move(deviceId))
+        , recipients(std::make_shared<RoomKeyRecipients>(std::move(recipients)))
+        , connection(connection)
+        , handler(std::move(handler))
+    {}
+
+    void run() override
+    {
+        QOlmAccount account(userId, deviceId);
+        account.unpickle(accountPickle, picklingMode);
+        QOlmUtility verifier; // Not shared, as it keeps the last error inside
+        for (auto& r : *recipients) {
+            // Verify contents of the one-time key - for that, drop
+            // `signatures` and `unsigned` and then verify the object against
+            // the respective signature
+            const auto signature =
+                r.oneTimeKey.signatures[r.userId]["ed25519:"_ls % r.deviceId]
+                    .toLatin1();
+            if (!verifier.ed25519Verify(
+                    r.edKey.toLatin1(),
+                    QJsonDocument(toJson(SignedOneTimeKey { r.oneTimeKey.key, {} }))
+                        .toJson(QJsonDocument::Compact),
+                    signature)) {
+                qWarning(E2EE) << "Failed to verify one-time-key signature for"
+                               << r.userId << r.deviceId
+                               << ". Skipping this device.";
+                continue;
+            }
+            // Olm wrappers throw on some errors; an exception escaping
+            // run() would terminate the application, so the recipient is
+            // passed back without a session instead
+            try {
+                auto session = QOlmSession::createOutboundSession(
+                    &account, r.curveKey, r.oneTimeKey.key);
+                if (!session) {
+                    qCWarning(E2EE) << "Failed to create olm session for "
+                                    << r.curveKey << session.error();
+                    continue;
+                }
+                r.messageType = (*session)->encryptMessageType();
+                r.ciphertext = (*session)->encrypt(r.payload).toCiphertext();
+                if (auto pickle = (*session)->pickle(picklingMode))
+                    r.pickle = std::move(*pickle);
+                else
+                    qCWarning(E2EE) << "Failed to pickle olm session. Error"
+                                    << pickle.error();
+                r.session = std::move(*session);
+            } catch (QOlmError error) {
+                qCWarning(E2EE) << "Failed to create olm session for"
+                                << r.curveKey << "- error" << error;
+            }
+        }
+        QMetaObject::invokeMethod(
+            connection,
+            [recipients = recipients, handler = std::move(handler)] {
+                handler(*recipients);
+            },
+            Qt::QueuedConnection);
     }
-    const auto recipientCurveKey =
-        curveKeyForUserDevice(targetUserId, targetDeviceId);
-    auto session =
-        QOlmSession::createOutboundSession(olmAccount.get(), recipientCurveKey,
-                                           signedOneTimeKey->key);
-    if (!session) {
-        qCWarning(E2EE) << "Failed to create olm session for "
-                        << recipientCurveKey << session.error();
-        return false;
+
+private:
+    QByteArray accountPickle;
+    PicklingMode picklingMode;
+    QString userId;
+    QString deviceId;
+    std::shared_ptr<RoomKeyRecipients> recipients;
+    Connection* connection;
+    Handler handler;
+};
+
+//! \brief A thread pool task generating one-time keys
+//!
+//! The keys are generated in a copy of the account unpickled from
+//! the passed pickle, so that the account itself remains usable in the
+//! meantime. The handler receives the pickle of the copy with the new keys,
+//! along with the signed device keys and one-time keys to upload; or
+//! the error if the keys could not be generated.
+class OneTimeKeysGenerationTask : public QRunnable {
+public:
+    struct Result {
+        QByteArray accountPickle;
+        DeviceKeys deviceKeys;
+        OneTimeKeys oneTimeKeys;
+        Omittable<QOlmError> error = none;
+    };
+    using Handler = std::function<void(Result&)>;
+
+    OneTimeKeysGenerationTask(QByteArray accountPickle,
+                              PicklingMode picklingMode, QString userId,
+                              QString deviceId, size_t count,
+                              Connection* connection, Handler handler)
+        : accountPickle(std::move(accountPickle))
+        , picklingMode(std::move(picklingMode))
+        , userId(std::move(userId))
+        , deviceId(std::move(deviceId))
+        , count(count)
+        , connection(connection)
+        , handler(std::move(handler))
+    {}
+
+    void run() override
+    {
+        auto result = std::make_shared<Result>();
+        // An exception escaping run() would terminate the application
+        try {
+            QOlmAccount account(userId, deviceId);
+            account.unpickle(accountPickle, picklingMode);
+            account.generateOneTimeKeys(count);
+            result->oneTimeKeys =
+                account.signOneTimeKeys(account.oneTimeKeys());
+            result->deviceKeys = account.deviceKeys();
+            if (auto pickle = account.pickle(picklingMode))
+                result->accountPickle = std::move(*pickle);
+            else
+                result->error = pickle.error();
+        } catch (QOlmError error) {
+            result->error = error;
+        }
+        QMetaObject::invokeMethod(
+            connection,
+            [result = std::move(result), handler = std::move(handler)] {
+                handler(*result);
+            },
+            Qt::QueuedConnection);
     }
-    saveSession(**session, recipientCurveKey);
-    olmSessions[recipientCurveKey].push_back(std::move(*session));
-    return true;
-}
 
-std::unique_ptr<EncryptedEvent> Connection::Private::makeEventForSessionKey(
+private:
+    QByteArray accountPickle;
+    PicklingMode picklingMode;
+    QString userId;
+    QString deviceId;
+    size_t count;
+    Connection* connection;
+    Handler handler;
+};
+} // namespace
+
+void Connection::Private::generateAndUploadOneTimeKeys(size_t count,
+                                                      int attempt)
+{
+    const auto accountPickle = olmAccount->pickle(picklingMode);
+    if (!accountPickle) {
+        qCWarning(E2EE) << "Failed to pickle olm account. Error"
+                        << accountPickle.error();
+        return;
+    }
+    isUploadingKeys = true;
+    olmTaskPool.start(new OneTimeKeysGenerationTask(
+        *accountPickle, picklingMode, data->userId(), data->deviceId(), count,
+        q,
+        [this, count, attempt, revision = olmAccountRevision](
+            OneTimeKeysGenerationTask::Result& result) {
+            if (result.error) {
+                qCWarning(E2EE) << "Failed to generate one-time keys. Error"
+                                << *result.error;
+                isUploadingKeys = false;
+                return;
+            }
+            if (revision != olmAccountRevision) {
+                // Sessions are created, and one-time keys used up, all
+                // the time; only give up if that keeps happening
+                if (attempt < MaxOneTimeKeysAttempts) {
+                    qCDebug(E2EE) << "The account has changed while "
+                                     "generating one-time keys; retrying";
+                    generateAndUploadOneTimeKeys(count, attempt + 1);
+                    return;
+                }
+                qCDebug(E2EE) << "Dropping generated one-time keys as the "
+                                 "account keeps changing";
+                isUploadingKeys = false;
+                return;
+            }
+            olmAccount->unpickle(result.accountPickle, picklingMode);
+            q->saveOlmAccount();
+            auto job = q->callApi<UploadKeysJob>(result.deviceKeys,
+                                                 result.oneTimeKeys);
+            connect(job, &BaseJob::success, q,
+                    [this] { olmAccount->markKeysAsPublished(); });
+            connect(job, &BaseJob::result, q,
+                    [this] { isUploadingKeys = false; });
+        }));
+}
+
+QByteArray Connection::Private::makeRoomKeyPayload(
     const QString& roomId, const QString& targetUserId,
     const QString& targetDeviceId, const QByteArray& sessionId,
     const QByteArray& sessionKey) const
@@ -2377,66 +3221,169 @@ std::unique_ptr<EncryptedEvent> Connection::Private::makeEventForSessionKey(
                            { Ed25519Key,
                              QString(olmAccount->identityKeys().ed25519) } });
     payloadJson.insert("sender_device"_ls, data->deviceId());
+    return QJsonDocument(payloadJson).toJson(QJsonDocument::Compact);
+}
 
-    const auto [type, cipherText] = olmEncryptMessage(
-        targetUserId, targetDeviceId,
-        QJsonDocument(payloadJson).toJson(QJsonDocument::Compact));
+std::unique_ptr<EncryptedEvent> Connection::Private::makeOlmEncryptedEvent(
+    const QString& recipientCurveKey, QOlmMessage::Type type,
+    const QByteArray& ciphertext) const
+{
     QJsonObject encrypted {
-        { curveKeyForUserDevice(targetUserId, targetDeviceId),
-          QJsonObject { { "type"_ls, type },
-                        { "body"_ls, QString(cipherText) } } }
+        { recipientCurveKey, QJsonObject { { "type"_ls, type },
+                                           { "body"_ls, QString(ciphertext) } } }
     };
-
     return makeEvent<EncryptedEvent>(encrypted,
                                      olmAccount->identityKeys().curve25519);
 }
 
-void Connection::sendSessionKeyToDevices(
+void Connection::Private::sendRoomKeyToDevices(
     const QString& roomId, const QByteArray& sessionId,
     const QByteArray& sessionKey, const QMultiHash<QString, QString>& devices,
-    int index)
+    const QHash<QString, QHash<QString, OneTimeKeys>>& oneTimeKeys, int index)
 {
-    qDebug(E2EE) << "Sending room key to devices:" << sessionId
-                 << sessionKey.toHex();
-    QHash<QString, QHash<QString, QString>> hash;
-    for (const auto& [userId, deviceId] : asKeyValueRange(devices))
-        if (!hasOlmSession(userId, deviceId)) {
-            hash[userId].insert(deviceId, "signed_curve25519"_ls);
-            qDebug(E2EE) << "Adding" << userId << deviceId
-                         << "to keys to claim";
-        }
+    struct Delivery {
+        UsersToDevicesToEvents events {};
+        QVector<std::tuple<QString, QString, QString>> receivedDevices {};
+        int pendingTasks = 0;
+    };
+    auto delivery = std::make_shared<Delivery>();
+    const auto deliver = [this, roomId, sessionId, index, delivery] {
+        if (delivery->events.empty())
+            return;
+        q->sendToDevices(EncryptedEvent::TypeId, delivery->events);
+        database->setDevicesReceivedKey(roomId, delivery->receivedDevices,
+                                        sessionId, index);
+    };
 
-    if (hash.isEmpty())
+    RoomKeyRecipients newSessionRecipients;
+    for (const auto& [userId, deviceId] : asKeyValueRange(devices)) {
+        const auto curveKey = curveKeyForUserDevice(userId, deviceId);
+        auto payload =
+            makeRoomKeyPayload(roomId, userId, deviceId, sessionId, sessionKey);
+        if (q->hasOlmSession(userId, deviceId)) {
+            // Existing sessions are used for decryption in this thread as
+            // well, so encrypting with them stays here; it's cheap anyway
+            const auto [type, ciphertext] =
+                olmEncryptMessage(userId, deviceId, payload);
+            delivery->events[userId][deviceId] =
+                makeOlmEncryptedEvent(curveKey, type, ciphertext);
+            delivery->receivedDevices.push_back({ userId, deviceId, curveKey });
+            continue;
+        }
+        const auto oneTimeKeyObject = oneTimeKeys.value(userId).value(deviceId);
+        if (oneTimeKeyObject.isEmpty()) {
+            qWarning(E2EE) << "No one time key for" << userId << deviceId;
+            continue;
+        }
+        const auto* signedOneTimeKey =
+            std::get_if<SignedOneTimeKey>(&*oneTimeKeyObject.begin());
+        if (!signedOneTimeKey) {
+            qWarning(E2EE) << "No signed one time key for" << userId
+                           << deviceId;
+            continue;
+        }
+        qDebug(E2EE) << "Creating a new session for" << userId << deviceId;
+        newSessionRecipients.push_back({ userId, deviceId, curveKey,
+                                         edKeyForUserDevice(userId, deviceId),
+                                         *signedOneTimeKey,
+                                         std::move(payload) });
+    }
+    if (newSessionRecipients.empty()) {
+        deliver();
         return;
+    }
+    const auto accountPickle = olmAccount->pickle(picklingMode);
+    if (!accountPickle) {
+        qCWarning(E2EE) << "Failed to pickle olm account. Error"
+                        << accountPickle.error();
+        deliver();
+        return;
+    }
 
-    auto job = callApi<ClaimKeysJob>(hash);
-    connect(job, &BaseJob::success, this, [job, this, roomId, sessionId, sessionKey, devices, index] {
-        UsersToDevicesToEvents usersToDevicesToEvents;
-        const auto oneTimeKeys = job->oneTimeKeys();
-        for (const auto& [targetUserId, targetDeviceId] :
-             asKeyValueRange(devices)) {
-            if (!hasOlmSession(targetUserId, targetDeviceId)
-                && !d->createOlmSession(
-                    targetUserId, targetDeviceId,
-                    oneTimeKeys[targetUserId][targetDeviceId]))
-                continue;
+    for (size_t i = 0; i < newSessionRecipients.size();
+         i += OlmSessionsPerTask) {
+        const auto taskEnd =
+            std::min(i + OlmSessionsPerTask, newSessionRecipients.size());
+        RoomKeyRecipients taskRecipients(
+            std::make_move_iterator(newSessionRecipients.begin() + i),
+            std::make_move_iterator(newSessionRecipients.begin() + taskEnd));
+        ++delivery->pendingTasks;
+        olmTaskPool.start(new OlmSessionCreationTask(
+            *accountPickle, picklingMode, data->userId(), data->deviceId(),
+            std::move(taskRecipients), q,
+            [this, delivery, deliver](RoomKeyRecipients& recipients) {
+                for (auto& r : recipients) {
+                    if (!r.session)
+                        continue;
+                    if (!r.pickle.isEmpty())
+                        database->saveOlmSession(r.curveKey,
+                                                 r.session->sessionId(),
+                                                 r.pickle,
+                                                 QDateTime::currentDateTime());
+                    olmSessions[r.curveKey].push_back(std::move(r.session));
+                    delivery->events[r.userId][r.deviceId] =
+                        makeOlmEncryptedEvent(r.curveKey, r.messageType,
+                                              r.ciphertext);
+                    delivery->receivedDevices.push_back(
+                        { r.userId, r.deviceId, r.curveKey });
+                }
+                if (--delivery->pendingTasks == 0)
+                    deliver();
+            }));
+    }
+}
 
-            usersToDevicesToEvents[targetUserId][targetDeviceId] =
-                d->makeEventForSessionKey(roomId, targetUserId, targetDeviceId,
-                                          sessionId, sessionKey);
+void Connection::Private::claimKeysAndSendRoomKey(
+    const QString& roomId, const QByteArray& sessionId,
+    const QByteArray& sessionKey,
+    const QHash<QString, QHash<QString, QString>>& keysToClaim, int index)
+{
+    enqueueKeyJob([=] {
+        auto job = q->callApi<ClaimKeysJob>(keysToClaim);
+        connect(job, &BaseJob::success, q, [=] {
+            QMultiHash<QString, QString> devices;
+            for (auto it = keysToClaim.cbegin(); it != keysToClaim.cend(); ++it)
+                for (const auto& deviceId : it.value().keys())
+                    devices.insert(it.key(), deviceId);
+            sendRoomKeyToDevices(roomId, sessionId, sessionKey, devices,
+                                 job->oneTimeKeys(), index);
+        });
+        return job;
+    });
+}
+
+void Connection::sendSessionKeyToDevices(
+    const QString& roomId, const QByteArray& sessionId,
+    const QByteArray& sessionKey, const QMultiHash<QString, QString>& devices,
+    int index)
+{
+    qDebug(E2EE) << "Sending room key to devices:" << sessionId
+                 << sessionKey.toHex();
+    // Devices with olm sessions get the key right away; one-time keys for
+    // the rest are claimed in batches, each batch being sent the key as soon
+    // as it has its keys
+    QMultiHash<QString, QString> devicesWithSessions;
+    QHash<QString, QHash<QString, QString>> keysToClaim;
+    int claimBatchSize = 0;
+    for (const auto& [userId, deviceId] : asKeyValueRange(devices)) {
+        if (hasOlmSession(userId, deviceId)) {
+            devicesWithSessions.insert(userId, deviceId);
+            continue;
         }
-        if (!usersToDevicesToEvents.empty()) {
-            sendToDevices(EncryptedEvent::TypeId, usersToDevicesToEvents);
-            QVector<std::tuple<QString, QString, QString>> receivedDevices;
-            receivedDevices.reserve(devices.size());
-            for (const auto& [user, device] : asKeyValueRange(devices))
-                receivedDevices.push_back(
-                    { user, device, d->curveKeyForUserDevice(user, device) });
-
-            database()->setDevicesReceivedKey(roomId, receivedDevices,
-                                              sessionId, index);
+        keysToClaim[userId].insert(deviceId, "signed_curve25519"_ls);
+        qDebug(E2EE) << "Adding" << userId << deviceId << "to keys to claim";
+        if (++claimBatchSize == Private::KeyClaimBatchSize) {
+            d->claimKeysAndSendRoomKey(roomId, sessionId, sessionKey,
+                                       std::exchange(keysToClaim, {}), index);
+            claimBatchSize = 0;
         }
-    });
+    }
+    if (!keysToClaim.isEmpty())
+        d->claimKeysAndSendRoomKey(roomId, sessionId, sessionKey, keysToClaim,
+                                   index);
+    if (!devicesWithSessions.isEmpty())
+        d->sendRoomKeyToDevices(roomId, sessionId, sessionKey,
+                                devicesWithSessions, {}, index);
 }
 
 QOlmOutboundGroupSessionPtr Connection::loadCurrentOutboundMegolmSession(
@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include "memoryusage.h"
 #include "ssosession.h"
 #include "qt_connection_util.h"
 #include "quotient_common.h"
@@ -24,6 +25,7 @@
 
 #ifdef Quotient_E2EE_ENABLED
 #include "e2ee/e2ee.h"
+#include "e2ee/keyexport.h"
 #include "e2ee/qolmmessage.h"
 #include "e2ee/qolmoutboundsession.h"
 #endif
@@ -35,6 +37,7 @@ namespace Quotient {
 class Room;
 class User;
 class ConnectionData;
+class Metrics;
 class RoomEvent;
 
 class SyncJob;
@@ -130,6 +133,7 @@ class QUOTIENT_API Connection : public QObject {
     Q_PROPERTY(bool supportsPasswordAuth READ supportsPasswordAuth NOTIFY loginFlowsChanged STORED false)
     Q_PROPERTY(bool cacheState READ cacheState WRITE setCacheState NOTIFY cacheStateChanged)
     Q_PROPERTY(bool lazyLoading READ lazyLoading WRITE setLazyLoading NOTIFY lazyLoadingChanged)
+    Q_PROPERTY(bool pipelinedSync READ pipelinedSync WRITE setPipelinedSync NOTIFY pipelinedSyncChanged)
     Q_PROPERTY(bool canChangePassword READ canChangePassword NOTIFY capabilitiesLoaded)
 
 public:
@@ -324,6 +328,29 @@ public:
         const Room* room) const;
     void saveMegolmSession(const Room* room,
                            const QOlmInboundGroupSession& session) const;
+    //! \brief Get an inbound megolm session of the room
+    //!
+    //! Sessions are loaded from the database on demand and kept unpickled
+    //! in a cache of a limited size, shared by all rooms of the connection.
+    //! The returned pointer keeps the session alive even if it gets evicted
+    //! from the cache while in use.
+    //! \return the session, or nullptr if there's no such session stored
+    std::shared_ptr<QOlmInboundGroupSession> inboundMegolmSession(
+        const Room* room, const QString& sessionId);
+    //! Save a new inbound megolm session of the room and put it to the cache
+    void addInboundMegolmSession(const Room* room,
+                                 QOlmInboundGroupSessionPtr session);
+    //! \brief Attribute an inbound megolm session without a sender to a user
+    //!
+    //! Sessions imported from a key export only come with the key of
+    //! the device that created them. Once that device is known, the session
+    //! is attributed to the user owning it - not necessarily \p userId,
+    //! the sender claimed by an event encrypted with the session; this is
+    //! saved, so that the device only needs to be looked up once.
+    //! \return true if the session is attributed to \p userId now
+    bool attributeMegolmSession(const Room* room,
+                                QOlmInboundGroupSession& session,
+                                const QString& userId);
     bool hasOlmSession(const QString& user, const QString& deviceId) const;
 
     QOlmOutboundGroupSessionPtr loadCurrentOutboundMegolmSession(
@@ -338,6 +365,25 @@ public:
                                  int index);
 
     QJsonObject decryptNotification(const QJsonObject &notification);
+
+    //! \brief Export all inbound megolm sessions to an opened \p device
+    //!
+    //! Sessions are read from the database and written in the encrypted
+    //! key export format one page at a time, so exporting doesn't need all of
+    //! them in memory at once; it blocks the calling thread though, most of
+    //! the time being spent on deriving keys from \p passphrase.
+    //! \return the number of exported sessions, or -1 on error
+    int exportRoomKeys(QIODevice* device, const QString& passphrase,
+                       int rounds = KeyExportWriter::DefaultRounds);
+    //! \brief Import megolm sessions from a key export on \p device
+    //!
+    //! The device must be opened and seekable: the export is verified
+    //! before anything is imported from it. Sessions are imported in
+    //! batches, each saved in a single database transaction; sessions that
+    //! are already known are skipped. Once everything is imported, rooms
+    //! retry decrypting events that waited for the new sessions.
+    //! \return the number of imported sessions, or -1 on error
+    int importRoomKeys(QIODevice* device, const QString& passphrase);
     QStringList devicesForUser(const QString& userId) const;
 #endif // Quotient_E2EE_ENABLED
     Q_INVOKABLE Quotient::SyncJob* syncJob() const;
@@ -425,6 +471,51 @@ public:
     bool lazyLoading() const;
     void setLazyLoading(bool newValue);
 
+    /*! \brief Performance metrics of this connection
+     *
+     * The registry is filled by the library with timings and counters for
+     * sync processing, network requests, state caching, decryption and
+     * database access (see MetricNames for the list); it can be queried
+     * from code or dumped as JSON or Prometheus text for a scraper.
+     */
+    Metrics& metrics() const;
+
+    /*! \brief Estimate memory used by the connection, per subsystem
+     *
+     * Subsystems are: \c rooms (the sum of Room::memoryUsage() totals for
+     * all rooms; use that method to look at individual rooms), \c roomMaps,
+     * \c users (User objects with names and cached avatars),
+     * \c directChats, \c accountData, \c pendingRoomUpdates (sync data not
+     * yet applied to rooms) and, with E2EE, \c deviceKeys, \c olmSessions,
+     * \c megolmSessionCache and \c pendingEncryptedEvents. Estimates of
+     * historical user avatars and of \c internedIds are also included,
+     * although these are shared with other connections (in the same thread,
+     * for avatars; see User::historicalAvatarsMemoryUsage() and
+     * InternedId::memoryUsage()).
+     *
+     * Like most Connection methods, this must be called in the thread
+     * the connection lives in (use invokeBlocking() from other threads);
+     * this is also the thread historical avatars are counted for.
+     * Computing the estimate goes through all events in all rooms; sampling
+     * it every few seconds is fine, doing so on every sync is not.
+     */
+    MemoryUsage memoryUsage() const;
+
+    /*! \brief Whether the sync loop requests the next batch ahead of time
+     *
+     * By default, syncLoop() only sends the next /sync request once the room
+     * updates from the previous response have been applied. In the pipelined
+     * mode the next request is sent as soon as the next batch token is known,
+     * so that waiting for the network overlaps with applying room updates.
+     * To keep memory usage in check, the loop only gets ahead by one batch:
+     * if room updates from previous batches are still being applied when
+     * a new batch arrives, the loop waits for them before sending the next
+     * request.
+     * \sa syncLoop
+     */
+    bool pipelinedSync() const;
+    void setPipelinedSync(bool newValue);
+
     /*! Start a pre-created job object on this connection */
     Q_INVOKABLE BaseJob* run(BaseJob* job,
                          RunningPolicy runningPolicy = ForegroundRequest);
@@ -491,6 +582,42 @@ public:
      */
     Q_INVOKABLE QByteArray generateTxnId() const;
 
+    //! \brief Move the connection to a thread of its own
+    //!
+    //! A connection, along with its rooms and users, normally lives in
+    //! the thread that created it - in most clients, the GUI thread. Calling
+    //! this method moves it to a new thread, so that sync processing of
+    //! several accounts (and the GUI) don't contend for one event loop.
+    //! After that, the connection and its rooms and users should only be
+    //! used from that thread:
+    //! - signals are queued to receivers in other threads, so by the time
+    //!   a slot is called the emitter may have changed further. From other
+    //!   threads, only connect to signals that pass values (ids, strings,
+    //!   numbers, such as Connection::syncDone(), Room::addedMessages() or
+    //!   Room::eventsDecrypted()) and treat Room and User pointers passed by
+    //!   them as handles, to be used from the connection thread only. Signals
+    //!   that pass events, ranges of events or other references (e.g.,
+    //!   Room::aboutToAddNewMessages() or Room::pendingEventAboutToMerge()),
+    //!   as well as all "about to" signals, rely on being handled before
+    //!   the emitter goes on; connect to them with a context object living in
+    //!   the connection thread;
+    //! - call their methods with QMetaObject::invokeMethod() (or
+    //!   Quotient::invokeBlocking() for results), rather than directly;
+    //! - destroy the connection with deleteLater(); the thread quits, and is
+    //!   deleted, once the connection is gone; threads of connections still
+    //!   alive at exit are stopped and waited for when Accounts is destroyed;
+    //! - to read room data in yet other threads, pass around snapshots made
+    //!   by Room::snapshot().
+    //!
+    //! The connection must have no parent, and the method must be called from
+    //! the thread the connection currently lives in, before the connection
+    //! is set up - that is, before logging in or assuming an identity; call
+    //! those through QMetaObject::invokeMethod() after moving the connection.
+    //! Connections made with makeMockConnection() can be moved at any time.
+    //! \return the new thread, already started; nullptr if the connection
+    //!         has already been set up
+    QThread* moveToWorkerThread();
+
     /// Set a room factory function
     static void setRoomFactory(room_factory_t f);
 
@@ -503,6 +630,13 @@ public:
     /// Get a user factory function
     static user_factory_t userFactory();
 
+    //! \brief Make a connection that has a local user but no server
+    //!
+    //! The connection is not logged in, doesn't cache its state and doesn't
+    //! set up E2EE; it is meant for tests and benchmarks that feed sync data
+    //! to it directly, through onSyncSuccess().
+    static Connection* makeMockConnection(const QString& mxId);
+
     /// Set the room factory to default with the overriden room type
     template <typename T>
     static void setRoomType()
@@ -856,6 +990,7 @@ Q_SIGNALS:
 
     void cacheStateChanged();
     void lazyLoadingChanged();
+    void pipelinedSyncChanged();
     void turnServersChanged(const QJsonObject& servers);
     void devicesListLoaded();
 
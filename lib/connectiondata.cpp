@@ -5,6 +5,7 @@
 #include "connectiondata.h"
 
 #include "logging.h"
+#include "metrics.h"
 #include "networkaccessmanager.h"
 #include "jobs/basejob.h"
 
@@ -38,6 +39,7 @@ public:
     using job_queue_t = std::queue<QPointer<BaseJob>>;
     std::array<job_queue_t, 2> jobs; // 0 - foreground, 1 - background
     QTimer rateLimiter;
+    std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>();
 };
 
 ConnectionData::ConnectionData(QUrl baseUrl)
@@ -91,6 +93,11 @@ void ConnectionData::submit(BaseJob* job)
                   << "queues";
 }
 
+void ConnectionData::moveToThread(QThread* thread)
+{
+    d->rateLimiter.moveToThread(thread);
+}
+
 void ConnectionData::limitRate(std::chrono::milliseconds nextCallAfter)
 {
     qCDebug(MAIN) << "Jobs for" << (d->userId + "/" + d->deviceId)
@@ -152,3 +159,10 @@ QByteArray ConnectionData::generateTxnId() const
     return d->deviceId.toLatin1() + QByteArray::number(d->txnBase)
            + QByteArray::number(++d->txnCounter);
 }
+
+Metrics& ConnectionData::metrics() const { return *d->metrics; }
+
+std::shared_ptr<Metrics> ConnectionData::sharedMetrics() const
+{
+    return d->metrics;
+}
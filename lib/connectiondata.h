@@ -9,11 +9,14 @@
 #include <QtCore/QUrl>
 
 #include <chrono>
+#include <memory>
 
 class QNetworkAccessManager;
+class QThread;
 
 namespace Quotient {
 class BaseJob;
+class Metrics;
 
 class ConnectionData {
 public:
@@ -22,6 +25,12 @@ public:
 
     void submit(BaseJob* job);
     void limitRate(std::chrono::milliseconds nextCallAfter);
+    //! \brief Move the internal timers to \p thread
+    //!
+    //! Must be called, from the current thread of the timers, along with
+    //! moving the owning connection so that jobs can be rate limited in
+    //! the new thread.
+    void moveToThread(QThread* thread);
 
     QByteArray accessToken() const;
     QUrl baseUrl() const;
@@ -41,6 +50,14 @@ public:
 
     QByteArray generateTxnId() const;
 
+    //! The metrics registry of the connection
+    Metrics& metrics() const;
+    //! \brief The metrics registry, for objects that can outlive the connection
+    //!
+    //! The registry is shared with, e.g., threads that keep working for some
+    //! time after ConnectionData is destroyed.
+    std::shared_ptr<Metrics> sharedMetrics() const;
+
 private:
     class Private;
     ImplPtr<Private> d;
@@ -9,13 +9,100 @@
 #include <QtCore/QStandardPaths>
 #include <QtCore/QDebug>
 #include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QRegularExpression>
+
+#include <algorithm>
+#include <limits>
 
 #include "e2ee/e2ee.h"
+#include "metrics.h"
 #include "e2ee/qolmsession.h"
 #include "e2ee/qolminboundsession.h"
 #include "e2ee/qolmoutboundsession.h"
 
 using namespace Quotient;
+
+namespace {
+QSqlQuery executeQuery(QSqlQuery& query)
+{
+    if (!query.exec()) {
+        qCritical() << "Failed to execute query";
+        qCritical() << query.lastQuery();
+        qCritical() << query.lastError();
+    }
+    return query;
+}
+
+//! \brief Get a prepared query from \p cache, preparing and caching it if needed
+//!
+//! The same statement is handed out on every call with the same text; its
+//! previous use is finished.
+QSqlQuery& cachedQuery(UnorderedMap<QString, QSqlQuery>& cache,
+                       const QSqlDatabase& db, const QString& queryString)
+{
+    auto [it, inserted] = cache.try_emplace(queryString, db);
+    auto& query = it->second;
+    if (!inserted)
+        query.finish(); // Reset the statement left over from the previous use
+    else if (!query.prepare(queryString)) {
+        qCritical() << "Failed to prepare query";
+        qCritical() << queryString;
+        qCritical() << query.lastError();
+    }
+    return query;
+}
+} // namespace
+
+//! The part of Database that lives in the database thread
+class Database::Worker : public QObject {
+public:
+    Worker(QString connectionName, QString databaseName)
+        : connectionName(std::move(connectionName))
+        , databaseName(std::move(databaseName))
+    {}
+
+    //! Get the connection of the database thread, opening it if necessary
+    QSqlDatabase database()
+    {
+        if (!QSqlDatabase::contains(connectionName)) {
+            auto db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"),
+                                                connectionName);
+            db.setDatabaseName(databaseName);
+            if (!db.open())
+                qCCritical(DATABASE) << "Failed to open the database:"
+                                     << db.lastError();
+            db.exec(QStringLiteral("PRAGMA synchronous = NORMAL;"));
+        }
+        return QSqlDatabase::database(connectionName, false);
+    }
+    QSqlQuery& prepareQuery(const QString& queryString)
+    {
+        return cachedQuery(preparedQueries, database(), queryString);
+    }
+    void execute(QSqlQuery& query)
+    {
+        executeQuery(query);
+        // Tasks only write; don't keep the statement active until the cached
+        // query is used again
+        query.finish();
+    }
+    void transaction() { database().transaction(); }
+    void commit() { database().commit(); }
+
+    void close()
+    {
+        preparedQueries.clear();
+        database().close();
+        QSqlDatabase::removeDatabase(connectionName);
+    }
+
+private:
+    QString connectionName;
+    QString databaseName;
+    UnorderedMap<QString, QSqlQuery> preparedQueries;
+};
+
 Database::Database(const QString& matrixId, const QString& deviceId, QObject* parent)
     : QObject(parent)
     , m_matrixId(matrixId)
@@ -26,13 +113,142 @@ Database::Database(const QString& matrixId, const QString& deviceId, QObject* pa
     QDir(databasePath).mkpath(databasePath);
     database().setDatabaseName(databasePath + QStringLiteral("/quotient_%1.db3").arg(deviceId));
     database().open();
+    // WAL lets the database thread write while other threads read; with it,
+    // NORMAL synchronisation is still safe from corruption
+    execute(QStringLiteral("PRAGMA journal_mode = WAL;"));
+    execute(QStringLiteral("PRAGMA synchronous = NORMAL;"));
 
     switch(version()) {
         case 0: migrateTo1();
         case 1: migrateTo2();
         case 2: migrateTo3();
         case 3: migrateTo4();
+        case 4: migrateTo5();
+        case 5: migrateTo6();
+        case 6: migrateTo7();
+        case 7: migrateTo8();
+    }
+
+    m_finishQueriesTimer.setSingleShot(true);
+    m_finishQueriesTimer.setInterval(0);
+    connect(&m_finishQueriesTimer, &QTimer::timeout, this,
+            &Database::finishCachedQueries);
+
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(50);
+    connect(&m_flushTimer, &QTimer::timeout, this, [this] {
+        flushGroupSessionIndexRecords();
+        flushOlmSessionTimestamps();
+    });
+
+    m_worker = new Worker(QStringLiteral("Quotient_%1_worker").arg(m_matrixId),
+                          database().databaseName());
+    m_worker->moveToThread(&m_thread);
+    m_thread.setObjectName(QStringLiteral("Database thread"));
+    m_thread.start();
+}
+
+Database::~Database()
+{
+    flushGroupSessionIndexRecords();
+    flushOlmSessionTimestamps();
+    // Blocking here makes sure all the previously queued writes are done
+    QMetaObject::invokeMethod(
+        m_worker, [this] { m_worker->close(); }, Qt::BlockingQueuedConnection);
+    m_thread.quit();
+    m_thread.wait();
+    delete m_worker;
+}
+
+void Database::setMetrics(std::shared_ptr<Metrics> metrics)
+{
+    m_metrics = std::move(metrics);
+}
+
+void Database::post(QStringList tables, std::function<void(Worker&)> task)
+{
+    m_pendingTasks.ref();
+    {
+        const QMutexLocker locker(&m_pendingWritesLock);
+        for (const auto& table : tables)
+            ++m_pendingWrites[table];
+    }
+    QMetaObject::invokeMethod(
+        m_worker,
+        [this, tables = std::move(tables), task = std::move(task),
+         metrics = m_metrics] {
+            QElapsedTimer et;
+            et.start();
+            task(*m_worker);
+            if (metrics)
+                metrics->observe(MetricNames::DatabaseSeconds, et,
+                                 { { QStringLiteral("mode"),
+                                     QStringLiteral("async") } });
+            {
+                const QMutexLocker locker(&m_pendingWritesLock);
+                for (const auto& table : tables)
+                    if (--m_pendingWrites[table] == 0)
+                        m_pendingWrites.remove(table);
+            }
+            m_pendingTasks.deref();
+        },
+        Qt::QueuedConnection);
+}
+
+void Database::postRead(std::function<void(QSqlDatabase)> readTask)
+{
+    // Not counted as a pending write: synchronous reads don't need to wait
+    // for it
+    QMetaObject::invokeMethod(
+        m_worker,
+        [this, readTask = std::move(readTask), metrics = m_metrics] {
+            QElapsedTimer et;
+            et.start();
+            readTask(m_worker->database());
+            if (metrics)
+                metrics->observe(MetricNames::DatabaseSeconds, et,
+                                 { { QStringLiteral("mode"),
+                                     QStringLiteral("async") } });
+        },
+        Qt::QueuedConnection);
+}
+
+void Database::waitForPendingWrites(const QStringList& tables)
+{
+    if (m_pendingTasks.loadAcquire() == 0)
+        return;
+    if (!tables.isEmpty()) {
+        const QMutexLocker locker(&m_pendingWritesLock);
+        if (std::none_of(tables.cbegin(), tables.cend(),
+                         [this](const QString& table) {
+                             return m_pendingWrites.contains(table);
+                         }))
+            return;
     }
+    // Tasks are executed in the order of queueing so once an empty task
+    // queued now is done, all the tasks queued before are done too
+    QMetaObject::invokeMethod(m_worker, [] {}, Qt::BlockingQueuedConnection);
+}
+
+QStringList Database::queryTables(const QString& queryString)
+{
+    if (const auto it = m_queryTables.constFind(queryString);
+        it != m_queryTables.cend())
+        return *it;
+
+    static const QRegularExpression TableRe(
+        QStringLiteral("\\b(?:FROM|JOIN)\\s+(\\w+)"),
+        QRegularExpression::CaseInsensitiveOption);
+    QStringList tables;
+    for (auto it = TableRe.globalMatch(queryString); it.hasNext();)
+        tables.push_back(it.next().captured(1));
+    return *m_queryTables.insert(queryString, tables);
+}
+
+void Database::finishCachedQueries()
+{
+    for (auto& [queryString, query] : m_preparedQueries)
+        query.finish();
 }
 
 int Database::version()
@@ -52,25 +268,44 @@ int Database::version()
 
 QSqlQuery Database::execute(const QString &queryString)
 {
+    QElapsedTimer et;
+    et.start();
+    waitForPendingWrites();
+    finishCachedQueries();
     auto query = database().exec(queryString);
     if (query.lastError().type() != QSqlError::NoError) {
         qCritical() << "Failed to execute query";
         qCritical() << query.lastQuery();
         qCritical() << query.lastError();
     }
+    recordSyncExecution(et);
     return query;
 }
 
 QSqlQuery Database::execute(QSqlQuery &query)
 {
-    if (!query.exec()) {
-        qCritical() << "Failed to execute query";
-        qCritical() << query.lastQuery();
-        qCritical() << query.lastError();
-    }
+    QElapsedTimer et;
+    et.start();
+    // A query that is not recognised (no tables found) waits for everything
+    waitForPendingWrites(queryTables(query.lastQuery()));
+    // Only one read statement is active at a time; this also makes sure
+    // the query sees the writes committed since the previous read
+    finishCachedQueries();
+    executeQuery(query);
+    if (!m_finishQueriesTimer.isActive())
+        m_finishQueriesTimer.start();
+    recordSyncExecution(et);
     return query;
 }
 
+void Database::recordSyncExecution(const QElapsedTimer& et)
+{
+    if (m_metrics)
+        m_metrics->observe(MetricNames::DatabaseSeconds, et,
+                           { { QStringLiteral("mode"),
+                               QStringLiteral("sync") } });
+}
+
 void Database::transaction()
 {
     database().transaction();
@@ -141,6 +376,57 @@ void Database::migrateTo4()
     commit();
 }
 
+void Database::migrateTo5()
+{
+    qCDebug(DATABASE) << "Migrating database to version 5";
+    transaction();
+
+    execute(QStringLiteral("CREATE INDEX inbound_room_session_idx ON inbound_megolm_sessions(roomId, sessionId);"));
+    execute(QStringLiteral("PRAGMA user_version = 5;"));
+    commit();
+}
+
+void Database::migrateTo6()
+{
+    qCDebug(DATABASE) << "Migrating database to version 6";
+    transaction();
+
+    // Device lists used to be appended to on every save; only keep the most
+    // recently saved row for each device before making the rows unique
+    execute(QStringLiteral("DELETE FROM tracked_devices WHERE rowid NOT IN (SELECT MAX(rowid) FROM tracked_devices GROUP BY matrixId, deviceId);"));
+    execute(QStringLiteral("CREATE UNIQUE INDEX tracked_devices_idx ON tracked_devices(matrixId, deviceId);"));
+    execute(QStringLiteral("DELETE FROM tracked_users WHERE rowid NOT IN (SELECT MIN(rowid) FROM tracked_users GROUP BY matrixId);"));
+    execute(QStringLiteral("CREATE UNIQUE INDEX tracked_users_idx ON tracked_users(matrixId);"));
+    execute(QStringLiteral("DELETE FROM outdated_users WHERE rowid NOT IN (SELECT MIN(rowid) FROM outdated_users GROUP BY matrixId);"));
+    execute(QStringLiteral("CREATE UNIQUE INDEX outdated_users_idx ON outdated_users(matrixId);"));
+    execute(QStringLiteral("PRAGMA user_version = 6;"));
+    commit();
+}
+
+void Database::migrateTo7()
+{
+    qCDebug(DATABASE) << "Migrating database to version 7";
+    transaction();
+
+    execute(QStringLiteral("CREATE TABLE pending_decryptions (roomId TEXT, sessionId TEXT, eventId TEXT);"));
+    execute(QStringLiteral("CREATE UNIQUE INDEX pending_decryptions_event_idx ON pending_decryptions(roomId, eventId);"));
+    execute(QStringLiteral("PRAGMA user_version = 7;"));
+    commit();
+}
+
+void Database::migrateTo8()
+{
+    qCDebug(DATABASE) << "Migrating database to version 8";
+    transaction();
+
+    // Keys of the device that created a session, for sessions that don't
+    // come over olm (those are dropped since version 3)
+    execute(QStringLiteral("ALTER TABLE inbound_megolm_sessions ADD senderKey TEXT;"));
+    execute(QStringLiteral("ALTER TABLE inbound_megolm_sessions ADD ed25519Key TEXT;"));
+    execute(QStringLiteral("PRAGMA user_version = 8;"));
+    commit();
+}
+
 QByteArray Database::accountPickle()
 {
     auto query = prepareQuery(QStringLiteral("SELECT pickle FROM accounts;"));
@@ -153,41 +439,58 @@ QByteArray Database::accountPickle()
 
 void Database::setAccountPickle(const QByteArray &pickle)
 {
-    auto deleteQuery = prepareQuery(QStringLiteral("DELETE FROM accounts;"));
-    auto query = prepareQuery(QStringLiteral("INSERT INTO accounts(pickle) VALUES(:pickle);"));
-    query.bindValue(":pickle", pickle);
-    transaction();
-    execute(deleteQuery);
-    execute(query);
-    commit();
+    post({ QStringLiteral("accounts") }, [pickle](Worker& w) {
+        auto& deleteQuery = w.prepareQuery(QStringLiteral("DELETE FROM accounts;"));
+        auto& query = w.prepareQuery(QStringLiteral("INSERT INTO accounts(pickle) VALUES(:pickle);"));
+        query.bindValue(":pickle", pickle);
+        w.transaction();
+        w.execute(deleteQuery);
+        w.execute(query);
+        w.commit();
+    });
 }
 
 void Database::clear()
 {
-    auto query = prepareQuery(QStringLiteral("DELETE FROM accounts;"));
-    auto sessionsQuery = prepareQuery(QStringLiteral("DELETE FROM olm_sessions;"));
-    auto megolmSessionsQuery = prepareQuery(QStringLiteral("DELETE FROM inbound_megolm_sessions;"));
-    auto groupSessionIndexRecordQuery = prepareQuery(QStringLiteral("DELETE FROM group_session_record_index;"));
-
-    transaction();
-    execute(query);
-    execute(sessionsQuery);
-    execute(megolmSessionsQuery);
-    execute(groupSessionIndexRecordQuery);
-    commit();
-
+    m_groupSessionIndices.clear();
+    m_pendingIndexRecords.clear();
+    m_pendingOlmSessionTimestamps.clear();
+    const QStringList tables {
+        QStringLiteral("accounts"),
+        QStringLiteral("olm_sessions"),
+        QStringLiteral("inbound_megolm_sessions"),
+        QStringLiteral("group_session_record_index"),
+        QStringLiteral("pending_decryptions")
+    };
+    post(tables, [](Worker& w) {
+        auto& query = w.prepareQuery(QStringLiteral("DELETE FROM accounts;"));
+        auto& sessionsQuery = w.prepareQuery(QStringLiteral("DELETE FROM olm_sessions;"));
+        auto& megolmSessionsQuery = w.prepareQuery(QStringLiteral("DELETE FROM inbound_megolm_sessions;"));
+        auto& groupSessionIndexRecordQuery = w.prepareQuery(QStringLiteral("DELETE FROM group_session_record_index;"));
+        auto& pendingDecryptionsQuery = w.prepareQuery(QStringLiteral("DELETE FROM pending_decryptions;"));
+
+        w.transaction();
+        w.execute(query);
+        w.execute(sessionsQuery);
+        w.execute(megolmSessionsQuery);
+        w.execute(groupSessionIndexRecordQuery);
+        w.execute(pendingDecryptionsQuery);
+        w.commit();
+    });
 }
 
 void Database::saveOlmSession(const QString& senderKey, const QString& sessionId, const QByteArray &pickle, const QDateTime& timestamp)
 {
-    auto query = prepareQuery(QStringLiteral("INSERT INTO olm_sessions(senderKey, sessionId, pickle, lastReceived) VALUES(:senderKey, :sessionId, :pickle, :lastReceived);"));
-    query.bindValue(":senderKey", senderKey);
-    query.bindValue(":sessionId", sessionId);
-    query.bindValue(":pickle", pickle);
-    query.bindValue(":lastReceived", timestamp);
-    transaction();
-    execute(query);
-    commit();
+    post({ QStringLiteral("olm_sessions") }, [senderKey, sessionId, pickle, timestamp](Worker& w) {
+        auto& query = w.prepareQuery(QStringLiteral("INSERT INTO olm_sessions(senderKey, sessionId, pickle, lastReceived) VALUES(:senderKey, :sessionId, :pickle, :lastReceived);"));
+        query.bindValue(":senderKey", senderKey);
+        query.bindValue(":sessionId", sessionId);
+        query.bindValue(":pickle", pickle);
+        query.bindValue(":lastReceived", timestamp);
+        w.transaction();
+        w.execute(query);
+        w.commit();
+    });
 }
 
 UnorderedMap<QString, std::vector<QOlmSessionPtr>> Database::loadOlmSessions(const PicklingMode& picklingMode)
@@ -232,45 +535,193 @@ UnorderedMap<QString, QOlmInboundGroupSessionPtr> Database::loadMegolmSessions(c
     return sessions;
 }
 
-void Database::saveMegolmSession(const QString& roomId, const QString& sessionId, const QByteArray& pickle, const QString& senderId, const QString& olmSessionId)
+QOlmInboundGroupSessionPtr Database::loadMegolmSession(
+    const QString& roomId, const QString& sessionId,
+    const PicklingMode& picklingMode)
 {
-    auto query = prepareQuery(QStringLiteral("INSERT INTO inbound_megolm_sessions(roomId, sessionId, pickle, senderId, olmSessionId) VALUES(:roomId, :sessionId, :pickle, :senderId, :olmSessionId);"));
+    auto query = prepareQuery(QStringLiteral("SELECT pickle, senderId, olmSessionId FROM inbound_megolm_sessions WHERE roomId=:roomId AND sessionId=:sessionId;"));
     query.bindValue(":roomId", roomId);
     query.bindValue(":sessionId", sessionId);
-    query.bindValue(":pickle", pickle);
-    query.bindValue(":senderId", senderId);
-    query.bindValue(":olmSessionId", olmSessionId);
-    transaction();
     execute(query);
-    commit();
+    if (!query.next())
+        return nullptr;
+    auto expectedSession = QOlmInboundGroupSession::unpickle(
+        query.value("pickle").toByteArray(), picklingMode);
+    if (!expectedSession) {
+        qCWarning(E2EE) << "Failed to unpickle megolm session:"
+                        << expectedSession.error();
+        return nullptr;
+    }
+    auto& session = *expectedSession;
+    session->setOlmSessionId(query.value("olmSessionId").toString());
+    session->setSenderId(query.value("senderId").toString());
+    return std::move(session);
 }
 
-void Database::addGroupSessionIndexRecord(const QString& roomId, const QString& sessionId, uint32_t index, const QString& eventId, qint64 ts)
+QSet<QString> Database::megolmSessionIds(const QString& roomId)
 {
-    auto query = prepareQuery("INSERT INTO group_session_record_index(roomId, sessionId, i, eventId, ts) VALUES(:roomId, :sessionId, :index, :eventId, :ts);");
+    auto query = prepareQuery(QStringLiteral("SELECT sessionId FROM inbound_megolm_sessions WHERE roomId=:roomId;"));
     query.bindValue(":roomId", roomId);
-    query.bindValue(":sessionId", sessionId);
-    query.bindValue(":index", index);
-    query.bindValue(":eventId", eventId);
-    query.bindValue(":ts", ts);
-    transaction();
     execute(query);
-    commit();
+    QSet<QString> sessionIds;
+    while (query.next())
+        sessionIds.insert(query.value("sessionId").toString());
+    return sessionIds;
 }
 
-std::pair<QString, qint64> Database::groupSessionIndexRecord(const QString& roomId, const QString& sessionId, qint64 index)
+void Database::saveMegolmSession(const QString& roomId, const QString& sessionId, const QByteArray& pickle, const QString& senderId, const QString& olmSessionId)
+{
+    post({ QStringLiteral("inbound_megolm_sessions") }, [roomId, sessionId, pickle, senderId, olmSessionId](Worker& w) {
+        auto& query = w.prepareQuery(QStringLiteral("INSERT INTO inbound_megolm_sessions(roomId, sessionId, pickle, senderId, olmSessionId) VALUES(:roomId, :sessionId, :pickle, :senderId, :olmSessionId);"));
+        query.bindValue(":roomId", roomId);
+        query.bindValue(":sessionId", sessionId);
+        query.bindValue(":pickle", pickle);
+        query.bindValue(":senderId", senderId);
+        query.bindValue(":olmSessionId", olmSessionId);
+        w.transaction();
+        w.execute(query);
+        w.commit();
+    });
+}
+
+QString Database::megolmSessionSenderKey(const QString& roomId,
+                                        const QString& sessionId)
 {
-    auto query = prepareQuery(QStringLiteral("SELECT * FROM group_session_record_index WHERE roomId=:roomId AND sessionId=:sessionId AND i=:index;"));
+    auto query = prepareQuery(QStringLiteral("SELECT senderKey FROM inbound_megolm_sessions WHERE roomId=:roomId AND sessionId=:sessionId;"));
     query.bindValue(":roomId", roomId);
     query.bindValue(":sessionId", sessionId);
-    query.bindValue(":index", index);
-    transaction();
     execute(query);
-    commit();
-    if (!query.next()) {
+    return query.next() ? query.value("senderKey").toString() : QString();
+}
+
+QString Database::curveKeyOwner(const QString& curveKey)
+{
+    auto query = prepareQuery(QStringLiteral("SELECT DISTINCT matrixId FROM tracked_devices WHERE curveKey=:curveKey LIMIT 2;"));
+    query.bindValue(":curveKey", curveKey);
+    execute(query);
+    if (!query.next())
         return {};
+    const auto ownerId = query.value("matrixId").toString();
+    return query.next() ? QString() : ownerId;
+}
+
+void Database::setMegolmSessionSenderId(const QString& roomId,
+                                        const QString& sessionId,
+                                        const QString& senderId)
+{
+    post({ QStringLiteral("inbound_megolm_sessions") }, [roomId, sessionId, senderId](Worker& w) {
+        auto& query = w.prepareQuery(QStringLiteral("UPDATE inbound_megolm_sessions SET senderId=:senderId WHERE roomId=:roomId AND sessionId=:sessionId;"));
+        query.bindValue(":senderId", senderId);
+        query.bindValue(":roomId", roomId);
+        query.bindValue(":sessionId", sessionId);
+        w.transaction();
+        w.execute(query);
+        w.commit();
+    });
+}
+
+std::vector<Database::MegolmSessionRecord> Database::loadMegolmSessionRecords(
+    qint64& afterRowId, int limit)
+{
+    // Sessions received over olm only have the sender key in olm_sessions
+    auto query = prepareQuery(QStringLiteral("SELECT i.rowid AS rowid, i.roomId, i.sessionId, i.pickle, i.senderId, i.olmSessionId, COALESCE(i.senderKey, o.senderKey) AS senderKey, i.ed25519Key FROM inbound_megolm_sessions i LEFT JOIN olm_sessions o ON o.sessionId = i.olmSessionId WHERE i.rowid > :rowid ORDER BY i.rowid LIMIT :limit;"));
+    query.bindValue(":rowid", afterRowId);
+    query.bindValue(":limit", limit);
+    execute(query);
+    std::vector<MegolmSessionRecord> records;
+    while (query.next()) {
+        afterRowId = query.value("rowid").toLongLong();
+        records.push_back({ query.value("roomId").toString(),
+                            query.value("sessionId").toString(),
+                            query.value("pickle").toByteArray(),
+                            query.value("senderId").toString(),
+                            query.value("olmSessionId").toString(),
+                            query.value("senderKey").toString(),
+                            query.value("ed25519Key").toString() });
     }
-    return {query.value("eventId").toString(), query.value("ts").toLongLong()};
+    return records;
+}
+
+void Database::saveMegolmSessions(std::vector<MegolmSessionRecord> records)
+{
+    if (records.empty())
+        return;
+    post({ QStringLiteral("inbound_megolm_sessions") }, [records = std::move(records)](Worker& w) {
+        auto& query = w.prepareQuery(QStringLiteral("INSERT INTO inbound_megolm_sessions(roomId, sessionId, pickle, senderId, olmSessionId, senderKey, ed25519Key) VALUES(:roomId, :sessionId, :pickle, :senderId, :olmSessionId, :senderKey, :ed25519Key);"));
+        w.transaction();
+        for (const auto& record : records) {
+            query.bindValue(":roomId", record.roomId);
+            query.bindValue(":sessionId", record.sessionId);
+            query.bindValue(":pickle", record.pickle);
+            query.bindValue(":senderId", record.senderId);
+            query.bindValue(":olmSessionId", record.olmSessionId);
+            query.bindValue(":senderKey", record.senderKey);
+            query.bindValue(":ed25519Key", record.ed25519Key);
+            w.execute(query);
+        }
+        w.commit();
+    });
+}
+
+Database::GroupSessionIndex& Database::groupSessionIndex(
+    const QString& roomId, const QString& sessionId)
+{
+    const auto key = qMakePair(roomId, sessionId);
+    if (auto* sessionIndex = m_groupSessionIndices.object(key))
+        return *sessionIndex;
+
+    // The index may have been evicted with records that are not saved yet;
+    // queue them so that the query below waits for them
+    flushGroupSessionIndexRecords();
+    auto* sessionIndex = new GroupSessionIndex;
+    auto query = prepareQuery(QStringLiteral("SELECT i, eventId, ts FROM group_session_record_index WHERE roomId=:roomId AND sessionId=:sessionId;"));
+    query.bindValue(":roomId", roomId);
+    query.bindValue(":sessionId", sessionId);
+    execute(query);
+    while (query.next())
+        sessionIndex->insert(query.value("i").toUInt(),
+                             { query.value("eventId").toString(),
+                               query.value("ts").toLongLong() });
+    // The cost of 1 never exceeds the capacity, so the index is not deleted
+    m_groupSessionIndices.insert(key, sessionIndex);
+    return *sessionIndex;
+}
+
+void Database::addGroupSessionIndexRecord(const QString& roomId, const QString& sessionId, uint32_t index, const QString& eventId, qint64 ts)
+{
+    groupSessionIndex(roomId, sessionId).insert(index, { eventId, ts });
+    m_pendingIndexRecords.push_back({ roomId, sessionId, index, eventId, ts });
+    if (!m_flushTimer.isActive())
+        m_flushTimer.start();
+}
+
+std::pair<QString, qint64> Database::groupSessionIndexRecord(const QString& roomId, const QString& sessionId, qint64 index)
+{
+    if (index < 0 || index > std::numeric_limits<uint32_t>::max())
+        return {};
+    return groupSessionIndex(roomId, sessionId).value(uint32_t(index));
+}
+
+void Database::flushGroupSessionIndexRecords()
+{
+    if (m_pendingIndexRecords.empty())
+        return;
+
+    post({ QStringLiteral("group_session_record_index") }, [records = std::exchange(m_pendingIndexRecords, {})](Worker& w) {
+        auto& query = w.prepareQuery(QStringLiteral("INSERT INTO group_session_record_index(roomId, sessionId, i, eventId, ts) VALUES(:roomId, :sessionId, :index, :eventId, :ts);"));
+        w.transaction();
+        for (const auto& record : records) {
+            query.bindValue(":roomId", record.roomId);
+            query.bindValue(":sessionId", record.sessionId);
+            query.bindValue(":index", record.index);
+            query.bindValue(":eventId", record.eventId);
+            query.bindValue(":ts", record.ts);
+            w.execute(query);
+        }
+        w.commit();
+        qCDebug(DATABASE) << "Saved" << records.size()
+                          << "group session index record(s)";
+    });
 }
 
 QSqlDatabase Database::database()
@@ -280,31 +731,105 @@ QSqlDatabase Database::database()
 
 QSqlQuery Database::prepareQuery(const QString& queryString)
 {
-    QSqlQuery query(database());
-    query.prepare(queryString);
-    return query;
+    // The copy shares the prepared statement with the cached query
+    return cachedQuery(m_preparedQueries, database(), queryString);
 }
 
 void Database::clearRoomData(const QString& roomId)
 {
-    auto query = prepareQuery(QStringLiteral("DELETE FROM inbound_megolm_sessions WHERE roomId=:roomId;"));
-    auto query2 = prepareQuery(QStringLiteral("DELETE FROM outbound_megolm_sessions WHERE roomId=:roomId;"));
-    auto query3 = prepareQuery(QStringLiteral("DELETE FROM group_session_record_index WHERE roomId=:roomId;"));
-    transaction();
+    const auto cachedKeys = m_groupSessionIndices.keys();
+    for (const auto& key : cachedKeys)
+        if (key.first == roomId)
+            m_groupSessionIndices.remove(key);
+    std::erase_if(m_pendingIndexRecords, [&roomId](const auto& record) {
+        return record.roomId == roomId;
+    });
+    const QStringList tables {
+        QStringLiteral("inbound_megolm_sessions"),
+        QStringLiteral("outbound_megolm_sessions"),
+        QStringLiteral("group_session_record_index"),
+        QStringLiteral("pending_decryptions")
+    };
+    post(tables, [roomId](Worker& w) {
+        auto& query = w.prepareQuery(QStringLiteral("DELETE FROM inbound_megolm_sessions WHERE roomId=:roomId;"));
+        auto& query2 = w.prepareQuery(QStringLiteral("DELETE FROM outbound_megolm_sessions WHERE roomId=:roomId;"));
+        auto& query3 = w.prepareQuery(QStringLiteral("DELETE FROM group_session_record_index WHERE roomId=:roomId;"));
+        auto& query4 = w.prepareQuery(QStringLiteral("DELETE FROM pending_decryptions WHERE roomId=:roomId;"));
+        query.bindValue(":roomId", roomId);
+        query2.bindValue(":roomId", roomId);
+        query3.bindValue(":roomId", roomId);
+        query4.bindValue(":roomId", roomId);
+        w.transaction();
+        w.execute(query);
+        w.execute(query2);
+        w.execute(query3);
+        w.execute(query4);
+        w.commit();
+    });
+}
+
+std::vector<std::pair<QString, QString>> Database::loadPendingDecryptions(
+    const QString& roomId)
+{
+    auto query = prepareQuery(QStringLiteral("SELECT sessionId, eventId FROM pending_decryptions WHERE roomId=:roomId ORDER BY rowid;"));
+    query.bindValue(":roomId", roomId);
     execute(query);
-    execute(query2);
-    execute(query3);
-    commit();
+    std::vector<std::pair<QString, QString>> result;
+    while (query.next())
+        result.emplace_back(query.value("sessionId").toString(),
+                            query.value("eventId").toString());
+    return result;
+}
+
+void Database::updatePendingDecryptions(
+    const QString& roomId, std::vector<std::pair<QString, QString>> added,
+    QStringList removedEventIds)
+{
+    if (added.empty() && removedEventIds.isEmpty())
+        return;
+    post({ QStringLiteral("pending_decryptions") },
+         [roomId, added = std::move(added),
+          removedEventIds = std::move(removedEventIds)](Worker& w) {
+        auto& deleteQuery = w.prepareQuery(QStringLiteral("DELETE FROM pending_decryptions WHERE roomId=:roomId AND eventId=:eventId;"));
+        auto& insertQuery = w.prepareQuery(QStringLiteral("INSERT OR IGNORE INTO pending_decryptions(roomId, sessionId, eventId) VALUES(:roomId, :sessionId, :eventId);"));
+        w.transaction();
+        for (const auto& eventId : removedEventIds) {
+            deleteQuery.bindValue(":roomId", roomId);
+            deleteQuery.bindValue(":eventId", eventId);
+            w.execute(deleteQuery);
+        }
+        for (const auto& [sessionId, eventId] : added) {
+            insertQuery.bindValue(":roomId", roomId);
+            insertQuery.bindValue(":sessionId", sessionId);
+            insertQuery.bindValue(":eventId", eventId);
+            w.execute(insertQuery);
+        }
+        w.commit();
+    });
 }
 
 void Database::setOlmSessionLastReceived(const QString& sessionId, const QDateTime& timestamp)
 {
-    auto query = prepareQuery(QStringLiteral("UPDATE olm_sessions SET lastReceived=:lastReceived WHERE sessionId=:sessionId;"));
-    query.bindValue(":lastReceived", timestamp);
-    query.bindValue(":sessionId", sessionId);
-    transaction();
-    execute(query);
-    commit();
+    m_pendingOlmSessionTimestamps.insert(sessionId, timestamp);
+    if (!m_flushTimer.isActive())
+        m_flushTimer.start();
+}
+
+void Database::flushOlmSessionTimestamps()
+{
+    if (m_pendingOlmSessionTimestamps.isEmpty())
+        return;
+
+    post({ QStringLiteral("olm_sessions") }, [timestamps = std::exchange(m_pendingOlmSessionTimestamps, {})](Worker& w) {
+        auto& query = w.prepareQuery(QStringLiteral("UPDATE olm_sessions SET lastReceived=:lastReceived WHERE sessionId=:sessionId;"));
+        w.transaction();
+        for (auto it = timestamps.cbegin(); it != timestamps.cend(); ++it) {
+            query.bindValue(":lastReceived", it.value());
+            query.bindValue(":sessionId", it.key());
+            w.execute(query);
+        }
+        w.commit();
+    });
 }
 
 void Database::saveCurrentOutboundMegolmSession(
@@ -313,21 +838,26 @@ void Database::saveCurrentOutboundMegolmSession(
 {
     const auto pickle = session.pickle(picklingMode);
     if (pickle) {
-        auto deleteQuery = prepareQuery(QStringLiteral("DELETE FROM outbound_megolm_sessions WHERE roomId=:roomId AND sessionId=:sessionId;"));
-        deleteQuery.bindValue(":roomId", roomId);
-        deleteQuery.bindValue(":sessionId", session.sessionId());
-
-        auto insertQuery = prepareQuery(QStringLiteral("INSERT INTO outbound_megolm_sessions(roomId, sessionId, pickle, creationTime, messageCount) VALUES(:roomId, :sessionId, :pickle, :creationTime, :messageCount);"));
-        insertQuery.bindValue(":roomId", roomId);
-        insertQuery.bindValue(":sessionId", session.sessionId());
-        insertQuery.bindValue(":pickle", pickle.value());
-        insertQuery.bindValue(":creationTime", session.creationTime());
-        insertQuery.bindValue(":messageCount", session.messageCount());
-
-        transaction();
-        execute(deleteQuery);
-        execute(insertQuery);
-        commit();
+        post({ QStringLiteral("outbound_megolm_sessions") },
+             [roomId, sessionId = session.sessionId(), pickledSession = *pickle,
+              creationTime = session.creationTime(),
+              messageCount = session.messageCount()](Worker& w) {
+            auto& deleteQuery = w.prepareQuery(QStringLiteral("DELETE FROM outbound_megolm_sessions WHERE roomId=:roomId AND sessionId=:sessionId;"));
+            deleteQuery.bindValue(":roomId", roomId);
+            deleteQuery.bindValue(":sessionId", sessionId);
+
+            auto& insertQuery = w.prepareQuery(QStringLiteral("INSERT INTO outbound_megolm_sessions(roomId, sessionId, pickle, creationTime, messageCount) VALUES(:roomId, :sessionId, :pickle, :creationTime, :messageCount);"));
+            insertQuery.bindValue(":roomId", roomId);
+            insertQuery.bindValue(":sessionId", sessionId);
+            insertQuery.bindValue(":pickle", pickledSession);
+            insertQuery.bindValue(":creationTime", creationTime);
+            insertQuery.bindValue(":messageCount", messageCount);
+
+            w.transaction();
+            w.execute(deleteQuery);
+            w.execute(insertQuery);
+            w.commit();
+        });
     }
 }
 
@@ -350,18 +880,82 @@ QOlmOutboundGroupSessionPtr Database::loadCurrentOutboundMegolmSession(const QSt
 
 void Database::setDevicesReceivedKey(const QString& roomId, const QVector<std::tuple<QString, QString, QString>>& devices, const QString& sessionId, int index)
 {
-    transaction();
-    for (const auto& [user, device, curveKey] : devices) {
-        auto query = prepareQuery(QStringLiteral("INSERT INTO sent_megolm_sessions(roomId, userId, deviceId, identityKey, sessionId, i) VALUES(:roomId, :userId, :deviceId, :identityKey, :sessionId, :i);"));
-        query.bindValue(":roomId", roomId);
-        query.bindValue(":userId", user);
-        query.bindValue(":deviceId", device);
-        query.bindValue(":identityKey", curveKey);
-        query.bindValue(":sessionId", sessionId);
-        query.bindValue(":i", index);
-        execute(query);
-    }
-    commit();
+    post({ QStringLiteral("sent_megolm_sessions") }, [roomId, devices, sessionId, index](Worker& w) {
+        auto& query = w.prepareQuery(QStringLiteral("INSERT INTO sent_megolm_sessions(roomId, userId, deviceId, identityKey, sessionId, i) VALUES(:roomId, :userId, :deviceId, :identityKey, :sessionId, :i);"));
+        w.transaction();
+        for (const auto& [user, device, curveKey] : devices) {
+            query.bindValue(":roomId", roomId);
+            query.bindValue(":userId", user);
+            query.bindValue(":deviceId", device);
+            query.bindValue(":identityKey", curveKey);
+            query.bindValue(":sessionId", sessionId);
+            query.bindValue(":i", index);
+            w.execute(query);
+        }
+        w.commit();
+    });
+}
+
+void Database::updateDevicesList(const DevicesListChanges& changes)
+{
+    const QStringList tables {
+        QStringLiteral("tracked_users"),
+        QStringLiteral("tracked_devices"),
+        QStringLiteral("outdated_users")
+    };
+    post(tables, [changes](Worker& w) {
+        w.transaction();
+        auto& addTrackedQuery = w.prepareQuery(QStringLiteral("INSERT OR IGNORE INTO tracked_users(matrixId) VALUES(:matrixId);"));
+        for (const auto& user : changes.addedTrackedUsers) {
+            addTrackedQuery.bindValue(":matrixId", user);
+            w.execute(addTrackedQuery);
+        }
+        auto& removeTrackedQuery = w.prepareQuery(QStringLiteral("DELETE FROM tracked_users WHERE matrixId=:matrixId;"));
+        auto& removeUserDevicesQuery = w.prepareQuery(QStringLiteral("DELETE FROM tracked_devices WHERE matrixId=:matrixId;"));
+        for (const auto& user : changes.removedTrackedUsers) {
+            removeTrackedQuery.bindValue(":matrixId", user);
+            w.execute(removeTrackedQuery);
+            removeUserDevicesQuery.bindValue(":matrixId", user);
+            w.execute(removeUserDevicesQuery);
+        }
+
+        auto& addOutdatedQuery = w.prepareQuery(QStringLiteral("INSERT OR IGNORE INTO outdated_users(matrixId) VALUES(:matrixId);"));
+        for (const auto& user : changes.addedOutdatedUsers) {
+            addOutdatedQuery.bindValue(":matrixId", user);
+            w.execute(addOutdatedQuery);
+        }
+        auto& removeOutdatedQuery = w.prepareQuery(QStringLiteral("DELETE FROM outdated_users WHERE matrixId=:matrixId;"));
+        for (const auto& user : changes.removedOutdatedUsers) {
+            removeOutdatedQuery.bindValue(":matrixId", user);
+            w.execute(removeOutdatedQuery);
+        }
+
+        auto& removeDeviceQuery = w.prepareQuery(QStringLiteral("DELETE FROM tracked_devices WHERE matrixId=:matrixId AND deviceId=:deviceId;"));
+        for (auto it = changes.removedDevices.cbegin();
+             it != changes.removedDevices.cend(); ++it) {
+            removeDeviceQuery.bindValue(":matrixId", it.key());
+            removeDeviceQuery.bindValue(":deviceId", it.value());
+            w.execute(removeDeviceQuery);
+        }
+        auto& saveDeviceQuery = w.prepareQuery(QStringLiteral(
+            "INSERT OR REPLACE INTO tracked_devices"
+            "(matrixId, deviceId, curveKeyId, curveKey, edKeyId, edKey) "
+            "VALUES(:matrixId, :deviceId, :curveKeyId, :curveKey, :edKeyId, :edKey);"));
+        for (const auto& device : changes.changedDevices) {
+            const auto keys = device.keys.keys();
+            const auto& curveKeyId = keys[0].startsWith(QLatin1String("curve")) ? keys[0] : keys[1];
+            const auto& edKeyId = keys[0].startsWith(QLatin1String("ed")) ? keys[0] : keys[1];
+
+            saveDeviceQuery.bindValue(":matrixId", device.userId);
+            saveDeviceQuery.bindValue(":deviceId", device.deviceId);
+            saveDeviceQuery.bindValue(":curveKeyId", curveKeyId);
+            saveDeviceQuery.bindValue(":curveKey", device.keys[curveKeyId]);
+            saveDeviceQuery.bindValue(":edKeyId", edKeyId);
+            saveDeviceQuery.bindValue(":edKey", device.keys[edKeyId]);
+            w.execute(saveDeviceQuery);
+        }
+        w.commit();
+    });
 }
 
 QMultiHash<QString, QString> Database::devicesWithoutKey(
@@ -383,12 +977,14 @@ QMultiHash<QString, QString> Database::devicesWithoutKey(
 
 void Database::updateOlmSession(const QString& senderKey, const QString& sessionId, const QByteArray& pickle)
 {
-    auto query = prepareQuery(QStringLiteral("UPDATE olm_sessions SET pickle=:pickle WHERE senderKey=:senderKey AND sessionId=:sessionId;"));
-    query.bindValue(":pickle", pickle);
-    query.bindValue(":senderKey", senderKey);
-    query.bindValue(":sessionId", sessionId);
-    transaction();
-    execute(query);
-    commit();
+    post({ QStringLiteral("olm_sessions") }, [senderKey, sessionId, pickle](Worker& w) {
+        auto& query = w.prepareQuery(QStringLiteral("UPDATE olm_sessions SET pickle=:pickle WHERE senderKey=:senderKey AND sessionId=:sessionId;"));
+        query.bindValue(":pickle", pickle);
+        query.bindValue(":senderKey", senderKey);
+        query.bindValue(":sessionId", sessionId);
+        w.transaction();
+        w.execute(query);
+        w.commit();
+    });
 }
 
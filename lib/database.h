@@ -3,23 +3,59 @@
 
 #pragma once
 
+#include <QtCore/QCache>
+#include <QtCore/QDateTime>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QMutex>
 #include <QtCore/QObject>
 #include <QtSql/QSqlQuery>
+#include <QtCore/QPointer>
+#include <QtCore/QSet>
+#include <QtCore/QStringList>
+#include <QtCore/QThread>
+#include <QtCore/QTimer>
 #include <QtCore/QVector>
 
 #include <QtCore/QHash>
 
+#include <functional>
+#include <memory>
+
+#include "csapi/definitions/device_keys.h"
 #include "e2ee/e2ee.h"
 
 namespace Quotient {
 class User;
 class Room;
+class Metrics;
 
+//! \brief The E2EE data store of a connection
+//!
+//! Writes to the database are executed in the order of calls on a dedicated
+//! thread, with a connection to the database of its own, so that committing
+//! them doesn't stall the calling (usually GUI) thread. Reads are executed
+//! synchronously by default; to make sure they see the data written before,
+//! execute() waits until the queued writes to the tables the query reads
+//! from are done. readAsync() allows to run a read on the database thread
+//! as well. Queries are prepared once and cached, on both threads, and
+//! the database is opened in the write-ahead log (WAL) mode so that reads
+//! and writes don't block each other. Cached read queries are finished
+//! before the next read and when control returns to the event loop, so
+//! that the reading connection doesn't hold on to an outdated snapshot;
+//! read the results of a query before executing another one, and don't keep
+//! them over to a next event loop iteration.
 class QUOTIENT_API Database : public QObject
 {
     Q_OBJECT
 public:
     Database(const QString& matrixId, const QString& deviceId, QObject* parent);
+    ~Database() override;
+
+    //! \brief Record the time spent in database operations to \p metrics
+    //!
+    //! The registry is shared as the database thread may still run for some
+    //! time after the owner of the registry is gone.
+    void setMetrics(std::shared_ptr<Metrics> metrics);
 
     int version();
     void transaction();
@@ -29,6 +65,28 @@ public:
     QSqlDatabase database();
     QSqlQuery prepareQuery(const QString& quaryString);
 
+    //! \brief Run a read on the database thread and pass its result back
+    //!
+    //! \p readFn is called on the database thread with a QSqlDatabase object
+    //! usable in that thread and should return the result of the read;
+    //! \p handler is then invoked with that result in the thread of this
+    //! Database object, unless \p context is destroyed by then.
+    template <typename ReadFnT, typename HandlerT>
+    void readAsync(ReadFnT readFn, QObject* context, HandlerT handler)
+    {
+        postRead([this, readFn, context = QPointer<QObject>(context),
+                  handler](QSqlDatabase db) mutable {
+            QMetaObject::invokeMethod(
+                this,
+                [context = std::move(context), handler = std::move(handler),
+                 result = readFn(db)]() mutable {
+                    if (context)
+                        handler(std::move(result));
+                },
+                Qt::QueuedConnection);
+        });
+    }
+
     QByteArray accountPickle();
     void setAccountPickle(const QByteArray &pickle);
     void clear();
@@ -38,18 +96,92 @@ public:
         const PicklingMode& picklingMode);
     UnorderedMap<QString, QOlmInboundGroupSessionPtr> loadMegolmSessions(
         const QString& roomId, const PicklingMode& picklingMode);
+    //! Load and unpickle a single inbound megolm session
+    QOlmInboundGroupSessionPtr loadMegolmSession(
+        const QString& roomId, const QString& sessionId,
+        const PicklingMode& picklingMode);
+    //! Get ids of inbound megolm sessions stored for the room
+    QSet<QString> megolmSessionIds(const QString& roomId);
     void saveMegolmSession(const QString& roomId, const QString& sessionId,
                            const QByteArray& pickle, const QString& senderId,
                            const QString& olmSessionId);
+    //! The Curve25519 key of the device that created the inbound megolm
+    //! session, if stored along with it
+    QString megolmSessionSenderKey(const QString& roomId,
+                                   const QString& sessionId);
+    //! \brief The user owning the device with the Curve25519 key
+    //!
+    //! \return the id of the user, or an empty string if no tracked device
+    //!         has this key or devices of several users claim it
+    QString curveKeyOwner(const QString& curveKey);
+    //! Save the user the inbound megolm session has been attributed to
+    void setMegolmSessionSenderId(const QString& roomId,
+                                  const QString& sessionId,
+                                  const QString& senderId);
+
+    //! A stored inbound megolm session along with its metadata
+    struct MegolmSessionRecord {
+        QString roomId;
+        QString sessionId;
+        QByteArray pickle;
+        QString senderId;
+        QString olmSessionId;
+        //! The Curve25519 key of the device that created the session
+        QString senderKey;
+        //! The Ed25519 key the device that created the session claims to own
+        QString ed25519Key;
+    };
+    //! \brief Load stored inbound megolm sessions page by page
+    //!
+    //! Returns up to \p limit records stored after \p afterRowId, updating it
+    //! to point to the last of them; an empty result means there's no more
+    //! sessions to load.
+    std::vector<MegolmSessionRecord> loadMegolmSessionRecords(
+        qint64& afterRowId, int limit);
+    //! Save several inbound megolm sessions in a single transaction
+    void saveMegolmSessions(std::vector<MegolmSessionRecord> records);
+    //! \brief Record the event decrypted with a given megolm message index
+    //!
+    //! The record becomes visible to groupSessionIndexRecord() immediately;
+    //! writing it to the database is deferred so that records added while
+    //! processing a batch of events are committed in a single transaction.
+    //! \sa flushGroupSessionIndexRecords
     void addGroupSessionIndexRecord(const QString& roomId,
                                     const QString& sessionId, uint32_t index,
                                     const QString& eventId, qint64 ts);
+    //! \brief Find the event decrypted with a given megolm message index
+    //!
+    //! Records for a given session are loaded from the database on the first
+    //! call for that session and served from memory afterwards, as long as
+    //! the session is among the GroupSessionIndexCacheSize most recently
+    //! used ones.
     std::pair<QString, qint64> groupSessionIndexRecord(const QString& roomId,
                                                        const QString& sessionId,
                                                        qint64 index);
+    //! Commit group session index records that are not yet in the database
+    void flushGroupSessionIndexRecords();
     void clearRoomData(const QString& roomId);
+    //! \brief Load ids of the room events waiting for megolm sessions
+    //!
+    //! \return pairs of session and event ids, in the order of adding them
+    std::vector<std::pair<QString, QString>> loadPendingDecryptions(
+        const QString& roomId);
+    //! \brief Update the events waiting for megolm sessions in the room
+    //!
+    //! \p added contains pairs of session and event ids; \p removedEventIds
+    //! must not overlap with the events in \p added.
+    void updatePendingDecryptions(
+        const QString& roomId,
+        std::vector<std::pair<QString, QString>> added,
+        QStringList removedEventIds);
+    //! \brief Update the time an olm session was last used to decrypt a message
+    //!
+    //! Like group session index records, the timestamps are written to the
+    //! database in batches, only the latest timestamp for each session.
     void setOlmSessionLastReceived(const QString& sessionId,
                                    const QDateTime& timestamp);
+    //! Commit olm session timestamps that are not yet in the database
+    void flushOlmSessionTimestamps();
     QOlmOutboundGroupSessionPtr loadCurrentOutboundMegolmSession(
         const QString& roomId, const PicklingMode& picklingMode);
     void saveCurrentOutboundMegolmSession(
@@ -58,6 +190,24 @@ public:
     void updateOlmSession(const QString& senderKey, const QString& sessionId,
                           const QByteArray& pickle);
 
+    //! Changes to the device lists, to be persisted with updateDevicesList()
+    struct DevicesListChanges {
+        QSet<QString> addedTrackedUsers {};
+        QSet<QString> removedTrackedUsers {};
+        QSet<QString> addedOutdatedUsers {};
+        QSet<QString> removedOutdatedUsers {};
+        //! Devices with new or changed keys
+        QVector<DeviceKeys> changedDevices {};
+        //! Devices to forget, as user id -> device id
+        QMultiHash<QString, QString> removedDevices {};
+    };
+    //! \brief Persist changes to the tracked users and their devices
+    //!
+    //! Only the rows affected by \p changes are written, in a single
+    //! transaction; devices of users that are no more tracked are removed
+    //! along with those users.
+    void updateDevicesList(const DevicesListChanges& changes);
+
     // Returns a map UserId -> [DeviceId] that have not received key yet
     QMultiHash<QString, QString> devicesWithoutKey(const QString& roomId, QMultiHash<QString, QString> devices,
         const QString& sessionId);
@@ -72,7 +222,61 @@ private:
     void migrateTo2();
     void migrateTo3();
     void migrateTo4();
+    void migrateTo5();
+    void migrateTo6();
+    void migrateTo7();
+    void migrateTo8();
+
+    class Worker;
+    //! \brief Queue a task for execution on the database thread
+    //!
+    //! \p tables should list all the tables the task writes to, so that
+    //! synchronous reads from other tables don't have to wait for it.
+    void post(QStringList tables, std::function<void(Worker&)> task);
+    void postRead(std::function<void(QSqlDatabase)> readTask);
+    //! \brief Wait until the writes to \p tables queued so far are executed
+    //!
+    //! If \p tables is empty, wait for all queued writes.
+    void waitForPendingWrites(const QStringList& tables = {});
+    //! The tables a query reads from, as found in its text
+    QStringList queryTables(const QString& queryString);
+    //! Release the statements of cached queries, along with their snapshot
+    void finishCachedQueries();
+    void recordSyncExecution(const QElapsedTimer& et);
+
+    using GroupSessionIndex = QHash<uint32_t, std::pair<QString, qint64>>;
+    GroupSessionIndex& groupSessionIndex(const QString& roomId,
+                                         const QString& sessionId);
+
+    struct GroupSessionIndexRecord {
+        QString roomId;
+        QString sessionId;
+        uint32_t index;
+        QString eventId;
+        qint64 ts;
+    };
 
     QString m_matrixId;
+    UnorderedMap<QString, QSqlQuery> m_preparedQueries;
+    QHash<QString, QStringList> m_queryTables;
+    //! Finishes cached queries when control returns to the event loop
+    QTimer m_finishQueriesTimer;
+    QThread m_thread;
+    Worker* m_worker = nullptr;
+    QAtomicInt m_pendingTasks;
+    //! Guards m_pendingWrites, updated from both threads
+    QMutex m_pendingWritesLock;
+    //! The numbers of queued tasks writing to each table
+    QHash<QString, int> m_pendingWrites;
+    std::shared_ptr<Metrics> m_metrics;
+    static constexpr int GroupSessionIndexCacheSize = 500;
+    //! Indices of recently used megolm sessions, keyed by room and session ids
+    QCache<QPair<QString, QString>, GroupSessionIndex> m_groupSessionIndices {
+        GroupSessionIndexCacheSize
+    };
+    std::vector<GroupSessionIndexRecord> m_pendingIndexRecords;
+    QHash<QString, QDateTime> m_pendingOlmSessionTimestamps;
+    //! Flushes group session index records and olm session timestamps
+    QTimer m_flushTimer;
 };
 }
@@ -0,0 +1,448 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "keyexport.h"
+
+#include "e2ee/e2ee.h"
+#include "e2ee/qolmutils.h"
+#include "events/event.h"
+#include "logging.h"
+
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+
+#include <openssl/evp.h>
+
+using namespace Quotient;
+
+namespace {
+const QByteArray ExportHeader = "-----BEGIN MEGOLM SESSION DATA-----";
+const QByteArray ExportFooter = "-----END MEGOLM SESSION DATA-----";
+constexpr char ExportVersion = 1;
+constexpr int SaltSize = 16;
+constexpr int IvSize = 16;
+constexpr int KeySize = 32;
+constexpr int MacSize = 32;
+//! The size of the version, salt, IV and rounds preceding the ciphertext
+constexpr int PrologueSize = 1 + SaltSize + IvSize + 4;
+//! Base64 lines are 96 characters long, encoding 72 bytes each
+constexpr int BytesPerLine = 72;
+constexpr qint64 ReadChunkSize = 64 * 1024;
+//! \brief The most PBKDF2 rounds accepted
+//!
+//! The number comes from the file; without a limit, a crafted export would
+//! keep the importing thread busy for hours. This is 20 times the default.
+constexpr quint32 MaxRounds = 10'000'000;
+
+using CipherCtxPtr =
+    std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)>;
+using MdCtxPtr = std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)>;
+using PKeyPtr = std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>;
+
+const auto* asUnsigned(const QByteArray& bytes)
+{
+    return reinterpret_cast<const unsigned char*>(bytes.constData());
+}
+
+//! Derive the AES key followed by the HMAC key from the passphrase
+QByteArray deriveKeys(const QString& passphrase, const QByteArray& salt,
+                      int rounds)
+{
+    const auto pass = passphrase.toUtf8();
+    QByteArray keys(2 * KeySize, '\0');
+    if (PKCS5_PBKDF2_HMAC(pass.constData(), pass.size(), asUnsigned(salt),
+                          salt.size(), rounds, EVP_sha512(), keys.size(),
+                          reinterpret_cast<unsigned char*>(keys.data()))
+        != 1) {
+        qCWarning(E2EE) << "Failed to derive keys for the key export";
+        return {};
+    }
+    return keys;
+}
+
+//! AES-256-CTR and HMAC-SHA256 over the stream, as the export format needs
+struct StreamCrypto {
+    CipherCtxPtr cipher { EVP_CIPHER_CTX_new(), &EVP_CIPHER_CTX_free };
+    MdCtxPtr mac { EVP_MD_CTX_new(), &EVP_MD_CTX_free };
+    PKeyPtr macKey { nullptr, &EVP_PKEY_free };
+
+    bool init(const QByteArray& keys, const QByteArray& iv, bool encrypt)
+    {
+        macKey.reset(EVP_PKEY_new_mac_key(EVP_PKEY_HMAC, nullptr,
+                                          asUnsigned(keys) + KeySize,
+                                          KeySize));
+        return macKey
+               && EVP_CipherInit_ex(cipher.get(), EVP_aes_256_ctr(), nullptr,
+                                    asUnsigned(keys), asUnsigned(iv),
+                                    encrypt ? 1 : 0)
+                      == 1
+               && EVP_DigestSignInit(mac.get(), nullptr, EVP_sha256(),
+                                     nullptr, macKey.get())
+                      == 1;
+    }
+    QByteArray transform(const QByteArray& input)
+    {
+        QByteArray output(input.size(), '\0');
+        int length = 0;
+        if (EVP_CipherUpdate(cipher.get(),
+                             reinterpret_cast<unsigned char*>(output.data()),
+                             &length, asUnsigned(input), input.size())
+            != 1)
+            return {};
+        output.resize(length);
+        return output;
+    }
+    bool addToMac(const QByteArray& data)
+    {
+        return EVP_DigestSignUpdate(mac.get(), data.constData(),
+                                    size_t(data.size()))
+               == 1;
+    }
+    QByteArray macResult()
+    {
+        QByteArray result(MacSize, '\0');
+        auto length = size_t(result.size());
+        if (EVP_DigestSignFinal(mac.get(),
+                                reinterpret_cast<unsigned char*>(result.data()),
+                                &length)
+            != 1)
+            return {};
+        return result;
+    }
+};
+} // namespace
+
+class KeyExportWriter::Private {
+public:
+    explicit Private(QIODevice* device) : device(device) {}
+
+    QIODevice* device;
+    StreamCrypto crypto {};
+    //! Bytes not yet written out as a complete base64 line
+    QByteArray pendingBytes {};
+    bool firstSession = true;
+    bool failed = false;
+
+    void writeBytes(const QByteArray& bytes, bool addToMac = true)
+    {
+        if (failed)
+            return;
+        if (addToMac && !crypto.addToMac(bytes)) {
+            failed = true;
+            return;
+        }
+        pendingBytes += bytes;
+        int written = 0;
+        for (; pendingBytes.size() - written >= BytesPerLine;
+             written += BytesPerLine)
+            writeLine(pendingBytes.mid(written, BytesPerLine).toBase64());
+        pendingBytes.remove(0, written);
+    }
+    void writeLine(const QByteArray& line)
+    {
+        if (device->write(line + '\n') != line.size() + 1)
+            failed = true;
+    }
+    void encryptAndWrite(const QByteArray& plainText)
+    {
+        const auto cipherText = crypto.transform(plainText);
+        if (cipherText.size() != plainText.size())
+            failed = true;
+        writeBytes(cipherText);
+    }
+};
+
+KeyExportWriter::KeyExportWriter(QIODevice* device, const QString& passphrase,
+                                 int rounds)
+    : d(makeImpl<Private>(device))
+{
+    const auto salt = getRandom(SaltSize);
+    auto iv = getRandom(IvSize);
+    iv[8] = char(iv[8] & 0x7F); // Clear bit 63 of the counter, as per the spec
+    const auto keys = deriveKeys(passphrase, salt, rounds);
+    if (keys.isEmpty() || !d->crypto.init(keys, iv, true)) {
+        d->failed = true;
+        return;
+    }
+    d->writeLine(ExportHeader);
+    QByteArray prologue;
+    prologue.reserve(PrologueSize);
+    prologue.append(ExportVersion).append(salt).append(iv);
+    for (auto shift : { 24, 16, 8, 0 })
+        prologue.append(char((quint32(rounds) >> shift) & 0xFF));
+    d->writeBytes(prologue);
+    d->encryptAndWrite("[");
+}
+
+KeyExportWriter::~KeyExportWriter() = default;
+
+bool KeyExportWriter::write(const ExportedMegolmSession& session)
+{
+    const QJsonObject json {
+        { AlgorithmKeyL, session.algorithm },
+        { "forwarding_curve25519_key_chain"_ls,
+          QJsonArray::fromStringList(session.forwardingCurve25519KeyChain) },
+        { RoomIdKeyL, session.roomId },
+        { SenderKeyKeyL, session.senderKey },
+        { "sender_claimed_keys"_ls,
+          QJsonObject { { Ed25519Key, session.senderClaimedEd25519Key } } },
+        { SessionIdKeyL, session.sessionId },
+        { "session_key"_ls, QString::fromLatin1(session.sessionKey) }
+    };
+    auto plainText = QJsonDocument(json).toJson(QJsonDocument::Compact);
+    if (!std::exchange(d->firstSession, false))
+        plainText.prepend(',');
+    d->encryptAndWrite(plainText);
+    return !d->failed;
+}
+
+bool KeyExportWriter::finish()
+{
+    d->encryptAndWrite("]");
+    if (d->failed)
+        return false;
+    const auto mac = d->crypto.macResult();
+    if (mac.isEmpty())
+        return false;
+    d->writeBytes(mac, false);
+    if (!d->pendingBytes.isEmpty())
+        d->writeLine(std::exchange(d->pendingBytes, {}).toBase64());
+    d->writeLine(ExportFooter);
+    return !d->failed;
+}
+
+class KeyExportReader::Private {
+public:
+    Private(QIODevice* device, QString passphrase)
+        : device(device), passphrase(std::move(passphrase))
+    {}
+
+    QIODevice* device;
+    QString passphrase;
+    QByteArray keys {};
+    QByteArray iv {};
+    //! The size of the ciphertext, as found by verify()
+    qint64 cipherTextSize = -1;
+    bool failed = false;
+
+    // Reading state
+    bool inArmor = false;
+    bool armorEnded = false;
+    QByteArray pendingBase64 {};
+    QByteArray pendingBytes {};
+
+    // Decryption and parsing state
+    bool decrypting = false;
+    StreamCrypto crypto {};
+    qint64 cipherTextLeft = 0;
+    QByteArray plainText {};
+    int parsePos = 0;
+    int objectStart = -1;
+    int depth = 0;
+    bool inString = false;
+    bool escaped = false;
+
+    //! Rewind the device to the start of the export
+    bool restart();
+    //! Read at least \p minSize more bytes of binary data, if there are any
+    QByteArray readBytes(qint64 minSize);
+    //! Parse the next complete object out of the decrypted plain text
+    Omittable<ExportedMegolmSession> nextSession();
+};
+
+bool KeyExportReader::Private::restart()
+{
+    inArmor = armorEnded = false;
+    pendingBase64.clear();
+    pendingBytes.clear();
+    return device->seek(0);
+}
+
+QByteArray KeyExportReader::Private::readBytes(qint64 minSize)
+{
+    while (pendingBytes.size() < minSize && !armorEnded) {
+        if (device->atEnd()) {
+            armorEnded = true;
+            break;
+        }
+        const auto line = device->readLine(ReadChunkSize).trimmed();
+        if (!inArmor) {
+            inArmor = line == ExportHeader;
+            continue;
+        }
+        if (line == ExportFooter) {
+            armorEnded = true;
+            break;
+        }
+        pendingBase64 += line;
+        // Only decode complete quadruples of base64 characters
+        const auto decodableSize = pendingBase64.size() / 4 * 4;
+        pendingBytes += QByteArray::fromBase64(pendingBase64.left(decodableSize));
+        pendingBase64.remove(0, decodableSize);
+    }
+    if (armorEnded && !pendingBase64.isEmpty())
+        pendingBytes += QByteArray::fromBase64(std::exchange(pendingBase64, {}));
+    return std::exchange(pendingBytes, {});
+}
+
+KeyExportReader::KeyExportReader(QIODevice* device, const QString& passphrase)
+    : d(makeImpl<Private>(device, passphrase))
+{}
+
+KeyExportReader::~KeyExportReader() = default;
+
+bool KeyExportReader::verify()
+{
+    if (!d->restart()) {
+        qCWarning(E2EE) << "The key export has to be read from a seekable device";
+        d->failed = true;
+        return false;
+    }
+    auto data = d->readBytes(PrologueSize + MacSize);
+    if (data.size() < PrologueSize + MacSize || data[0] != ExportVersion) {
+        qCWarning(E2EE) << "Unsupported or malformed key export";
+        d->failed = true;
+        return false;
+    }
+    const auto salt = data.mid(1, SaltSize);
+    d->iv = data.mid(1 + SaltSize, IvSize);
+    quint32 rounds = 0;
+    for (int i = 1 + SaltSize + IvSize; i < PrologueSize; ++i)
+        rounds = (rounds << 8) | quint8(data[i]);
+    if (rounds == 0 || rounds > MaxRounds) {
+        qCWarning(E2EE) << "Unsupported number of rounds in the key export:"
+                        << rounds;
+        d->failed = true;
+        return false;
+    }
+    d->keys = deriveKeys(d->passphrase, salt, int(rounds));
+    StreamCrypto crypto;
+    if (d->keys.isEmpty() || !crypto.init(d->keys, d->iv, false)) {
+        d->failed = true;
+        return false;
+    }
+
+    // Everything except the trailing MAC goes to the MAC
+    qint64 totalSize = 0;
+    while (true) {
+        data += d->readBytes(ReadChunkSize);
+        if (data.size() <= MacSize)
+            break;
+        const auto macInput = data.left(data.size() - MacSize);
+        crypto.addToMac(macInput);
+        totalSize += macInput.size();
+        data.remove(0, macInput.size());
+        if (d->armorEnded)
+            break;
+    }
+    if (data.size() != MacSize || crypto.macResult() != data) {
+        qCWarning(E2EE) << "Wrong passphrase or corrupt key export";
+        d->failed = true;
+        return false;
+    }
+    d->cipherTextSize = totalSize - PrologueSize;
+    return true;
+}
+
+Omittable<ExportedMegolmSession> KeyExportReader::Private::nextSession()
+{
+    for (; parsePos < plainText.size(); ++parsePos) {
+        const auto c = plainText[parsePos];
+        if (inString) {
+            if (escaped)
+                escaped = false;
+            else if (c == '\\')
+                escaped = true;
+            else if (c == '"')
+                inString = false;
+            continue;
+        }
+        if (c == '"')
+            inString = true;
+        else if (c == '{') {
+            if (depth++ == 0)
+                objectStart = parsePos;
+        } else if (c == '}' && depth > 0 && --depth == 0) {
+            const auto json =
+                QJsonDocument::fromJson(
+                    plainText.mid(objectStart, parsePos + 1 - objectStart))
+                    .object();
+            // Drop what's been parsed to keep the buffer small
+            plainText.remove(0, ++parsePos);
+            parsePos = 0;
+            objectStart = -1;
+            ExportedMegolmSession session {
+                json.value(AlgorithmKeyL).toString(),
+                json.value(RoomIdKeyL).toString(),
+                json.value(SenderKeyKeyL).toString(),
+                json.value("sender_claimed_keys"_ls)
+                    .toObject()
+                    .value(Ed25519Key)
+                    .toString(),
+                json.value(SessionIdKeyL).toString(),
+                json.value("session_key"_ls).toString().toLatin1(),
+                {}
+            };
+            fromJson(json.value("forwarding_curve25519_key_chain"_ls),
+                     session.forwardingCurve25519KeyChain);
+            return session;
+        }
+    }
+    // Drop separators and brackets before the object being parsed
+    const auto parsedSize = depth == 0 ? plainText.size() : objectStart;
+    plainText.remove(0, parsedSize);
+    parsePos -= parsedSize;
+    if (objectStart >= 0)
+        objectStart -= parsedSize;
+    return none;
+}
+
+std::vector<ExportedMegolmSession> KeyExportReader::read(int maxCount)
+{
+    std::vector<ExportedMegolmSession> sessions;
+    if (d->failed || d->cipherTextSize < 0)
+        return sessions;
+
+    if (!d->decrypting) {
+        // The first call after verify(): skip the prologue and set up
+        // the decryption
+        if (!d->restart()) {
+            d->failed = true;
+            return sessions;
+        }
+        const auto head = d->readBytes(PrologueSize);
+        if (head.size() < PrologueSize
+            || !d->crypto.init(d->keys, d->iv, false)) {
+            d->failed = true;
+            return sessions;
+        }
+        d->pendingBytes = head.mid(PrologueSize);
+        d->cipherTextLeft = d->cipherTextSize;
+        d->decrypting = true;
+    }
+    while (int(sessions.size()) < maxCount) {
+        if (auto session = d->nextSession()) {
+            sessions.push_back(std::move(*session));
+            continue;
+        }
+        if (d->cipherTextLeft == 0)
+            break;
+        // readBytes() may return more than asked; it continues from where
+        // it stopped, so the overshoot is carried in pendingBytes
+        auto cipherText = d->readBytes(std::min(ReadChunkSize, d->cipherTextLeft));
+        if (cipherText.size() > d->cipherTextLeft) {
+            d->pendingBytes = cipherText.mid(int(d->cipherTextLeft));
+            cipherText.truncate(int(d->cipherTextLeft));
+        }
+        if (cipherText.isEmpty()) {
+            d->failed = true;
+            break;
+        }
+        d->cipherTextLeft -= cipherText.size();
+        d->plainText += d->crypto.transform(cipherText);
+    }
+    return sessions;
+}
+
+bool KeyExportReader::hasError() const { return d->failed; }
@@ -0,0 +1,85 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "util.h"
+
+#include <QtCore/QIODevice>
+
+#include <vector>
+
+namespace Quotient {
+
+//! \brief A megolm session in the key export format
+//!
+//! \sa https://spec.matrix.org/v1.3/client-server-api/#key-export-format
+struct QUOTIENT_API ExportedMegolmSession {
+    QString algorithm;
+    QString roomId;
+    //! The Curve25519 key of the device that created the session
+    QString senderKey;
+    //! The Ed25519 key the device that created the session claims to own
+    QString senderClaimedEd25519Key;
+    QString sessionId;
+    //! The session key in the format of olm_export_inbound_group_session()
+    QByteArray sessionKey;
+    QStringList forwardingCurve25519KeyChain;
+};
+
+//! \brief Write megolm sessions in the encrypted key export format
+//!
+//! Sessions are encrypted and written to the device as they are passed to
+//! write(), so that only one of them is kept in memory at a time; finish()
+//! has to be called after the last one to complete the export.
+class QUOTIENT_API KeyExportWriter {
+public:
+    //! The number of PBKDF2 rounds used by default
+    static constexpr int DefaultRounds = 500000;
+
+    //! \brief Start writing an export to an opened \p device
+    //!
+    //! Deriving keys from \p passphrase is deliberately slow; it is done
+    //! once, in the constructor.
+    KeyExportWriter(QIODevice* device, const QString& passphrase,
+                    int rounds = DefaultRounds);
+    ~KeyExportWriter();
+
+    bool write(const ExportedMegolmSession& session);
+    //! \brief Complete the export
+    //! \return whether the whole export has been successfully written
+    bool finish();
+
+private:
+    class Private;
+    ImplPtr<Private> d;
+};
+
+//! \brief Read megolm sessions from an encrypted key export
+//!
+//! The export is read twice: verify() checks the passphrase and
+//! the integrity of the whole export, after which read() decrypts and parses
+//! sessions from the device in batches. The device, therefore, has to be
+//! opened and support seeking.
+class QUOTIENT_API KeyExportReader {
+public:
+    KeyExportReader(QIODevice* device, const QString& passphrase);
+    ~KeyExportReader();
+
+    //! \brief Check the passphrase and the integrity of the export
+    //!
+    //! This must be called, and return true, before reading sessions.
+    bool verify();
+    //! \brief Read up to \p maxCount next sessions
+    //!
+    //! Returns an empty vector once all sessions are read, or if the export
+    //! cannot be read; hasError() tells the two cases apart.
+    std::vector<ExportedMegolmSession> read(int maxCount);
+    bool hasError() const;
+
+private:
+    class Private;
+    ImplPtr<Private> d;
+};
+
+} // namespace Quotient
@@ -49,6 +49,10 @@ void QOlmAccount::createNewAccount()
 
 void QOlmAccount::unpickle(QByteArray &pickled, const PicklingMode &mode)
 {
+    if (m_account) { // Replacing the account state
+        olm_clear_account(m_account);
+        delete[](reinterpret_cast<uint8_t *>(m_account));
+    }
     m_account = olm_account(new uint8_t[olm_account_size()]);
     const QByteArray key = toKey(mode);
     const auto error = olm_unpickle_account(m_account, key.data(), key.length(), pickled.data(), pickled.size());
@@ -19,7 +19,25 @@ void _impl::EventFactoryBase::logAddingMethod(event_type_t TypeId,
                    << "chain";
 }
 
-Event::Event(Type type, const QJsonObject& json) : _type(type), _json(json)
+namespace {
+QJsonObject ownJson(const QJsonObject& json)
+{
+#if QT_VERSION < QT_VERSION_CHECK(5, 15, 0)
+    // Before Qt 5.15, objects taken from a parsed document share the binary
+    // storage of the whole document: an event staying in the timeline would
+    // keep in memory the entire /sync response (or cache file) it came from.
+    // Making a document out of the object copies it out, compacted, unless
+    // it's the root object already.
+    return QJsonDocument(json).object();
+#else
+    // Nested objects have their own storage since Qt 5.15
+    return json;
+#endif
+}
+} // namespace
+
+Event::Event(Type type, const QJsonObject& json)
+    : _type(type), _json(ownJson(json))
 {
     if (!json.contains(ContentKeyL)
         && !json.value(UnsignedKeyL).toObject().contains(RedactedCauseKeyL)) {
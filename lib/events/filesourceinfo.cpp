@@ -6,12 +6,17 @@
 
 #include "logging.h"
 
+#include <QtCore/QFile>
+
 #ifdef Quotient_E2EE_ENABLED
 #    include "e2ee/qolmutils.h"
 
+#    include <QtCore/QBuffer>
 #    include <QtCore/QCryptographicHash>
 
 #    include <openssl/evp.h>
+
+#    include <limits>
 #endif
 
 using namespace Quotient;
@@ -58,50 +63,210 @@ std::pair<EncryptedFileMetadata, QByteArray> Quotient::encryptFile(
     const QByteArray& plainText)
 {
 #ifdef Quotient_E2EE_ENABLED
-    QByteArray k = getRandom(32);
-    auto kBase64 = k.toBase64();
+    QBuffer source;
+    source.setData(plainText);
+    EncryptingFileDevice encryptor(&source);
+    if (!encryptor.open(QIODevice::ReadOnly)) {
+        qCWarning(E2EE) << "Couldn't encrypt the file:"
+                        << encryptor.errorString();
+        return {};
+    }
+    auto cipherText = encryptor.readAll();
+    return { encryptor.metadata(), cipherText };
+#else
+    return {};
+#endif
+}
+
+class EncryptingFileDevice::Private {
+public:
+    explicit Private(QIODevice* plainTextSource) : source(plainTextSource) {}
+
+    QIODevice* source;
+#ifdef Quotient_E2EE_ENABLED
+    QByteArray key = getRandom(32);
     QByteArray iv = getRandom(16);
-    JWK key = { "oct"_ls,
-                { "encrypt"_ls, "decrypt"_ls },
-                "A256CTR"_ls,
-                QString(k.toBase64())
-                    .replace(u'/', u'_')
-                    .replace(u'+', u'-')
-                    .left(kBase64.indexOf('=')),
-                true };
+    std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> ctx {
+        EVP_CIPHER_CTX_new(), &EVP_CIPHER_CTX_free
+    };
+    QCryptographicHash hash { QCryptographicHash::Sha256 };
+    //! The ciphertext is hashed in order; this is how much has been hashed
+    qint64 hashedBytes = 0;
 
-    int length;
-    auto* ctx = EVP_CIPHER_CTX_new();
-    EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), nullptr,
-                       reinterpret_cast<const unsigned char*>(k.data()),
-                       reinterpret_cast<const unsigned char*>(iv.data()));
-    const auto blockSize = EVP_CIPHER_CTX_block_size(ctx);
-    QByteArray cipherText(plainText.size() + blockSize - 1, '\0');
-    EVP_EncryptUpdate(ctx, reinterpret_cast<unsigned char*>(cipherText.data()),
-                      &length,
-                      reinterpret_cast<const unsigned char*>(plainText.data()),
-                      plainText.size());
-    EVP_EncryptFinal_ex(ctx,
-                        reinterpret_cast<unsigned char*>(cipherText.data())
-                            + length,
-                        &length);
-    EVP_CIPHER_CTX_free(ctx);
+    bool resetCipher(qint64 offset);
+    void updateHash(qint64 offset, const char* data, qint64 size);
+#endif
+};
+
+#ifdef Quotient_E2EE_ENABLED
+constexpr auto AesBlockSize = 16;
+
+bool EncryptingFileDevice::Private::resetCipher(qint64 offset)
+{
+    // In CTR mode, the counter block for a given offset is the IV incremented
+    // (as a 128-bit big-endian integer) by the number of whole blocks before
+    // that offset; this is also what OpenSSL does when advancing the counter.
+    auto counter = iv;
+    auto carry = quint64(offset / AesBlockSize);
+    for (auto i = counter.size() - 1; i >= 0 && carry > 0; --i) {
+        const auto sum = quint64(quint8(counter[i])) + (carry & 0xFF);
+        counter[i] = char(sum & 0xFF);
+        carry = (carry >> 8) + (sum >> 8);
+    }
+    if (EVP_EncryptInit_ex(ctx.get(), EVP_aes_256_ctr(), nullptr,
+                           reinterpret_cast<const unsigned char*>(key.data()),
+                           reinterpret_cast<const unsigned char*>(
+                               counter.data()))
+        != 1)
+        return false;
+
+    // Skip the part of the keystream before the offset within the block
+    if (const auto skip = int(offset % AesBlockSize); skip > 0) {
+        std::array<unsigned char, AesBlockSize> dummy {};
+        int length = 0;
+        return EVP_EncryptUpdate(ctx.get(), dummy.data(), &length,
+                                 dummy.data(), skip)
+               == 1;
+    }
+    return true;
+}
+
+void EncryptingFileDevice::Private::updateHash(qint64 offset, const char* data,
+                                               qint64 size)
+{
+    // Data read out of order (past the hashed part) is not hashed here;
+    // metadata() takes care of it if needed
+    if (offset > hashedBytes || offset + size <= hashedBytes)
+        return;
+    const auto alreadyHashed = hashedBytes - offset;
+    hash.addData(data + alreadyHashed, int(size - alreadyHashed));
+    hashedBytes = offset + size;
+}
+#endif
+
+EncryptingFileDevice::EncryptingFileDevice(const QString& fileName,
+                                           QObject* parent)
+    : EncryptingFileDevice(new QFile(fileName), parent)
+{
+    d->source->setParent(this);
+}
 
-    auto hash = QCryptographicHash::hash(cipherText, QCryptographicHash::Sha256)
-                    .toBase64();
-    auto ivBase64 = iv.toBase64();
-    EncryptedFileMetadata efm = { {},
-                           key,
-                           ivBase64.left(ivBase64.indexOf('=')),
-                           { { QStringLiteral("sha256"),
-                               hash.left(hash.indexOf('=')) } },
-                           "v2"_ls };
-    return { efm, cipherText };
+EncryptingFileDevice::EncryptingFileDevice(QIODevice* plainTextSource,
+                                           QObject* parent)
+    : QIODevice(parent), d(makeImpl<Private>(plainTextSource))
+{}
+
+EncryptingFileDevice::~EncryptingFileDevice() = default;
+
+bool EncryptingFileDevice::open(OpenMode mode)
+{
+#ifdef Quotient_E2EE_ENABLED
+    if (mode & WriteOnly) {
+        setErrorString(tr("The encrypting device is read-only"));
+        return false;
+    }
+    if (!d->source->isOpen() && !d->source->open(ReadOnly)) {
+        setErrorString(d->source->errorString());
+        return false;
+    }
+    if (d->source->isSequential() || !d->source->seek(0)
+        || !d->resetCipher(0)) {
+        setErrorString(tr("Couldn't initialise encryption of the source"));
+        return false;
+    }
+    d->hash.reset();
+    d->hashedBytes = 0;
+    // Buffering would make the position of the source out of sync with
+    // the position of this device, and gives nothing since the source is
+    // likely buffered already
+    return QIODevice::open(mode | Unbuffered);
+#else
+    setErrorString(tr("This build of libQuotient doesn't support E2EE"));
+    return false;
+#endif
+}
+
+void EncryptingFileDevice::close()
+{
+    QIODevice::close();
+    d->source->close();
+}
+
+bool EncryptingFileDevice::isSequential() const { return false; }
+
+qint64 EncryptingFileDevice::size() const { return d->source->size(); }
+
+bool EncryptingFileDevice::seek(qint64 pos)
+{
+#ifdef Quotient_E2EE_ENABLED
+    return QIODevice::seek(pos) && d->source->seek(pos) && d->resetCipher(pos);
+#else
+    return false;
+#endif
+}
+
+EncryptedFileMetadata EncryptingFileDevice::metadata()
+{
+#ifdef Quotient_E2EE_ENABLED
+    if (d->hashedBytes < size()) {
+        const auto savedPos = pos();
+        if (seek(d->hashedBytes)) {
+            QByteArray buffer(64 * 1024, Qt::Uninitialized);
+            while (d->hashedBytes < size()
+                   && read(buffer.data(), buffer.size()) > 0)
+                ;
+        }
+        seek(savedPos);
+        if (d->hashedBytes < size())
+            qCWarning(E2EE) << "Couldn't read the whole file to calculate "
+                               "the hash of encrypted data";
+    }
+    constexpr auto UnpaddedBase64 = QByteArray::OmitTrailingEquals;
+    return { {},
+             { "oct"_ls,
+               { "encrypt"_ls, "decrypt"_ls },
+               "A256CTR"_ls,
+               QString::fromLatin1(d->key.toBase64(
+                   QByteArray::Base64UrlEncoding | UnpaddedBase64)),
+               true },
+             QString::fromLatin1(d->iv.toBase64(UnpaddedBase64)),
+             { { QStringLiteral("sha256"),
+                 QString::fromLatin1(d->hash.result().toBase64(
+                     UnpaddedBase64)) } },
+             "v2"_ls };
 #else
     return {};
 #endif
 }
 
+qint64 EncryptingFileDevice::readData(char* data, qint64 maxSize)
+{
+#ifdef Quotient_E2EE_ENABLED
+    const auto offset = d->source->pos();
+    const auto bytesRead = d->source->read(
+        data, std::min(maxSize, qint64(std::numeric_limits<int>::max())));
+    if (bytesRead <= 0)
+        return bytesRead;
+
+    // CTR mode doesn't pad, and OpenSSL allows encrypting in place
+    auto* const buffer = reinterpret_cast<unsigned char*>(data);
+    int length = 0;
+    if (EVP_EncryptUpdate(d->ctx.get(), buffer, &length, buffer,
+                          int(bytesRead))
+            != 1
+        || length != bytesRead) {
+        setErrorString(tr("Encryption failed"));
+        return -1;
+    }
+    d->updateHash(offset, data, bytesRead);
+    return bytesRead;
+#else
+    return -1;
+#endif
+}
+
+qint64 EncryptingFileDevice::writeData(const char*, qint64) { return -1; }
+
 void JsonObjectConverter<EncryptedFileMetadata>::dumpTo(QJsonObject& jo,
                                                 const EncryptedFileMetadata& pod)
 {
@@ -6,6 +6,8 @@
 
 #include "converters.h"
 
+#include <QtCore/QIODevice>
+
 #include <array>
 
 namespace Quotient {
@@ -52,6 +54,51 @@ QUOTIENT_API std::pair<EncryptedFileMetadata, QByteArray> encryptFile(
 QUOTIENT_API QByteArray decryptFile(const QByteArray& ciphertext,
                                     const EncryptedFileMetadata& metadata);
 
+//! \brief A read-only device that encrypts another device's data on the fly
+//!
+//! The device produces the AES-256-CTR ciphertext of the source data, in
+//! the format used for encrypted attachments. Because CTR mode retains the size
+//! of the data, the device is random-access and has the same size as
+//! the source; this allows QNetworkAccessManager to stream it to the network
+//! without buffering the whole file and to rewind it when a request is retried.
+//! The SHA-256 hash of the ciphertext is calculated incrementally as the data
+//! is read; metadata() can be called once the data has been consumed
+//! (e.g., the upload has finished) to obtain the complete
+//! EncryptedFileMetadata (with an empty URL).
+class QUOTIENT_API EncryptingFileDevice : public QIODevice {
+    Q_OBJECT
+public:
+    //! Encrypt the contents of the local file \p fileName
+    explicit EncryptingFileDevice(const QString& fileName,
+                                  QObject* parent = nullptr);
+    //! \brief Encrypt the contents of \p plainTextSource
+    //!
+    //! The source device must be random-access and must outlive this device.
+    explicit EncryptingFileDevice(QIODevice* plainTextSource,
+                                  QObject* parent = nullptr);
+    ~EncryptingFileDevice() override;
+
+    bool open(OpenMode mode) override;
+    void close() override;
+    bool isSequential() const override;
+    qint64 size() const override;
+    bool seek(qint64 pos) override;
+
+    //! \brief Get the metadata required to decrypt the data
+    //!
+    //! If parts of the ciphertext have not been read yet, this reads them
+    //! to complete the hash; the current position is preserved.
+    EncryptedFileMetadata metadata();
+
+protected:
+    qint64 readData(char* data, qint64 maxSize) override;
+    qint64 writeData(const char* data, qint64 maxSize) override;
+
+private:
+    class Private;
+    ImplPtr<Private> d;
+};
+
 template <>
 struct QUOTIENT_API JsonObjectConverter<EncryptedFileMetadata> {
     static void dumpTo(QJsonObject& jo, const EncryptedFileMetadata& pod);
@@ -62,8 +62,19 @@ public:
 
 #ifdef Quotient_E2EE_ENABLED
     void setOriginalEvent(event_ptr_tt<RoomEvent>&& originalEvent);
-    const RoomEvent* originalEvent() { return _originalEvent.get(); }
+    const RoomEvent* originalEvent() const { return _originalEvent.get(); }
     const QJsonObject encryptedJson() const;
+    //! \brief Whether the sender of the decrypted event has been verified
+    //!
+    //! Megolm sessions received from a device over olm are tied to the user
+    //! owning that device and events claiming another sender are not
+    //! decrypted with them. Sessions imported from a key export are only
+    //! tied to a user once their device is known; until then, events
+    //! decrypted with them are not verified and their sender is only what
+    //! the event claims. This is false for events that have not been
+    //! decrypted.
+    bool isSenderVerified() const { return _senderVerified; }
+    void setSenderVerified(bool verified) { _senderVerified = verified; }
 #endif
 
 protected:
@@ -74,6 +85,7 @@ private:
 
 #ifdef Quotient_E2EE_ENABLED
     event_ptr_tt<RoomEvent> _originalEvent;
+    bool _senderVerified = false;
 #endif
 };
 using RoomEventPtr = event_ptr_tt<RoomEvent>;
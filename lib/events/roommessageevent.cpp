@@ -89,6 +89,19 @@ inline bool isReplacement(const Omittable<EventRelation>& rel)
     return rel && rel->type == EventRelation::ReplacementType;
 }
 
+inline bool isTextMsgType(MsgType msgType)
+{
+    return msgType == MsgType::Text || msgType == MsgType::Emote
+           || msgType == MsgType::Notice;
+}
+
+//! Whether content of this message type has a FileInfo part
+inline bool isUrlBasedMsgType(MsgType msgType)
+{
+    return msgType == MsgType::Image || msgType == MsgType::File
+           || msgType == MsgType::Video || msgType == MsgType::Audio;
+}
+
 } // anonymous namespace
 
 QJsonObject RoomMessageEvent::assembleContentJson(const QString& plainBody,
@@ -131,7 +144,9 @@ RoomMessageEvent::RoomMessageEvent(const QString& plainBody,
     : RoomEvent(typeId(), matrixTypeId(),
                 assembleContentJson(plainBody, jsonMsgType, content))
     , _content(content)
-{}
+{
+    std::call_once(_contentLoaded, [] {}); // The content is already there
+}
 
 RoomMessageEvent::RoomMessageEvent(const QString& plainBody, MsgType msgType,
                                    TypedBase* content)
@@ -176,30 +191,37 @@ RoomMessageEvent::RoomMessageEvent(const QString& plainBody,
 
 RoomMessageEvent::RoomMessageEvent(const QJsonObject& obj)
     : RoomEvent(typeId(), obj), _content(nullptr)
-{
-    if (isRedacted())
-        return;
-    const QJsonObject content = contentJson();
-    if (content.contains(MsgTypeKey) && content.contains(BodyKeyL)) {
-        auto msgtype = content[MsgTypeKey].toString();
-        bool msgTypeFound = false;
-        for (const auto& mt : msgTypes)
-            if (mt.matrixType == msgtype) {
-                _content.reset(mt.maker(content));
-                msgTypeFound = true;
-            }
+{}
 
-        if (!msgTypeFound) {
+TypedBase* RoomMessageEvent::loadContent() const
+{
+    std::call_once(_contentLoaded, [this] {
+        if (isRedacted())
+            return;
+        const QJsonObject content = contentJson();
+        if (!content.contains(MsgTypeKey) || !content.contains(BodyKeyL)) {
+            qCWarning(EVENTS) << "No body or msgtype in room message event";
+            qCWarning(EVENTS) << formatJson << fullJson();
+            return;
+        }
+        const auto msgtype = content[MsgTypeKey].toString();
+        const auto it = std::find_if(msgTypes.cbegin(), msgTypes.cend(),
+                                     [&msgtype](const MsgTypeDesc& mtd) {
+                                         return mtd.matrixType == msgtype;
+                                     });
+        if (it == msgTypes.cend()) {
             qCWarning(EVENTS) << "RoomMessageEvent: unknown msg_type,"
                               << " full content dump follows";
             qCWarning(EVENTS) << formatJson << content;
+            return;
         }
-    } else {
-        qCWarning(EVENTS) << "No body or msgtype in room message event";
-        qCWarning(EVENTS) << formatJson << obj;
-    }
+        _content.reset(it->maker(content));
+    });
+    return _content.data();
 }
 
+const TypedBase* RoomMessageEvent::content() const { return loadContent(); }
+
 RoomMessageEvent::MsgType RoomMessageEvent::msgtype() const
 {
     return jsonToMsgType(rawMsgtype());
@@ -219,32 +241,39 @@ QMimeType RoomMessageEvent::mimeType() const
 {
     static const auto PlainTextMimeType =
         QMimeDatabase().mimeTypeForName("text/plain");
-    return _content ? _content->type() : PlainTextMimeType;
+    const auto* c = content();
+    return c ? c->type() : PlainTextMimeType;
 }
 
 bool RoomMessageEvent::hasTextContent() const
 {
-    return !content()
-           || (msgtype() == MsgType::Text || msgtype() == MsgType::Emote
-               || msgtype() == MsgType::Notice);
+    const auto type = msgtype();
+    // Messages with unknown or no msgtype have no content object; neither do
+    // messages of other types with no body
+    return isTextMsgType(type) || type == MsgType::Unknown
+           || !contentJson().contains(BodyKeyL);
 }
 
 bool RoomMessageEvent::hasFileContent() const
 {
-    return content() && content()->fileInfo();
+    return isUrlBasedMsgType(msgtype()) && content() && content()->fileInfo();
 }
 
 bool RoomMessageEvent::hasThumbnail() const
 {
-    return content() && content()->thumbnailInfo();
+    return isUrlBasedMsgType(msgtype()) && content()
+           && content()->thumbnailInfo();
 }
 
 QString RoomMessageEvent::replacedEvent() const
 {
-    if (!content() || !hasTextContent())
+    // Only text messages can be replacements; read the relation from JSON
+    // rather than making TextContent for that
+    const auto json = contentJson();
+    if (!isTextMsgType(msgtype()) || !json.contains(BodyKeyL))
         return {};
 
-    const auto& rel = static_cast<const TextContent*>(content())->relatesTo;
+    const auto rel = fromJson<Omittable<EventRelation>>(json[RelatesToKey]);
     return isReplacement(rel) ? rel->eventId : QString();
 }
 
@@ -9,6 +9,8 @@
 #include "eventrelation.h"
 #include "roomevent.h"
 
+#include <mutex>
+
 class QFileInfo;
 
 namespace Quotient {
@@ -16,6 +18,10 @@ namespace MessageEventContent = EventContent; // Back-compatibility
 
 /**
  * The event class corresponding to m.room.message events
+ *
+ * The content object (see content()) is only made out of JSON when it is
+ * first needed; msgtype(), plainBody(), hasTextContent(), hasFileContent(),
+ * hasThumbnail() and replacedEvent() read the JSON directly when they can.
  */
 class QUOTIENT_API RoomMessageEvent : public RoomEvent {
     Q_GADGET
@@ -50,11 +56,15 @@ public:
     MsgType msgtype() const;
     QString rawMsgtype() const;
     QString plainBody() const;
-    const EventContent::TypedBase* content() const { return _content.data(); }
+    //! \brief The content object of the message, if there's one
+    //!
+    //! The content object is made on the first call; it is safe to call this
+    //! concurrently from several threads.
+    const EventContent::TypedBase* content() const;
     template <typename VisitorT>
     void editContent(VisitorT&& visitor)
     {
-        visitor(*_content);
+        visitor(*loadContent());
         editJson()[ContentKeyL] = assembleContentJson(plainBody(), rawMsgtype(),
                                                       _content.data());
     }
@@ -85,7 +95,10 @@ public:
     static QString rawMsgTypeForFile(const QFileInfo& fi);
 
 private:
-    QScopedPointer<EventContent::TypedBase> _content;
+    mutable std::once_flag _contentLoaded;
+    mutable QScopedPointer<EventContent::TypedBase> _content;
+
+    EventContent::TypedBase* loadContent() const;
 
     // FIXME: should it really be static?
     static QJsonObject assembleContentJson(const QString& plainBody,
@@ -0,0 +1,158 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "internedid.h"
+
+#include "memoryusage.h"
+#include "util.h"
+
+#include <QtCore/QReadWriteLock>
+
+using namespace Quotient;
+
+struct InternedId::Entry {
+    QString str;
+    QAtomicInt refs = 0;
+};
+
+namespace {
+//! Don't bother purging the table until it has as many entries
+constexpr size_t MinPurgeThreshold = 4096;
+
+//! \brief The table of interned strings
+//!
+//! Most lookups find strings that are already in the table, so these only
+//! take the lock for reading and don't block each other; adding entries
+//! and purging them takes the lock for writing.
+struct Table {
+    QReadWriteLock lock;
+    UnorderedMap<QString, std::unique_ptr<InternedId::Entry>> entries;
+    size_t purgeThreshold = MinPurgeThreshold;
+
+    //! \brief Find the entry for \p s and add a reference to it
+    //!
+    //! Must be called with the lock taken, for reading or writing.
+    //! \return the entry, or nullptr if \p s is not in the table
+    InternedId::Entry* refEntry(const QString& s)
+    {
+        const auto it = entries.find(s);
+        if (it == entries.end())
+            return nullptr;
+        it->second->refs.ref();
+        return it->second.get();
+    }
+
+    //! \brief Drop entries no more referred to by any handle
+    //!
+    //! Must be called with the lock taken for writing. References are only
+    //! added with the lock taken, so there's no race between this and
+    //! handles being created.
+    void purge()
+    {
+        for (auto it = entries.begin(); it != entries.end();)
+            if (it->second->refs.loadAcquire() == 0)
+                it = entries.erase(it);
+            else
+                ++it;
+        // Let the table grow twice before purging it again, to keep
+        // the amortised cost of purging constant
+        purgeThreshold = std::max(MinPurgeThreshold, 2 * entries.size());
+    }
+};
+
+Table& table()
+{
+    static Table t;
+    return t;
+}
+
+//! \brief The entry returned by InternedId::find() for strings not in
+//!        the table
+//!
+//! It is never dropped, so handles don't count references to it; this
+//! saves all threads that look up unknown ids from updating the same
+//! counter.
+InternedId::Entry absentEntry {};
+
+bool isCounted(const InternedId::Entry* e)
+{
+    return e != nullptr && e != &absentEntry;
+}
+} // namespace
+
+InternedId::InternedId(const QString& s)
+{
+    if (s.isEmpty())
+        return;
+
+    auto& t = table();
+    {
+        const QReadLocker locker(&t.lock);
+        entry = t.refEntry(s);
+    }
+    if (entry)
+        return;
+
+    // Another thread may add the same string in between; try_emplace()
+    // takes care of that
+    const QWriteLocker locker(&t.lock);
+    auto [it, inserted] = t.entries.try_emplace(s);
+    if (inserted) {
+        it->second = std::make_unique<Entry>();
+        it->second->str = it->first;
+    }
+    entry = it->second.get();
+    entry->refs.ref();
+    if (inserted && t.entries.size() >= t.purgeThreshold)
+        t.purge();
+}
+
+InternedId::InternedId(const InternedId& other) noexcept : entry(other.entry)
+{
+    if (isCounted(entry))
+        entry->refs.ref();
+}
+
+InternedId::~InternedId()
+{
+    if (isCounted(entry))
+        entry->refs.deref();
+}
+
+InternedId InternedId::find(const QString& s)
+{
+    if (s.isEmpty())
+        return {};
+
+    auto& t = table();
+    const QReadLocker locker(&t.lock);
+    auto* e = t.refEntry(s);
+    return InternedId(e ? e : &absentEntry);
+}
+
+const QString& InternedId::toString() const
+{
+    static const QString empty;
+    return entry ? entry->str : empty;
+}
+
+int InternedId::tableSize()
+{
+    auto& t = table();
+    const QReadLocker locker(&t.lock);
+    return int(t.entries.size());
+}
+
+MemoryUsage InternedId::memoryUsage()
+{
+    auto& t = table();
+    const QReadLocker locker(&t.lock);
+    // The key and Entry::str share the string data
+    qint64 bytes = MemoryUsage::nodesOf(t.entries)
+                   + qint64(t.entries.size() * sizeof(Entry));
+    for (const auto& [s, _] : t.entries)
+        bytes += MemoryUsage::sizeOf(s);
+    MemoryUsage result;
+    result.add(QStringLiteral("internedIds"), bytes);
+    return result;
+}
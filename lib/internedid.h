@@ -0,0 +1,85 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "quotient_export.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QString>
+
+#include <utility>
+
+namespace Quotient {
+class MemoryUsage;
+
+//! \brief A small handle to a process-wide copy of an identifier string
+//!
+//! Matrix identifiers (event ids, user ids, room ids) recur a lot across
+//! the library indices: the same user id is a key in read receipts, an entry
+//! in the read users of an event and so on. InternedId stores the string
+//! once in a process-wide table and refers to it by a pointer; copying,
+//! comparing and hashing handles only deals with that pointer. Use it for
+//! keys of internal containers and convert from/to QString at the API
+//! boundary.
+//!
+//! Interning a string takes a (thread-safe) lookup in the table; lookups of
+//! strings already in the table don't block each other. Strings no more
+//! referred to by any handle are dropped from the table from time to time.
+//! An empty string is represented by a null handle.
+class QUOTIENT_API InternedId {
+public:
+    InternedId() = default;
+    //! Intern \p s, adding it to the table if it's not there yet
+    explicit InternedId(const QString& s);
+    InternedId(const InternedId& other) noexcept;
+    InternedId(InternedId&& other) noexcept
+        : entry(std::exchange(other.entry, nullptr))
+    {}
+    InternedId& operator=(InternedId other) noexcept
+    {
+        std::swap(entry, other.entry);
+        return *this;
+    }
+    ~InternedId();
+
+    //! \brief Find an already interned string, without interning it
+    //!
+    //! Use this to look up containers keyed by InternedId: unlike the
+    //! constructor, it doesn't add anything to the table. If \p s has not
+    //! been interned, the returned handle converts to an empty string and
+    //! is not equal to the null handle or any handle made by the constructor,
+    //! so it's not found in containers; all such handles, returned for
+    //! different strings, are equal to each other though.
+    static InternedId find(const QString& s);
+
+    bool isNull() const { return entry == nullptr; }
+    const QString& toString() const;
+    operator const QString&() const { return toString(); } // NOLINT
+
+    friend bool operator==(const InternedId& lhs, const InternedId& rhs)
+    {
+        return lhs.entry == rhs.entry;
+    }
+    friend bool operator!=(const InternedId& lhs, const InternedId& rhs)
+    {
+        return lhs.entry != rhs.entry;
+    }
+    friend auto qHash(const InternedId& id, decltype(qHash(0)) seed = 0)
+    {
+        return qHash(quintptr(id.entry), seed);
+    }
+
+    //! The number of strings currently in the table
+    static int tableSize();
+    //! The heap memory taken by the table, including the strings
+    static MemoryUsage memoryUsage();
+
+    struct Entry;
+
+private:
+    Entry* entry = nullptr;
+
+    explicit InternedId(Entry* e) : entry(e) {}
+};
+} // namespace Quotient
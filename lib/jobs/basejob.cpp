@@ -5,11 +5,15 @@
 #include "basejob.h"
 
 #include "connectiondata.h"
+#include "metrics.h"
 
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QRegularExpression>
 #include <QtCore/QTimer>
 #include <QtCore/QMetaEnum>
 #include <QtCore/QPointer>
+#include <QtCore/QRunnable>
+#include <QtCore/QThreadPool>
 #include <QtNetwork/QNetworkAccessManager>
 #include <QtNetwork/QNetworkReply>
 #include <QtNetwork/QNetworkRequest>
@@ -100,6 +104,21 @@ public:
      */
     Status parseJson();
 
+    /*! \brief Parse the response byte array into JSON on a worker thread
+     *
+     * Does the same as parseJson() but in a thread from the global thread pool,
+     * calling BaseJob::gotJsonReply() on the job's thread once done.
+     */
+    void parseJsonInBackground(BaseJob* job);
+
+    //! Drop the raw response, except a sample for rawDataSample()
+    void releaseRawResponse();
+
+    //! Responses bigger than this are parsed on a worker thread
+    static constexpr auto BackgroundParsingThreshold = 256 * 1024;
+    //! How much of a successfully parsed response is kept in rawResponse
+    static constexpr auto RawResponseSampleSize = 65535;
+
     ConnectionData* connection = nullptr;
 
     // Contents for the network request
@@ -125,6 +144,8 @@ public:
 
     Status status = Unprepared;
     QByteArray rawResponse;
+    //! The size of the whole response, even if rawResponse is trimmed
+    qsizetype rawResponseSize = 0;
     /// Contains a null document in case of non-JSON body (for a successful
     /// or unsuccessful response); a document with QJsonObject or QJsonArray
     /// in case of a successful response with JSON payload, as per the API
@@ -137,6 +158,8 @@ public:
 
     QTimer timer;
     QTimer retryTimer;
+    //! Measures the time from sending the request to getting the reply
+    QElapsedTimer requestTimer;
 
     static constexpr std::array<const JobTimeoutConfig, 3> errorStrategy {
         { { 90s, 5s }, { 90s, 10s }, { 120s, 30s } }
@@ -214,6 +237,19 @@ QUrl BaseJob::requestUrl() const { return d->reply ? d->reply->url() : QUrl(); }
 
 bool BaseJob::isBackground() const { return d->inBackground; }
 
+QString BaseJob::metricsLabel() const
+{
+    auto label = objectName();
+    const auto dashPos = label.lastIndexOf(u'-');
+    if (dashPos > 0) {
+        bool isNumber = false;
+        label.mid(dashPos + 1).toULongLong(&isNumber);
+        if (isNumber)
+            label.truncate(dashPos);
+    }
+    return label;
+}
+
 const BaseJob::headers_t& BaseJob::requestHeaders() const
 {
     return d->requestHeaders;
@@ -380,12 +416,10 @@ void BaseJob::sendRequest()
     qCDebug(d->logCat).noquote() << "Making" << d->dumpRequest();
     d->needsToken |= d->connection->needsToken(objectName());
     emit aboutToSendRequest();
+    d->requestTimer.start();
     d->sendRequest();
     Q_ASSERT(d->reply);
-    connect(reply(), &QNetworkReply::finished, this, [this] {
-        gotReply();
-        finishJob();
-    });
+    connect(reply(), &QNetworkReply::finished, this, &BaseJob::gotReply);
     if (d->reply->isRunning()) {
         connect(reply(), &QNetworkReply::metaDataChanged, this,
                 [this] { checkReply(reply()); });
@@ -411,30 +445,111 @@ BaseJob::Status BaseJob::Private::parseJson()
              error.errorString() };
 }
 
+//! \brief A thread pool task parsing JSON for a job
+//!
+//! The task is also a QObject living in the job's thread; this allows
+//! to safely deliver the result even if the job is gone by then (the task
+//! only accesses the job from its own thread, through QPointer).
+class BaseJob::JsonParsingTask : public QObject, public QRunnable {
+public:
+    JsonParsingTask(QByteArray data, BaseJob* job)
+        : data(std::move(data)), job(job)
+    {
+        setAutoDelete(false); // Deleted in the job's thread, see run()
+    }
+
+    void run() override
+    {
+        QJsonParseError error { 0, QJsonParseError::MissingObject };
+        auto json = QJsonDocument::fromJson(data, &error);
+        data.clear();
+        QMetaObject::invokeMethod(
+            this,
+            [this, json = std::move(json), error] {
+                if (job && job->status().code != BaseJob::Abandoned)
+                    job->gotJsonReply(json, error);
+                deleteLater();
+            },
+            Qt::QueuedConnection);
+    }
+
+private:
+    QByteArray data;
+    QPointer<BaseJob> job;
+};
+
+void BaseJob::Private::parseJsonInBackground(BaseJob* job)
+{
+    QThreadPool::globalInstance()->start(
+        new BaseJob::JsonParsingTask(rawResponse, job));
+}
+
+void BaseJob::Private::releaseRawResponse()
+{
+    if (rawResponse.size() > RawResponseSampleSize)
+        rawResponse = rawResponse.left(RawResponseSampleSize);
+}
+
 void BaseJob::gotReply()
 {
+    d->connection->metrics().observe(
+        MetricNames::JobSeconds, d->requestTimer,
+        { { QStringLiteral("job"), metricsLabel() } });
     // Defer actually updating the status until it's finalised
     auto statusSoFar = checkReply(reply());
     if (statusSoFar.good()
         && d->expectedContentTypes == QByteArrayList { "application/json" }) //
     {
         d->rawResponse = reply()->readAll();
-        statusSoFar = d->parseJson();
-        if (statusSoFar.good() && !expectedKeys().empty()) {
-            const auto& responseObject = jsonData();
-            QByteArrayList missingKeys;
-            for (const auto& k: expectedKeys())
-                if (!responseObject.contains(k))
-                    missingKeys.push_back(k);
-            if (!missingKeys.empty())
-                statusSoFar = { IncorrectResponse,
-                                tr("Required JSON keys missing: ")
-                                    + missingKeys.join() };
-        }
-        setStatus(statusSoFar);
-        if (!status().good()) // Bad JSON in a "good" reply: bail out
+        d->rawResponseSize = d->rawResponse.size();
+        if (d->rawResponseSize >= Private::BackgroundParsingThreshold) {
+            // Keep the event loop responsive while big payloads (/sync, room
+            // members, key queries etc.) are being parsed; the job continues
+            // in gotJsonReply() once the parsing is done.
+            d->timer.stop();
+            qCDebug(d->logCat) << this << "parsing" << d->rawResponseSize
+                               << "bytes in background";
+            d->parseJsonInBackground(this);
             return;
+        }
+        processJsonReply(d->parseJson());
+        return;
+    }
+    processReply(statusSoFar);
+}
+
+void BaseJob::gotJsonReply(const QJsonDocument& json,
+                           const QJsonParseError& parseError)
+{
+    d->jsonResponse = json;
+    processJsonReply({ parseError.error == QJsonParseError::NoError
+                           ? NoError
+                           : IncorrectResponse,
+                       parseError.errorString() });
+}
+
+void BaseJob::processJsonReply(Status statusSoFar)
+{
+    if (statusSoFar.good() && !expectedKeys().empty()) {
+        const auto& responseObject = jsonData();
+        QByteArrayList missingKeys;
+        for (const auto& k: expectedKeys())
+            if (!responseObject.contains(k))
+                missingKeys.push_back(k);
+        if (!missingKeys.empty())
+            statusSoFar = { IncorrectResponse, tr("Required JSON keys missing: ")
+                                                   + missingKeys.join() };
     }
+    setStatus(statusSoFar);
+    if (!status().good()) { // Bad JSON in a "good" reply: bail out
+        finishJob();
+        return;
+    }
+    processReply(statusSoFar);
+}
+
+void BaseJob::processReply(const Status& statusSoFar)
+{
     // If the endpoint expects anything else than just (API-related) JSON
     // reply()->readAll() is not performed and the whole reply processing
     // is left to derived job classes: they may read it piecemeal or customise
@@ -442,13 +557,18 @@ void BaseJob::gotReply()
     // (see, e.g., DownloadFileJob).
     if (statusSoFar.good()) {
         setStatus(prepareResult());
-        return;
+        // The JSON is already parsed and stored in the job; keep only
+        // a sample of the raw response for diagnostic purposes
+        if (status().good())
+            d->releaseRawResponse();
+    } else {
+        d->rawResponse = reply()->readAll();
+        d->rawResponseSize = d->rawResponse.size();
+        qCDebug(d->logCat).noquote()
+            << "Error body (truncated if long):" << rawDataSample(500);
+        setStatus(prepareError(statusSoFar));
     }
-
-    d->rawResponse = reply()->readAll();
-    qCDebug(d->logCat).noquote()
-        << "Error body (truncated if long):" << rawDataSample(500);
-    setStatus(prepareError(statusSoFar));
+    finishJob();
 }
 
 bool checkContentType(const QByteArray& type, const QByteArrayList& patterns)
@@ -594,6 +714,9 @@ void BaseJob::finishJob()
     stop();
     switch(error()) {
     case TooManyRequests:
+        d->connection->metrics().increment(
+            MetricNames::JobsRateLimited, 1,
+            { { QStringLiteral("job"), metricsLabel() } });
         emit rateLimited();
         d->connection->submit(this);
         return;
@@ -632,6 +755,12 @@ void BaseJob::finishJob()
 
     Q_ASSERT(status().code != Pending);
 
+    // The connection is null if the job failed to initiate
+    if (error() && d->connection)
+        d->connection->metrics().increment(
+            MetricNames::JobFailures, 1,
+            { { QStringLiteral("job"), metricsLabel() } });
+
     // Notify those interested in any completion of the job including abandon()
     emit finished(this);
 
@@ -696,12 +825,12 @@ const QByteArray& BaseJob::rawData() const { return d->rawResponse; }
 QString BaseJob::rawDataSample(int bytesAtMost) const
 {
     auto data = rawData(bytesAtMost);
-    Q_ASSERT(data.size() <= d->rawResponse.size());
-    return data.size() == d->rawResponse.size()
+    Q_ASSERT(data.size() <= d->rawResponseSize);
+    return data.size() == d->rawResponseSize
                ? data
                : data + tr("...(truncated, %Ln bytes in total)",
                            "Comes after trimmed raw network response",
-                           d->rawResponse.size());
+                           int(d->rawResponseSize));
 }
 
 QJsonObject BaseJob::jsonData() const
@@ -146,6 +146,13 @@ public:
     QUrl requestUrl() const;
     bool isBackground() const;
 
+    //! \brief The value of the "job" label in metrics reported by this job
+    //!
+    //! This is objectName() with a per-instance numeric suffix (as in
+    //! SyncJob-42) stripped, so that all jobs of one kind report into
+    //! the same metrics series.
+    QString metricsLabel() const;
+
     /** Current status of the job */
     Status status() const;
 
@@ -160,7 +167,13 @@ public:
      */
     QByteArray rawData(int bytesAtMost) const;
 
-    /*! Access the whole response body as received from the server */
+    /*! \brief Access the response body as received from the server
+     *
+     * Once a JSON response has been successfully parsed and processed,
+     * only its first 64 kilobytes are retained, to save memory on big
+     * payloads such as /sync; use jsonData() or jsonItems() to access
+     * the response contents.
+     */
     const QByteArray& rawData() const;
 
     /** Get UI-friendly sample of raw data
@@ -463,6 +476,11 @@ private Q_SLOTS:
     friend class ConnectionData; // to provide access to sendRequest()
 
 private:
+    class JsonParsingTask;
+    void gotJsonReply(const QJsonDocument& json,
+                      const QJsonParseError& parseError);
+    void processJsonReply(Status statusSoFar);
+    void processReply(const Status& statusSoFar);
     void stop();
     void finishJob();
 
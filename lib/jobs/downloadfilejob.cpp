@@ -4,9 +4,12 @@
 #include "downloadfilejob.h"
 
 #include <QtCore/QFile>
+#include <QtCore/QSaveFile>
 #include <QtCore/QTemporaryFile>
 #include <QtNetwork/QNetworkReply>
 
+#include <algorithm>
+
 #ifdef Quotient_E2EE_ENABLED
 #    include "events/filesourceinfo.h"
 
@@ -14,6 +17,40 @@
 #endif
 
 using namespace Quotient;
+
+namespace {
+struct ContentRange {
+    qint64 first = -1;
+    qint64 last = -1;
+    qint64 total = -1; //< -1 if the total size is unknown (`*`)
+
+    bool isValid() const { return first >= 0 && last >= first; }
+};
+
+//! Parse the value of a Content-Range header, e.g. `bytes 0-499/1234`
+ContentRange parseContentRange(const QByteArray& headerValue)
+{
+    static constexpr auto Unit = "bytes ";
+    const auto dashPos = headerValue.indexOf('-');
+    const auto slashPos = headerValue.indexOf('/');
+    if (!headerValue.startsWith(Unit) || dashPos == -1 || slashPos < dashPos)
+        return {};
+
+    const auto unitLength = int(qstrlen(Unit));
+    bool firstOk = false, lastOk = false, totalOk = false;
+    ContentRange result {
+        headerValue.mid(unitLength, dashPos - unitLength).toLongLong(&firstOk),
+        headerValue.mid(dashPos + 1, slashPos - dashPos - 1).toLongLong(&lastOk),
+        headerValue.mid(slashPos + 1).toLongLong(&totalOk)
+    };
+    if (!firstOk || !lastOk)
+        return {};
+    if (!totalOk)
+        result.total = -1;
+    return result;
+}
+} // namespace
+
 class DownloadFileJob::Private {
 public:
     Private() : tempFile(new QTemporaryFile()) {}
@@ -21,10 +58,77 @@ public:
     explicit Private(const QString& localFilename)
         : targetFile(new QFile(localFilename))
         , tempFile(new QFile(targetFile->fileName() + ".qtntdownload"))
+        , progressFileName(tempFile->fileName() + ".progress")
     {}
 
     QScopedPointer<QFile> targetFile;
     QScopedPointer<QFile> tempFile;
+    //! \brief The file bytesReceived is saved to
+    //!
+    //! The size of tempFile can't tell how much of it is valid, since it
+    //! is preallocated; and it is only trimmed if the job fails, not if
+    //! the application is killed or crashes. Empty if there's no target
+    //! file, as downloads to a temporary file are never resumed.
+    QString progressFileName;
+    //! The number of bytes at the beginning of tempFile known to be valid
+    qint64 bytesReceived = 0;
+    //! The value of bytesReceived last saved to progressFileName
+    qint64 savedBytesReceived = 0;
+    //! The size of the whole content as reported by the server, if known
+    qint64 expectedSize = -1;
+
+    //! Save progress after receiving at least this many bytes
+    static constexpr qint64 ProgressSaveInterval = 1024 * 1024;
+
+    void writeChunk(const QByteArray& bytes)
+    {
+        const auto written = tempFile->write(bytes);
+        if (written > 0)
+            bytesReceived += written;
+        if (bytesReceived - savedBytesReceived >= ProgressSaveInterval)
+            saveProgress();
+    }
+
+    //! Continue writing to tempFile from \p offset on
+    void rewind(qint64 offset)
+    {
+        bytesReceived = offset;
+        tempFile->seek(offset);
+        saveProgress();
+    }
+
+    void saveProgress()
+    {
+        if (progressFileName.isEmpty() || bytesReceived == savedBytesReceived)
+            return;
+        // Never let the saved value get ahead of what's in tempFile
+        tempFile->flush();
+        QSaveFile progressFile(progressFileName);
+        if (progressFile.open(QIODevice::WriteOnly)
+            && progressFile.write(QByteArray::number(bytesReceived)) != -1
+            && progressFile.commit())
+            savedBytesReceived = bytesReceived;
+        else
+            qCWarning(JOBS) << "Couldn't save the download progress to"
+                            << progressFileName;
+    }
+
+    //! The number of valid bytes in a leftover tempFile, 0 if unknown
+    qint64 loadProgress() const
+    {
+        QFile progressFile(progressFileName);
+        if (!progressFile.open(QIODevice::ReadOnly))
+            return 0;
+        bool ok = false;
+        const auto savedValue = progressFile.readAll().toLongLong(&ok);
+        return ok ? std::clamp(savedValue, qint64(0), tempFile->size()) : 0;
+    }
+
+    void removeProgress()
+    {
+        if (!progressFileName.isEmpty())
+            QFile::remove(progressFileName);
+    }
 
 #ifdef Quotient_E2EE_ENABLED
     Omittable<EncryptedFileMetadata> encryptedFileMetadata;
@@ -45,6 +149,7 @@ DownloadFileJob::DownloadFileJob(const QString& serverName,
                                 : makeImpl<Private>(localFilename))
 {
     setObjectName(QStringLiteral("DownloadFileJob"));
+    setupResumption();
 }
 
 #ifdef Quotient_E2EE_ENABLED
@@ -57,6 +162,7 @@ DownloadFileJob::DownloadFileJob(const QString& serverName,
                                 : makeImpl<Private>(localFilename))
 {
     setObjectName(QStringLiteral("DownloadFileJob"));
+    setupResumption();
     d->encryptedFileMetadata = file;
 }
 #endif
@@ -65,6 +171,34 @@ QString DownloadFileJob::targetFileName() const
     return (d->targetFile ? d->targetFile : d->tempFile)->fileName();
 }
 
+void DownloadFileJob::setupResumption()
+{
+    // Every attempt, including retries, continues from where the previous
+    // one has stopped
+    connect(this, &BaseJob::aboutToSendRequest, this, [this] {
+        auto headers = requestHeaders();
+        if (d->bytesReceived > 0) {
+            qCDebug(JOBS) << "Resuming the download to"
+                          << d->tempFile->fileName() << "from byte"
+                          << d->bytesReceived;
+            headers.insert("Range", "bytes="
+                                        + QByteArray::number(d->bytesReceived)
+                                        + '-');
+        } else
+            headers.remove("Range");
+        setRequestHeaders(headers);
+        d->tempFile->seek(d->bytesReceived);
+    });
+    // Keep what's been downloaded for the next job with the same target file,
+    // making sure that the temporary file has no preallocated tail
+    connect(this, &BaseJob::failure, this, [this] {
+        if (d->tempFile->isOpen()) {
+            d->tempFile->resize(d->bytesReceived);
+            d->saveProgress();
+        }
+    });
+}
+
 void DownloadFileJob::doPrepare()
 {
     if (d->targetFile && !d->targetFile->isReadable()
@@ -80,6 +214,10 @@ void DownloadFileJob::doPrepare()
         setStatus(FileError, "Could not open the temporary download file");
         return;
     }
+    // A leftover from an interrupted download with the same target file
+    // can be resumed; a temporary file without a target is always new
+    if (d->targetFile)
+        d->bytesReceived = d->savedBytesReceived = d->loadProgress();
     qCDebug(JOBS) << "Downloading to" << d->tempFile->fileName();
 }
 
@@ -88,16 +226,38 @@ void DownloadFileJob::onSentRequest(QNetworkReply* reply)
     connect(reply, &QNetworkReply::metaDataChanged, this, [this, reply] {
         if (!status().good())
             return;
-        auto sizeHeader = reply->header(QNetworkRequest::ContentLengthHeader);
-        if (sizeHeader.isValid()) {
-            auto targetSize = sizeHeader.toLongLong();
-            if (targetSize != -1)
-                if (!d->tempFile->resize(targetSize)) {
-                    qCWarning(JOBS) << "Failed to allocate" << targetSize
-                                    << "bytes for" << d->tempFile->fileName();
-                    setStatus(FileError,
-                              "Could not reserve disk space for download");
-                }
+        const auto httpCode =
+            reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        if (httpCode == 206) {
+            const auto range =
+                parseContentRange(reply->rawHeader("Content-Range"));
+            if (!range.isValid() || range.first > d->bytesReceived) {
+                qCWarning(JOBS) << "Unexpected range in the response:"
+                                << reply->rawHeader("Content-Range");
+                d->rewind(0); // Start over on the next attempt
+                setStatus(IncorrectResponse,
+                          "Unexpected content range in the response");
+                return;
+            }
+            d->rewind(range.first);
+            d->expectedSize = range.total;
+        } else if (httpCode / 100 == 2) {
+            if (d->bytesReceived > 0) {
+                qCDebug(JOBS) << "The server sent the whole content instead "
+                                 "of a range, restarting the download";
+                d->rewind(0);
+            }
+            const auto sizeHeader =
+                reply->header(QNetworkRequest::ContentLengthHeader);
+            d->expectedSize = sizeHeader.isValid() ? sizeHeader.toLongLong()
+                                                   : -1;
+        } else
+            return;
+
+        if (d->expectedSize != -1 && !d->tempFile->resize(d->expectedSize)) {
+            qCWarning(JOBS) << "Failed to allocate" << d->expectedSize
+                            << "bytes for" << d->tempFile->fileName();
+            setStatus(FileError, "Could not reserve disk space for download");
         }
     });
     connect(reply, &QIODevice::readyRead, this, [this, reply] {
@@ -105,7 +265,7 @@ void DownloadFileJob::onSentRequest(QNetworkReply* reply)
             return;
         auto bytes = reply->read(reply->bytesAvailable());
         if (!bytes.isEmpty())
-            d->tempFile->write(bytes);
+            d->writeChunk(bytes);
         else
             qCWarning(JOBS) << "Unexpected empty chunk when downloading from"
                             << reply->url() << "to" << d->tempFile->fileName();
@@ -117,6 +277,7 @@ void DownloadFileJob::beforeAbandon()
     if (d->targetFile)
         d->targetFile->remove();
     d->tempFile->remove();
+    d->removeProgress();
 }
 
 void decryptFile(QFile& sourceFile, const EncryptedFileMetadata& metadata,
@@ -130,7 +291,18 @@ void decryptFile(QFile& sourceFile, const EncryptedFileMetadata& metadata,
 
 BaseJob::Status DownloadFileJob::prepareResult()
 {
+    if (!status().good()) // Set while processing the reply, see onSentRequest()
+        return status();
+    if (reply()->bytesAvailable() > 0)
+        d->writeChunk(reply()->readAll());
+    if (d->expectedSize != -1 && d->bytesReceived != d->expectedSize) {
+        qCWarning(JOBS) << "Received" << d->bytesReceived << "bytes out of"
+                        << d->expectedSize << "for" << d->tempFile->fileName();
+        // The next attempt will resume the download
+        return { IncorrectResponse, "Incomplete download" };
+    }
     if (d->targetFile) {
+        d->removeProgress(); // Nothing to resume from now on
 #ifdef Quotient_E2EE_ENABLED
         if (d->encryptedFileMetadata.has_value()) {
             decryptFile(*d->tempFile, *d->encryptedFileMetadata, *d->targetFile);
@@ -176,3 +348,64 @@ BaseJob::Status DownloadFileJob::prepareResult()
     qDebug(JOBS) << "Saved a file as" << targetFileName();
     return Success;
 }
+
+BaseJob::Status DownloadFileJob::prepareError(Status currentStatus)
+{
+    if (d->bytesReceived > 0
+        && reply()->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()
+               == 416) {
+        // The partially downloaded file doesn't match the remote content
+        // (e.g., it's a leftover from another download); start over
+        qCWarning(JOBS) << "Could not resume the download to"
+                        << d->tempFile->fileName() << "- restarting it";
+        d->rewind(0);
+        d->tempFile->resize(0);
+        return { IncorrectResponse, "Could not resume the download" };
+    }
+    return GetContentJob::prepareError(currentStatus);
+}
+
+GetContentRangeJob::GetContentRangeJob(const QString& serverName,
+                                       const QString& mediaId, qint64 offset,
+                                       qint64 length)
+    : GetContentJob(serverName, mediaId), _offset(offset), _length(length)
+{
+    setObjectName(QStringLiteral("GetContentRangeJob"));
+    Q_ASSERT(offset >= 0);
+    setRequestHeader("Range",
+                     "bytes=" + QByteArray::number(offset) + '-'
+                         + (length > 0 ? QByteArray::number(offset + length - 1)
+                                       : QByteArray()));
+}
+
+GetContentRangeJob::GetContentRangeJob(const QUrl& mxcUri, qint64 offset,
+                                       qint64 length)
+    : GetContentRangeJob(mxcUri.authority(),
+                         mxcUri.path().mid(1), // sans leading '/'
+                         offset, length)
+{}
+
+BaseJob::Status GetContentRangeJob::prepareResult()
+{
+    auto body = reply()->readAll();
+    const auto sizeHeader = reply()->header(QNetworkRequest::ContentLengthHeader);
+    if (sizeHeader.isValid() && sizeHeader.toLongLong() != body.size())
+        return { IncorrectResponse,
+                 "The content length doesn't match the received data" };
+
+    if (reply()->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()
+        != 206) {
+        // The server doesn't support ranges and sent the whole content
+        _totalSize = body.size();
+        _rangeContent = body.mid(int(_offset), _length > 0 ? int(_length) : -1);
+        return Success;
+    }
+    const auto range = parseContentRange(reply()->rawHeader("Content-Range"));
+    if (!range.isValid() || range.first != _offset
+        || range.last - range.first + 1 != body.size())
+        return { IncorrectResponse,
+                 "Unexpected content range in the response" };
+    _totalSize = range.total;
+    _rangeContent = std::move(body);
+    return Success;
+}
@@ -8,6 +8,17 @@
 #include "events/filesourceinfo.h"
 
 namespace Quotient {
+//! \brief Download a media file to a local file
+//!
+//! The file is downloaded to a temporary file next to the target one (with
+//! `.qtntdownload` suffix appended) that is renamed to the target name once
+//! the download is complete. If the download is interrupted, the next attempt
+//! (either a retry of the same job or a new job with the same target file)
+//! resumes it using an HTTP Range request. How much of the temporary file is
+//! valid is saved in another file next to it (with `.progress` appended to
+//! its name), as the temporary file is preallocated to the full size. The size
+//! of the downloaded data is checked against the content length reported by
+//! the server.
 class QUOTIENT_API DownloadFileJob : public GetContentJob {
 public:
     using GetContentJob::makeRequestUrl;
@@ -25,9 +36,45 @@ private:
     class Private;
     ImplPtr<Private> d;
 
+    void setupResumption();
+
     void doPrepare() override;
     void onSentRequest(QNetworkReply* reply) override;
     void beforeAbandon() override;
     Status prepareResult() override;
+    Status prepareError(Status currentStatus) override;
+};
+
+//! \brief Download a byte range of a media file into memory
+//!
+//! This is useful for previews and for seeking within media without
+//! downloading the whole file. The job sends an HTTP Range request; if
+//! the server doesn't support ranges and returns the whole content instead,
+//! the requested range is cut out of it.
+class QUOTIENT_API GetContentRangeJob : public GetContentJob {
+public:
+    //! \brief Request \p length bytes of the content starting at \p offset
+    //!
+    //! If \p length is negative, everything from \p offset to the end
+    //! of the content is requested.
+    GetContentRangeJob(const QString& serverName, const QString& mediaId,
+                       qint64 offset, qint64 length = -1);
+    GetContentRangeJob(const QUrl& mxcUri, qint64 offset, qint64 length = -1);
+
+    //! The offset of the downloaded range within the content
+    qint64 offset() const { return _offset; }
+    //! The size of the whole content, or -1 if the server didn't report it
+    qint64 totalSize() const { return _totalSize; }
+    //! The bytes of the downloaded range
+    const QByteArray& rangeContent() const { return _rangeContent; }
+
+protected:
+    Status prepareResult() override;
+
+private:
+    qint64 _offset;
+    qint64 _length;
+    qint64 _totalSize = -1;
+    QByteArray _rangeContent;
 };
 } // namespace Quotient
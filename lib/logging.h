@@ -7,6 +7,8 @@
 #include <QtCore/QElapsedTimer>
 #include <QtCore/QLoggingCategory>
 
+#include <string_view>
+
 Q_DECLARE_LOGGING_CATEGORY(MAIN)
 Q_DECLARE_LOGGING_CATEGORY(STATE)
 Q_DECLARE_LOGGING_CATEGORY(MEMBERS)
@@ -22,6 +24,31 @@ Q_DECLARE_LOGGING_CATEGORY(PROFILER)
 Q_DECLARE_LOGGING_CATEGORY(DATABASE)
 
 namespace Quotient {
+namespace _impl {
+    //! \brief Check whether debug and info logging of \p category is stripped
+    //!
+    //! Quotient_STRIPPED_LOGGING is a comma-separated list of logging
+    //! category names (as in the code, e.g. \c STATE), or \c * to strip
+    //! all categories; it is set from the build option of the same name for
+    //! non-Debug builds of the library.
+    constexpr bool isLoggingStripped([[maybe_unused]] std::string_view category)
+    {
+#ifdef Quotient_STRIPPED_LOGGING
+        std::string_view names = Quotient_STRIPPED_LOGGING;
+        while (!names.empty()) {
+            const auto commaPos = names.find(',');
+            const auto name = names.substr(0, commaPos);
+            if (name == "*" || name == category)
+                return true;
+            if (commaPos == std::string_view::npos)
+                break;
+            names.remove_prefix(commaPos + 1);
+        }
+#endif
+        return false;
+    }
+} // namespace _impl
+
 // QDebug manipulators
 
 using QDebugManip = QDebug (*)(QDebug);
@@ -86,3 +113,35 @@ inline QDebug operator<<(QDebug debug_object, const QElapsedTimer& et)
         debug_object << val / 1000 << "ms";
     return debug_object;
 }
+
+/**
+ * @brief Debug and info logging that can be compiled out
+ *
+ * Use these instead of qCDebug() and qCInfo() in hot code paths. They work
+ * the same way unless the category is listed in the Quotient_STRIPPED_LOGGING
+ * build option; in that case the condition is a compile-time false, so
+ * the logging statement, including its arguments, is never evaluated and is
+ * optimised away, without even the runtime check of the category.
+ *
+ * @example QUO_CDEBUG(STATE) << "Updated room state:" << e;
+ */
+#define QUO_CDEBUG(Category)                                                 \
+    for (bool quoLogEnabled_ =                                               \
+             !::Quotient::_impl::isLoggingStripped(#Category);               \
+         quoLogEnabled_; quoLogEnabled_ = false)                             \
+    qCDebug(Category)
+
+//! \copydoc QUO_CDEBUG
+#define QUO_CINFO(Category)                                                  \
+    for (bool quoLogEnabled_ =                                               \
+             !::Quotient::_impl::isLoggingStripped(#Category);               \
+         quoLogEnabled_; quoLogEnabled_ = false)                             \
+    qCInfo(Category)
+
+//! \brief Check whether debug messages of \p Category would be logged
+//!
+//! Use this to guard code that only prepares data for QUO_CDEBUG() (or
+//! a plain QDebug object), so that it is compiled out along with logging.
+#define QUO_DEBUG_ENABLED(Category)                                          \
+    (!::Quotient::_impl::isLoggingStripped(#Category)                        \
+     && Category().isDebugEnabled())
@@ -0,0 +1,118 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "memoryusage.h"
+
+#include "events/roomevent.h"
+
+#include <QtCore/QJsonArray>
+#include <QtGui/QImage>
+
+#include <numeric>
+
+using namespace Quotient;
+
+namespace {
+//! The header of a heap block of QString, QByteArray and the like
+constexpr qint64 ArrayHeaderSize = 3 * sizeof(void*);
+//! The fixed part of an event object, with its members other than JSON
+constexpr qint64 EventObjectSize = 8 * sizeof(void*);
+//! The per-element overhead of QJsonObject and QJsonArray storage
+constexpr qint64 JsonElementSize = 2 * sizeof(void*);
+} // namespace
+
+void MemoryUsage::add(const QString& subsystem, qint64 bytes)
+{
+    this->bytes[subsystem] += bytes;
+}
+
+MemoryUsage& MemoryUsage::operator+=(const MemoryUsage& other)
+{
+    for (auto it = other.bytes.cbegin(); it != other.bytes.cend(); ++it)
+        add(it.key(), it.value());
+    return *this;
+}
+
+qint64 MemoryUsage::value(const QString& subsystem) const
+{
+    return bytes.value(subsystem);
+}
+
+qint64 MemoryUsage::total() const
+{
+    return std::accumulate(bytes.cbegin(), bytes.cend(), qint64(0));
+}
+
+QJsonObject MemoryUsage::toJson() const
+{
+    QJsonObject json;
+    for (auto it = bytes.cbegin(); it != bytes.cend(); ++it)
+        json.insert(it.key(), it.value());
+    json.insert(QStringLiteral("total"), total());
+    return json;
+}
+
+qint64 MemoryUsage::sizeOf(const QString& s)
+{
+    // Null and empty strings share a static block; literals have their data
+    // in the binary but it's not worth telling them apart here
+    return s.isEmpty() ? 0
+                       : ArrayHeaderSize
+                             + 2 * (std::max(s.size(), s.capacity()) + 1);
+}
+
+qint64 MemoryUsage::sizeOf(const QByteArray& bytes)
+{
+    return bytes.isEmpty()
+               ? 0
+               : ArrayHeaderSize + std::max(bytes.size(), bytes.capacity()) + 1;
+}
+
+qint64 MemoryUsage::sizeOf(const QJsonValue& value)
+{
+    switch (value.type()) {
+    case QJsonValue::String:
+        return sizeOf(value.toString());
+    case QJsonValue::Object:
+        return sizeOf(value.toObject());
+    case QJsonValue::Array:
+        return sizeOf(value.toArray());
+    default:
+        return 0; // Stored inline
+    }
+}
+
+qint64 MemoryUsage::sizeOf(const QJsonObject& object)
+{
+    qint64 result = object.isEmpty() ? 0 : ArrayHeaderSize;
+    for (auto it = object.begin(); it != object.end(); ++it)
+        // Keys are usually ASCII and stored as such
+        result += JsonElementSize + it.key().size() + sizeOf(it.value());
+    return result;
+}
+
+qint64 MemoryUsage::sizeOf(const QJsonArray& array)
+{
+    qint64 result = array.isEmpty() ? 0 : ArrayHeaderSize;
+    for (const auto& v : array)
+        result += JsonElementSize + sizeOf(v);
+    return result;
+}
+
+qint64 MemoryUsage::sizeOf(const QImage& image)
+{
+    return image.isNull() ? 0 : qint64(image.sizeInBytes());
+}
+
+qint64 MemoryUsage::sizeOf(const Event& event)
+{
+    return EventObjectSize + sizeOf(event.fullJson());
+}
+
+qint64 MemoryUsage::sizeOf(const RoomEvent& event)
+{
+    auto result = sizeOf(static_cast<const Event&>(event));
+    if (const auto* original = event.originalEvent())
+        result += sizeOf(*original);
+    return result;
+}
@@ -0,0 +1,85 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "quotient_export.h"
+
+#include <QtCore/QJsonObject>
+#include <QtCore/QMap>
+#include <QtCore/QString>
+
+class QImage;
+class QJsonArray;
+
+namespace Quotient {
+class Event;
+class RoomEvent;
+
+//! \brief An estimate of heap memory used by an object, per subsystem
+//!
+//! Room::memoryUsage() and Connection::memoryUsage() return these to help
+//! deciding which rooms to unload and to spot containers that keep growing.
+//! The figures are estimates: they are based on element counts and payload
+//! sizes rather than on allocator statistics, and data implicitly shared
+//! between several objects is counted for each of them. They are cheap
+//! enough to be sampled periodically, though, and are comparable across
+//! samples.
+class QUOTIENT_API MemoryUsage {
+public:
+    //! Add \p bytes to the estimate for \p subsystem
+    void add(const QString& subsystem, qint64 bytes);
+    MemoryUsage& operator+=(const MemoryUsage& other);
+
+    //! The estimate for \p subsystem, in bytes; 0 if there's no such subsystem
+    qint64 value(const QString& subsystem) const;
+    //! The sum of estimates for all subsystems, in bytes
+    qint64 total() const;
+    //! Estimates for all subsystems, in bytes, keyed by the subsystem name
+    const QMap<QString, qint64>& subsystems() const { return bytes; }
+
+    //! Subsystem names mapped to byte counts, with the total under \c total
+    QJsonObject toJson() const;
+
+    //! \name Size estimates of commonly used types
+    //! These return the heap memory used by the object, not counting
+    //! the object itself (which is expected to be counted as a part of
+    //! the enclosing object or container).
+    //! \{
+    static qint64 sizeOf(const QString& s);
+    static qint64 sizeOf(const QByteArray& bytes);
+    static qint64 sizeOf(const QJsonValue& value);
+    static qint64 sizeOf(const QJsonObject& object);
+    static qint64 sizeOf(const QJsonArray& array);
+    static qint64 sizeOf(const QImage& image);
+    //! The event object along with its JSON
+    static qint64 sizeOf(const Event& event);
+    //! The event object along with its JSON and, for decrypted events,
+    //! the original encrypted event
+    static qint64 sizeOf(const RoomEvent& event);
+    //! \}
+
+    //! \brief A rough per-entry overhead of node-based containers
+    //!
+    //! Covers the node allocation and the bucket pointer of hash tables, or
+    //! the node links and colour of trees.
+    static constexpr qint64 NodeOverhead = 3 * sizeof(void*);
+
+    //! The heap memory taken by \p container nodes, not counting the heap
+    //! memory of the keys and values themselves
+    template <typename ContainerT>
+    static qint64 nodesOf(const ContainerT& container)
+    {
+        qint64 entrySize = 0;
+        if constexpr (requires { typename ContainerT::mapped_type; })
+            entrySize = sizeof(typename ContainerT::key_type)
+                        + sizeof(typename ContainerT::mapped_type);
+        else
+            entrySize = sizeof(typename ContainerT::value_type);
+        return qint64(container.size()) * (entrySize + NodeOverhead);
+    }
+
+private:
+    QMap<QString, qint64> bytes;
+};
+} // namespace Quotient
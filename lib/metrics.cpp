@@ -0,0 +1,213 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "metrics.h"
+
+#include "logging.h"
+
+#include <QtCore/QJsonArray>
+#include <QtCore/QStringBuilder>
+
+#include <algorithm>
+
+using namespace Quotient;
+
+namespace {
+QString escapeLabelValue(QString value)
+{
+    return value.replace('\\', QStringLiteral("\\\\"))
+        .replace('"', QStringLiteral("\\\""))
+        .replace('\n', QStringLiteral("\\n"));
+}
+
+//! Serialise labels in the Prometheus format, without the curly braces
+QString labelsText(const Metrics::Labels& labels)
+{
+    QStringList parts;
+    parts.reserve(int(labels.size()));
+    for (const auto& [name, value] : labels)
+        parts << name % "=\"" % escapeLabelValue(value) % '"';
+    return parts.join(',');
+}
+
+QString formatNumber(double value) { return QString::number(value, 'g', 15); }
+
+QString typeName(int type)
+{
+    static const QString names[] { QStringLiteral("counter"),
+                                   QStringLiteral("gauge"),
+                                   QStringLiteral("histogram") };
+    return names[type];
+}
+} // namespace
+
+const std::vector<double>& Metrics::defaultBounds()
+{
+    // Covers anything from parsing a small event to a long-polling /sync
+    static const std::vector<double> bounds { 0.0005, 0.001, 0.0025, 0.005,
+                                              0.01,   0.025, 0.05,   0.1,
+                                              0.25,   0.5,   1,      2.5,
+                                              5,      10,    30,     60 };
+    return bounds;
+}
+
+Metrics::Series& Metrics::series(const QString& name, Type type,
+                                 const Labels& labels)
+{
+    auto& family = families.try_emplace(name, Family { type, {} }).first->second;
+    if (Q_UNLIKELY(family.type != type)) {
+        qCCritical(MAIN) << "Metric" << name
+                         << "is used with different types; the update is "
+                            "discarded";
+        static thread_local Series discarded;
+        discarded = {};
+        return discarded;
+    }
+    auto [it, inserted] = family.series.try_emplace(labelsText(labels));
+    if (inserted) {
+        it->second.labels = labels;
+        if (type == Type::Histogram) {
+            auto& h = it->second.histogram;
+            h.bounds = defaultBounds();
+            h.bucketCounts.resize(h.bounds.size() + 1);
+        }
+    }
+    return it->second;
+}
+
+const Metrics::Series* Metrics::findSeries(const QString& name, Type type,
+                                           const Labels& labels) const
+{
+    const auto familyIt = families.find(name);
+    if (familyIt == families.cend() || familyIt->second.type != type)
+        return nullptr;
+    const auto it = familyIt->second.series.find(labelsText(labels));
+    return it != familyIt->second.series.cend() ? &it->second : nullptr;
+}
+
+void Metrics::increment(const QString& name, qint64 delta,
+                        const Labels& labels)
+{
+    const QMutexLocker locker(&mutex);
+    series(name, Type::Counter, labels).value += double(delta);
+}
+
+void Metrics::setGauge(const QString& name, double value, const Labels& labels)
+{
+    const QMutexLocker locker(&mutex);
+    series(name, Type::Gauge, labels).value = value;
+}
+
+void Metrics::observe(const QString& name, double seconds,
+                      const Labels& labels)
+{
+    const QMutexLocker locker(&mutex);
+    auto& h = series(name, Type::Histogram, labels).histogram;
+    if (h.bucketCounts.empty()) // The series has been discarded
+        return;
+    const auto bucket =
+        std::lower_bound(h.bounds.cbegin(), h.bounds.cend(), seconds)
+        - h.bounds.cbegin();
+    ++h.bucketCounts[size_t(bucket)];
+    ++h.count;
+    h.sum += seconds;
+}
+
+qint64 Metrics::counter(const QString& name, const Labels& labels) const
+{
+    const QMutexLocker locker(&mutex);
+    const auto* s = findSeries(name, Type::Counter, labels);
+    return s ? qint64(s->value) : 0;
+}
+
+double Metrics::gauge(const QString& name, const Labels& labels) const
+{
+    const QMutexLocker locker(&mutex);
+    const auto* s = findSeries(name, Type::Gauge, labels);
+    return s ? s->value : 0;
+}
+
+Metrics::Histogram Metrics::histogram(const QString& name,
+                                      const Labels& labels) const
+{
+    const QMutexLocker locker(&mutex);
+    const auto* s = findSeries(name, Type::Histogram, labels);
+    return s ? s->histogram : Histogram {};
+}
+
+QJsonObject Metrics::toJson() const
+{
+    const QMutexLocker locker(&mutex);
+    QJsonObject result;
+    for (const auto& [name, family] : families) {
+        QJsonArray seriesJson;
+        for (const auto& [_, s] : family.series) {
+            QJsonObject labelsJson;
+            for (const auto& [labelName, labelValue] : s.labels)
+                labelsJson.insert(labelName, labelValue);
+            QJsonObject json { { QStringLiteral("labels"), labelsJson } };
+            if (family.type == Type::Histogram) {
+                const auto& h = s.histogram;
+                QJsonObject buckets;
+                qint64 cumulativeCount = 0;
+                for (size_t i = 0; i < h.bounds.size(); ++i)
+                    buckets.insert(formatNumber(h.bounds[i]),
+                                   cumulativeCount += h.bucketCounts[i]);
+                buckets.insert(QStringLiteral("+Inf"), h.count);
+                json.insert(QStringLiteral("count"), h.count);
+                json.insert(QStringLiteral("sum"), h.sum);
+                json.insert(QStringLiteral("buckets"), buckets);
+            } else
+                json.insert(QStringLiteral("value"), s.value);
+            seriesJson.append(json);
+        }
+        result.insert(name,
+                      QJsonObject { { QStringLiteral("type"),
+                                      typeName(int(family.type)) },
+                                    { QStringLiteral("series"), seriesJson } });
+    }
+    return result;
+}
+
+QString Metrics::toPrometheus() const
+{
+    const QMutexLocker locker(&mutex);
+    QString result;
+    for (const auto& [name, family] : families) {
+        result += "# TYPE "_ls % name % ' ' % typeName(int(family.type)) % '\n';
+        for (const auto& [labels, s] : family.series) {
+            if (family.type != Type::Histogram) {
+                result += name
+                          % (labels.isEmpty() ? QString()
+                                              : QString('{' % labels % '}'))
+                          % ' ' % formatNumber(s.value) % '\n';
+                continue;
+            }
+            const auto& h = s.histogram;
+            const auto labelsPrefix =
+                labels.isEmpty() ? labels : QString(labels % ',');
+            qint64 cumulativeCount = 0;
+            for (size_t i = 0; i < h.bounds.size(); ++i)
+                result += name % "_bucket{"_ls % labelsPrefix % "le=\""_ls
+                          % formatNumber(h.bounds[i]) % "\"} "_ls
+                          % QString::number(cumulativeCount +=
+                                            h.bucketCounts[i])
+                          % '\n';
+            result += name % "_bucket{"_ls % labelsPrefix % "le=\"+Inf\"} "_ls
+                      % QString::number(h.count) % '\n';
+            const auto labelsSuffix =
+                labels.isEmpty() ? QString() : QString('{' % labels % '}');
+            result += name % "_sum"_ls % labelsSuffix % ' '
+                      % formatNumber(h.sum) % '\n';
+            result += name % "_count"_ls % labelsSuffix % ' '
+                      % QString::number(h.count) % '\n';
+        }
+    }
+    return result;
+}
+
+void Metrics::reset()
+{
+    const QMutexLocker locker(&mutex);
+    families.clear();
+}
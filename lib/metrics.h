@@ -0,0 +1,146 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "util.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QJsonObject>
+#include <QtCore/QMutex>
+
+#include <map>
+#include <vector>
+
+namespace Quotient {
+
+//! \brief Names of the metrics collected by the library
+//!
+//! These names are stable across releases and follow Prometheus naming
+//! conventions: durations are in seconds, counters end with \c _total.
+namespace MetricNames {
+    //! Counter: /sync responses processed
+    constexpr auto Syncs = "quotient_syncs_total"_ls;
+    //! Counter: events received in /sync responses, across all rooms
+    constexpr auto SyncEvents = "quotient_sync_events_total"_ls;
+    //! Histogram: time to parse a /sync response into SyncData
+    constexpr auto SyncParseSeconds = "quotient_sync_parse_seconds"_ls;
+    //! Gauge: rooms with /sync updates waiting to be applied
+    constexpr auto RoomUpdateQueueDepth = "quotient_room_update_queue_depth"_ls;
+    //! Counter: events added to room timelines, new and historical
+    constexpr auto TimelineEvents = "quotient_timeline_events_total"_ls;
+    //! Histogram: time to add a batch of events to a room timeline
+    constexpr auto TimelineInsertSeconds =
+        "quotient_timeline_insert_seconds"_ls;
+    //! Histogram: time to process a batch of ephemeral events in a room
+    constexpr auto EphemeralProcessingSeconds =
+        "quotient_ephemeral_processing_seconds"_ls;
+    //! Histogram, labelled by \c job: time from sending a request to getting
+    //! the reply, per attempt
+    constexpr auto JobSeconds = "quotient_job_duration_seconds"_ls;
+    //! Counter, labelled by \c job: jobs that finished with an error
+    constexpr auto JobFailures = "quotient_job_failures_total"_ls;
+    //! Counter, labelled by \c job: requests rejected with M_LIMIT_EXCEEDED
+    constexpr auto JobsRateLimited = "quotient_job_rate_limited_total"_ls;
+    //! Histogram, labelled by \c scope (\c connection or \c room): time to
+    //! save the state cache
+    constexpr auto CacheSaveSeconds = "quotient_cache_save_seconds"_ls;
+    //! Histogram: time to load the state cache
+    constexpr auto CacheLoadSeconds = "quotient_cache_load_seconds"_ls;
+    //! Histogram, labelled by \c mode: time to decrypt a megolm-encrypted
+    //! room event (\c single) or a batch of events received together
+    //! (\c batch)
+    constexpr auto DecryptSeconds = "quotient_decrypt_seconds"_ls;
+    //! Counter: room events that could not be decrypted
+    constexpr auto DecryptFailures = "quotient_decrypt_failures_total"_ls;
+    //! Histogram, labelled by \c mode (\c sync or \c async): time spent in
+    //! database operations; \c sync includes waiting for pending writes
+    constexpr auto DatabaseSeconds = "quotient_database_seconds"_ls;
+} // namespace MetricNames
+
+//! \brief A registry of counters, gauges and latency histograms
+//!
+//! Each Connection has a registry accessible via Connection::metrics(),
+//! filled by the library with the metrics listed in MetricNames; clients
+//! can add their own metrics too. Metrics are created on first use; each
+//! metric name can have several series distinguished by label values.
+//! All methods are thread-safe.
+//!
+//! The whole registry can be dumped as JSON (toJson()) or in the Prometheus
+//! text exposition format (toPrometheus()), to be served to a scraper.
+class QUOTIENT_API Metrics {
+public:
+    using Labels = std::vector<std::pair<QString, QString>>;
+
+    struct Histogram {
+        //! Upper bounds of the buckets, in seconds; the last, implicit,
+        //! bucket has no upper bound
+        std::vector<double> bounds;
+        //! The number of observations in each bucket, not cumulative;
+        //! has one more element than bounds
+        std::vector<qint64> bucketCounts;
+        qint64 count = 0;
+        double sum = 0;
+    };
+
+    //! Default histogram bucket bounds, in seconds
+    static const std::vector<double>& defaultBounds();
+
+    Metrics() = default;
+    Q_DISABLE_COPY_MOVE(Metrics)
+
+    void increment(const QString& name, qint64 delta = 1,
+                   const Labels& labels = {});
+    void setGauge(const QString& name, double value, const Labels& labels = {});
+    //! Record a duration, in seconds, in a histogram
+    void observe(const QString& name, double seconds,
+                 const Labels& labels = {});
+    //! Record the time elapsed on \p timer in a histogram
+    void observe(const QString& name, const QElapsedTimer& timer,
+                 const Labels& labels = {})
+    {
+        observe(name, double(timer.nsecsElapsed()) / 1e9, labels);
+    }
+
+    //! The counter value, or 0 if it hasn't been incremented yet
+    qint64 counter(const QString& name, const Labels& labels = {}) const;
+    //! The gauge value, or 0 if it hasn't been set yet
+    double gauge(const QString& name, const Labels& labels = {}) const;
+    //! The histogram data, or an empty histogram if nothing was observed
+    Histogram histogram(const QString& name, const Labels& labels = {}) const;
+
+    //! \brief Dump all metrics as JSON
+    //!
+    //! Each metric is a key in the returned object, with an object value
+    //! containing \c type (\c counter, \c gauge or \c histogram) and
+    //! \c series, an array of objects with \c labels and either \c value
+    //! or, for histograms, \c count, \c sum and \c buckets (cumulative
+    //! counts keyed by the upper bound, with \c +Inf for the last bucket).
+    QJsonObject toJson() const;
+    //! Dump all metrics in the Prometheus text exposition format
+    QString toPrometheus() const;
+
+    //! Forget all metrics
+    void reset();
+
+private:
+    enum class Type { Counter, Gauge, Histogram };
+    struct Series {
+        Labels labels;
+        double value = 0;
+        Histogram histogram;
+    };
+    struct Family {
+        Type type;
+        //! Series keyed by the serialised labels, as used in Prometheus
+        std::map<QString, Series> series;
+    };
+
+    mutable QMutex mutex;
+    std::map<QString, Family> families;
+
+    Series& series(const QString& name, Type type, const Labels& labels);
+    const Series* findSeries(const QString& name, Type type,
+                             const Labels& labels) const;
+};
+} // namespace Quotient
@@ -5,6 +5,7 @@
 
 #include <QtCore/QBuffer>
 #include "accountregistry.h"
+#include "qt_connection_util.h"
 #include "room.h"
 
 #ifdef Quotient_E2EE_ENABLED
@@ -61,13 +62,18 @@ MxcReply::MxcReply(QNetworkReply* reply, Room* room, const QString &eventId)
     });
 
 #ifdef Quotient_E2EE_ENABLED
-    auto eventIt = room->findInTimeline(eventId);
-    if(eventIt != room->historyEdge()) {
-        auto event = eventIt->viewAs<RoomMessageEvent>();
-        if (auto* efm = std::get_if<EncryptedFileMetadata>(
-                &event->content()->fileInfo()->source))
-            d->m_encryptedFile = *efm;
-    }
+    // The room may live in another thread, see Connection::moveToWorkerThread()
+    d->m_encryptedFile = invokeBlocking(room, [room, &eventId] {
+        Omittable<EncryptedFileMetadata> result;
+        auto eventIt = room->findInTimeline(eventId);
+        if (eventIt != room->historyEdge()) {
+            auto event = eventIt->viewAs<RoomMessageEvent>();
+            if (auto* efm = std::get_if<EncryptedFileMetadata>(
+                    &event->content()->fileInfo()->source))
+                result = *efm;
+        }
+        return result;
+    });
 #endif
 }
 
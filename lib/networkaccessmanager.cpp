@@ -26,9 +26,12 @@ public:
                                      Connection* connection)
     {
         Q_ASSERT(outerRequest.url().scheme() == "mxc");
+        const auto homeserver = invokeBlocking(connection, [connection] {
+            return connection->homeserver();
+        });
         QNetworkRequest r(outerRequest);
         r.setUrl(QUrl(QStringLiteral("%1/_matrix/media/r0/download/%2")
-                          .arg(connection->homeserver().toString(),
+                          .arg(homeserver.toString(),
                                outerRequest.url().authority()
                                    + outerRequest.url().path())));
         return q->createRequest(op, r);
@@ -115,7 +118,11 @@ QNetworkReply* NetworkAccessManager::createRequest(
             }
             const auto roomId = query.queryItemValue(QStringLiteral("room_id"));
             if (!roomId.isEmpty()) {
-                auto room = connection->room(roomId);
+                // The connection may live in another thread, see
+                // Connection::moveToWorkerThread()
+                auto* room = invokeBlocking(connection, [connection, &roomId] {
+                    return connection->room(roomId);
+                });
                 if (!room) {
                     qCWarning(NETWORK) << "Room" << roomId << "not found";
                     return new MxcReply();
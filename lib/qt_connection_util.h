@@ -6,6 +6,7 @@
 #include "function_traits.h"
 
 #include <QtCore/QPointer>
+#include <QtCore/QThread>
 
 namespace Quotient {
 namespace _impl {
@@ -159,4 +160,31 @@ public:
 private:
     QObject* subscriber;
 };
+
+/*! \brief Call a function in the thread of a context object and get the result
+ *
+ * If \p context lives in the current thread, \p fn is called directly;
+ * otherwise the call is queued to the thread of \p context and the current
+ * thread waits until it's done. The thread of \p context must run an event
+ * loop and must not be waiting on the current thread, or both threads will
+ * deadlock.
+ */
+template <typename FnT>
+inline auto invokeBlocking(QObject* context, FnT&& fn)
+{
+    if (context->thread() == QThread::currentThread())
+        return fn();
+
+    using result_type = std::invoke_result_t<FnT>;
+    if constexpr (std::is_void_v<result_type>)
+        QMetaObject::invokeMethod(context, std::forward<FnT>(fn),
+                                  Qt::BlockingQueuedConnection);
+    else {
+        result_type result {};
+        QMetaObject::invokeMethod(
+            context, [&result, &fn] { result = fn(); },
+            Qt::BlockingQueuedConnection);
+        return result;
+    }
+}
 } // namespace Quotient
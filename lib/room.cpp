@@ -15,6 +15,8 @@
 #include "syncdata.h"
 #include "user.h"
 #include "eventstats.h"
+#include "internedid.h"
+#include "metrics.h"
 #include "roomstateview.h"
 
 // NB: since Qt 6, moc_room.cpp needs User fully defined
@@ -53,16 +55,19 @@
 #include "jobs/mediathumbnailjob.h"
 #include "events/roomcanonicalaliasevent.h"
 
+#include <QtCore/QCoreApplication>
 #include <QtCore/QDir>
 #include <QtCore/QHash>
 #include <QtCore/QPointer>
 #include <QtCore/QRegularExpression>
+#include <QtCore/QRunnable>
 #include <QtCore/QStringBuilder> // for efficient string concats (operator%)
-#include <QtCore/QTemporaryFile>
+#include <QtCore/QThreadPool>
 
 #include <array>
 #include <cmath>
 #include <functional>
+#include <map>
 
 #ifdef Quotient_E2EE_ENABLED
 #include "e2ee/e2ee.h"
@@ -72,6 +77,8 @@
 #include "e2ee/qolmoutboundsession.h"
 #include "e2ee/qolmutility.h"
 #include "database.h"
+
+#include <QtCore/QSemaphore>
 #endif // Quotient_E2EE_ENABLED
 
 
@@ -84,6 +91,113 @@ using std::llround;
 
 enum EventsPlacement : int { Older = -1, Newer = 1 };
 
+#ifdef Quotient_E2EE_ENABLED
+namespace {
+//! \brief Encrypted events of a room waiting for their megolm sessions
+//!
+//! The number of events is bounded, the earliest added being forgotten
+//! first. Changes are accumulated and written to the database by flush().
+class PendingDecryptions {
+public:
+    static constexpr size_t MaxEvents = 5000;
+
+    explicit PendingDecryptions(
+        const std::vector<std::pair<QString, QString>>& savedEvents)
+    {
+        for (const auto& [sessionId, eventId] : savedEvents)
+            insert(sessionId, eventId);
+    }
+
+    void add(const QString& sessionId, const QString& eventId)
+    {
+        if (events.contains(eventId))
+            return;
+        insert(sessionId, eventId);
+        changes.insert(eventId, sessionId);
+        while (order.size() > MaxEvents)
+            remove(QString(order.cbegin()->second));
+    }
+    void remove(const QString& eventId)
+    {
+        const auto it = events.find(eventId);
+        if (it == events.end())
+            return;
+        const auto sessionIt = bySession.find(it->sessionId);
+        sessionIt->second.erase(it->seq);
+        if (sessionIt->second.empty())
+            bySession.erase(sessionIt);
+        order.erase(it->seq);
+        events.erase(it);
+        changes.insert(eventId, none);
+    }
+    //! Ids of the events waiting for the session, earliest added first
+    QStringList eventIds(const QString& sessionId) const
+    {
+        QStringList result;
+        if (const auto it = bySession.find(sessionId); it != bySession.end())
+            for (const auto& [seq, eventId] : it->second)
+                result.push_back(eventId);
+        return result;
+    }
+    qint64 memoryUsage() const
+    {
+        qint64 result = MemoryUsage::nodesOf(events) + MemoryUsage::nodesOf(order)
+                        + MemoryUsage::nodesOf(changes);
+        // Event ids are shared between the containers
+        for (auto it = events.cbegin(); it != events.cend(); ++it)
+            result += MemoryUsage::sizeOf(it.key())
+                      + MemoryUsage::sizeOf(it->sessionId);
+        for (const auto& [sessionId, sessionEvents] : bySession)
+            result += MemoryUsage::NodeOverhead + MemoryUsage::nodesOf(sessionEvents);
+        return result;
+    }
+    //! Write the changes made since the last call to the database
+    void flush(Database* db, const QString& roomId)
+    {
+        if (changes.isEmpty())
+            return;
+        std::vector<std::pair<QString, QString>> added;
+        QStringList removed;
+        for (auto it = changes.cbegin(); it != changes.cend(); ++it)
+            if (*it)
+                added.emplace_back(**it, it.key());
+            else
+                removed.push_back(it.key());
+        changes.clear();
+        // Keep the order of adding so that the same events get forgotten
+        // first after reloading
+        std::sort(added.begin(), added.end(),
+                  [this](const auto& lhs, const auto& rhs) {
+                      return events.value(lhs.second).seq
+                             < events.value(rhs.second).seq;
+                  });
+        db->updatePendingDecryptions(roomId, std::move(added),
+                                     std::move(removed));
+    }
+
+private:
+    struct Entry {
+        QString sessionId;
+        quint64 seq = 0;
+    };
+    QHash<QString, Entry> events;
+    UnorderedMap<QString, std::map<quint64, QString>> bySession;
+    std::map<quint64, QString> order;
+    quint64 nextSeq = 0;
+    //! Event id -> session id for added events, none for removed ones
+    QHash<QString, Omittable<QString>> changes;
+
+    void insert(const QString& sessionId, const QString& eventId)
+    {
+        const auto seq = nextSeq++;
+        events.insert(eventId, { sessionId, seq });
+        bySession[sessionId].emplace(seq, eventId);
+        order.emplace(seq, eventId);
+    }
+};
+} // namespace
+#endif // Quotient_E2EE_ENABLED
+
 class Room::Private {
 public:
     /// Map of user names to users
@@ -104,17 +218,22 @@ public:
     /// \sa timelineBase
     UnorderedMap<StateEventKey, StateEventPtr> baseState;
     /// State event stubs - events without content, just type and state key
-    static decltype(baseState) stubbedState;
+    /// (per thread, as connections can live in different threads)
+    static thread_local decltype(baseState) stubbedState;
     /// The state of the room at syncEdge()
     /// \sa syncEdge
     RoomStateView currentState;
+    /// The current state as event JSON, shared with room snapshots; only
+    /// maintained after the first snapshot is taken
+    /// \sa Room::snapshot
+    Omittable<RoomSnapshot::StateTable> stateJson;
     /// Servers with aliases for this room except the one of the local user
     /// \sa Room::remoteAliases
     QSet<QString> aliasServers;
 
     Timeline timeline;
     PendingEvents unsyncedEvents;
-    QHash<QString, TimelineItem::index_t> eventsIndex;
+    QHash<InternedId, TimelineItem::index_t> eventsIndex;
     // A map from evtId to a map of relation type to a vector of event
     // pointers. Not using QMultiHash, because we want to quickly return
     // a number of relations for a given event without enumerating them.
@@ -128,21 +247,19 @@ public:
     EventStats partiallyReadStats {}, unreadStats {};
     members_map_t membersMap;
     QList<User*> usersTyping;
-    QHash<QString, QSet<QString>> eventIdReadUsers;
+    QHash<InternedId, QSet<InternedId>> eventIdReadUsers;
     QList<User*> usersInvited;
     QList<User*> membersLeft;
     bool displayed = false;
     QString firstDisplayedEventId;
     QString lastDisplayedEventId;
-    QHash<QString, ReadReceipt> lastReadReceipts;
+    QHash<InternedId, ReadReceipt> lastReadReceipts;
     QString fullyReadUntilEventId;
     TagsMap tags;
     UnorderedMap<QString, EventPtr> accountData;
     QString prevBatch;
     QPointer<GetRoomEventsJob> eventsHistoryJob;
     QPointer<GetMembersByRoomJob> allMembersJob;
-    // Map from megolm sessionId to set of eventIds
-    UnorderedMap<QString, QSet<QString>> undecryptedEvents;
 
     struct FileTransferPrivateInfo {
         FileTransferPrivateInfo() = default;
@@ -249,7 +366,7 @@ public:
                 }
             }
             if (events.size() > 9 || et.nsecsElapsed() >= profilerMinNsecs())
-                qCDebug(PROFILER)
+                QUO_CDEBUG(PROFILER)
                     << "Updated" << q->objectName() << "room state from"
                     << events.size() << "event(s) in" << et;
         }
@@ -339,17 +456,48 @@ public:
     bool isLocalUser(const User* u) const { return u == q->localUser(); }
 
 #ifdef Quotient_E2EE_ENABLED
-    UnorderedMap<QString, QOlmInboundGroupSessionPtr> groupSessions;
+    //! Ids of inbound megolm sessions of the room, loaded on first use;
+    //! the sessions themselves are loaded through the connection on demand
+    Omittable<QSet<QString>> megolmSessionIds;
     int currentMegolmSessionMessageCount = 0;
     //TODO save this to database
     unsigned long long currentMegolmSessionCreationTimestamp = 0;
     QOlmOutboundGroupSessionPtr currentOutboundMegolmSession = nullptr;
+    bool outboundMegolmSessionLoaded = false;
+
+    //! Encrypted events waiting for megolm sessions, loaded on first use
+    Omittable<PendingDecryptions> pendingDecryptions;
+
+    PendingDecryptions& pending()
+    {
+        if (!pendingDecryptions)
+            pendingDecryptions.emplace(
+                connection->database()->loadPendingDecryptions(id));
+        return *pendingDecryptions;
+    }
+
+    const QSet<QString>& knownMegolmSessionIds()
+    {
+        if (!megolmSessionIds)
+            megolmSessionIds = connection->database()->megolmSessionIds(id);
+        return *megolmSessionIds;
+    }
+
+    void loadOutboundMegolmSession()
+    {
+        if (std::exchange(outboundMegolmSessionLoaded, true))
+            return;
+        currentOutboundMegolmSession =
+            connection->loadCurrentOutboundMegolmSession(id);
+        if (currentOutboundMegolmSession && shouldRotateMegolmSession())
+            currentOutboundMegolmSession = nullptr;
+    }
 
     bool addInboundGroupSession(QString sessionId, QByteArray sessionKey,
                                 const QString& senderId,
                                 const QString& olmSessionId)
     {
-        if (groupSessions.contains(sessionId)) {
+        if (knownMegolmSessionIds().contains(sessionId)) {
             qCWarning(E2EE) << "Inbound Megolm session" << sessionId << "already exists";
             return false;
         }
@@ -362,53 +510,122 @@ public:
         megolmSession->setSenderId(senderId);
         megolmSession->setOlmSessionId(olmSessionId);
         qCWarning(E2EE) << "Adding inbound session";
-        connection->saveMegolmSession(q, *megolmSession);
-        groupSessions[sessionId] = std::move(megolmSession);
+        connection->addInboundMegolmSession(q, std::move(megolmSession));
+        megolmSessionIds->insert(sessionId);
         return true;
     }
 
-    QString groupSessionDecryptMessage(QByteArray cipher,
-                                       const QString& sessionId,
-                                       const QString& eventId,
-                                       QDateTime timestamp,
-                                       const QString& senderId)
+    //! Get the inbound megolm session, if it is known, loading it if needed
+    std::shared_ptr<QOlmInboundGroupSession> megolmSession(
+        const QString& sessionId)
     {
-        auto groupSessionIt = groupSessions.find(sessionId);
-        if (groupSessionIt == groupSessions.end()) {
+        if (!knownMegolmSessionIds().contains(sessionId)) {
             // qCWarning(E2EE) << "Unable to decrypt event" << eventId
             //               << "The sender's device has not sent us the keys for "
             //                  "this message";
-            return {};
+            return nullptr;
         }
-        auto& senderSession = groupSessionIt->second;
-        if (senderSession->senderId() != senderId) {
-            qCWarning(E2EE) << "Sender from event does not match sender from session";
-            return {};
-        }
-        auto decryptResult = senderSession->decrypt(cipher);
-        if(!decryptResult) {
-            qCWarning(E2EE) << "Unable to decrypt event" << eventId
-            << "with matching megolm session:" << decryptResult.error();
-            return {};
-        }
-        const auto& [content, index] = *decryptResult;
+        auto session = connection->inboundMegolmSession(q, sessionId);
+        if (!session)
+            qCWarning(E2EE) << "Failed to load megolm session" << sessionId;
+        return session;
+    }
+
+    //! Check the megolm message index of the event against replay attacks
+    bool checkMegolmMessageIndex(const QString& sessionId, uint32_t index,
+                                 const QString& eventId,
+                                 const QDateTime& timestamp)
+    {
         const auto& [recordEventId, ts] =
             q->connection()->database()->groupSessionIndexRecord(
-                q->id(), senderSession->sessionId(), index);
+                q->id(), sessionId, index);
         if (recordEventId.isEmpty()) {
             q->connection()->database()->addGroupSessionIndexRecord(
-                q->id(), senderSession->sessionId(), index, eventId,
+                q->id(), sessionId, index, eventId,
                 timestamp.toMSecsSinceEpoch());
         } else {
             if ((eventId != recordEventId)
                 || (ts != timestamp.toMSecsSinceEpoch())) {
                 qCWarning(E2EE) << "Detected a replay attack on event" << eventId;
-                return {};
+                return false;
             }
         }
-        return content;
+        return true;
     }
 
+    enum class SenderCheck { Verified, Unverified, Mismatch };
+
+    //! \brief Check the sender of an event against its megolm session
+    //!
+    //! Sessions that are not tied to a user yet (imported ones) get
+    //! attributed to the owner of the device that created them, once that
+    //! device is known. Events claiming a sender other than the one of
+    //! the session are not decrypted; if the sender of the session is still
+    //! unknown, the event is decrypted but its sender remains unverified.
+    SenderCheck checkMegolmSessionSender(QOlmInboundGroupSession& session,
+                                         const QString& senderId)
+    {
+        if (session.senderId().isEmpty()) {
+            connection->attributeMegolmSession(q, session, senderId);
+            if (session.senderId().isEmpty())
+                return SenderCheck::Unverified;
+        }
+        if (session.senderId() != senderId) {
+            qCWarning(E2EE) << "Sender from event does not match sender from session";
+            return SenderCheck::Mismatch;
+        }
+        return SenderCheck::Verified;
+    }
+
+    //! \return the decrypted content (empty if decryption failed) and
+    //!         whether the sender has been verified
+    std::pair<QString, bool> groupSessionDecryptMessage(
+        QByteArray cipher, const QString& sessionId, const QString& eventId,
+        QDateTime timestamp, const QString& senderId)
+    {
+        const auto senderSession = megolmSession(sessionId);
+        if (!senderSession)
+            return {};
+        const auto senderCheck =
+            checkMegolmSessionSender(*senderSession, senderId);
+        if (senderCheck == SenderCheck::Mismatch)
+            return {};
+        auto decryptResult = senderSession->decrypt(cipher);
+        if(!decryptResult) {
+            qCWarning(E2EE) << "Unable to decrypt event" << eventId
+            << "with matching megolm session:" << decryptResult.error();
+            return {};
+        }
+        const auto& [content, index] = *decryptResult;
+        if (!checkMegolmMessageIndex(sessionId, index, eventId, timestamp))
+            return {};
+        return { content, senderCheck == SenderCheck::Verified };
+    }
+
+    //! \brief Decrypt megolm-encrypted events
+    //!
+    //! Events are grouped by session; since decryption with different
+    //! sessions is independent, the groups are decrypted in parallel on
+    //! a dedicated thread pool, keeping the order of events within each group.
+    //! Checks that involve the room or the database are done afterwards on
+    //! the calling thread. Events that could not be decrypted are added to
+    //! the pending decryptions, and those decrypted are removed from there.
+    //! \return decrypted events, in the order of \p events; nullptr for
+    //!         events that could not be decrypted
+    std::vector<RoomEventPtr> decryptEvents(
+        const std::vector<const EncryptedEvent*>& events);
+
+    //! Decrypt encrypted events of a batch in place
+    void decryptIncomingEvents(RoomEvents& events);
+
+    //! \brief Retry decrypting events that wait for given megolm sessions
+    //!
+    //! All events in the timeline waiting for any of \p sessionIds are
+    //! decrypted in one batch and announced with a single eventsDecrypted()
+    //! signal. Events that are not in the timeline stay pending, to be
+    //! decrypted when they are loaded again.
+    void redecryptEvents(const QSet<QString>& sessionIds);
+
     bool shouldRotateMegolmSession() const
     {
         if (!q->usesEncryption()) {
@@ -446,6 +663,7 @@ public:
         qCDebug(E2EE) << "Creating new outbound megolm session for room "
                       << q->objectName();
         currentOutboundMegolmSession = QOlmOutboundGroupSession::create();
+        outboundMegolmSessionLoaded = true;
         connection->saveCurrentOutboundMegolmSession(
             id, *currentOutboundMegolmSession);
 
@@ -492,7 +710,8 @@ private:
     users_shortlist_t buildShortlist(const QStringList& userIds) const;
 };
 
-decltype(Room::Private::baseState) Room::Private::stubbedState {};
+thread_local decltype(Room::Private::baseState)
+    Room::Private::stubbedState {};
 
 Room::Room(Connection* connection, QString id, JoinState initialJoinState)
     : QObject(connection), d(new Private(connection, id, initialJoinState))
@@ -511,16 +730,12 @@ Room::Room(Connection* connection, QString id, JoinState initialJoinState)
             connection->encryptionUpdate(this);
         }
     });
-    d->groupSessions = connection->loadRoomMegolmSessions(this);
-    d->currentOutboundMegolmSession =
-        connection->loadCurrentOutboundMegolmSession(this->id());
-    if (d->shouldRotateMegolmSession()) {
-        d->currentOutboundMegolmSession = nullptr;
-    }
+    // Megolm sessions are loaded from the database on demand
     connect(this, &Room::userRemoved, this, [this](){
         if (!usesEncryption()) {
             return;
         }
+        d->loadOutboundMegolmSession();
         if (d->hasValidMegolmSession()) {
             d->createMegolmSession();
         }
@@ -535,7 +750,37 @@ Room::Room(Connection* connection, QString id, JoinState initialJoinState)
     qCDebug(STATE) << "New" << terse << initialJoinState << "Room:" << id;
 }
 
-Room::~Room() { delete d; }
+namespace {
+//! A thread pool task that destroys a timeline handed over to it
+class TimelineDisposal : public QRunnable {
+public:
+    explicit TimelineDisposal(Room::Timeline&& timeline)
+        : timeline(std::move(timeline))
+    {}
+    void run() override { timeline.clear(); }
+
+private:
+    Room::Timeline timeline;
+};
+
+//! Timelines at least this long are destroyed on a thread pool
+constexpr size_t TimelineDisposalThreshold = 1000;
+} // namespace
+
+Room::~Room()
+{
+    // Destroying an event takes a few deallocations; for long timelines
+    // this adds up to a noticeable freeze of the thread owning the room
+    // (e.g., when the connection is closed). Events are not referred to from
+    // anywhere else by then so they can be destroyed on another thread.
+    // When the application is shutting down the global pool may be gone
+    // already; the timeline is destroyed along with the rest of the room then.
+    if (d->timeline.size() >= TimelineDisposalThreshold
+        && !QCoreApplication::closingDown())
+        if (auto* pool = QThreadPool::globalInstance())
+            pool->start(new TimelineDisposal(std::exchange(d->timeline, {})));
+    delete d;
+}
 
 const QString& Room::id() const { return d->id; }
 
@@ -727,8 +972,8 @@ Room::Changes Room::Private::setLastReadReceipt(const QString& userId,
         // eagerMarker is now just after the desired event for newMarker
         if (eagerMarker != newMarker.base()) {
             newMarker = rev_iter_t(eagerMarker);
-            qCDebug(EPHEMERAL) << "Auto-promoted read receipt for" << userId
-                               << "to" << *newMarker;
+            QUO_CDEBUG(EPHEMERAL) << "Auto-promoted read receipt for" << userId
+                                  << "to" << *newMarker;
         }
         // Fill newReceipt with the event (and, if needed, timestamp) from
         // eagerMarker
@@ -736,8 +981,9 @@ Room::Changes Room::Private::setLastReadReceipt(const QString& userId,
         if (newReceipt.timestamp.isNull())
             newReceipt.timestamp = QDateTime::currentDateTime();
     }
+    const InternedId userKey(userId);
     auto& storedReceipt =
-            lastReadReceipts[userId]; // clazy:exclude=detaching-member
+            lastReadReceipts[userKey]; // clazy:exclude=detaching-member
     const auto prevEventId = storedReceipt.eventId;
     // Check that either the new marker is actually "newer" than the current one
     // or, if both markers are at historyEdge(), event ids are different.
@@ -749,17 +995,21 @@ Room::Changes Room::Private::setLastReadReceipt(const QString& userId,
     // Finally make the change
 
     Changes changes = Change::Other;
-    auto oldEventReadUsersIt =
-        eventIdReadUsers.find(prevEventId); // clazy:exclude=detaching-member
+    auto oldEventReadUsersIt = eventIdReadUsers.find(
+        InternedId::find(prevEventId)); // clazy:exclude=detaching-member
     if (oldEventReadUsersIt != eventIdReadUsers.end()) {
-        oldEventReadUsersIt->remove(userId);
+        oldEventReadUsersIt->remove(userKey);
         if (oldEventReadUsersIt->isEmpty())
             eventIdReadUsers.erase(oldEventReadUsersIt);
     }
-    eventIdReadUsers[newReceipt.eventId].insert(userId);
+    const InternedId eventKey(newReceipt.eventId);
+    eventIdReadUsers[eventKey].insert(userKey);
+    newReceipt.eventId = eventKey; // Share the string with the index
     storedReceipt = move(newReceipt);
 
-    {
+    // qDebug(), unlike qCDebug(), makes the stream even when the category
+    // is disabled; so check for that beforehand
+    if (QUO_DEBUG_ENABLED(EPHEMERAL)) {
         auto dbg = qDebug(EPHEMERAL); // This trick needs qDebug, not qCDebug
         dbg << "The new read receipt for" << userId << "is now at";
         if (newMarker == historyEdge())
@@ -775,7 +1025,7 @@ Room::Changes Room::Private::setLastReadReceipt(const QString& userId,
     if (isLocalUser(member) && !deferStatsUpdate) {
         if (unreadStats.updateOnMarkerMove(q, q->findInTimeline(prevEventId),
                                            newMarker)) {
-            qCDebug(MESSAGES)
+            QUO_CDEBUG(MESSAGES)
                 << "Updated unread event statistics in" << q->objectName()
                 << "after moving the local read receipt:" << unreadStats;
             changes |= Change::UnreadStats;
@@ -804,9 +1054,10 @@ Room::Changes Room::Private::updateStats(const rev_iter_t& from,
         && setLastReadReceipt(connection->userId(), fullyReadMarker, {}, true)) {
         changes |= Change::Other;
         readReceiptMarker = q->localReadReceiptMarker();
-        qCInfo(MESSAGES) << "The local m.read receipt was behind m.fully_read "
-                            "marker - it's now corrected to be at index"
-                         << readReceiptMarker->index();
+        QUO_CINFO(MESSAGES)
+            << "The local m.read receipt was behind m.fully_read marker - it's"
+               " now corrected to be at index"
+            << readReceiptMarker->index();
     }
 
     if (fullyReadMarker < from)
@@ -827,8 +1078,9 @@ Room::Changes Room::Private::updateStats(const rev_iter_t& from,
     if (readReceiptMarker < to || changes /*i.e. read receipt was corrected*/) {
         unreadStats = EventStats::fromMarker(q, readReceiptMarker);
         Q_ASSERT(!unreadStats.isEstimate);
-        qCDebug(MESSAGES).nospace() << "Recalculated unread event statistics in"
-                                    << q->objectName() << ": " << unreadStats;
+        QUO_CDEBUG(MESSAGES).nospace()
+            << "Recalculated unread event statistics in" << q->objectName()
+            << ": " << unreadStats;
         changes |= Change::UnreadStats;
         if (fullyReadMarker < to) {
             // Add up to unreadStats instead of counting same events again
@@ -837,7 +1089,7 @@ Room::Changes Room::Private::updateStats(const rev_iter_t& from,
                                                        unreadStats);
             Q_ASSERT(!partiallyReadStats.isEstimate);
 
-            qCDebug(MESSAGES).nospace()
+            QUO_CDEBUG(MESSAGES).nospace()
                     << "Recalculated partially read event statistics in "
                     << q->objectName() << ": " << partiallyReadStats;
             return changes | Change::PartiallyReadStats;
@@ -871,10 +1123,11 @@ Room::Changes Room::Private::updateStats(const rev_iter_t& from,
         Q_ASSERT(!changes.testFlag(Change::UnreadStats));
         doAddStats(unreadStats, readReceiptMarker, Change::UnreadStats);
     }
-    qCDebug(MESSAGES) << "Room" << q->objectName() << "has gained" << newStats
-                      << "notable/highlighted event(s); total statistics:"
-                      << partiallyReadStats << "since the fully read marker,"
-                      << unreadStats << "since read receipt";
+    QUO_CDEBUG(MESSAGES) << "Room" << q->objectName() << "has gained"
+                         << newStats
+                         << "notable/highlighted event(s); total statistics:"
+                         << partiallyReadStats << "since the fully read marker,"
+                         << unreadStats << "since read receipt";
 
     // Check invariants
     Q_ASSERT(partiallyReadStats.isValidFor(q, fullyReadMarker));
@@ -1040,12 +1293,14 @@ Room::rev_iter_t Room::findInTimeline(TimelineItem::index_t index) const
 
 Room::rev_iter_t Room::findInTimeline(const QString& evtId) const
 {
-    if (!d->timeline.empty() && d->eventsIndex.contains(evtId)) {
-        auto it = findInTimeline(d->eventsIndex.value(evtId));
-        Q_ASSERT(it != historyEdge() && (*it)->id() == evtId);
-        return it;
-    }
-    return historyEdge();
+    if (d->timeline.empty())
+        return historyEdge();
+    const auto pIdx = d->eventsIndex.constFind(InternedId::find(evtId));
+    if (pIdx == d->eventsIndex.cend())
+        return historyEdge();
+    auto it = findInTimeline(*pIdx);
+    Q_ASSERT(it != historyEdge() && (*it)->id() == evtId);
+    return it;
 }
 
 Room::PendingEvents::iterator Room::findPendingEvent(const QString& txnId)
@@ -1191,12 +1446,12 @@ QString Room::readMarkerEventId() const { return lastFullyReadEventId(); }
 
 ReadReceipt Room::lastReadReceipt(const QString& userId) const
 {
-    return d->lastReadReceipts.value(userId);
+    return d->lastReadReceipts.value(InternedId::find(userId));
 }
 
 ReadReceipt Room::lastLocalReadReceipt() const
 {
-    return d->lastReadReceipts.value(localUser()->id());
+    return d->lastReadReceipts.value(InternedId::find(localUser()->id()));
 }
 
 Room::rev_iter_t Room::localReadReceiptMarker() const
@@ -1213,12 +1468,17 @@ Room::rev_iter_t Room::fullyReadMarker() const
 
 QSet<QString> Room::userIdsAtEvent(const QString& eventId)
 {
-    return d->eventIdReadUsers.value(eventId);
+    const auto& userIds = d->eventIdReadUsers.value(InternedId::find(eventId));
+    QSet<QString> result;
+    result.reserve(userIds.size());
+    for (const auto& uId : userIds)
+        result.insert(uId);
+    return result;
 }
 
 QSet<User*> Room::usersAtEventId(const QString& eventId)
 {
-    const auto& userIds = d->eventIdReadUsers.value(eventId);
+    const auto& userIds = d->eventIdReadUsers.value(InternedId::find(eventId));
     QSet<User*> users;
     users.reserve(userIds.size());
     for (const auto& uId : userIds)
@@ -1567,6 +1827,20 @@ RoomStateView Room::currentState() const
     return d->currentState;
 }
 
+RoomSnapshot Room::snapshot(int timelineWindow) const
+{
+    if (!d->stateJson) {
+        // From now on, processStateEvent() keeps the table up to date
+        d->stateJson.emplace();
+        const auto& events = d->currentState.events();
+        d->stateJson->reserve(events.size());
+        for (auto it = events.cbegin(); it != events.cend(); ++it)
+            if (*it)
+                d->stateJson->insert(it.key(), (*it)->fullJson());
+    }
+    return { *this, d->summary, *d->stateJson, timelineWindow };
+}
+
 RoomEventPtr Room::decryptMessage(const EncryptedEvent& encryptedEvent)
 {
 #ifndef Quotient_E2EE_ENABLED
@@ -1579,16 +1853,23 @@ RoomEventPtr Room::decryptMessage(const EncryptedEvent& encryptedEvent)
                     << encryptedEvent.id() << "is not decryptable by the current device";
         return {};
     }
-    QString decrypted = d->groupSessionDecryptMessage(
+    QElapsedTimer et;
+    et.start();
+    const auto [decrypted, senderVerified] = d->groupSessionDecryptMessage(
         encryptedEvent.ciphertext(), encryptedEvent.sessionId(),
         encryptedEvent.id(), encryptedEvent.originTimestamp(),
         encryptedEvent.senderId());
+    auto& metrics = connection()->metrics();
+    metrics.observe(MetricNames::DecryptSeconds, et,
+                    { { QStringLiteral("mode"), QStringLiteral("single") } });
     if (decrypted.isEmpty()) {
         // qCWarning(E2EE) << "Encrypted message is empty";
+        metrics.increment(MetricNames::DecryptFailures);
         return {};
     }
     auto decryptedEvent = encryptedEvent.createDecrypted(decrypted);
     if (decryptedEvent->roomId() == id()) {
+        decryptedEvent->setSenderVerified(senderVerified);
         return decryptedEvent;
     }
     qCWarning(E2EE) << "Decrypted event" << encryptedEvent.id() << "not for this room; discarding.";
@@ -1614,28 +1895,65 @@ void Room::handleRoomKeyEvent(const RoomKeyEvent& roomKeyEvent,
                                   roomKeyEvent.sessionKey(), senderId,
                                   olmSessionId)) {
         qCWarning(E2EE) << "added new inboundGroupSession:"
-                      << d->groupSessions.size();
-        auto undecryptedEvents = d->undecryptedEvents[roomKeyEvent.sessionId()];
-        for (const auto& eventId : undecryptedEvents) {
-            const auto pIdx = d->eventsIndex.constFind(eventId);
-            if (pIdx == d->eventsIndex.cend())
+                      << d->megolmSessionIds->size();
+        d->redecryptEvents({ roomKeyEvent.sessionId() });
+    }
+#endif // Quotient_E2EE_ENABLED
+}
+
+void Room::handleImportedMegolmSessions(const QSet<QString>& sessionIds)
+{
+#ifndef Quotient_E2EE_ENABLED
+    Q_UNUSED(sessionIds)
+    qCWarning(E2EE) << "End-to-end encryption (E2EE) support is turned off.";
+#else // Quotient_E2EE_ENABLED
+    // Imported sessions are written to the database directly
+    d->megolmSessionIds.reset();
+    d->redecryptEvents(sessionIds);
+#endif // Quotient_E2EE_ENABLED
+}
+
+#ifdef Quotient_E2EE_ENABLED
+void Room::Private::redecryptEvents(const QSet<QString>& sessionIds)
+{
+    auto& pendingEvents = pending();
+    std::vector<const EncryptedEvent*> encryptedEvents;
+    std::vector<TimelineItem*> items;
+    for (const auto& sessionId : sessionIds)
+        for (const auto& eventId : pendingEvents.eventIds(sessionId)) {
+            const auto pIdx =
+                eventsIndex.constFind(InternedId::find(eventId));
+            if (pIdx == eventsIndex.cend())
                 continue;
-            auto& ti = d->timeline[Timeline::size_type(*pIdx - minTimelineIndex())];
-            if (auto encryptedEvent = ti.viewAs<EncryptedEvent>()) {
-                auto decrypted = decryptMessage(*encryptedEvent);
-                if(decrypted) {
-                    // The reference will survive the pointer being moved
-                    auto& decryptedEvent = *decrypted;
-                    auto oldEvent = ti.replaceEvent(std::move(decrypted));
-                    decryptedEvent.setOriginalEvent(std::move(oldEvent));
-                    emit replacedEvent(ti.event(), decryptedEvent.originalEvent());
-                    d->undecryptedEvents[roomKeyEvent.sessionId()] -= eventId;
-                }
-            }
+            auto& ti =
+                timeline[Timeline::size_type(*pIdx - q->minTimelineIndex())];
+            if (const auto* encrypted = ti.viewAs<EncryptedEvent>()) {
+                encryptedEvents.push_back(encrypted);
+                items.push_back(&ti);
+            } else
+                pendingEvents.remove(eventId);
         }
+    if (encryptedEvents.empty()) {
+        pendingEvents.flush(connection->database(), id);
+        return;
     }
-#endif // Quotient_E2EE_ENABLED
+
+    auto decryptedEvents = decryptEvents(encryptedEvents);
+    QVector<TimelineItem::index_t> decryptedIndices;
+    for (size_t i = 0; i < decryptedEvents.size(); ++i) {
+        auto& decrypted = decryptedEvents[i];
+        if (!decrypted)
+            continue;
+        // The reference will survive the pointer being moved
+        auto& decryptedEvent = *decrypted;
+        auto oldEvent = items[i]->replaceEvent(std::move(decrypted));
+        decryptedEvent.setOriginalEvent(std::move(oldEvent));
+        decryptedIndices.push_back(items[i]->index());
+    }
+    if (!decryptedIndices.isEmpty())
+        emit q->eventsDecrypted(decryptedIndices);
 }
+#endif // Quotient_E2EE_ENABLED
 
 int Room::joinedCount() const
 {
@@ -1671,9 +1989,9 @@ void Room::Private::insertMemberIntoMap(User* u)
                            << "has no name (even empty)";
     const auto userName = maybeUserName.value_or(QString());
     const auto namesakes = membersMap.values(userName);
-    qCDebug(MEMBERS) << "insertMemberIntoMap(), user" << u->id()
-                     << "with name" << userName << '-'
-                     << namesakes.size() << "namesake(s) found";
+    QUO_CDEBUG(MEMBERS) << "insertMemberIntoMap(), user" << u->id()
+                        << "with name" << userName << '-'
+                        << namesakes.size() << "namesake(s) found";
 
     // Callers should make sure they are not adding an existing user once more
     Q_ASSERT(!namesakes.contains(u));
@@ -1699,8 +2017,8 @@ void Room::Private::removeMemberFromMap(User* u)
                                                &RoomMemberEvent::newDisplayName,
                                                QString());
 
-    qCDebug(MEMBERS) << "removeMemberFromMap(), username" << userName
-                     << "for user" << u->id();
+    QUO_CDEBUG(MEMBERS) << "removeMemberFromMap(), username" << userName
+                        << "for user" << u->id();
     User* namesake = nullptr;
     auto namesakes = membersMap.values(userName);
     // If there was one namesake besides the removed user, signal member
@@ -1712,7 +2030,7 @@ void Room::Private::removeMemberFromMap(User* u)
         emit q->memberAboutToRename(namesake, userName);
     }
     if (membersMap.remove(userName, u) == 0) {
-        qCDebug(MEMBERS) << "No entries removed; checking the whole list";
+        QUO_CDEBUG(MEMBERS) << "No entries removed; checking the whole list";
         // Unless at the stage of initial filling, this no removed entries
         // is suspicious; double-check that this user is not found in
         // the whole map, and stop (for debug builds) or shout in the logs
@@ -1721,7 +2039,7 @@ void Room::Private::removeMemberFromMap(User* u)
         QElapsedTimer et;
         auto it = std::find(membersMap.cbegin(), membersMap.cend(), u);
         if (et.nsecsElapsed() > profilerMinNsecs() / 10)
-            qCDebug(MEMBERS) << "...done in" << et;
+            QUO_CDEBUG(MEMBERS) << "...done in" << et;
         if (it != membersMap.cend()) {
             // The assert (still) does more harm than good, it seems
 //            Q_ASSERT_X(false, __FUNCTION__,
@@ -1761,13 +2079,13 @@ Room::Private::moveEventsToTimeline(RoomEventsRange events,
             !eId.isEmpty(), __FUNCTION__,
             makeErrorStr(*e, "Event with empty id cannot be in the timeline"));
         Q_ASSERT_X(
-            !eventsIndex.contains(eId), __FUNCTION__,
+            !eventsIndex.contains(InternedId::find(eId)), __FUNCTION__,
             makeErrorStr(*e, "Event is already in the timeline; "
                              "incoming events were not properly deduplicated"));
         const auto& ti = placement == Older
                              ? timeline.emplace_front(move(e), --index)
                              : timeline.emplace_back(move(e), ++index);
-        eventsIndex.insert(eId, index);
+        eventsIndex.insert(InternedId(eId), index);
         if (auto n = q->checkForNotifications(ti); n.type != Notification::None)
             notifications.insert(e->id(), n);
         Q_ASSERT(q->findInTimeline(eId)->event()->id() == eId);
@@ -1866,10 +2184,10 @@ Room::Changes Room::Private::updateStatsFromSyncData(const SyncRoomData& data,
         if (data.unreadCount == 0 && data.partiallyReadCount == -1)
             unreadStats.isEstimate = false;
         changes |= Change::PartiallyReadStats | Change::UnreadStats;
-        qCDebug(MESSAGES) << "Loaded" << q->objectName()
-                          << "event statistics from cache:" << partiallyReadStats
-                          << "since m.fully_read," << unreadStats
-                          << "since m.read";
+        QUO_CDEBUG(MESSAGES) << "Loaded" << q->objectName()
+                             << "event statistics from cache:"
+                             << partiallyReadStats << "since m.fully_read,"
+                             << unreadStats << "since m.read";
     } else if (timeline.empty()) {
         // In absence of actual events use statistics from the homeserver
         if (merge(unreadStats.notableCount, data.unreadCount))
@@ -1878,7 +2196,7 @@ Room::Changes Room::Private::updateStatsFromSyncData(const SyncRoomData& data,
             changes |= Change::UnreadStats;
         unreadStats.isEstimate = !data.unreadCount.has_value()
                                  || *data.unreadCount > 0;
-        qCDebug(MESSAGES)
+        QUO_CDEBUG(MESSAGES)
             << "Using server-side unread event statistics while the"
             << q->objectName() << "timeline is empty:" << unreadStats;
     }
@@ -1898,10 +2216,10 @@ Room::Changes Room::Private::updateStatsFromSyncData(const SyncRoomData& data,
         partiallyReadStats.isEstimate = true;
     }
     if (correctedStats)
-        qCDebug(MESSAGES) << "Partially read event statistics in"
-                          << q->objectName() << "were adjusted to"
-                          << partiallyReadStats
-                          << "to be consistent with the m.read receipt";
+        QUO_CDEBUG(MESSAGES) << "Partially read event statistics in"
+                             << q->objectName() << "were adjusted to"
+                             << partiallyReadStats
+                             << "to be consistent with the m.read receipt";
     Q_ASSERT(partiallyReadStats.isValidFor(q, q->fullyReadMarker()));
     Q_ASSERT(unreadStats.isValidFor(q, q->localReadReceiptMarker()));
 
@@ -1909,8 +2227,8 @@ Room::Changes Room::Private::updateStatsFromSyncData(const SyncRoomData& data,
     // serverHighlightCount and only use the server-side counter when
     // the timeline is empty (see the code above).
     if (merge(serverHighlightCount, data.highlightCount)) {
-        qCDebug(MESSAGES) << "Updated highlights number in" << q->objectName()
-                          << "to" << serverHighlightCount;
+        QUO_CDEBUG(MESSAGES) << "Updated highlights number in"
+                             << q->objectName() << "to" << serverHighlightCount;
         changes |= Change::Highlights;
     }
     return changes;
@@ -1918,7 +2236,7 @@ Room::Changes Room::Private::updateStatsFromSyncData(const SyncRoomData& data,
 
 void Room::updateData(SyncRoomData&& data, bool fromCache)
 {
-    qCDebug(MAIN) << "--- Updating room" << id() << "/" << objectName();
+    QUO_CDEBUG(MAIN) << "--- Updating room" << id() << "/" << objectName();
     bool firstUpdate = d->baseState.empty();
 
     if (d->prevBatch.isEmpty())
@@ -1948,7 +2266,8 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
     d->postprocessChanges(roomChanges, !fromCache);
     if (firstUpdate)
         emit baseStateLoaded();
-    qCDebug(MAIN) << "--- Finished updating room" << id() << "/" << objectName();
+    QUO_CDEBUG(MAIN) << "--- Finished updating room" << id() << "/"
+                     << objectName();
 }
 
 void Room::Private::postprocessChanges(Changes changes, bool saveState)
@@ -1974,7 +2293,7 @@ void Room::Private::postprocessChanges(Changes changes, bool saveState)
     if (changes & Change::Highlights)
         emit q->highlightCountChanged();
 
-    qCDebug(MAIN) << terse << changes << "= hex" <<
+    QUO_CDEBUG(MAIN) << terse << changes << "= hex" <<
 #if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
         Qt::
 #endif
@@ -2021,6 +2340,7 @@ QString Room::Private::doSendEvent(const RoomEvent* pEvent)
         qWarning() << "This build of libQuotient does not support E2EE.";
         return {};
 #else
+        loadOutboundMegolmSession();
         if (!hasValidMegolmSession() || shouldRotateMegolmSession()) {
             createMegolmSession();
         }
@@ -2441,22 +2761,28 @@ void Room::uploadFile(const QString& id, const QUrl& localFilename,
 {
     Q_ASSERT_X(localFilename.isLocalFile(), __FUNCTION__,
                "localFilename should point at a local file");
-    auto fileName = localFilename.toLocalFile();
-    FileSourceInfo fileMetadata;
+    const auto fileName = localFilename.toLocalFile();
+    EncryptingFileDevice* encryptor = nullptr;
+    UploadContentJob* job = nullptr;
 #ifdef Quotient_E2EE_ENABLED
-    QTemporaryFile tempFile;
     if (usesEncryption()) {
-        tempFile.open();
-        QFile file(localFilename.toLocalFile());
-        file.open(QFile::ReadOnly);
-        QByteArray data;
-        std::tie(fileMetadata, data) = encryptFile(file.readAll());
-        tempFile.write(data);
-        tempFile.close();
-        fileName = QFileInfo(tempFile).absoluteFilePath();
-    }
+        // The file is encrypted on the fly while being uploaded; the file name
+        // is not disclosed to the server.
+        encryptor = new EncryptingFileDevice(fileName);
+        if (encryptor->open(QIODevice::ReadOnly))
+            job = connection()->uploadContent(
+                encryptor, {},
+                overrideContentType.isEmpty()
+                    ? QStringLiteral("application/octet-stream")
+                    : overrideContentType);
+        else {
+            qCWarning(MAIN) << "Couldn't open" << fileName
+                            << "for encryption:" << encryptor->errorString();
+            delete encryptor;
+        }
+    } else
 #endif
-    auto job = connection()->uploadFile(fileName, overrideContentType);
+        job = connection()->uploadFile(fileName, overrideContentType);
     if (isJobPending(job)) {
         d->fileTransfers[id] = { job, fileName, true };
         connect(job, &BaseJob::uploadProgress, this,
@@ -2464,10 +2790,14 @@ void Room::uploadFile(const QString& id, const QUrl& localFilename,
                     d->fileTransfers[id].update(sent, total);
                     emit fileTransferProgress(id, sent, total);
                 });
+        // The encryptor is owned by the job and is alive until it's deleted
         connect(job, &BaseJob::success, this,
-                [this, id, localFilename, job, fileMetadata]() mutable {
-                    // The lambda is mutable to change encryptedFileMetadata
+                [this, id, localFilename, job, encryptor] {
                     d->fileTransfers[id].status = FileTransferInfo::Completed;
+                    // The hash of encrypted data is only known at this point
+                    auto fileMetadata = encryptor
+                                            ? FileSourceInfo { encryptor->metadata() }
+                                            : FileSourceInfo {};
                     setUrlInSourceInfo(fileMetadata, QUrl(job->contentUri()));
                     emit fileTransferCompleted(id, localFilename, fileMetadata);
                 });
@@ -2569,7 +2899,7 @@ void Room::Private::dropDuplicateEvents(RoomEvents& events) const
     // 1. Check for duplicates against the timeline.
     auto dupsBegin =
         remove_if(events.begin(), events.end(), [&](const RoomEventPtr& e) {
-            return eventsIndex.contains(e->id());
+            return eventsIndex.contains(InternedId::find(e->id()));
         });
 
     // 2. Check for duplicates within the batch if there are still events.
@@ -2580,8 +2910,8 @@ void Room::Private::dropDuplicateEvents(RoomEvents& events) const
     if (dupsBegin == events.end())
         return;
 
-    qCDebug(EVENTS) << "Dropping" << distance(dupsBegin, events.end())
-                    << "duplicate event(s)";
+    QUO_CDEBUG(EVENTS) << "Dropping" << distance(dupsBegin, events.end())
+                       << "duplicate event(s)";
     events.erase(dupsBegin, events.end());
 }
 
@@ -2650,7 +2980,8 @@ bool Room::Private::processRedaction(const RedactionEvent& redaction)
 {
     // Can't use findInTimeline because it returns a const iterator, and
     // we need to change the underlying TimelineItem.
-    const auto pIdx = eventsIndex.constFind(redaction.redactedEvent());
+    const auto pIdx =
+        eventsIndex.constFind(InternedId::find(redaction.redactedEvent()));
     if (pIdx == eventsIndex.cend())
         return false;
 
@@ -2728,7 +3059,8 @@ bool Room::Private::processReplacement(const RoomMessageEvent& newEvent)
 {
     // Can't use findInTimeline because it returns a const iterator, and
     // we need to change the underlying TimelineItem.
-    const auto pIdx = eventsIndex.constFind(newEvent.replacedEvent());
+    const auto pIdx =
+        eventsIndex.constFind(InternedId::find(newEvent.replacedEvent()));
     if (pIdx == eventsIndex.cend())
         return false;
 
@@ -2769,6 +3101,172 @@ inline bool isEditing(const RoomEventPtr& ep)
     return false;
 }
 
+#ifdef Quotient_E2EE_ENABLED
+namespace {
+//! \brief The pool to decrypt event batches on
+//!
+//! The caller blocks until the whole batch is decrypted, so this is not
+//! the global pool: long-running tasks queued there by other parts of
+//! the library (or by the client) would stall the room's thread.
+QThreadPool& decryptionPool()
+{
+    static QThreadPool pool;
+    return pool;
+}
+
+//! A thread pool task that releases a semaphore once done
+class DecryptionTask : public QRunnable {
+public:
+    DecryptionTask(std::function<void()> fn, QSemaphore& done)
+        : fn(std::move(fn)), done(done)
+    {}
+    void run() override
+    {
+        fn();
+        done.release();
+    }
+
+private:
+    std::function<void()> fn;
+    QSemaphore& done;
+};
+} // namespace
+
+std::vector<RoomEventPtr> Room::Private::decryptEvents(
+    const std::vector<const EncryptedEvent*>& events)
+{
+    struct SessionBatch {
+        //! Shared with the session cache, so that the session stays alive
+        //! even if other sessions of the batch push it out of the cache
+        std::shared_ptr<QOlmInboundGroupSession> session = nullptr;
+        std::vector<size_t> eventIndices {};
+        std::vector<bool> sendersVerified {};
+        std::vector<QByteArray> ciphertexts {};
+        std::vector<Omittable<std::pair<QByteArray, uint32_t>>> results {};
+
+        void decrypt()
+        {
+            results.reserve(ciphertexts.size());
+            for (const auto& ciphertext : ciphertexts) {
+                auto& r = results.emplace_back();
+                if (auto result = session->decrypt(ciphertext))
+                    r = std::move(*result);
+                else
+                    qCWarning(E2EE) << "Unable to decrypt event with matching"
+                                       " megolm session:"
+                                    << result.error();
+            }
+        }
+    };
+
+    QElapsedTimer et;
+    et.start();
+    std::vector<RoomEventPtr> decryptedEvents(events.size());
+    auto& pendingEvents = pending();
+    // Group events by session, leaving out those that can't be decrypted
+    UnorderedMap<QString, SessionBatch> batches;
+    for (size_t i = 0; i < events.size(); ++i) {
+        const auto* encrypted = events[i];
+        if (encrypted->algorithm() != MegolmV1AesSha2AlgoKey) {
+            qCWarning(E2EE) << "Algorithm of the encrypted event with id"
+                            << encrypted->id()
+                            << "is not decryptable by the current device";
+            continue;
+        }
+        const auto sessionId = encrypted->sessionId();
+        auto [it, isNew] = batches.try_emplace(sessionId);
+        auto& batch = it->second;
+        if (isNew)
+            batch.session = megolmSession(sessionId);
+        if (!batch.session) {
+            pendingEvents.add(sessionId, encrypted->id());
+            continue;
+        }
+        const auto senderCheck =
+            checkMegolmSessionSender(*batch.session, encrypted->senderId());
+        if (senderCheck == SenderCheck::Mismatch) {
+            pendingEvents.add(sessionId, encrypted->id());
+            continue;
+        }
+        batch.eventIndices.push_back(i);
+        batch.sendersVerified.push_back(senderCheck == SenderCheck::Verified);
+        batch.ciphertexts.push_back(encrypted->ciphertext());
+    }
+
+    std::vector<SessionBatch*> pendingBatches;
+    for (auto& [sessionId, batch] : batches)
+        if (!batch.ciphertexts.empty())
+            pendingBatches.push_back(&batch);
+    if (!pendingBatches.empty()) {
+        // Offload all batches but the first one to the pool and take care
+        // of the first one on this thread in the meantime
+        QSemaphore done;
+        for (size_t b = 1; b < pendingBatches.size(); ++b)
+            decryptionPool().start(new DecryptionTask(
+                [batch = pendingBatches[b]] { batch->decrypt(); }, done));
+        pendingBatches.front()->decrypt();
+        done.acquire(int(pendingBatches.size() - 1));
+    }
+
+    qint64 decryptedCount = 0;
+    for (auto& [sessionId, batch] : batches)
+        for (size_t k = 0; k < batch.results.size(); ++k) {
+            const auto i = batch.eventIndices[k];
+            const auto& encrypted = *events[i];
+            const auto& result = batch.results[k];
+            RoomEventPtr decrypted;
+            if (result && !result->first.isEmpty()
+                && checkMegolmMessageIndex(sessionId, result->second,
+                                           encrypted.id(),
+                                           encrypted.originTimestamp())) {
+                decrypted = encrypted.createDecrypted(result->first);
+                if (decrypted->roomId() != id) {
+                    qCWarning(E2EE) << "Decrypted event" << encrypted.id()
+                                    << "not for this room; discarding.";
+                    decrypted.reset();
+                }
+            }
+            if (decrypted) {
+                decrypted->setSenderVerified(batch.sendersVerified[k]);
+                pendingEvents.remove(encrypted.id());
+                decryptedEvents[i] = std::move(decrypted);
+                ++decryptedCount;
+            } else
+                pendingEvents.add(sessionId, encrypted.id());
+        }
+    pendingEvents.flush(connection->database(), id);
+
+    auto& metrics = connection->metrics();
+    metrics.observe(MetricNames::DecryptSeconds, et,
+                    { { QStringLiteral("mode"), QStringLiteral("batch") } });
+    if (const auto failedCount = qint64(events.size()) - decryptedCount;
+        failedCount > 0)
+        metrics.increment(MetricNames::DecryptFailures, failedCount);
+    return decryptedEvents;
+}
+
+void Room::Private::decryptIncomingEvents(RoomEvents& events)
+{
+    std::vector<const EncryptedEvent*> encryptedEvents;
+    std::vector<size_t> eventIndices;
+    for (size_t i = 0; i < events.size(); ++i)
+        if (const auto* encrypted = eventCast<EncryptedEvent>(events[i])) {
+            encryptedEvents.push_back(encrypted);
+            eventIndices.push_back(i);
+        }
+    if (encryptedEvents.empty())
+        return;
+
+    auto decryptedEvents = decryptEvents(encryptedEvents);
+    for (size_t k = 0; k < decryptedEvents.size(); ++k)
+        if (auto& decrypted = decryptedEvents[k]) {
+            auto& eventPtr = events[eventIndices[k]];
+            auto oldEvent = std::exchange(eventPtr, std::move(decrypted));
+            eventPtr->setOriginalEvent(std::move(oldEvent));
+        }
+}
+#endif // Quotient_E2EE_ENABLED
+
 Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
 {
     dropDuplicateEvents(events);
@@ -2779,17 +3277,7 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
     et.start();
 
 #ifdef Quotient_E2EE_ENABLED
-    for(long unsigned int i = 0; i < events.size(); i++) {
-        if(auto* encrypted = eventCast<EncryptedEvent>(events[i])) {
-            auto decrypted = q->decryptMessage(*encrypted);
-            if(decrypted) {
-                auto oldEvent = std::exchange(events[i], std::move(decrypted));
-                events[i]->setOriginalEvent(std::move(oldEvent));
-            } else {
-                undecryptedEvents[encrypted->sessionId()] += encrypted->id();
-            }
-        }
-    }
+    decryptIncomingEvents(events);
 #endif
 
     {
@@ -2810,7 +3298,7 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
                         }); targetIt != events.end())
                     *targetIt = makeRedacted(**targetIt, *r);
                 else
-                    qCDebug(STATE)
+                    QUO_CDEBUG(STATE)
                         << "Redaction" << r->id() << "ignored: target event"
                         << r->redactedEvent() << "is not found";
                 // If the target event comes later, it comes already redacted.
@@ -2826,7 +3314,7 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
                 if (targetIt != it)
                     *targetIt = makeReplaced(**targetIt, *msg);
                 else // FIXME: hide the replacing event when target arrives later
-                    qCDebug(EVENTS)
+                    QUO_CDEBUG(EVENTS)
                         << "Replacing event" << msg->id()
                         << "ignored: target event" << msg->replacedEvent()
                         << "is not found";
@@ -2875,9 +3363,9 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
             emit q->pendingEventChanged(pendingEvtIdx);
         }
         emit q->pendingEventAboutToMerge(nextPendingEvt, pendingEvtIdx);
-        qCDebug(MESSAGES) << "Merging pending event from transaction"
-                         << nextPendingEvt->transactionId() << "into"
-                         << nextPendingEvt->id();
+        QUO_CDEBUG(MESSAGES) << "Merging pending event from transaction"
+                             << nextPendingEvt->transactionId() << "into"
+                             << nextPendingEvt->id();
         auto transfer = fileTransfers.take(nextPendingEvt->transactionId());
         if (transfer.status != FileTransferInfo::None)
             fileTransfers.insert(nextPendingEvt->id(), transfer);
@@ -2910,9 +3398,10 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
             }
         }
 
-        qCDebug(MESSAGES) << "Room" << q->objectName() << "received"
-                       << totalInserted << "new events; the last event is now"
-                       << timeline.back();
+        QUO_CDEBUG(MESSAGES) << "Room" << q->objectName() << "received"
+                             << totalInserted
+                             << "new events; the last event is now"
+                             << timeline.back();
 
         roomChanges |= updateStats(timeline.crbegin(), rev_iter_t(from));
 
@@ -2927,9 +3416,12 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
     }
 
     Q_ASSERT(timeline.size() == timelineSize + totalInserted);
+    auto& metrics = connection->metrics();
+    metrics.increment(MetricNames::TimelineEvents, totalInserted);
+    metrics.observe(MetricNames::TimelineInsertSeconds, et);
     if (totalInserted > 9 || et.nsecsElapsed() >= profilerMinNsecs())
-        qCDebug(PROFILER) << "Added" << totalInserted << "new event(s) to"
-                          << q->objectName() << "in" << et;
+        QUO_CDEBUG(PROFILER) << "Added" << totalInserted << "new event(s) to"
+                             << q->objectName() << "in" << et;
     return roomChanges;
 }
 
@@ -2946,17 +3438,7 @@ void Room::Private::addHistoricalMessageEvents(RoomEvents&& events)
     Changes changes {};
 
 #ifdef Quotient_E2EE_ENABLED
-    for(long unsigned int i = 0; i < events.size(); i++) {
-        if(auto* encrypted = eventCast<EncryptedEvent>(events[i])) {
-            auto decrypted = q->decryptMessage(*encrypted);
-            if(decrypted) {
-                auto oldEvent = std::exchange(events[i], std::move(decrypted));
-                events[i]->setOriginalEvent(std::move(oldEvent));
-            } else {
-                undecryptedEvents[encrypted->sessionId()] += encrypted->id();
-            }
-        }
-    }
+    decryptIncomingEvents(events);
 #endif
 
     // In case of lazy-loading new members may be loaded with historical
@@ -2975,8 +3457,9 @@ void Room::Private::addHistoricalMessageEvents(RoomEvents&& events)
     const auto insertedSize = moveEventsToTimeline(events, Older);
     const auto from = historyEdge() - insertedSize;
 
-    qCDebug(STATE) << "Room" << displayname << "received" << insertedSize
-                   << "past events; the oldest event is now" << timeline.front();
+    QUO_CDEBUG(STATE) << "Room" << displayname << "received" << insertedSize
+                      << "past events; the oldest event is now"
+                      << timeline.front();
     q->onAddHistoricalTimelineEvents(from);
     emit q->addedMessages(timeline.front().index(), from->index());
 
@@ -2988,9 +3471,13 @@ void Room::Private::addHistoricalMessageEvents(RoomEvents&& events)
         }
     }
     Q_ASSERT(timeline.size() == timelineSize + insertedSize);
+    auto& metrics = connection->metrics();
+    metrics.increment(MetricNames::TimelineEvents, insertedSize);
+    metrics.observe(MetricNames::TimelineInsertSeconds, et);
     if (insertedSize > 9 || et.nsecsElapsed() >= profilerMinNsecs())
-        qCDebug(PROFILER) << "Added" << insertedSize << "historical event(s) to"
-                          << q->objectName() << "in" << et;
+        QUO_CDEBUG(PROFILER) << "Added" << insertedSize
+                             << "historical event(s) to" << q->objectName()
+                             << "in" << et;
 
     changes |= updateStats(from, historyEdge());
     if (changes)
@@ -3094,13 +3581,15 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
     // Change the state
     const auto* const oldStateEvent =
         std::exchange(curStateEvent, static_cast<const StateEventBase*>(&e));
+    if (d->stateJson) // Detaches from the snapshots' copies, if any
+        d->stateJson->insert({ e.matrixType(), e.stateKey() }, e.fullJson());
     Q_ASSERT(!oldStateEvent
              || (oldStateEvent->matrixType() == e.matrixType()
                  && oldStateEvent->stateKey() == e.stateKey()));
     if (is<RoomMemberEvent>(e))
-        qCDebug(MEMBERS) << "Updated room member state:" << e;
+        QUO_CDEBUG(MEMBERS) << "Updated room member state:" << e;
     else
-        qCDebug(STATE) << "Updated room state:" << e;
+        QUO_CDEBUG(STATE) << "Updated room state:" << e;
 
     // Update internal structures as per the change and work out the return value
 
@@ -3225,7 +3714,7 @@ Room::Changes Room::processEphemeralEvent(EventPtr&& event)
                 d->usersTyping.append(user(userId));
 
         if (users.size() > 3 || et.nsecsElapsed() >= profilerMinNsecs())
-            qCDebug(PROFILER)
+            QUO_CDEBUG(PROFILER)
                 << "Processing typing events from" << users.size()
                 << "user(s) in" << objectName() << "took" << et;
         emit typingChanged();
@@ -3237,7 +3726,7 @@ Room::Changes Room::processEphemeralEvent(EventPtr&& event)
             totalReceipts += p.receipts.size();
             const auto newMarker = findInTimeline(p.evtId);
             if (newMarker == historyEdge())
-                qCDebug(EPHEMERAL)
+                QUO_CDEBUG(EPHEMERAL)
                     << "Event" << p.evtId
                     << "is not found; saving read receipt(s) anyway";
             // If the event is not found (most likely, because it's too old and
@@ -3257,18 +3746,21 @@ Room::Changes Room::processEphemeralEvent(EventPtr&& event)
                 });
 
             if (p.receipts.size() > 1)
-                qCDebug(EPHEMERAL) << p.evtId << "marked as read for"
-                                   << updatedCount << "user(s)";
+                QUO_CDEBUG(EPHEMERAL) << p.evtId << "marked as read for"
+                                      << updatedCount << "user(s)";
             if (updatedCount < p.receipts.size())
-                qCDebug(EPHEMERAL) << p.receipts.size() - updatedCount
-                                   << "receipts were skipped";
+                QUO_CDEBUG(EPHEMERAL) << p.receipts.size() - updatedCount
+                                      << "receipts were skipped";
         }
         if (eventsWithReceipts.size() > 3 || totalReceipts > 10
             || et.nsecsElapsed() >= profilerMinNsecs())
-            qCDebug(PROFILER) << "Processing" << totalReceipts
-                              << "receipt(s) on" << eventsWithReceipts.size()
-                              << "event(s) in" << objectName() << "took" << et;
+            QUO_CDEBUG(PROFILER)
+                << "Processing" << totalReceipts << "receipt(s) on"
+                << eventsWithReceipts.size() << "event(s) in" << objectName()
+                << "took" << et;
     }
+    connection()->metrics().observe(MetricNames::EphemeralProcessingSeconds,
+                                    et);
     return changes;
 }
 
@@ -3494,6 +3986,81 @@ QJsonObject Room::Private::toJson() const
 
 QJsonObject Room::toJson() const { return d->toJson(); }
 
+MemoryUsage Room::memoryUsage() const
+{
+    using M = MemoryUsage;
+    MemoryUsage result;
+
+    qint64 timelineBytes = qint64(d->timeline.size() * sizeof(TimelineItem));
+    for (const auto& ti : d->timeline)
+        timelineBytes += M::sizeOf(*ti);
+    result.add(QStringLiteral("timeline"), timelineBytes);
+
+    qint64 pendingBytes =
+        qint64(d->unsyncedEvents.capacity() * sizeof(PendingEventItem));
+    for (const auto& pi : d->unsyncedEvents)
+        pendingBytes += M::sizeOf(*pi) + M::sizeOf(pi.annotation());
+    result.add(QStringLiteral("pendingEvents"), pendingBytes);
+
+    // State events in the timeline are already counted above; currentState
+    // only refers to events owned by baseState or the timeline
+    qint64 stateBytes =
+        M::nodesOf(d->baseState) + M::nodesOf(d->currentState.events());
+    if (d->stateJson) // The JSON itself is shared with the events
+        stateBytes += M::nodesOf(*d->stateJson);
+    for (const auto& [key, evt] : d->baseState)
+        stateBytes += M::sizeOf(key.first) + M::sizeOf(key.second)
+                      + (evt ? M::sizeOf(*evt) : 0);
+    result.add(QStringLiteral("state"), stateBytes);
+
+    // Keys are InternedId handles; the strings are accounted for
+    // by InternedId::memoryUsage()
+    result.add(QStringLiteral("eventsIndex"), M::nodesOf(d->eventsIndex));
+
+    qint64 relationsBytes = M::nodesOf(d->relations);
+    for (auto it = d->relations.cbegin(); it != d->relations.cend(); ++it)
+        relationsBytes += M::sizeOf(it.key().first)
+                          + M::sizeOf(it.key().second)
+                          + qint64(it->capacity() * sizeof(const RoomEvent*));
+    result.add(QStringLiteral("relations"), relationsBytes);
+
+    qint64 receiptsBytes =
+        M::nodesOf(d->lastReadReceipts) + M::nodesOf(d->eventIdReadUsers);
+    for (const auto& userIds : std::as_const(d->eventIdReadUsers))
+        receiptsBytes += M::nodesOf(userIds);
+    result.add(QStringLiteral("receipts"), receiptsBytes);
+
+    qint64 membersBytes = M::nodesOf(d->membersMap);
+    for (auto it = d->membersMap.cbegin(); it != d->membersMap.cend(); ++it)
+        membersBytes += M::sizeOf(it.key());
+    membersBytes += qint64((d->usersTyping.size() + d->usersInvited.size()
+                            + d->membersLeft.size())
+                           * sizeof(User*));
+    result.add(QStringLiteral("members"), membersBytes);
+
+    qint64 notificationsBytes = M::nodesOf(d->notifications);
+    for (auto it = d->notifications.cbegin(); it != d->notifications.cend();
+         ++it)
+        notificationsBytes += M::sizeOf(it.key());
+    result.add(QStringLiteral("notifications"), notificationsBytes);
+
+    qint64 accountDataBytes = M::nodesOf(d->accountData) + M::nodesOf(d->tags);
+    for (const auto& [type, evt] : d->accountData)
+        accountDataBytes += M::sizeOf(type) + (evt ? M::sizeOf(*evt) : 0);
+    for (auto it = d->tags.cbegin(); it != d->tags.cend(); ++it)
+        accountDataBytes += M::sizeOf(it.key());
+    result.add(QStringLiteral("accountData"), accountDataBytes);
+
+    result.add(QStringLiteral("avatar"), d->avatar.cachedImagesSize());
+
+#ifdef Quotient_E2EE_ENABLED
+    if (d->pendingDecryptions)
+        result.add(QStringLiteral("pendingDecryptions"),
+                   d->pendingDecryptions->memoryUsage());
+#endif
+    return result;
+}
+
 MemberSorter Room::memberSorter() const { return MemberSorter(this); }
 
 bool MemberSorter::operator()(User* u1, User* u2) const
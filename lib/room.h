@@ -11,7 +11,9 @@
 
 #include "connection.h"
 #include "roomstateview.h"
+#include "roomsnapshot.h"
 #include "eventitem.h"
+#include "memoryusage.h"
 #include "quotient_common.h"
 
 #include "csapi/message_pagination.h"
@@ -278,6 +280,12 @@ public:
     bool usesEncryption() const;
     RoomEventPtr decryptMessage(const EncryptedEvent& encryptedEvent);
     void handleRoomKeyEvent(const RoomKeyEvent& roomKeyEvent, const QString& senderId, const QString& olmSessionId);
+    //! \brief Use megolm sessions imported into the database for the room
+    //!
+    //! Events that could not be decrypted so far for lack of those sessions
+    //! are decrypted and replaced in the timeline.
+    //! \sa Connection::importRoomKeys
+    void handleImportedMegolmSessions(const QSet<QString>& sessionIds);
     int joinedCount() const;
     int invitedCount() const;
     int totalMemberCount() const;
@@ -403,6 +411,18 @@ public:
     const RoomCreateEvent* creation() const;
     const RoomTombstoneEvent* tombstone() const;
 
+    //! \brief Estimate memory used by the room, per subsystem
+    //!
+    //! Subsystems are: \c timeline (events with their JSON), \c pendingEvents,
+    //! \c state (events not in the timeline and the state lookup tables),
+    //! \c eventsIndex, \c relations, \c receipts, \c members (the lookup
+    //! tables; User objects are accounted for by the connection),
+    //! \c notifications, \c accountData, \c avatar (cached images) and,
+    //! with E2EE, \c pendingDecryptions. Users' avatars and the room state
+    //! shared between rooms are not included.
+    //! \sa Connection::memoryUsage
+    MemoryUsage memoryUsage() const;
+
     bool displayed() const;
     /// Mark the room as currently displayed to the user
     /**
@@ -782,6 +802,18 @@ public:
     /// \brief Get the current room state
     RoomStateView currentState() const;
 
+    //! \brief Capture room data for reading from other threads
+    //!
+    //! Makes an immutable copy of the current state, the summary, the unread
+    //! statistics and the last \p timelineWindow events of the timeline
+    //! (pass a negative value to capture the whole loaded timeline). Unlike
+    //! the room itself, the returned object can be passed to and read from
+    //! any thread. This method, like other Room methods, must be called from
+    //! the thread the room lives in; use invokeBlocking() to call it from
+    //! elsewhere. Taking snapshots repeatedly is cheap: the state table is
+    //! shared between snapshots until the room state changes.
+    RoomSnapshot snapshot(int timelineWindow = 100) const;
+
     //! Send a request to update the room state with the given event
     SetRoomStateWithKeyJob* setState(const StateEventBase& evt);
 
@@ -996,6 +1028,13 @@ Q_SIGNALS:
     void updatedEvent(QString eventId);
     void replacedEvent(const Quotient::RoomEvent* newEvent,
                        const Quotient::RoomEvent* oldEvent);
+    //! \brief Events waiting for megolm sessions have been decrypted
+    //!
+    //! Emitted once for all events decrypted after new sessions arrived,
+    //! instead of replacedEvent() for each of them; \p timelineIndices
+    //! point to the decrypted events, which keep the encrypted ones as
+    //! their originalEvent().
+    void eventsDecrypted(QVector<int> timelineIndices);
 
     void newFileTransfer(QString id, QUrl localFile);
     void fileTransferProgress(QString id, qint64 progress, qint64 total);
@@ -0,0 +1,156 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "roomsnapshot.h"
+
+#include "eventstats.h"
+#include "room.h"
+#include "syncdata.h"
+
+#include "events/roommemberevent.h"
+
+using namespace Quotient;
+
+struct RoomSnapshot::Data {
+    QString id;
+    JoinState joinState;
+    QString displayName;
+    QString topic;
+    QString canonicalAlias;
+    bool usesEncryption;
+    RoomSummary summary;
+    EventStats partiallyReadStats;
+    EventStats unreadStats;
+    qsizetype highlightCount;
+    QString lastFullyReadEventId;
+    StateTable state;
+    QVector<TimelineEntry> timeline;
+    TimelineItem::index_t minTimelineIndex;
+};
+
+RoomSnapshot::RoomSnapshot(const Room& room, const RoomSummary& summary,
+                           StateTable state, int timelineWindow)
+{
+    const auto& roomTimeline = room.messageEvents();
+    const auto windowSize =
+        timelineWindow < 0
+            ? roomTimeline.size()
+            : std::min(roomTimeline.size(), size_t(timelineWindow));
+    QVector<TimelineEntry> timeline;
+    timeline.reserve(int(windowSize));
+    for (auto it = roomTimeline.cend() - ptrdiff_t(windowSize);
+         it != roomTimeline.cend(); ++it)
+        timeline.push_back({ it->index(), (*it)->fullJson() });
+
+    d = std::make_shared<const Data>(
+        Data { room.id(), room.joinState(), room.displayName(), room.topic(),
+               room.canonicalAlias(), room.usesEncryption(), summary,
+               room.partiallyReadStats(), room.unreadStats(),
+               room.highlightCount(), room.lastFullyReadEventId(),
+               std::move(state), std::move(timeline),
+               room.minTimelineIndex() });
+}
+
+namespace {
+template <typename T>
+const T& nullValue()
+{
+    static const T value {};
+    return value;
+}
+} // namespace
+
+QString RoomSnapshot::id() const { return d ? d->id : QString(); }
+
+JoinState RoomSnapshot::joinState() const
+{
+    return d ? d->joinState : JoinState::Invalid;
+}
+
+QString RoomSnapshot::displayName() const
+{
+    return d ? d->displayName : QString();
+}
+
+QString RoomSnapshot::topic() const { return d ? d->topic : QString(); }
+
+QString RoomSnapshot::canonicalAlias() const
+{
+    return d ? d->canonicalAlias : QString();
+}
+
+bool RoomSnapshot::usesEncryption() const { return d && d->usesEncryption; }
+
+RoomSummary RoomSnapshot::summary() const
+{
+    return d ? d->summary : RoomSummary();
+}
+
+EventStats RoomSnapshot::partiallyReadStats() const
+{
+    return d ? d->partiallyReadStats : EventStats();
+}
+
+EventStats RoomSnapshot::unreadStats() const
+{
+    return d ? d->unreadStats : EventStats();
+}
+
+qsizetype RoomSnapshot::highlightCount() const
+{
+    return d ? d->highlightCount : 0;
+}
+
+QString RoomSnapshot::lastFullyReadEventId() const
+{
+    return d ? d->lastFullyReadEventId : QString();
+}
+
+const RoomSnapshot::StateTable& RoomSnapshot::state() const
+{
+    return d ? d->state : nullValue<StateTable>();
+}
+
+QJsonObject RoomSnapshot::stateEventJson(const QString& evtType,
+                                         const QString& stateKey) const
+{
+    return state().value({ evtType, stateKey });
+}
+
+QStringList RoomSnapshot::joinedMemberIds() const
+{
+    QStringList result;
+    const auto& s = state();
+    for (auto it = s.cbegin(); it != s.cend(); ++it)
+        if (it.key().first == RoomMemberEvent::TypeId
+            && it.value()[ContentKeyL]["membership"_ls].toString()
+                   == "join"_ls)
+            result.push_back(it.key().second);
+    return result;
+}
+
+QString RoomSnapshot::memberDisplayName(const QString& userId) const
+{
+    const auto json = stateEventJson(RoomMemberEvent::TypeId, userId);
+    return json[ContentKeyL]["displayname"_ls].toString();
+}
+
+const QVector<RoomSnapshot::TimelineEntry>& RoomSnapshot::timeline() const
+{
+    return d ? d->timeline : nullValue<QVector<TimelineEntry>>();
+}
+
+QJsonObject RoomSnapshot::timelineEvent(TimelineItem::index_t index) const
+{
+    const auto& t = timeline();
+    if (t.isEmpty())
+        return {};
+    // The window is contiguous, so the position can be calculated
+    const auto pos = index - t.front().index;
+    return pos >= 0 && pos < t.size() ? t[pos].json : QJsonObject();
+}
+
+TimelineItem::index_t RoomSnapshot::minTimelineIndex() const
+{
+    return d ? d->minTimelineIndex : 0;
+}
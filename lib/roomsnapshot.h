@@ -0,0 +1,98 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "quotient_common.h"
+#include "eventitem.h"
+
+#include "events/stateevent.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QJsonObject>
+#include <QtCore/QVector>
+
+#include <memory>
+
+namespace Quotient {
+class Room;
+struct EventStats;
+struct RoomSummary;
+
+//! \brief An immutable copy of room data that can be read from any thread
+//!
+//! Room objects live in the thread of their connection and their containers
+//! (the timeline, the state) change with every sync; reading them from
+//! another thread is not safe. Room::snapshot() captures the current state,
+//! the summary, the unread statistics and a window of the timeline into
+//! an object of this class instead. Snapshots never change after creation;
+//! they can be copied around and read from any number of threads without
+//! locking. Copying a snapshot only copies a pointer; making one is cheap
+//! as well, since events are captured as their (implicitly shared) JSON,
+//! and the state table is shared with the room until the room state changes.
+//!
+//! Events are stored in their JSON form; use loadEvent() to get typed
+//! event objects out of them in the consumer thread.
+//! \sa Room::snapshot
+class QUOTIENT_API RoomSnapshot {
+public:
+    //! An event in the captured timeline window
+    struct TimelineEntry {
+        TimelineItem::index_t index;
+        QJsonObject json;
+    };
+    using StateTable = QHash<StateEventKey, QJsonObject>;
+
+    //! Make a null snapshot; accessors return empty/default values on it
+    RoomSnapshot() = default;
+
+    bool isNull() const { return d == nullptr; }
+
+    QString id() const;
+    JoinState joinState() const;
+    //! The room display name calculated by the room when taking the snapshot
+    QString displayName() const;
+    QString topic() const;
+    QString canonicalAlias() const;
+    bool usesEncryption() const;
+
+    RoomSummary summary() const;
+    EventStats partiallyReadStats() const;
+    EventStats unreadStats() const;
+    qsizetype highlightCount() const;
+    QString lastFullyReadEventId() const;
+
+    //! The whole current state of the room, as event JSON
+    const StateTable& state() const;
+    //! The JSON of the state event with the given type and state key;
+    //! empty if there's no such event in the room state
+    QJsonObject stateEventJson(const QString& evtType,
+                               const QString& stateKey = {}) const;
+    //! The ids of users with \c join membership
+    QStringList joinedMemberIds() const;
+    //! \brief The display name set by the member in their membership event
+    //!
+    //! Unlike Room::safeMemberName() and friends, this doesn't disambiguate
+    //! between members with the same display name.
+    QString memberDisplayName(const QString& userId) const;
+
+    //! The captured timeline window, from the oldest to the newest event
+    const QVector<TimelineEntry>& timeline() const;
+    //! \brief The JSON of the timeline event with the given index
+    //!
+    //! Returns an empty object if the event is outside the captured window.
+    QJsonObject timelineEvent(TimelineItem::index_t index) const;
+    //! The lowest timeline index in the room at the snapshot moment; can be
+    //! below the first index in timeline() if the window was limited
+    TimelineItem::index_t minTimelineIndex() const;
+
+private:
+    friend class Room;
+    struct Data;
+    std::shared_ptr<const Data> d;
+
+    RoomSnapshot(const Room& room, const RoomSummary& summary,
+                 StateTable state, int timelineWindow);
+};
+} // namespace Quotient
+Q_DECLARE_METATYPE(Quotient::RoomSnapshot)
@@ -99,6 +99,33 @@ SyncRoomData::SyncRoomData(QString roomId_, JoinState joinState,
     fromJson(unreadJson.value(HighlightCountKey), highlightCount);
 }
 
+template <typename EventsArrayT>
+inline void appendEvents(EventsArrayT& to, EventsArrayT&& from)
+{
+    to.insert(to.end(), std::make_move_iterator(from.begin()),
+              std::make_move_iterator(from.end()));
+}
+
+bool SyncRoomData::merge(SyncRoomData&& other)
+{
+    // Invite data have no timeline; and a state block in a later update
+    // describes the state after this update's timeline, which updateData()
+    // would apply before it. Both cases are left for separate updates.
+    if (other.roomId != roomId || other.joinState != joinState
+        || joinState == JoinState::Invite || other.timelineLimited
+        || !other.state.empty())
+        return false;
+
+    summary.merge(other.summary);
+    appendEvents(timeline, std::move(other.timeline));
+    appendEvents(ephemeral, std::move(other.ephemeral));
+    appendEvents(accountData, std::move(other.accountData));
+    partiallyReadCount.merge(other.partiallyReadCount);
+    unreadCount.merge(other.unreadCount);
+    highlightCount.merge(other.highlightCount);
+    return true;
+}
+
 QDebug Quotient::operator<<(QDebug dbg, const DevicesList& devicesList)
 {
     QDebugStateSaver _(dbg);
@@ -240,6 +267,8 @@ void SyncData::parseJson(const QJsonObject& json, const QString& baseDir)
     }
     if (!unresolvedRoomIds.empty())
         qCWarning(MAIN) << "Unresolved rooms:" << unresolvedRoomIds.join(',');
+    eventCount_ = totalEvents;
+    parsingNsecs_ = et.nsecsElapsed();
     if (totalRooms > 9 || et.nsecsElapsed() >= profilerMinNsecs())
         qCDebug(PROFILER) << "*** SyncData::parseJson(): batch with"
                           << totalRooms << "room(s)," << totalEvents
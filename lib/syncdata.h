@@ -82,6 +82,14 @@ public:
                  const QJsonObject& roomJson);
     SyncRoomData(SyncRoomData&&) = default;
     SyncRoomData& operator=(SyncRoomData&&) = default;
+
+    /// \brief Append a later update for the same room to this one
+    ///
+    /// Only an update that continues this one without a gap - the same join
+    /// state, no limited timeline and no state block - can be merged;
+    /// \p other is left intact otherwise.
+    /// \return true if \p other has been merged into this object
+    bool merge(SyncRoomData&& other);
 };
 
 // QVector cannot work with non-copyable objects, std::vector can.
@@ -109,6 +117,10 @@ public:
     DevicesList takeDevicesList();
 
     QString nextBatch() const { return nextBatch_; }
+    //! The number of room events (of all kinds) parsed by parseJson()
+    qint64 eventCount() const { return eventCount_; }
+    //! The time parseJson() took, in nanoseconds
+    qint64 parsingNsecs() const { return parsingNsecs_; }
 
     QStringList unresolvedRooms() const { return unresolvedRoomIds; }
 
@@ -125,6 +137,8 @@ private:
     QStringList unresolvedRoomIds;
     QHash<QString, int> deviceOneTimeKeysCount_;
     DevicesList devicesList;
+    qint64 eventCount_ = 0;
+    qint64 parsingNsecs_ = 0;
 
     static QJsonObject loadJson(const QString& fileName);
 };
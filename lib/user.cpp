@@ -39,11 +39,13 @@ public:
     // the timeline that far back, historical avatars are still kept around.
     // This is consistent with the rest of Quotient, as room timelines
     // are never vacuumed either. This will probably change in the future.
-    /// Map of mediaId to Avatar objects
-    static UnorderedMap<QString, Avatar> otherAvatars;
+    /// Map of mediaId to Avatar objects; Avatar objects use jobs of
+    /// the thread they are requested from so this is per thread
+    static thread_local UnorderedMap<QString, Avatar> otherAvatars;
 };
 
-decltype(User::Private::otherAvatars) User::Private::otherAvatars {};
+thread_local decltype(User::Private::otherAvatars)
+    User::Private::otherAvatars {};
 
 User::User(QString userId, Connection* connection)
     : QObject(connection), d(makeImpl<Private>(move(userId)))
@@ -55,6 +57,30 @@ User::User(QString userId, Connection* connection)
     }
 }
 
+MemoryUsage User::memoryUsage() const
+{
+    MemoryUsage result;
+    result.add(QStringLiteral("names"), MemoryUsage::sizeOf(d->id)
+                                            + MemoryUsage::sizeOf(d->defaultName));
+    result.add(QStringLiteral("avatar"), d->defaultAvatar.cachedImagesSize());
+    return result;
+}
+
+MemoryUsage User::historicalAvatarsMemoryUsage()
+{
+    const auto& avatars = Private::otherAvatars;
+    qint64 images = 0;
+    qint64 ids = MemoryUsage::nodesOf(avatars);
+    for (const auto& [mediaId, avatar] : avatars) {
+        ids += MemoryUsage::sizeOf(mediaId);
+        images += avatar.cachedImagesSize();
+    }
+    MemoryUsage result;
+    result.add(QStringLiteral("historicalAvatarIds"), ids);
+    result.add(QStringLiteral("historicalAvatarImages"), images);
+    return result;
+}
+
 Connection* User::connection() const
 {
     Q_ASSERT(parent());
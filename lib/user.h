@@ -5,6 +5,7 @@
 #pragma once
 
 #include "avatar.h"
+#include "memoryusage.h"
 #include "util.h"
 
 #include <QtCore/QObject>
@@ -92,6 +93,15 @@ public:
     QString avatarMediaId(const Room* room = nullptr) const;
     QUrl avatarUrl(const Room* room = nullptr) const;
 
+    //! Estimated memory used by the user's name and avatar
+    MemoryUsage memoryUsage() const;
+    //! \brief Estimated memory used by avatars that users had in the past
+    //!
+    //! These avatars are shared by all users in the calling thread, across
+    //! connections; they are kept for the timelines to show the avatar
+    //! a user had at the time of an event, and are never forgotten.
+    static MemoryUsage historicalAvatarsMemoryUsage();
+
 public Q_SLOTS:
     /// Set a new name in the global user profile
     void rename(const QString& newName);
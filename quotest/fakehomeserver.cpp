@@ -0,0 +1,658 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "fakehomeserver.h"
+
+#include <QtCore/QDateTime>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QRandomGenerator>
+#include <QtCore/QSet>
+#include <QtNetwork/QTcpSocket>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+constexpr auto ClientApiPrefix = "_matrix/client";
+constexpr auto MediaApiPrefix = "_matrix/media";
+//! Recent events kept for incremental syncs
+constexpr size_t MaxStreamEvents = 10000;
+//! The longest time a /sync request waits for new events
+constexpr int MaxSyncTimeoutMs = 30000;
+constexpr qint64 BaseTimestamp = 1650000000000;
+
+QByteArray toJson(const QJsonObject& o)
+{
+    return QJsonDocument(o).toJson(QJsonDocument::Compact);
+}
+
+QJsonObject parseJson(const QByteArray& bytes)
+{
+    return QJsonDocument::fromJson(bytes).object();
+}
+
+QByteArray errorBody(const QString& errcode, const QString& message)
+{
+    return toJson({ { QStringLiteral("errcode"), errcode },
+                    { QStringLiteral("error"), message } });
+}
+
+QByteArray reasonPhrase(int status)
+{
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 404: return "Not Found";
+    case 429: return "Too Many Requests";
+    default: return "Unknown";
+    }
+}
+
+// A 1x1 transparent PNG served for any media download or thumbnail
+const QByteArray MediaContent = QByteArray::fromBase64(
+    "iVBORw0KGgoAAAANSUhEUgAAAAEAAAABCAQAAAC1HAwCAAAAC0lEQVR42mNkYAAAAAYAAjCB0C8"
+    "AAAAASUVORK5CYII=");
+} // namespace
+
+FakeHomeserver::FakeHomeserver(Config config, QObject* parent)
+    : QObject(parent), config(std::move(config))
+{
+    this->config.historyDepth =
+        std::max(this->config.historyDepth, this->config.messagesPerRoom);
+    connect(&server, &QTcpServer::newConnection, this,
+            &FakeHomeserver::onNewConnection);
+    if (this->config.newMessageIntervalMs > 0) {
+        newMessageTimer.setInterval(this->config.newMessageIntervalMs);
+        connect(&newMessageTimer, &QTimer::timeout, this,
+                &FakeHomeserver::addRandomMessage);
+        newMessageTimer.start();
+    }
+}
+
+bool FakeHomeserver::listen(const QHostAddress& address, quint16 port)
+{
+    return server.listen(address, port);
+}
+
+QUrl FakeHomeserver::baseUrl() const
+{
+    QUrl url;
+    url.setScheme(QStringLiteral("http"));
+    url.setHost(server.serverAddress().toString());
+    url.setPort(server.serverPort());
+    return url;
+}
+
+void FakeHomeserver::onNewConnection()
+{
+    while (auto* socket = server.nextPendingConnection()) {
+        clients.insert(socket, {});
+        connect(socket, &QTcpSocket::readyRead, this,
+                [this, socket] { processBuffer(socket); });
+        connect(socket, &QTcpSocket::disconnected, this, [this, socket] {
+            clients.remove(socket);
+            socket->deleteLater();
+        });
+    }
+}
+
+void FakeHomeserver::processBuffer(QTcpSocket* socket)
+{
+    auto it = clients.find(socket);
+    if (it == clients.end())
+        return;
+    it->buffer += socket->readAll();
+    // Requests on a single connection are handled one after another, as
+    // HTTP/1.1 requires responses to come in the order of requests
+    if (it->busy)
+        return;
+
+    const auto headerEnd = it->buffer.indexOf("\r\n\r\n");
+    if (headerEnd == -1)
+        return;
+    const auto headerLines = it->buffer.left(headerEnd).split('\n');
+    const auto requestLine = headerLines.front().trimmed().split(' ');
+    if (requestLine.size() < 2) {
+        socket->disconnectFromHost();
+        return;
+    }
+    Request request;
+    request.method = requestLine[0];
+    const QUrl url(QString::fromUtf8(requestLine[1]));
+    request.path = url.path(QUrl::FullyDecoded);
+    request.query = QUrlQuery(url);
+    for (auto i = 1; i < headerLines.size(); ++i) {
+        const auto& line = headerLines[i];
+        const auto colon = line.indexOf(':');
+        if (colon > 0)
+            request.headers.insert(line.left(colon).trimmed().toLower(),
+                                   line.mid(colon + 1).trimmed());
+    }
+    const auto bodySize = request.headers.value("content-length").toInt();
+    if (it->buffer.size() < headerEnd + 4 + bodySize)
+        return; // Wait for the rest of the body
+    request.body = it->buffer.mid(headerEnd + 4, bodySize);
+    it->buffer.remove(0, headerEnd + 4 + bodySize);
+    it->busy = true;
+
+    const bool closeAfter =
+        request.headers.value("connection").toLower() == "close";
+    auto respond = [this, socket = QPointer<QTcpSocket>(socket),
+                    closeAfter](const Response& response) {
+        if (!socket)
+            return;
+        writeResponse(socket, response, closeAfter);
+        if (auto it = clients.find(socket); it != clients.end()) {
+            it->busy = false;
+            if (!it->buffer.isEmpty())
+                processBuffer(socket);
+        }
+    };
+    if (config.latencyMs > 0)
+        QTimer::singleShot(config.latencyMs, this,
+                           [this, request = std::move(request),
+                            respond = std::move(respond)]() mutable {
+                               dispatch(std::move(request), respond);
+                           });
+    else
+        dispatch(std::move(request), respond);
+}
+
+void FakeHomeserver::writeResponse(QTcpSocket* socket,
+                                   const Response& response, bool closeAfter)
+{
+    ++requestsServed;
+    QByteArray data = "HTTP/1.1 " + QByteArray::number(response.status) + ' '
+                      + reasonPhrase(response.status)
+                      + "\r\nContent-Type: " + response.contentType
+                      + "\r\nContent-Length: "
+                      + QByteArray::number(response.body.size())
+                      + (closeAfter ? "\r\nConnection: close\r\n\r\n"
+                                    : "\r\nConnection: keep-alive\r\n\r\n")
+                      + response.body;
+    socket->write(data);
+    if (closeAfter)
+        socket->disconnectFromHost();
+}
+
+void FakeHomeserver::dispatch(Request&& request, const Responder& respond)
+{
+    auto token = request.query.queryItemValue(QStringLiteral("access_token"));
+    if (const auto auth = request.headers.value("authorization");
+        auth.startsWith("Bearer "))
+        token = QString::fromUtf8(auth.mid(7));
+    if (token.startsWith(QStringLiteral("token_")))
+        request.userId = QLatin1Char('@') % token.mid(6) % QLatin1Char(':')
+                         % config.serverName;
+    else if (!token.isEmpty()) {
+        respond({ 401, errorBody(QStringLiteral("M_UNKNOWN_TOKEN"),
+                                 QStringLiteral("Unknown access token")) });
+        return;
+    }
+
+    if (!request.userId.isEmpty())
+        if (const auto retryAfterMs = checkRateLimit(request.userId)) {
+            ++requestsRateLimited;
+            auto body = parseJson(errorBody(QStringLiteral("M_LIMIT_EXCEEDED"),
+                                            QStringLiteral("Too many requests")));
+            body.insert(QStringLiteral("retry_after_ms"), retryAfterMs);
+            respond({ 429, toJson(body) });
+            return;
+        }
+
+    auto path = request.path.split(QLatin1Char('/'));
+    path.removeAll({});
+    const auto apiPrefix = path.mid(0, 2).join(QLatin1Char('/'));
+    if (path.size() >= 3 && apiPrefix == QLatin1String(ClientApiPrefix)) {
+        if (path[2] == QLatin1String("versions")) {
+            respond({ 200, toJson({ { QStringLiteral("versions"),
+                                      QJsonArray { QStringLiteral("v1.1"),
+                                                   QStringLiteral("v1.2"),
+                                                   QStringLiteral("v1.3") } } }) });
+            return;
+        }
+        if (path.size() >= 4) {
+            const auto response = handleClientApi(path.mid(3), request, respond);
+            if (response.status != 0)
+                respond(response);
+            return;
+        }
+    }
+    if (path.size() >= 4 && apiPrefix == QLatin1String(MediaApiPrefix)) {
+        respond(handleMedia(path.mid(3), request));
+        return;
+    }
+    respond({ 404, errorBody(QStringLiteral("M_UNRECOGNIZED"),
+                             QStringLiteral("Unrecognized request")) });
+}
+
+int FakeHomeserver::checkRateLimit(const QString& userId)
+{
+    if (config.rateLimit <= 0)
+        return 0;
+    auto it = rateLimitBuckets.find(userId);
+    if (it == rateLimitBuckets.end()) {
+        it = rateLimitBuckets.insert(userId, { double(config.rateLimit), {} });
+        it->refilled.start();
+    }
+    // The bucket holds up to a second worth of requests
+    it->tokens = std::min(double(config.rateLimit),
+                          it->tokens
+                              + it->refilled.restart() * config.rateLimit
+                                    / 1000.0);
+    if (it->tokens >= 1) {
+        it->tokens -= 1;
+        return 0;
+    }
+    return int(std::ceil((1 - it->tokens) * 1000 / config.rateLimit));
+}
+
+FakeHomeserver::Response FakeHomeserver::handleClientApi(
+    const QStringList& path, const Request& request, const Responder& respond)
+{
+    const auto& endpoint = path[0];
+    if (endpoint == QLatin1String("login")) {
+        if (request.method == "GET")
+            return { 200, toJson({ { QStringLiteral("flows"),
+                                     QJsonArray { QJsonObject {
+                                         { QStringLiteral("type"),
+                                           QStringLiteral("m.login.password") } } } } }) };
+        const auto body = parseJson(request.body);
+        auto user = body[QStringLiteral("identifier")]
+                        [QStringLiteral("user")].toString();
+        if (user.isEmpty())
+            user = body[QStringLiteral("user")].toString();
+        // Accept both a localpart and a full user id
+        const auto localpart = user.startsWith(QLatin1Char('@'))
+                                   ? user.mid(1).section(QLatin1Char(':'), 0, 0)
+                                   : user;
+        if (localpart.isEmpty())
+            return { 400, errorBody(QStringLiteral("M_BAD_JSON"),
+                                    QStringLiteral("No user to log in")) };
+        auto deviceId = body[QStringLiteral("device_id")].toString();
+        if (deviceId.isEmpty())
+            deviceId = QStringLiteral("DEVICE_") + localpart;
+        return { 200,
+                 toJson({ { QStringLiteral("user_id"),
+                            QLatin1Char('@') % localpart % QLatin1Char(':')
+                                % config.serverName },
+                          { QStringLiteral("access_token"),
+                            QStringLiteral("token_") + localpart },
+                          { QStringLiteral("device_id"), deviceId } }) };
+    }
+
+    if (request.userId.isEmpty())
+        return { 401, errorBody(QStringLiteral("M_MISSING_TOKEN"),
+                                QStringLiteral("Missing access token")) };
+
+    if (endpoint == QLatin1String("account") && path.value(1) == QLatin1String("whoami"))
+        return { 200, toJson({ { QStringLiteral("user_id"), request.userId } }) };
+
+    if (endpoint == QLatin1String("capabilities"))
+        return { 200,
+                 toJson({ { QStringLiteral("capabilities"),
+                            QJsonObject {
+                                { QStringLiteral("m.room_versions"),
+                                  QJsonObject {
+                                      { QStringLiteral("default"), QStringLiteral("9") },
+                                      { QStringLiteral("available"),
+                                        QJsonObject { { QStringLiteral("9"),
+                                                        QStringLiteral("stable") } } } } } } } }) };
+
+    if (endpoint == QLatin1String("sync")) {
+        handleSync(request, respond);
+        return { 0 }; // Responded to asynchronously
+    }
+
+    if (endpoint == QLatin1String("user") && path.value(2) == QLatin1String("filter"))
+        return { 200, toJson({ { QStringLiteral("filter_id"), QStringLiteral("0") } }) };
+
+    if (endpoint == QLatin1String("keys")) {
+        const auto body = parseJson(request.body);
+        if (path.value(1) == QLatin1String("upload")) {
+            auto& count = oneTimeKeyCounts[request.userId];
+            count += body[QStringLiteral("one_time_keys")].toObject().size();
+            return { 200, toJson({ { QStringLiteral("one_time_key_counts"),
+                                     QJsonObject { { QStringLiteral("signed_curve25519"),
+                                                     count } } } }) };
+        }
+        if (path.value(1) == QLatin1String("query")) {
+            // Nobody in the fake server has devices with keys
+            QJsonObject deviceKeys;
+            const auto users = body[QStringLiteral("device_keys")].toObject();
+            for (auto it = users.begin(); it != users.end(); ++it)
+                deviceKeys.insert(it.key(), QJsonObject {});
+            return { 200, toJson({ { QStringLiteral("device_keys"), deviceKeys } }) };
+        }
+        if (path.value(1) == QLatin1String("claim"))
+            return { 200, toJson({ { QStringLiteral("one_time_keys"), QJsonObject {} } }) };
+        if (path.value(1) == QLatin1String("changes"))
+            return { 200, toJson({ { QStringLiteral("changed"), QJsonArray {} },
+                                   { QStringLiteral("left"), QJsonArray {} } }) };
+    }
+
+    if (endpoint == QLatin1String("sendToDevice") || endpoint == QLatin1String("pushrules")
+        || endpoint == QLatin1String("presence") || endpoint == QLatin1String("logout"))
+        return {};
+
+    if (endpoint != QLatin1String("rooms") || path.size() < 3)
+        return { 404, errorBody(QStringLiteral("M_UNRECOGNIZED"),
+                                QStringLiteral("Unrecognized request")) };
+
+    const auto r = roomIndex(path[1]);
+    if (r == -1)
+        return { 404, errorBody(QStringLiteral("M_NOT_FOUND"),
+                                QStringLiteral("No such room")) };
+    const auto& roomEndpoint = path[2];
+
+    if (roomEndpoint == QLatin1String("messages")) {
+        // Pagination tokens are "h<number of older messages>"
+        auto from = config.historyDepth - config.messagesPerRoom;
+        if (const auto fromToken =
+                request.query.queryItemValue(QStringLiteral("from"));
+            fromToken.startsWith(QLatin1Char('h')))
+            from = std::clamp(fromToken.mid(1).toInt(), 0, config.historyDepth);
+        const auto limit = std::clamp(
+            request.query.queryItemValue(QStringLiteral("limit")).toInt(), 1, 1000);
+        const auto to = std::max(0, from - limit);
+        QJsonArray chunk;
+        for (auto i = from - 1; i >= to; --i)
+            chunk.append(makeHistoryMessage(r, i));
+        QJsonObject body { { QStringLiteral("start"), QStringLiteral("h%1").arg(from) },
+                           { QStringLiteral("chunk"), chunk } };
+        if (to > 0)
+            body.insert(QStringLiteral("end"), QStringLiteral("h%1").arg(to));
+        return { 200, toJson(body) };
+    }
+
+    if (roomEndpoint == QLatin1String("members")) {
+        QJsonArray chunk;
+        for (auto m = 0; m < config.membersPerRoom; ++m)
+            chunk.append(makeMemberEvent(r, memberId(m)));
+        chunk.append(makeMemberEvent(r, request.userId));
+        return { 200, toJson({ { QStringLiteral("chunk"), chunk } }) };
+    }
+
+    if ((roomEndpoint == QLatin1String("send") && path.size() >= 5)
+        || (roomEndpoint == QLatin1String("state") && path.size() >= 4)) {
+        const auto eventId =
+            QStringLiteral("$s%1:%2").arg(streamPos + 1).arg(config.serverName);
+        QJsonObject event {
+            { QStringLiteral("type"), path[3] },
+            { QStringLiteral("sender"), request.userId },
+            { QStringLiteral("event_id"), eventId },
+            { QStringLiteral("origin_server_ts"),
+              QDateTime::currentMSecsSinceEpoch() },
+            { QStringLiteral("content"), parseJson(request.body) }
+        };
+        if (roomEndpoint == QLatin1String("state"))
+            event.insert(QStringLiteral("state_key"), path.value(4));
+        addStreamEvent(r, std::move(event), request.userId,
+                       roomEndpoint == QLatin1String("send") ? path[4] : QString());
+        return { 200, toJson({ { QStringLiteral("event_id"), eventId } }) };
+    }
+
+    if (roomEndpoint == QLatin1String("receipt")
+        || roomEndpoint == QLatin1String("read_markers")
+        || roomEndpoint == QLatin1String("typing"))
+        return {};
+
+    return { 404, errorBody(QStringLiteral("M_UNRECOGNIZED"),
+                            QStringLiteral("Unrecognized request")) };
+}
+
+FakeHomeserver::Response FakeHomeserver::handleMedia(const QStringList& path,
+                                                     const Request& request)
+{
+    if (path[0] == QLatin1String("upload") && request.method == "POST")
+        return { 200,
+                 toJson({ { QStringLiteral("content_uri"),
+                            QStringLiteral("mxc://%1/m%2")
+                                .arg(config.serverName)
+                                .arg(++mediaCounter) } }) };
+    if (path[0] == QLatin1String("download")
+        || path[0] == QLatin1String("thumbnail"))
+        return { 200, MediaContent, "image/png" };
+    if (path[0] == QLatin1String("config"))
+        return { 200, toJson({ { QStringLiteral("m.upload.size"), 50000000 } }) };
+    return { 404, errorBody(QStringLiteral("M_UNRECOGNIZED"),
+                            QStringLiteral("Unrecognized request")) };
+}
+
+void FakeHomeserver::handleSync(const Request& request,
+                                const Responder& respond)
+{
+    const auto sinceToken = request.query.queryItemValue(QStringLiteral("since"));
+    if (!sinceToken.startsWith(QLatin1Char('s'))) {
+        respond(makeSyncResponse(request.userId, -1));
+        return;
+    }
+    const auto since = sinceToken.mid(1).toLongLong();
+    const auto timeout = std::min(
+        request.query.queryItemValue(QStringLiteral("timeout")).toInt(),
+        MaxSyncTimeoutMs);
+    if (since < streamPos || timeout <= 0) {
+        respond(makeSyncResponse(request.userId, since));
+        return;
+    }
+    // Wait for new events or the timeout, whichever comes first
+    const auto id = ++lastPendingSyncId;
+    pendingSyncs.push_back({ id, request.userId, since, respond });
+    QTimer::singleShot(timeout, this, [this, id] {
+        const auto it = std::find_if(pendingSyncs.begin(), pendingSyncs.end(),
+                                     [id](const PendingSync& s) {
+                                         return s.id == id;
+                                     });
+        if (it == pendingSyncs.end())
+            return; // Already responded to
+        const auto pendingSync = std::move(*it);
+        pendingSyncs.erase(it);
+        pendingSync.respond(
+            makeSyncResponse(pendingSync.userId, pendingSync.since));
+    });
+}
+
+FakeHomeserver::Response FakeHomeserver::makeSyncResponse(const QString& userId,
+                                                          qint64 since) const
+{
+    QJsonObject joinedRooms;
+    if (since < 0) {
+        for (auto r = 0; r < config.roomCount; ++r) {
+            QJsonArray timeline;
+            const auto firstMessage =
+                config.historyDepth - config.messagesPerRoom;
+            for (auto i = firstMessage; i < config.historyDepth; ++i)
+                timeline.append(makeHistoryMessage(r, i));
+            joinedRooms.insert(
+                roomId(r),
+                QJsonObject {
+                    { QStringLiteral("state"),
+                      QJsonObject { { QStringLiteral("events"),
+                                      makeRoomState(r, userId) } } },
+                    { QStringLiteral("timeline"),
+                      QJsonObject { { QStringLiteral("events"), timeline },
+                                    { QStringLiteral("limited"), true },
+                                    { QStringLiteral("prev_batch"),
+                                      QStringLiteral("h%1").arg(firstMessage) } } },
+                    { QStringLiteral("summary"),
+                      QJsonObject { { QStringLiteral("m.joined_member_count"),
+                                      config.membersPerRoom + 1 } } },
+                    { QStringLiteral("unread_notifications"),
+                      QJsonObject { { QStringLiteral("notification_count"), 0 },
+                                    { QStringLiteral("highlight_count"), 0 } } } });
+        }
+    }
+    QHash<int, QJsonArray> newEvents;
+    for (auto it = std::upper_bound(stream.cbegin(), stream.cend(), since,
+                                    [](qint64 pos, const StreamEvent& e) {
+                                        return pos < e.pos;
+                                    });
+         it != stream.cend(); ++it) {
+        auto event = it->event;
+        if (!it->transactionId.isEmpty() && it->senderId == userId)
+            event.insert(QStringLiteral("unsigned"),
+                         QJsonObject { { QStringLiteral("transaction_id"),
+                                         it->transactionId } });
+        newEvents[it->roomIndex].append(event);
+    }
+    // Events dropped from the stream can't be delivered anymore; rooms where
+    // the client has missed some of those get a gap in the timeline
+    QSet<int> gappedRooms;
+    if (since >= 0)
+        for (auto it = lastDroppedPositions.cbegin();
+             it != lastDroppedPositions.cend(); ++it)
+            if (since < it.value()) {
+                gappedRooms.insert(it.key());
+                newEvents[it.key()]; // Make sure the room is in the response
+            }
+    for (auto it = newEvents.cbegin(); it != newEvents.cend(); ++it) {
+        auto roomJson = joinedRooms.value(roomId(it.key())).toObject();
+        auto timelineJson = roomJson.value(QStringLiteral("timeline")).toObject();
+        auto events = timelineJson.value(QStringLiteral("events")).toArray();
+        for (const auto& e : *it)
+            events.append(e);
+        if (gappedRooms.contains(it.key())) {
+            // Only the synthetic history can be paginated
+            timelineJson.insert(QStringLiteral("limited"), true);
+            timelineJson.insert(
+                QStringLiteral("prev_batch"),
+                QStringLiteral("h%1").arg(config.historyDepth
+                                          - config.messagesPerRoom));
+        }
+        timelineJson.insert(QStringLiteral("events"), events);
+        roomJson.insert(QStringLiteral("timeline"), timelineJson);
+        joinedRooms.insert(roomId(it.key()), roomJson);
+    }
+    return { 200,
+             toJson({ { QStringLiteral("next_batch"),
+                        QStringLiteral("s%1").arg(streamPos) },
+                      { QStringLiteral("rooms"),
+                        QJsonObject { { QStringLiteral("join"), joinedRooms } } },
+                      { QStringLiteral("device_one_time_keys_count"),
+                        QJsonObject { { QStringLiteral("signed_curve25519"),
+                                        oneTimeKeyCounts.value(userId) } } } }) };
+}
+
+void FakeHomeserver::addStreamEvent(int roomIndex, QJsonObject event,
+                                    const QString& senderId,
+                                    const QString& transactionId)
+{
+    stream.push_back({ ++streamPos, roomIndex, std::move(event), senderId,
+                       transactionId });
+    if (stream.size() > MaxStreamEvents) {
+        lastDroppedPositions.insert(stream.front().roomIndex,
+                                    stream.front().pos);
+        stream.pop_front();
+    }
+    // Wake up all syncs waiting for new events
+    for (auto& s : std::exchange(pendingSyncs, {}))
+        s.respond(makeSyncResponse(s.userId, s.since));
+}
+
+void FakeHomeserver::addRandomMessage()
+{
+    if (config.roomCount <= 0 || config.membersPerRoom <= 0)
+        return;
+    auto* rng = QRandomGenerator::global();
+    const auto r = int(rng->bounded(config.roomCount));
+    const auto sender = memberId(int(rng->bounded(config.membersPerRoom)));
+    addStreamEvent(
+        r, { { QStringLiteral("type"), QStringLiteral("m.room.message") },
+             { QStringLiteral("sender"), sender },
+             { QStringLiteral("event_id"),
+               QStringLiteral("$s%1:%2").arg(streamPos + 1).arg(config.serverName) },
+             { QStringLiteral("origin_server_ts"),
+               QDateTime::currentMSecsSinceEpoch() },
+             { QStringLiteral("content"),
+               QJsonObject { { QStringLiteral("msgtype"), QStringLiteral("m.text") },
+                             { QStringLiteral("body"),
+                               QStringLiteral("Live message %1").arg(streamPos + 1) } } } });
+}
+
+QString FakeHomeserver::roomId(int roomIndex) const
+{
+    return QStringLiteral("!room%1:%2").arg(roomIndex).arg(config.serverName);
+}
+
+int FakeHomeserver::roomIndex(const QString& roomId) const
+{
+    const auto suffix = QLatin1Char(':') + config.serverName;
+    if (!roomId.startsWith(QStringLiteral("!room")) || !roomId.endsWith(suffix))
+        return -1;
+    bool ok = false;
+    const auto r = roomId.mid(5, roomId.size() - 5 - suffix.size()).toInt(&ok);
+    return ok && r >= 0 && r < config.roomCount ? r : -1;
+}
+
+QString FakeHomeserver::memberId(int memberIndex) const
+{
+    return QStringLiteral("@member%1:%2").arg(memberIndex).arg(config.serverName);
+}
+
+QJsonObject FakeHomeserver::makeMemberEvent(int roomIndex,
+                                            const QString& userId) const
+{
+    return { { QStringLiteral("type"), QStringLiteral("m.room.member") },
+             { QStringLiteral("sender"), userId },
+             { QStringLiteral("state_key"), userId },
+             { QStringLiteral("event_id"),
+               QStringLiteral("$member_%1_%2").arg(roomIndex).arg(userId) },
+             { QStringLiteral("origin_server_ts"), BaseTimestamp },
+             { QStringLiteral("content"),
+               QJsonObject { { QStringLiteral("membership"), QStringLiteral("join") },
+                             { QStringLiteral("displayname"),
+                               userId.section(QLatin1Char(':'), 0, 0).mid(1) } } } };
+}
+
+QJsonArray FakeHomeserver::makeRoomState(int roomIndex,
+                                         const QString& localUserId) const
+{
+    const auto creator = memberId(0);
+    auto makeStateEvent = [roomIndex, &creator](const QString& type,
+                                                QJsonObject content) {
+        return QJsonObject { { QStringLiteral("type"), type },
+                             { QStringLiteral("sender"), creator },
+                             { QStringLiteral("state_key"), QString() },
+                             { QStringLiteral("event_id"),
+                               QStringLiteral("$state_%1_%2").arg(roomIndex).arg(type) },
+                             { QStringLiteral("origin_server_ts"), BaseTimestamp },
+                             { QStringLiteral("content"), content } };
+    };
+    QJsonArray state {
+        makeStateEvent(QStringLiteral("m.room.create"),
+                       { { QStringLiteral("creator"), creator },
+                         { QStringLiteral("room_version"), QStringLiteral("9") } }),
+        makeStateEvent(QStringLiteral("m.room.name"),
+                       { { QStringLiteral("name"),
+                           QStringLiteral("Room %1").arg(roomIndex) } }),
+        makeStateEvent(QStringLiteral("m.room.join_rules"),
+                       { { QStringLiteral("join_rule"), QStringLiteral("public") } })
+    };
+    for (auto m = 0; m < config.membersPerRoom; ++m)
+        state.append(makeMemberEvent(roomIndex, memberId(m)));
+    state.append(makeMemberEvent(roomIndex, localUserId));
+    return state;
+}
+
+QJsonObject FakeHomeserver::makeHistoryMessage(int roomIndex,
+                                               int messageIndex) const
+{
+    const auto sender =
+        memberId(config.membersPerRoom > 0
+                     ? messageIndex % config.membersPerRoom
+                     : 0);
+    return { { QStringLiteral("type"), QStringLiteral("m.room.message") },
+             { QStringLiteral("sender"), sender },
+             { QStringLiteral("event_id"),
+               QStringLiteral("$h%1_%2:%3")
+                   .arg(roomIndex)
+                   .arg(messageIndex)
+                   .arg(config.serverName) },
+             { QStringLiteral("origin_server_ts"),
+               BaseTimestamp + qint64(messageIndex) * 1000 },
+             { QStringLiteral("content"),
+               QJsonObject { { QStringLiteral("msgtype"), QStringLiteral("m.text") },
+                             { QStringLiteral("body"),
+                               QStringLiteral("Message %1").arg(messageIndex) } } } };
+}
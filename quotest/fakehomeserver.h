@@ -0,0 +1,145 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonObject>
+#include <QtCore/QPointer>
+#include <QtCore/QTimer>
+#include <QtCore/QUrlQuery>
+#include <QtNetwork/QHostAddress>
+#include <QtNetwork/QTcpServer>
+
+#include <deque>
+#include <functional>
+
+class QTcpSocket;
+
+//! \brief A stand-in for a Matrix homeserver, for load testing
+//!
+//! The server speaks just enough HTTP/1.1 and client-server API to let
+//! Connection objects log in, sync, paginate, load members, send events and
+//! upload media. Every user is joined to the same set of generated rooms;
+//! new messages appear in random rooms at a configured rate, along with
+//! the events sent by clients. Any access token of the form
+//! <tt>token_localpart</tt> is accepted as belonging to
+//! <tt>\@localpart:serverName</tt>; logging in with any password gives such
+//! a token.
+class FakeHomeserver : public QObject {
+    Q_OBJECT
+public:
+    struct Config {
+        QString serverName = QStringLiteral("localhost");
+        int roomCount = 100;
+        int membersPerRoom = 10;
+        //! The number of messages in the initial sync timeline of each room
+        int messagesPerRoom = 20;
+        //! The number of messages in each room available through /messages
+        int historyDepth = 1000;
+        //! The delay before handling each request, in milliseconds
+        int latencyMs = 0;
+        //! Requests per second allowed for each user; 0 means no limit
+        int rateLimit = 0;
+        //! How often a new message appears in a random room, in milliseconds;
+        //! 0 means only events sent by clients appear
+        int newMessageIntervalMs = 1000;
+    };
+
+    explicit FakeHomeserver(Config config, QObject* parent = nullptr);
+
+    bool listen(const QHostAddress& address = QHostAddress::LocalHost,
+                quint16 port = 0);
+    QUrl baseUrl() const;
+    QString errorString() const { return server.errorString(); }
+
+    qint64 requestCount() const { return requestsServed; }
+    qint64 rateLimitedCount() const { return requestsRateLimited; }
+
+private:
+    struct Request {
+        QByteArray method;
+        QString path;
+        QUrlQuery query;
+        QHash<QByteArray, QByteArray> headers;
+        QByteArray body;
+        //! The user making the request, empty if there's no access token
+        QString userId;
+    };
+    struct Response {
+        int status = 200;
+        QByteArray body = "{}";
+        QByteArray contentType = "application/json";
+    };
+    using Responder = std::function<void(Response)>;
+
+    struct ClientState {
+        QByteArray buffer;
+        bool busy = false;
+    };
+    struct StreamEvent {
+        qint64 pos;
+        int roomIndex;
+        QJsonObject event;
+        //! The user who sent the event and the transaction id they used
+        QString senderId;
+        QString transactionId;
+    };
+    struct PendingSync {
+        qint64 id;
+        QString userId;
+        qint64 since;
+        Responder respond;
+    };
+    struct RateLimitBucket {
+        double tokens;
+        QElapsedTimer refilled;
+    };
+
+    Config config;
+    QTcpServer server;
+    QHash<QTcpSocket*, ClientState> clients;
+    //! Recent events in all rooms, in the order of their stream positions
+    std::deque<StreamEvent> stream;
+    qint64 streamPos = 0;
+    //! \brief The position of the last event dropped from the stream, by room
+    //!
+    //! Clients that haven't seen that event get a limited timeline.
+    QHash<int, qint64> lastDroppedPositions;
+    std::vector<PendingSync> pendingSyncs;
+    qint64 lastPendingSyncId = 0;
+    QTimer newMessageTimer;
+    QHash<QString, RateLimitBucket> rateLimitBuckets;
+    QHash<QString, int> oneTimeKeyCounts;
+    qint64 mediaCounter = 0;
+    qint64 requestsServed = 0;
+    qint64 requestsRateLimited = 0;
+
+    void onNewConnection();
+    void processBuffer(QTcpSocket* socket);
+    void writeResponse(QTcpSocket* socket, const Response& response,
+                       bool closeAfter);
+    void dispatch(Request&& request, const Responder& respond);
+    //! \return the number of milliseconds until a request is allowed, or 0
+    int checkRateLimit(const QString& userId);
+
+    Response handleClientApi(const QStringList& path, const Request& request,
+                             const Responder& respond);
+    Response handleMedia(const QStringList& path, const Request& request);
+    void handleSync(const Request& request, const Responder& respond);
+    Response makeSyncResponse(const QString& userId, qint64 since) const;
+    void addStreamEvent(int roomIndex, QJsonObject event,
+                        const QString& senderId = {},
+                        const QString& transactionId = {});
+    void addRandomMessage();
+
+    QString roomId(int roomIndex) const;
+    //! The room index from a room id, or -1 if there's no such room
+    int roomIndex(const QString& roomId) const;
+    QString memberId(int memberIndex) const;
+    QJsonObject makeMemberEvent(int roomIndex, const QString& userId) const;
+    QJsonArray makeRoomState(int roomIndex, const QString& localUserId) const;
+    QJsonObject makeHistoryMessage(int roomIndex, int messageIndex) const;
+};
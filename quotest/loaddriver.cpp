@@ -0,0 +1,140 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "loaddriver.h"
+
+#include "fakehomeserver.h"
+
+#include "connection.h"
+#include "room.h"
+
+#include <QtCore/QRandomGenerator>
+
+#include <iostream>
+
+using namespace Quotient;
+using std::clog, std::endl;
+
+namespace {
+//! The delay between starting consecutive clients, to avoid a thundering herd
+constexpr int ClientStartIntervalMs = 10;
+constexpr int StatsIntervalMs = 5000;
+} // namespace
+
+LoadDriver::LoadDriver(Config config, FakeHomeserver* server, QObject* parent)
+    : QObject(parent), config(std::move(config)), server(server)
+{
+    statsTimer.setInterval(StatsIntervalMs);
+    connect(&statsTimer, &QTimer::timeout, this, &LoadDriver::printStats);
+    if (this->config.sendIntervalMs > 0 && this->config.clientCount > 0) {
+        // Spread the messages from all clients evenly over the interval
+        sendTimer.setInterval(
+            std::max(1, this->config.sendIntervalMs / this->config.clientCount));
+        connect(&sendTimer, &QTimer::timeout, this,
+                &LoadDriver::sendNextMessage);
+    }
+}
+
+LoadDriver::~LoadDriver()
+{
+    for (auto* c : connections) {
+        c->stopSync();
+        delete c;
+    }
+}
+
+void LoadDriver::start()
+{
+    clog << "Starting " << config.clientCount << " client(s) against "
+         << config.serverUrl.toString().toStdString() << endl;
+    elapsed.start();
+    for (auto i = 0; i < config.clientCount; ++i)
+        QTimer::singleShot(i * ClientStartIntervalMs, this,
+                           [this, i] { addClient(i); });
+    statsTimer.start();
+    if (config.sendIntervalMs > 0)
+        sendTimer.start();
+    if (config.durationSecs > 0)
+        QTimer::singleShot(config.durationSecs * 1000, this,
+                           &LoadDriver::finish);
+}
+
+void LoadDriver::addClient(int index)
+{
+    auto* c = new Connection(config.serverUrl);
+    connections.push_back(c);
+    // Hundreds of clients writing their state to the same cache directory
+    // would measure the disk rather than the library
+    c->setCacheState(false);
+    connect(c, &Connection::connected, this, [this, c] {
+        ++counters.connected;
+        c->syncLoop();
+    });
+    connect(c, &Connection::syncDone, this, [this] { ++counters.syncs; });
+    connect(c, &Connection::syncError, this, [this](const QString& message) {
+        if (counters.syncErrors++ == 0)
+            clog << "Sync error: " << message.toStdString() << endl;
+    });
+    connect(c, &Connection::networkError, this, [this] {
+        ++counters.networkErrors;
+    });
+    connect(c, &Connection::loadedRoomState, this,
+            [this] { ++counters.roomsLoaded; });
+    const auto localpart = QStringLiteral("load%1").arg(index);
+    c->assumeIdentity(QLatin1Char('@') % localpart % QLatin1Char(':')
+                          % config.serverName,
+                      QStringLiteral("token_") + localpart,
+                      localpart.toUpper());
+}
+
+void LoadDriver::sendNextMessage()
+{
+    if (connections.empty())
+        return;
+    auto* c = connections[nextSender++ % connections.size()];
+    if (!c->isLoggedIn())
+        return;
+    const auto rooms = c->allRooms();
+    if (rooms.isEmpty())
+        return;
+    auto* room =
+        rooms[int(QRandomGenerator::global()->bounded(int(rooms.size())))];
+    room->postPlainText(QStringLiteral("Load message %1")
+                            .arg(++counters.messagesSent));
+}
+
+void LoadDriver::printStats()
+{
+    const auto seconds = StatsIntervalMs / 1000.0;
+    clog << elapsed.elapsed() / 1000 << "s: " << counters.connected << '/'
+         << config.clientCount << " clients connected, "
+         << (counters.syncs - lastReported.syncs) / seconds << " syncs/s, "
+         << counters.roomsLoaded << " rooms loaded, " << counters.messagesSent
+         << " messages sent, " << counters.syncErrors << " sync errors, "
+         << counters.networkErrors << " network errors";
+    if (server)
+        clog << "; server: " << server->requestCount() << " requests, "
+             << server->rateLimitedCount() << " rate-limited";
+    clog << endl;
+    lastReported = counters;
+}
+
+void LoadDriver::finish()
+{
+    statsTimer.stop();
+    sendTimer.stop();
+    const auto seconds = std::max<qint64>(elapsed.elapsed(), 1) / 1000.0;
+    clog << "Load test summary after " << seconds << "s:\n"
+         << "  clients connected: " << counters.connected << '/'
+         << config.clientCount << '\n'
+         << "  syncs: " << counters.syncs << " (" << counters.syncs / seconds
+         << "/s)\n"
+         << "  rooms loaded: " << counters.roomsLoaded << '\n'
+         << "  messages sent: " << counters.messagesSent << '\n'
+         << "  sync errors: " << counters.syncErrors << '\n'
+         << "  network errors: " << counters.networkErrors << endl;
+    if (server)
+        clog << "  server requests: " << server->requestCount() << " ("
+             << server->rateLimitedCount() << " rate-limited)" << endl;
+    emit finished();
+}
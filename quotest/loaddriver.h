@@ -0,0 +1,75 @@
+// SPDX-FileCopyrightText: 2022 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QObject>
+#include <QtCore/QPointer>
+#include <QtCore/QTimer>
+#include <QtCore/QUrl>
+
+#include <vector>
+
+namespace Quotient {
+class Connection;
+}
+class FakeHomeserver;
+
+//! \brief Drives many Connection objects against a homeserver at once
+//!
+//! Each client assumes the identity <tt>\@loadN:serverName</tt> with the access
+//! token <tt>token_loadN</tt> (which is what FakeHomeserver accepts), runs
+//! the sync loop and optionally sends a message to a random room at regular
+//! intervals. Throughput and error counts are printed periodically and
+//! summarised when the run ends.
+class LoadDriver : public QObject {
+    Q_OBJECT
+public:
+    struct Config {
+        QUrl serverUrl;
+        QString serverName = QStringLiteral("localhost");
+        int clientCount = 10;
+        //! How long to run, in seconds; 0 means until interrupted
+        int durationSecs = 60;
+        //! How often each client sends a message, in milliseconds; 0 means
+        //! clients only sync
+        int sendIntervalMs = 0;
+    };
+
+    //! \param server an in-process server to take request counts from;
+    //!               can be nullptr if the server is elsewhere
+    explicit LoadDriver(Config config, FakeHomeserver* server = nullptr,
+                        QObject* parent = nullptr);
+    ~LoadDriver() override;
+
+    void start();
+
+Q_SIGNALS:
+    void finished();
+
+private:
+    struct Counters {
+        qint64 connected = 0;
+        qint64 syncs = 0;
+        qint64 syncErrors = 0;
+        qint64 networkErrors = 0;
+        qint64 roomsLoaded = 0;
+        qint64 messagesSent = 0;
+    };
+
+    Config config;
+    QPointer<FakeHomeserver> server;
+    std::vector<Quotient::Connection*> connections;
+    QTimer statsTimer;
+    QTimer sendTimer;
+    QElapsedTimer elapsed;
+    Counters counters;
+    Counters lastReported;
+    size_t nextSender = 0;
+
+    void addClient(int index);
+    void sendNextMessage();
+    void printStats();
+    void finish();
+};
@@ -1,6 +1,9 @@
 // SPDX-FileCopyrightText: 2016 Kitsune Ral <Kitsune-Ral@users.sf.net>
 // SPDX-License-Identifier: LGPL-2.1-or-later
 
+#include "fakehomeserver.h"
+#include "loaddriver.h"
+
 #include "connection.h"
 #include "room.h"
 #include "user.h"
@@ -17,6 +20,7 @@
 #include "events/roommemberevent.h"
 
 #include <QtTest/QSignalSpy>
+#include <QtCore/QCommandLineParser>
 #include <QtCore/QCoreApplication>
 #include <QtCore/QFileInfo>
 #include <QtCore/QStringBuilder>
@@ -27,6 +31,7 @@
 
 #include <functional>
 #include <iostream>
+#include <memory>
 
 using namespace Quotient;
 using std::clog, std::endl;
@@ -1023,12 +1028,126 @@ void TestManager::finalize()
         Qt::QueuedConnection);
 }
 
+//! Run the fake homeserver, and the load driver unless --fake-server is given
+int runLoadTest(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        QStringLiteral("Load testing with a local fake homeserver"));
+    parser.addHelpOption();
+    const QCommandLineOption serveOnlyOption(
+        QStringLiteral("fake-server"),
+        QStringLiteral("Only run the fake homeserver, until interrupted"));
+    const QCommandLineOption loadOption(
+        QStringLiteral("load"), QStringLiteral("Run <count> clients"),
+        QStringLiteral("count"), QStringLiteral("10"));
+    // Clients don't log in but use tokens that only the fake server accepts
+    const QCommandLineOption serverOption(
+        QStringLiteral("server"),
+        QStringLiteral("Load the fake server at <url> (started with "
+                       "--fake-server in another process) instead of "
+                       "an in-process one; real homeservers are not supported"),
+        QStringLiteral("url"));
+    const QCommandLineOption portOption(
+        QStringLiteral("port"), QStringLiteral("Fake server port"),
+        QStringLiteral("port"), QStringLiteral("0"));
+    const QCommandLineOption roomsOption(
+        QStringLiteral("rooms"), QStringLiteral("Rooms on the fake server"),
+        QStringLiteral("count"), QStringLiteral("100"));
+    const QCommandLineOption membersOption(
+        QStringLiteral("members"), QStringLiteral("Members in each room"),
+        QStringLiteral("count"), QStringLiteral("10"));
+    const QCommandLineOption messagesOption(
+        QStringLiteral("messages"),
+        QStringLiteral("Messages in each room timeline at initial sync"),
+        QStringLiteral("count"), QStringLiteral("20"));
+    const QCommandLineOption latencyOption(
+        QStringLiteral("latency"),
+        QStringLiteral("Fake server response delay, in milliseconds"),
+        QStringLiteral("ms"), QStringLiteral("0"));
+    const QCommandLineOption rateLimitOption(
+        QStringLiteral("rate-limit"),
+        QStringLiteral("Requests per second per user before the fake server "
+                       "returns M_LIMIT_EXCEEDED; 0 for no limit"),
+        QStringLiteral("rps"), QStringLiteral("0"));
+    const QCommandLineOption messageIntervalOption(
+        QStringLiteral("message-interval"),
+        QStringLiteral("How often a new message appears on the fake server, "
+                       "in milliseconds; 0 for never"),
+        QStringLiteral("ms"), QStringLiteral("1000"));
+    const QCommandLineOption durationOption(
+        QStringLiteral("duration"),
+        QStringLiteral("Load test duration in seconds; 0 for no limit"),
+        QStringLiteral("seconds"), QStringLiteral("60"));
+    const QCommandLineOption sendIntervalOption(
+        QStringLiteral("send-interval"),
+        QStringLiteral("How often each client sends a message, "
+                       "in milliseconds; 0 for never"),
+        QStringLiteral("ms"), QStringLiteral("0"));
+    parser.addOptions({ serveOnlyOption, loadOption, serverOption, portOption,
+                        roomsOption, membersOption, messagesOption,
+                        latencyOption, rateLimitOption, messageIntervalOption,
+                        durationOption, sendIntervalOption });
+    parser.process(app);
+
+    FakeHomeserver::Config serverConfig;
+    serverConfig.roomCount = parser.value(roomsOption).toInt();
+    serverConfig.membersPerRoom = parser.value(membersOption).toInt();
+    serverConfig.messagesPerRoom = parser.value(messagesOption).toInt();
+    serverConfig.latencyMs = parser.value(latencyOption).toInt();
+    serverConfig.rateLimit = parser.value(rateLimitOption).toInt();
+    serverConfig.newMessageIntervalMs =
+        parser.value(messageIntervalOption).toInt();
+
+    LoadDriver::Config loadConfig;
+    loadConfig.clientCount = parser.value(loadOption).toInt();
+    loadConfig.durationSecs = parser.value(durationOption).toInt();
+    loadConfig.sendIntervalMs = parser.value(sendIntervalOption).toInt();
+
+    std::unique_ptr<FakeHomeserver> server;
+    if (parser.isSet(serverOption))
+        loadConfig.serverUrl = QUrl(parser.value(serverOption));
+    else {
+        server = std::make_unique<FakeHomeserver>(serverConfig);
+        if (!server->listen(QHostAddress::LocalHost,
+                            quint16(parser.value(portOption).toUInt()))) {
+            clog << "Couldn't start the fake server: "
+                 << server->errorString().toStdString() << endl;
+            return 1;
+        }
+        loadConfig.serverUrl = server->baseUrl();
+        loadConfig.serverName = serverConfig.serverName;
+        clog << "Fake homeserver listening at "
+             << loadConfig.serverUrl.toString().toStdString() << endl;
+    }
+    if (parser.isSet(serveOnlyOption)) {
+        if (!server) {
+            clog << "--fake-server and --server can't be used together" << endl;
+            return 1;
+        }
+        return app.exec();
+    }
+
+    LoadDriver driver(loadConfig, server.get());
+    QObject::connect(&driver, &LoadDriver::finished, &app,
+                     &QCoreApplication::quit);
+    driver.start();
+    return app.exec();
+}
+
 int main(int argc, char* argv[])
 {
+    if (argc > 1 && QByteArray(argv[1]).startsWith("--"))
+        return runLoadTest(argc, argv);
+
     // TODO: use QCommandLineParser
     if (argc < 5) {
         clog << "Usage: quotest <user> <passwd> <device_name> <room_alias> [origin]"
-             << endl;
+             << endl
+             << "   or: quotest --load <clients> [options] (see --help)"
+             << endl
+             << "   or: quotest --fake-server [options]" << endl;
         return -1;
     }
     // NOLINTNEXTLINE(readability-static-accessed-through-instance)